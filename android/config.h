@@ -23,6 +23,9 @@
 /* Message logging */
 //#define ENABLE_LOGGING
 
+/* Most verbose log level compiled in, from 0 (none) to 4 (debug) */
+#define USBI_COMPILED_LOG_LEVEL 4
+
 /* Define to 1 if you have the <dlfcn.h> header file. */
 #define HAVE_DLFCN_H 1
 
@@ -50,6 +53,9 @@
 /* Define to 1 if you have the <poll.h> header file. */
 #define HAVE_POLL_H 1
 
+/* Define to 1 if you have the <sys/epoll.h> header file. */
+#define HAVE_SYS_EPOLL_H 1
+
 /* Define to 1 if you have the <sys/stat.h> header file. */
 #define HAVE_SYS_STAT_H 1
 
@@ -65,6 +71,9 @@
 /* Define to 1 if you have the <linux/filter.h> header file. */
 #define HAVE_LINUX_FILTER_H 1
 
+/* Define to 1 if you have the `recvmmsg' function. */
+#define HAVE_RECVMMSG 1
+
 /* Define to 1 if you have the <linux/netlink.h> header file. */
 #define HAVE_LINUX_NETLINK_H 1
 
@@ -35,6 +35,9 @@ LOCAL_SRC_FILES := \
   $(LIBUSB_ROOT_REL)/libusb/sync.c \
   $(LIBUSB_ROOT_REL)/libusb/strerror.c \
   $(LIBUSB_ROOT_REL)/libusb/os/linux_usbfs.c \
+  $(LIBUSB_ROOT_REL)/libusb/os/linux_iouring.c \
+  $(LIBUSB_ROOT_REL)/libusb/os/linux_loopback.c \
+  $(LIBUSB_ROOT_REL)/libusb/os/linux_replay.c \
   $(LIBUSB_ROOT_REL)/libusb/os/poll_posix.c \
   $(LIBUSB_ROOT_REL)/libusb/os/threads_posix.c \
   $(LIBUSB_ROOT_REL)/libusb/os/linux_netlink.c \
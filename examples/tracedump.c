@@ -0,0 +1,255 @@
+/*
+ * libusb example program to decode trace dumps
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Reads a dump written by libusb_trace_dump() and prints the events of all
+ * threads as a single timeline, or with -j as Chrome trace JSON (load it in
+ * chrome://tracing or Perfetto). In the JSON output each transfer shows as a
+ * slice from its submission to its completion on the submitting thread, and
+ * every event as an instant event.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "libusb.h"
+
+static const char *event_name(uint8_t type)
+{
+	switch (type) {
+	case LIBUSB_TRACE_SUBMIT:
+		return "submit";
+	case LIBUSB_TRACE_SUBMIT_URB:
+		return "submiturb";
+	case LIBUSB_TRACE_REAP_URB:
+		return "reapurb";
+	case LIBUSB_TRACE_COMPLETE:
+		return "complete";
+	case LIBUSB_TRACE_CANCEL:
+		return "cancel";
+	case LIBUSB_TRACE_TIMEOUT:
+		return "timeout";
+	case LIBUSB_TRACE_HOTPLUG:
+		return "hotplug";
+	default:
+		return "unknown";
+	}
+}
+
+static int compare_events(const void *a, const void *b)
+{
+	const struct libusb_trace_event *ea = a, *eb = b;
+
+	if (ea->timestamp != eb->timestamp)
+		return ea->timestamp < eb->timestamp ? -1 : 1;
+	if (ea->thread != eb->thread)
+		return ea->thread < eb->thread ? -1 : 1;
+	return 0;
+}
+
+static void print_timeline(const struct libusb_trace_event *events, uint32_t n)
+{
+	uint64_t start = n ? events[0].timestamp : 0;
+	uint32_t i;
+
+	for (i = 0; i < n; i++) {
+		const struct libusb_trace_event *e = &events[i];
+
+		printf("%12.6f ms  T%-3u %-10s ", (e->timestamp - start) / 1e6,
+			e->thread, event_name(e->type));
+		if (e->type == LIBUSB_TRACE_HOTPLUG) {
+			printf("dev 0x%" PRIx64 " %s bus %u addr %u\n", e->object,
+				e->status == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED ? "arrived" : "left",
+				(e->length >> 8) & 0xff, e->length & 0xff);
+			continue;
+		}
+		printf("xfer 0x%" PRIx64 " ep 0x%02x", e->object, e->endpoint);
+		if (e->urb >= 0)
+			printf(" urb %d", e->urb);
+		printf(" status %d len %u\n", e->status, e->length);
+	}
+}
+
+/* the submissions and completions of a transfer, in the order recorded */
+struct transfer_event {
+	uint64_t object;
+	uint32_t index;
+};
+
+static int compare_transfer_events(const void *a, const void *b)
+{
+	const struct transfer_event *ta = a, *tb = b;
+
+	if (ta->object != tb->object)
+		return ta->object < tb->object ? -1 : 1;
+	if (ta->index != tb->index)
+		return ta->index < tb->index ? -1 : 1;
+	return 0;
+}
+
+/* find the completion of each submission. sorting the submissions and
+ * completions by transfer puts the completion of a submission (if any)
+ * right after it. complete[i] is set to the index of the completion of a
+ * submission at i, or to n */
+static int pair_transfers(const struct libusb_trace_event *events, uint32_t n,
+	uint32_t *complete)
+{
+	struct transfer_event *te;
+	uint32_t i, num_te = 0;
+
+	te = malloc((n ? n : 1) * sizeof(*te));
+	if (!te)
+		return -1;
+
+	for (i = 0; i < n; i++) {
+		complete[i] = n;
+		if (events[i].type != LIBUSB_TRACE_SUBMIT &&
+		    events[i].type != LIBUSB_TRACE_COMPLETE)
+			continue;
+		te[num_te].object = events[i].object;
+		te[num_te].index = i;
+		num_te++;
+	}
+
+	qsort(te, num_te, sizeof(*te), compare_transfer_events);
+
+	for (i = 0; i + 1 < num_te; i++) {
+		if (events[te[i].index].type == LIBUSB_TRACE_SUBMIT &&
+		    te[i + 1].object == te[i].object &&
+		    events[te[i + 1].index].type == LIBUSB_TRACE_COMPLETE)
+			complete[te[i].index] = te[i + 1].index;
+	}
+
+	free(te);
+	return 0;
+}
+
+static int print_json(const struct libusb_trace_event *events, uint32_t n)
+{
+	uint64_t start = n ? events[0].timestamp : 0;
+	const char *sep = "";
+	uint32_t *complete;
+	uint32_t i, j;
+
+	complete = malloc((n ? n : 1) * sizeof(*complete));
+	if (!complete || pair_transfers(events, n, complete) < 0) {
+		free(complete);
+		return -1;
+	}
+
+	printf("{\"traceEvents\":[\n");
+	for (i = 0; i < n; i++) {
+		const struct libusb_trace_event *e = &events[i];
+
+		printf("%s{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,"
+			"\"tid\":%u,\"ts\":%.3f,\"args\":{\"object\":\"0x%" PRIx64 "\","
+			"\"endpoint\":%u,\"urb\":%d,\"status\":%d,\"length\":%u}}",
+			sep, event_name(e->type), e->thread,
+			(e->timestamp - start) / 1e3, e->object, e->endpoint,
+			e->urb, e->status, e->length);
+		sep = ",\n";
+
+		j = complete[i];
+		if (j == n)
+			continue;
+
+		printf("%s{\"name\":\"ep 0x%02x\",\"ph\":\"X\",\"pid\":1,"
+			"\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"transfer\":"
+			"\"0x%" PRIx64 "\",\"status\":%d,\"length\":%u}}",
+			sep, e->endpoint, e->thread, (e->timestamp - start) / 1e3,
+			(events[j].timestamp - e->timestamp) / 1e3, e->object,
+			events[j].status, events[j].length);
+	}
+	printf("\n]}\n");
+
+	free(complete);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct libusb_trace_header header;
+	struct libusb_trace_event *events;
+	const char *path = NULL;
+	int json = 0, i;
+	FILE *f;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-j"))
+			json = 1;
+		else
+			path = argv[i];
+	}
+
+	if (!path) {
+		fprintf(stderr, "usage: %s [-j] DUMP\n", argv[0]);
+		return 1;
+	}
+
+	f = fopen(path, "rb");
+	if (!f) {
+		perror(path);
+		return 1;
+	}
+
+	if (fread(&header, sizeof(header), 1, f) != 1 ||
+	    header.magic != LIBUSB_TRACE_MAGIC) {
+		fprintf(stderr, "%s: not a libusb trace dump\n", path);
+		fclose(f);
+		return 1;
+	}
+
+	if (header.version != LIBUSB_TRACE_VERSION ||
+	    header.event_size != sizeof(struct libusb_trace_event)) {
+		fprintf(stderr, "%s: unsupported trace version %u\n", path,
+			header.version);
+		fclose(f);
+		return 1;
+	}
+
+	events = calloc(header.num_events ? header.num_events : 1, sizeof(*events));
+	if (!events) {
+		fclose(f);
+		return 1;
+	}
+
+	if (fread(events, sizeof(*events), header.num_events, f) != header.num_events) {
+		fprintf(stderr, "%s: truncated dump\n", path);
+		free(events);
+		fclose(f);
+		return 1;
+	}
+	fclose(f);
+
+	qsort(events, header.num_events, sizeof(*events), compare_events);
+
+	if (json) {
+		if (print_json(events, header.num_events) < 0) {
+			fprintf(stderr, "out of memory\n");
+			free(events);
+			return 1;
+		}
+	} else {
+		print_timeline(events, header.num_events);
+	}
+
+	free(events);
+	return 0;
+}
@@ -50,10 +50,23 @@ static const struct libusb_version libusb_version_internal =
 	  LIBUSB_RC, "http://libusb.info" };
 static int default_context_refcnt = 0;
 static usbi_mutex_static_t default_context_lock = USBI_MUTEX_INITIALIZER;
+/* LIBUSB_OPTION_DEVICE_SCAN, protected by default_context_lock */
+static enum libusb_device_scan default_device_scan = LIBUSB_DEVICE_SCAN_EAGER;
 static struct timespec timestamp_origin = { 0, 0 };
 #ifndef USE_SYSTEM_LOGGING_FACILITY
 static libusb_log_cb log_handler = NULL;
 #endif
+#if defined(ENABLE_LOGGING) && !defined(ENABLE_DEBUG_LOGGING)
+/* lets everything through until libusb_init() has read LIBUSB_DEBUG */
+int usbi_log_level = LIBUSB_LOG_LEVEL_DEBUG;
+static int log_level_resolved = 0;
+static void raise_log_level(enum libusb_log_level level);
+#endif
+#if defined(ENABLE_LOGGING) && defined(THREADS_POSIX) && defined(__GNUC__)
+#define HAVE_ASYNC_LOG
+static int log_async_start(void);
+static void log_async_stop(void);
+#endif
 
 usbi_mutex_static_t active_contexts_lock = USBI_MUTEX_INITIALIZER;
 struct list_head active_contexts_list;
@@ -705,6 +718,7 @@ struct libusb_device *usbi_alloc_device(struct libusb_context *ctx,
 void usbi_connect_device(struct libusb_device *dev)
 {
 	struct libusb_context *ctx = DEVICE_CTX(dev);
+	int scanned;
 
 	dev->attached = 1;
 
@@ -712,10 +726,17 @@ void usbi_connect_device(struct libusb_device *dev)
 	list_add(&dev->list, &dev->ctx->usb_devs);
 	usbi_mutex_unlock(&dev->ctx->usb_devs_lock);
 
+	/* a deferred initial scan counts as initial enumeration too, along
+	 * with the devices that turn up before it is done */
+	usbi_mutex_lock(&ctx->scan_lock);
+	scanned = ctx->scan_state == USBI_SCAN_DONE;
+	usbi_mutex_unlock(&ctx->scan_lock);
+
 	/* Signal that an event has occurred for this device if we support hotplug AND
 	 * the hotplug message list is ready. This prevents an event from getting raised
 	 * during initial enumeration. */
-	if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) && dev->ctx->hotplug_msgs.next) {
+	if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) && dev->ctx->hotplug_msgs.next &&
+	    scanned) {
 		usbi_hotplug_notification(ctx, dev, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED);
 	}
 }
@@ -784,6 +805,91 @@ struct libusb_device *usbi_get_device_by_session_id(struct libusb_context *ctx,
 	return ret;
 }
 
+/* Run the device scan deferred by LIBUSB_OPTION_DEVICE_SCAN, or wait for
+ * the one in progress. A failed scan is tried again by the next caller. */
+int usbi_wait_device_scan(struct libusb_context *ctx)
+{
+	int r = 0;
+
+	usbi_mutex_lock(&ctx->scan_lock);
+	while (ctx->scan_state == USBI_SCAN_RUNNING)
+		usbi_cond_wait(&ctx->scan_cond, &ctx->scan_lock);
+	if (ctx->scan_state == USBI_SCAN_PENDING) {
+		ctx->scan_state = USBI_SCAN_RUNNING;
+		usbi_mutex_unlock(&ctx->scan_lock);
+
+		usbi_dbg("scanning devices");
+		r = usbi_backend.scan_devices(ctx);
+		if (r < 0)
+			usbi_err(ctx, "device scan failed, error %d", r);
+
+		usbi_mutex_lock(&ctx->scan_lock);
+		ctx->scan_state = r < 0 ? USBI_SCAN_PENDING : USBI_SCAN_DONE;
+		usbi_cond_broadcast(&ctx->scan_cond);
+	}
+	usbi_mutex_unlock(&ctx->scan_lock);
+
+	return r;
+}
+
+#if defined(THREADS_POSIX)
+static void *scan_thread_main(void *arg)
+{
+	usbi_wait_device_scan(arg);
+	return NULL;
+}
+#endif
+
+static void start_scan_thread(struct libusb_context *ctx)
+{
+#if defined(THREADS_POSIX)
+	int r;
+
+	if (ctx->device_scan != LIBUSB_DEVICE_SCAN_BACKGROUND)
+		return;
+
+	/* if the thread cannot be had the scan is left to the first caller */
+	r = pthread_create(&ctx->scan_thread, NULL, scan_thread_main, ctx);
+	if (r)
+		usbi_warn(ctx, "failed to create device scan thread (%d)", r);
+	else
+		ctx->scan_thread_started = 1;
+#else
+	UNUSED(ctx);
+#endif
+}
+
+static void stop_scan_thread(struct libusb_context *ctx)
+{
+#if defined(THREADS_POSIX)
+	if (ctx->scan_thread_started)
+		pthread_join(ctx->scan_thread, NULL);
+	ctx->scan_thread_started = 0;
+#else
+	UNUSED(ctx);
+#endif
+}
+
+/** \ingroup libusb_lib
+ * Wait for the context to know about the devices in the system. This runs
+ * the device scan of a context initialized with \ref LIBUSB_DEVICE_SCAN_LAZY
+ * in effect, and waits for the one running in the background under
+ * \ref LIBUSB_DEVICE_SCAN_BACKGROUND. Other contexts know about the devices
+ * once libusb_init() returns.
+ *
+ * libusb_get_device_list() and libusb_hotplug_register_callback() do this
+ * themselves, so there is no need to call it before them.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \returns 0 on success, or a LIBUSB_ERROR code if the scan failed
+ * \see LIBUSB_OPTION_DEVICE_SCAN
+ */
+int API_EXPORTED libusb_wait_device_scan(libusb_context *ctx)
+{
+	USBI_GET_CONTEXT(ctx);
+	return usbi_wait_device_scan(ctx);
+}
+
 /** @ingroup libusb_dev
  * Returns a list of USB devices currently attached to the system. This is
  * your entry point into finding a USB device to operate.
@@ -817,6 +923,12 @@ ssize_t API_EXPORTED libusb_get_device_list(libusb_context *ctx,
 	if (!discdevs)
 		return LIBUSB_ERROR_NO_MEM;
 
+	r = usbi_wait_device_scan(ctx);
+	if (r < 0) {
+		len = r;
+		goto out;
+	}
+
 	if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
 		/* backend provides hotplug support */
 		struct libusb_device *dev;
@@ -1000,6 +1112,33 @@ int API_EXPORTED libusb_get_device_speed(libusb_device *dev)
 	return dev->speed;
 }
 
+static const struct libusb_interface *find_interface(
+	struct libusb_config_descriptor *config, int interface_number)
+{
+	int i;
+
+	for (i = 0; i < config->bNumInterfaces; i++) {
+		const struct libusb_interface *iface = &config->interface[i];
+
+		if (iface->num_altsetting &&
+		    iface->altsetting[0].bInterfaceNumber == interface_number)
+			return iface;
+	}
+	return NULL;
+}
+
+static const struct libusb_interface_descriptor *find_altsetting(
+	const struct libusb_interface *iface, int alternate_setting)
+{
+	int i;
+
+	for (i = 0; i < iface->num_altsetting; i++) {
+		if (iface->altsetting[i].bAlternateSetting == alternate_setting)
+			return &iface->altsetting[i];
+	}
+	return NULL;
+}
+
 static const struct libusb_endpoint_descriptor *find_endpoint(
 	struct libusb_config_descriptor *config, unsigned char endpoint)
 {
@@ -1145,6 +1284,73 @@ out:
 	return r;
 }
 
+static int endpoint_interval(enum libusb_speed speed,
+	const struct libusb_endpoint_descriptor *ep)
+{
+	int interval = ep->bInterval;
+
+	switch (ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) {
+	case LIBUSB_TRANSFER_TYPE_INTERRUPT:
+		if (speed < LIBUSB_SPEED_HIGH)
+			return interval ? interval : 1;
+		/* fall through */
+	case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
+		interval = MIN(MAX(interval, 1), 16);
+		return 1 << (interval - 1);
+	default:
+		return LIBUSB_ERROR_INVALID_PARAM;
+	}
+}
+
+/* The service interval of a periodic endpoint in the alternate setting its
+ * interface is set to on dev_handle, in frames at full and low speed and in
+ * microframes above. */
+int usbi_get_endpoint_interval(struct libusb_device_handle *dev_handle,
+	unsigned char endpoint)
+{
+	struct libusb_device *dev = dev_handle->dev;
+	struct libusb_config_descriptor *config;
+	const struct libusb_endpoint_descriptor *ep = NULL;
+	uint8_t altsettings[USB_MAXINTERFACES];
+	int r, i, j;
+
+	usbi_mutex_lock(&dev_handle->lock);
+	memcpy(altsettings, dev_handle->altsettings, sizeof(altsettings));
+	usbi_mutex_unlock(&dev_handle->lock);
+
+	r = libusb_get_active_config_descriptor(dev, &config);
+	if (r < 0)
+		return LIBUSB_ERROR_OTHER;
+
+	for (i = 0; i < config->bNumInterfaces && !ep; i++) {
+		const struct libusb_interface *iface = &config->interface[i];
+		const struct libusb_interface_descriptor *altsetting;
+		int number;
+
+		if (!iface->num_altsetting)
+			continue;
+		number = iface->altsetting[0].bInterfaceNumber;
+		altsetting = find_altsetting(iface,
+			number < USB_MAXINTERFACES ? altsettings[number] : 0);
+		if (!altsetting)
+			continue;
+		for (j = 0; j < altsetting->bNumEndpoints; j++) {
+			if (altsetting->endpoint[j].bEndpointAddress == endpoint) {
+				ep = &altsetting->endpoint[j];
+				break;
+			}
+		}
+	}
+
+	if (ep)
+		r = endpoint_interval(dev->speed, ep);
+	else
+		r = LIBUSB_ERROR_NOT_FOUND;
+
+	libusb_free_config_descriptor(config);
+	return r;
+}
+
 /** \ingroup libusb_dev
  * Increment the reference count of a device.
  * \param dev the device to reference
@@ -1231,6 +1437,153 @@ int usbi_clear_event(struct libusb_context *ctx)
 	return 0;
 }
 
+/** \ingroup libusb_dev
+ * Attach an emulated loopback device to a context. The device is described
+ * by its descriptors and endpoints and behaves like a device plugged into
+ * the system: it shows up in the device list, hotplug callbacks are told
+ * of its arrival, and it can be opened and used for I/O with the rest of
+ * the API. This is meant for testing and benchmarking applications and
+ * libusb itself without hardware.
+ *
+ * Transfers on an endpoint complete after the endpoint's latency and the
+ * time its bandwidth needs to move the data, one after the other. Faults
+ * can be injected by stalling or dropping every Nth transfer. Standard
+ * requests on the control endpoint are answered from the descriptors;
+ * anything else goes to the device's control callback.
+ *
+ * The endpoint and control callbacks are called with an internal lock held,
+ * from the thread submitting the transfer or from an internal timer thread.
+ * They must not call back into libusb.
+ *
+ * Loopback devices are currently only available on Linux, on a bus numbered
+ * 255. The configuration is copied, so it need not outlive this call.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param config the description of the device
+ * \param dev output location for a reference to the new device, or NULL.
+ * Only populated when the return code is 0; release it with
+ * libusb_unref_device().
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if the configuration is not valid
+ * \returns LIBUSB_ERROR_NO_MEM on memory allocation failure
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if the operation is not supported on this
+ * platform
+ * \returns another LIBUSB_ERROR code on other failure
+ * \see libusb_loopback_remove_device()
+ */
+int API_EXPORTED libusb_loopback_add_device(libusb_context *ctx,
+	const struct libusb_loopback_device *config, libusb_device **dev)
+{
+	USBI_GET_CONTEXT(ctx);
+
+	if (!usbi_backend.add_loopback_device)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	return usbi_backend.add_loopback_device(ctx, config, dev);
+}
+
+/** \ingroup libusb_dev
+ * Unplug a device added with libusb_loopback_add_device(). Transfers in
+ * flight fail with LIBUSB_TRANSFER_NO_DEVICE, further I/O on open handles
+ * fails with LIBUSB_ERROR_NO_DEVICE and hotplug callbacks are told the
+ * device has left, just as when a real device is unplugged.
+ *
+ * \param dev the loopback device
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if dev is not a loopback device
+ * \returns LIBUSB_ERROR_NO_DEVICE if the device was already removed
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if the operation is not supported on this
+ * platform
+ */
+int API_EXPORTED libusb_loopback_remove_device(libusb_device *dev)
+{
+	if (!usbi_backend.remove_loopback_device)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	return usbi_backend.remove_loopback_device(dev);
+}
+
+/** \ingroup libusb_dev
+ * Attach the devices recorded in a usbmon capture as loopback devices that
+ * replay the recorded traffic, so that an application can be run against
+ * real device data without the device.
+ *
+ * The capture can be a pcapng or pcap file of either usbmon link type, as
+ * written by Wireshark, tcpdump or \ref LIBUSB_OPTION_CAPTURE_FD. Each
+ * recorded device gets the descriptors it returned to GET_DESCRIPTOR
+ * requests; when these were not recorded, a vendor specific interface with
+ * the endpoints seen in the capture stands in for its configuration.
+ *
+ * Control requests are answered with the recorded response to the same
+ * request, cycling through the responses when a request was recorded more
+ * than once, and complete after the recorded latency. Standard requests
+ * that were not recorded are answered from the descriptors, other ones
+ * stall.
+ *
+ * Transfers on the other endpoints take the recorded completions of their
+ * endpoint in order, with the recorded data, length and status. The first
+ * such transfer starts the clock, and each one completes when its recorded
+ * completion is due relative to that, scaled by rate: 100 replays in the
+ * original pacing, 200 twice as fast, and 0 completes every transfer as
+ * soon as it is submitted. Transfers that were cancelled in the recording,
+ * and IN transfers submitted once the recording of their endpoint has run
+ * out, stay pending until they time out or are cancelled.
+ *
+ * The devices can be unplugged with libusb_loopback_remove_device(). They
+ * are currently only available on Linux.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param path the capture file
+ * \param rate the replay speed in percent of the recorded one, or 0
+ * \param list output location for a NULL-terminated list of the new
+ * devices. Must be freed with libusb_free_device_list().
+ * \returns the number of devices in the outputted list, or any
+ * \ref libusb_error according to errors encountered by the backend.
+ * \returns LIBUSB_ERROR_IO if the file cannot be read
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if the file is not a usbmon capture
+ * or replay is not supported on this platform
+ */
+ssize_t API_EXPORTED libusb_replay_load(libusb_context *ctx, const char *path,
+	unsigned int rate, libusb_device ***list)
+{
+	struct discovered_devs *discdevs;
+	struct libusb_device **ret;
+	ssize_t i, len;
+	int r;
+	USBI_GET_CONTEXT(ctx);
+
+	if (!path || !list)
+		return LIBUSB_ERROR_INVALID_PARAM;
+	if (!usbi_backend.load_replay)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	discdevs = discovered_devs_alloc();
+	if (!discdevs)
+		return LIBUSB_ERROR_NO_MEM;
+
+	r = usbi_backend.load_replay(ctx, path, rate, &discdevs);
+	if (r < 0) {
+		len = r;
+		goto out;
+	}
+
+	len = (ssize_t)discdevs->len;
+	ret = calloc((size_t)len + 1, sizeof(struct libusb_device *));
+	if (!ret) {
+		len = LIBUSB_ERROR_NO_MEM;
+		goto out;
+	}
+
+	for (i = 0; i < len; i++)
+		ret[i] = libusb_ref_device(discdevs->devices[i]);
+	*list = ret;
+
+out:
+	if (discdevs)
+		discovered_devs_free(discdevs);
+	return len;
+}
+
 /** \ingroup libusb_dev
  * Wrap a platform-specific system device handle and obtain a libusb device
  * handle for the underlying device. The handle allows you to use libusb to
@@ -1285,6 +1638,7 @@ int API_EXPORTED libusb_wrap_sys_device(libusb_context *ctx, intptr_t sys_dev,
 	_dev_handle->dev = NULL;
 	_dev_handle->auto_detach_kernel_driver = 0;
 	_dev_handle->claimed_interfaces = 0;
+	memset(_dev_handle->stats, 0, sizeof(_dev_handle->stats));
 	memset(&_dev_handle->os_priv, 0, priv_size);
 
 	r = usbi_backend.wrap_sys_device(ctx, _dev_handle, sys_dev);
@@ -1348,6 +1702,7 @@ int API_EXPORTED libusb_open(libusb_device *dev,
 	_dev_handle->dev = libusb_ref_device(dev);
 	_dev_handle->auto_detach_kernel_driver = 0;
 	_dev_handle->claimed_interfaces = 0;
+	memset(_dev_handle->stats, 0, sizeof(_dev_handle->stats));
 	memset(&_dev_handle->os_priv, 0, priv_size);
 
 	r = usbi_backend.open(_dev_handle);
@@ -1424,6 +1779,7 @@ static void do_close(struct libusb_context *ctx,
 {
 	struct usbi_transfer *itransfer;
 	struct usbi_transfer *tmp;
+	int i;
 
 	/* remove any transfers in flight that are for this device */
 	usbi_mutex_lock(&ctx->flying_transfers_lock);
@@ -1470,6 +1826,8 @@ static void do_close(struct libusb_context *ctx,
 	usbi_backend.close(dev_handle);
 	libusb_unref_device(dev_handle->dev);
 	usbi_mutex_destroy(&dev_handle->lock);
+	for (i = 0; i < USBI_NUM_ENDPOINT_STATS; i++)
+		free(dev_handle->stats[i]);
 	free(dev_handle);
 }
 
@@ -1651,8 +2009,16 @@ int API_EXPORTED libusb_get_configuration(libusb_device_handle *dev_handle,
 int API_EXPORTED libusb_set_configuration(libusb_device_handle *dev_handle,
 	int configuration)
 {
+	int r;
+
 	usbi_dbg("configuration %d", configuration);
-	return usbi_backend.set_configuration(dev_handle, configuration);
+	r = usbi_backend.set_configuration(dev_handle, configuration);
+	if (r == 0) {
+		usbi_mutex_lock(&dev_handle->lock);
+		memset(dev_handle->altsettings, 0, sizeof(dev_handle->altsettings));
+		usbi_mutex_unlock(&dev_handle->lock);
+	}
+	return r;
 }
 
 /** \ingroup libusb_dev
@@ -1700,8 +2066,10 @@ int API_EXPORTED libusb_claim_interface(libusb_device_handle *dev_handle,
 		goto out;
 
 	r = usbi_backend.claim_interface(dev_handle, interface_number);
-	if (r == 0)
+	if (r == 0) {
 		dev_handle->claimed_interfaces |= 1U << interface_number;
+		dev_handle->altsettings[interface_number] = 0;
+	}
 
 out:
 	usbi_mutex_unlock(&dev_handle->lock);
@@ -1775,6 +2143,8 @@ out:
 int API_EXPORTED libusb_set_interface_alt_setting(libusb_device_handle *dev_handle,
 	int interface_number, int alternate_setting)
 {
+	int r;
+
 	usbi_dbg("interface %d altsetting %d",
 		interface_number, alternate_setting);
 	if (interface_number >= USB_MAXINTERFACES)
@@ -1792,8 +2162,352 @@ int API_EXPORTED libusb_set_interface_alt_setting(libusb_device_handle *dev_hand
 	}
 	usbi_mutex_unlock(&dev_handle->lock);
 
-	return usbi_backend.set_interface_altsetting(dev_handle, interface_number,
+	r = usbi_backend.set_interface_altsetting(dev_handle, interface_number,
 		alternate_setting);
+	if (r == 0) {
+		usbi_mutex_lock(&dev_handle->lock);
+		dev_handle->altsettings[interface_number] =
+			(uint8_t)alternate_setting;
+		usbi_mutex_unlock(&dev_handle->lock);
+	}
+	return r;
+}
+
+/* USB 2.0 section 5.11.3: host controller and low speed hub setup delays,
+ * and the bit time of a payload with worst case bit stuffing */
+#define BW_HOST_DELAY		1000
+#define BW_HUB_LS_SETUP		333
+#define BW_BIT_TIME(bytes)	(7 * 8 * (bytes) / 6)
+
+/* SuperSpeed header, framing and link overhead of a data packet, in bytes */
+#define BW_SS_PACKET_OVERHEAD	36
+
+/* share of a (micro)frame periodic transfers may reserve, in ns per ms */
+#define BW_HS_BUDGET		800000
+#define BW_BUDGET		900000
+
+/* the bus time, in nanoseconds, of one transaction of a periodic endpoint */
+static uint64_t transaction_time(enum libusb_speed speed, int in, int iso,
+	unsigned int bytes)
+{
+	uint64_t bits = 31 + 10 * (uint64_t)BW_BIT_TIME(bytes);
+
+	switch (speed) {
+	case LIBUSB_SPEED_LOW:
+		if (in)
+			return 64060 + 2 * BW_HUB_LS_SETUP + BW_HOST_DELAY +
+				67667 * bits / 1000;
+		return 64107 + 2 * BW_HUB_LS_SETUP + BW_HOST_DELAY +
+			66700 * bits / 1000;
+	case LIBUSB_SPEED_FULL:
+		if (iso)
+			return (in ? 7268 : 6265) + BW_HOST_DELAY + 8354 * bits / 1000;
+		return 9107 + BW_HOST_DELAY + 8354 * bits / 1000;
+	default:
+		return ((iso ? 38 : 55) * 8 * 2083 +
+			2083 * (3 + (uint64_t)BW_BIT_TIME(bytes))) / 1000 + 5;
+	}
+}
+
+/* bus time reserved on the bus of a device and on its transaction
+ * translator, averaged over the service intervals, in ns per ms */
+struct periodic_load {
+	uint64_t bus;
+	uint64_t tt;
+};
+
+/* the high speed hub whose transaction translator a full or low speed
+ * device is behind, and the port of the translator on multi-TT hubs */
+static struct libusb_device *find_tt(struct libusb_device *dev, int *port)
+{
+	struct libusb_device *hub;
+
+	*port = 0;
+	if (dev->speed == LIBUSB_SPEED_UNKNOWN || dev->speed >= LIBUSB_SPEED_HIGH)
+		return NULL;
+
+	for (hub = dev->parent_dev; hub; dev = hub, hub = hub->parent_dev) {
+		if (hub->speed != LIBUSB_SPEED_HIGH)
+			continue;
+		/* root hubs have no descriptor protocol to go by, but give
+		 * each port a translator of its own where they have any */
+		if (!hub->parent_dev ||
+		    hub->device_descriptor.bDeviceProtocol == 2)
+			*port = dev->port_number;
+		return hub;
+	}
+	return NULL;
+}
+
+static void endpoint_load(struct libusb_device *dev,
+	const struct libusb_endpoint_descriptor *ep, struct periodic_load *load)
+{
+	struct libusb_ss_endpoint_companion_descriptor *ss_ep_cmp;
+	enum libusb_speed speed = dev->speed;
+	int type = ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK;
+	int in = ep->bEndpointAddress & LIBUSB_ENDPOINT_IN;
+	int iso = type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS;
+	unsigned int maxp = ep->wMaxPacketSize & 0x07ff;
+	unsigned int mult = 1 + ((ep->wMaxPacketSize >> 11) & 3);
+	unsigned int bytes, packets;
+	uint64_t ns;
+	int interval, port;
+
+	/* zero bandwidth alternate settings reserve nothing */
+	interval = endpoint_interval(speed, ep);
+	if (interval < 0 || !maxp)
+		return;
+
+	if (speed >= LIBUSB_SPEED_SUPER) {
+		bytes = maxp * mult;
+		if (libusb_get_ss_endpoint_companion_descriptor(dev->ctx, ep,
+				&ss_ep_cmp) == LIBUSB_SUCCESS) {
+			bytes = ss_ep_cmp->wBytesPerInterval;
+			libusb_free_ss_endpoint_companion_descriptor(ss_ep_cmp);
+		}
+		/* 8b/10b coding at 5 Gbps, 128b/132b at 10 Gbps */
+		packets = maxp ? (bytes + maxp - 1) / maxp : 1;
+		ns = (uint64_t)(bytes + packets * BW_SS_PACKET_OVERHEAD) *
+			(speed == LIBUSB_SPEED_SUPER ? 2000 : 825) / 1000;
+		load->bus += ns * 8 / interval;
+	} else if (speed == LIBUSB_SPEED_HIGH) {
+		ns = mult * transaction_time(speed, in, iso, maxp);
+		load->bus += ns * 8 / interval;
+	} else if (find_tt(dev, &port)) {
+		/* the start and complete splits on the high speed side carry
+		 * the payload in one direction and a handshake in the other */
+		load->tt += transaction_time(speed, in, iso, maxp) / interval;
+		ns = transaction_time(LIBUSB_SPEED_HIGH, in, iso, maxp) +
+			transaction_time(LIBUSB_SPEED_HIGH, in, iso, 0);
+		load->bus += ns / interval;
+	} else {
+		load->bus += transaction_time(speed, in, iso, maxp) / interval;
+	}
+}
+
+static void altsetting_load(struct libusb_device *dev,
+	const struct libusb_interface_descriptor *altsetting,
+	struct periodic_load *load)
+{
+	int i;
+
+	for (i = 0; i < altsetting->bNumEndpoints; i++)
+		endpoint_load(dev, &altsetting->endpoint[i], load);
+}
+
+/* the claimed interfaces of an open handle, copied so that descriptors
+ * are not read with the context's locks held */
+struct periodic_claim {
+	struct libusb_device *dev;
+	unsigned long claimed_interfaces;
+	uint8_t altsettings[USB_MAXINTERFACES];
+	int is_handle;
+};
+
+/* add up the periodic bandwidth the claimed interfaces of every handle of
+ * the context reserve on the bus and the transaction translator of the
+ * device of dev_handle, leaving out one of its interfaces (-1 for none) */
+static int periodic_usage(libusb_device_handle *dev_handle,
+	int skip_interface, struct periodic_load *usage)
+{
+	struct libusb_context *ctx = HANDLE_CTX(dev_handle);
+	struct libusb_device *dev = dev_handle->dev;
+	struct libusb_device_handle *it;
+	struct libusb_device *tt, *other_tt;
+	struct periodic_claim *claims;
+	int num_claims = 0, tt_port, other_port;
+	int i, j, r;
+
+	usbi_mutex_lock(&ctx->open_devs_lock);
+	list_for_each_entry(it, &ctx->open_devs, list, struct libusb_device_handle)
+		num_claims++;
+	claims = calloc(num_claims ? num_claims : 1, sizeof(*claims));
+	if (!claims) {
+		usbi_mutex_unlock(&ctx->open_devs_lock);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+	i = 0;
+	list_for_each_entry(it, &ctx->open_devs, list, struct libusb_device_handle) {
+		claims[i].dev = libusb_ref_device(it->dev);
+		claims[i].is_handle = it == dev_handle;
+		usbi_mutex_lock(&it->lock);
+		claims[i].claimed_interfaces = it->claimed_interfaces;
+		memcpy(claims[i].altsettings, it->altsettings,
+			sizeof(claims[i].altsettings));
+		usbi_mutex_unlock(&it->lock);
+		i++;
+	}
+	usbi_mutex_unlock(&ctx->open_devs_lock);
+
+	memset(usage, 0, sizeof(*usage));
+	tt = find_tt(dev, &tt_port);
+	for (i = 0; i < num_claims; i++) {
+		struct libusb_device *other = claims[i].dev;
+		struct libusb_config_descriptor *config;
+		struct periodic_load load = { 0, 0 };
+
+		if (other->bus_number != dev->bus_number)
+			continue;
+		if (claims[i].is_handle && skip_interface >= 0)
+			claims[i].claimed_interfaces &= ~(1UL << skip_interface);
+		if (!claims[i].claimed_interfaces)
+			continue;
+
+		r = libusb_get_active_config_descriptor(other, &config);
+		if (r < 0) {
+			usbi_dbg("no active config of device %u.%u, error %d",
+				other->bus_number, other->device_address, r);
+			continue;
+		}
+		for (j = 0; j < USB_MAXINTERFACES; j++) {
+			const struct libusb_interface *iface;
+			const struct libusb_interface_descriptor *altsetting;
+
+			if (!(claims[i].claimed_interfaces & (1UL << j)))
+				continue;
+			iface = find_interface(config, j);
+			altsetting = iface ?
+				find_altsetting(iface, claims[i].altsettings[j]) : NULL;
+			if (altsetting)
+				altsetting_load(other, altsetting, &load);
+		}
+		libusb_free_config_descriptor(config);
+
+		usage->bus += load.bus;
+		other_tt = find_tt(other, &other_port);
+		if (tt && other_tt == tt && other_port == tt_port)
+			usage->tt += load.tt;
+	}
+
+	for (i = 0; i < num_claims; i++)
+		libusb_unref_device(claims[i].dev);
+	free(claims);
+	return 0;
+}
+
+static void periodic_budget(struct libusb_device *dev,
+	struct libusb_periodic_bandwidth *bandwidth)
+{
+	int port;
+
+	bandwidth->bus_budget = BW_BUDGET;
+	if (dev->speed == LIBUSB_SPEED_HIGH || find_tt(dev, &port))
+		bandwidth->bus_budget = BW_HS_BUDGET;
+	bandwidth->tt_budget = find_tt(dev, &port) ? BW_BUDGET : 0;
+}
+
+/** \ingroup libusb_dev
+ * Get the periodic bandwidth reserved on the bus of a device, and on the
+ * transaction translator of the hub it is behind if it is a full or low
+ * speed device behind a high speed hub. The bandwidth of every isochronous
+ * and interrupt endpoint in the alternate settings of the interfaces that
+ * are claimed through the handles of the context is counted, from the
+ * cached descriptors of their devices.
+ *
+ * Bus time is given in nanoseconds per millisecond and averaged over the
+ * service intervals of the endpoints. It follows the transaction times of
+ * section 5.11.3 of the USB 2.0 specification, and for SuperSpeed counts
+ * wBytesPerInterval of the endpoint companion descriptors at the signalling
+ * rate. Since host controllers have to place each endpoint in particular
+ * (micro)frames, and other programs may hold bandwidth too, an endpoint
+ * may still be refused bandwidth that seems to be free.
+ *
+ * This is a non-blocking function; no requests are sent over the bus.
+ *
+ * \param dev_handle a device handle
+ * \param bandwidth output location for the bandwidth in use
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NO_MEM on memory allocation failure
+ * \see libusb_get_fitting_altsetting()
+ */
+int API_EXPORTED libusb_get_periodic_bandwidth(
+	libusb_device_handle *dev_handle,
+	struct libusb_periodic_bandwidth *bandwidth)
+{
+	struct periodic_load usage;
+	int r;
+
+	r = periodic_usage(dev_handle, -1, &usage);
+	if (r < 0)
+		return r;
+
+	bandwidth->bus_used = (uint32_t)MIN(usage.bus, UINT32_MAX);
+	bandwidth->tt_used = (uint32_t)MIN(usage.tt, UINT32_MAX);
+	periodic_budget(dev_handle->dev, bandwidth);
+	return 0;
+}
+
+/** \ingroup libusb_dev
+ * Find the alternate setting of an interface with the most periodic
+ * bandwidth that would fit in the bandwidth left on the bus and the
+ * transaction translator of the device, so that it can be activated with
+ * libusb_set_interface_alt_setting() before any transfer is submitted. The
+ * bandwidth of the alternate setting that is active on the interface does
+ * not count as used. Of alternate settings that need the same bandwidth,
+ * the one with the highest number is found.
+ *
+ * Usage is worked out as by libusb_get_periodic_bandwidth(). The interface
+ * need not be claimed.
+ *
+ * \param dev_handle a device handle
+ * \param interface_number the <tt>bInterfaceNumber</tt> of the interface
+ * \returns the <tt>bAlternateSetting</tt> of the alternate setting found
+ * \returns LIBUSB_ERROR_NOT_FOUND if the interface does not exist
+ * \returns LIBUSB_ERROR_BUSY if no alternate setting fits
+ * \returns another LIBUSB_ERROR code on other failure
+ */
+int API_EXPORTED libusb_get_fitting_altsetting(
+	libusb_device_handle *dev_handle, int interface_number)
+{
+	struct libusb_device *dev = dev_handle->dev;
+	struct libusb_config_descriptor *config;
+	const struct libusb_interface *iface;
+	struct libusb_periodic_bandwidth budget;
+	struct periodic_load usage, best = { 0, 0 };
+	int i, r;
+
+	if (interface_number < 0 || interface_number >= USB_MAXINTERFACES)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	r = periodic_usage(dev_handle, interface_number, &usage);
+	if (r < 0)
+		return r;
+	periodic_budget(dev, &budget);
+
+	r = libusb_get_active_config_descriptor(dev, &config);
+	if (r < 0)
+		return r;
+
+	iface = find_interface(config, interface_number);
+	if (!iface) {
+		r = LIBUSB_ERROR_NOT_FOUND;
+		goto out;
+	}
+
+	r = LIBUSB_ERROR_BUSY;
+	for (i = 0; i < iface->num_altsetting; i++) {
+		const struct libusb_interface_descriptor *altsetting =
+			&iface->altsetting[i];
+		struct periodic_load load = { 0, 0 };
+
+		altsetting_load(dev, altsetting, &load);
+		usbi_dbg("interface %d altsetting %u needs %u/%u ns per ms",
+			interface_number, altsetting->bAlternateSetting,
+			(unsigned int)load.bus, (unsigned int)load.tt);
+		if (usage.bus + load.bus > budget.bus_budget ||
+		    usage.tt + load.tt > budget.tt_budget)
+			continue;
+		if (r >= 0 && (load.bus + load.tt < best.bus + best.tt ||
+		    (load.bus + load.tt == best.bus + best.tt &&
+		     altsetting->bAlternateSetting < r)))
+			continue;
+		best = load;
+		r = altsetting->bAlternateSetting;
+	}
+
+out:
+	libusb_free_config_descriptor(config);
+	return r;
 }
 
 /** \ingroup libusb_dev
@@ -1843,11 +2557,20 @@ int API_EXPORTED libusb_clear_halt(libusb_device_handle *dev_handle,
  */
 int API_EXPORTED libusb_reset_device(libusb_device_handle *dev_handle)
 {
+	int r;
+
 	usbi_dbg("");
 	if (!dev_handle->dev->attached)
 		return LIBUSB_ERROR_NO_DEVICE;
 
-	return usbi_backend.reset_device(dev_handle);
+	/* the reset puts every interface back in its first alternate setting */
+	r = usbi_backend.reset_device(dev_handle);
+	if (r == 0) {
+		usbi_mutex_lock(&dev_handle->lock);
+		memset(dev_handle->altsettings, 0, sizeof(dev_handle->altsettings));
+		usbi_mutex_unlock(&dev_handle->lock);
+	}
+	return r;
 }
 
 /** \ingroup libusb_asyncio
@@ -2110,6 +2833,7 @@ void API_EXPORTED libusb_set_debug(libusb_context *ctx, int level)
 	if (!ctx->debug_fixed) {
 		level = CLAMP(level, LIBUSB_LOG_LEVEL_NONE, LIBUSB_LOG_LEVEL_DEBUG);
 		ctx->debug = (enum libusb_log_level)level;
+		raise_log_level(ctx->debug);
 	}
 #else
 	UNUSED(ctx);
@@ -2185,6 +2909,20 @@ int API_EXPORTED libusb_set_option(libusb_context *ctx,
 	int arg, r = LIBUSB_SUCCESS;
 	va_list ap;
 
+	/* applies to the contexts initialized from now on, so takes none */
+	if (option == LIBUSB_OPTION_DEVICE_SCAN) {
+		va_start(ap, option);
+		arg = va_arg(ap, int);
+		va_end(ap);
+		if (ctx || arg < LIBUSB_DEVICE_SCAN_EAGER ||
+		    arg > LIBUSB_DEVICE_SCAN_BACKGROUND)
+			return LIBUSB_ERROR_INVALID_PARAM;
+		usbi_mutex_static_lock(&default_context_lock);
+		default_device_scan = (enum libusb_device_scan)arg;
+		usbi_mutex_static_unlock(&default_context_lock);
+		return LIBUSB_SUCCESS;
+	}
+
 	USBI_GET_CONTEXT(ctx);
 
 	va_start(ap, option);
@@ -2196,13 +2934,78 @@ int API_EXPORTED libusb_set_option(libusb_context *ctx,
 			break;
 		}
 #if defined(ENABLE_LOGGING) && !defined(ENABLE_DEBUG_LOGGING)
-		if (!ctx->debug_fixed)
+		if (!ctx->debug_fixed) {
 			ctx->debug = (enum libusb_log_level)arg;
+			raise_log_level(ctx->debug);
+		}
+#endif
+		break;
+
+	case LIBUSB_OPTION_LOG_ASYNC:
+		arg = va_arg(ap, int);
+#if defined(ENABLE_LOGGING) && defined(HAVE_ASYNC_LOG)
+		if (arg && !ctx->log_async) {
+			r = log_async_start();
+			if (r == 0)
+				ctx->log_async = 1;
+		} else if (!arg && ctx->log_async) {
+			log_async_stop();
+			ctx->log_async = 0;
+		}
+#else
+		r = LIBUSB_ERROR_NOT_SUPPORTED;
 #endif
 		break;
 
+	case LIBUSB_OPTION_BUSY_POLL:
+		arg = va_arg(ap, int);
+		if (arg < 0 || arg > USBI_MAX_BUSY_POLL_US) {
+			r = LIBUSB_ERROR_INVALID_PARAM;
+			break;
+		}
+		if (!usbi_backend.busy_poll) {
+			r = LIBUSB_ERROR_NOT_SUPPORTED;
+			break;
+		}
+		ctx->busy_poll_us = (unsigned int)arg;
+		break;
+
+	case LIBUSB_OPTION_ENDPOINT_STATS:
+		ctx->endpoint_stats = va_arg(ap, int) != 0;
+		if (ctx->endpoint_stats)
+			ctx->endpoint_stats_used = 1;
+		break;
+
+	case LIBUSB_OPTION_TRACE_RING:
+		r = usbi_set_trace_ring(ctx, va_arg(ap, int));
+		break;
+
+	case LIBUSB_OPTION_CAPTURE_FD:
+		r = usbi_set_capture(ctx, va_arg(ap, int));
+		break;
+
+	case LIBUSB_OPTION_EVENT_THREAD:
+		r = usbi_start_event_thread(ctx, va_arg(ap, int));
+		break;
+
+	case LIBUSB_OPTION_EVENT_THREAD_AFFINITY:
+		r = usbi_set_event_thread_affinity(ctx, va_arg(ap, int));
+		break;
+
+	case LIBUSB_OPTION_EVENT_THREAD_PRIORITY:
+		r = usbi_set_event_thread_priority(ctx, va_arg(ap, int));
+		break;
+
 	/* Handle all backend-specific options here */
 	case LIBUSB_OPTION_USE_USBDK:
+	case LIBUSB_OPTION_HOTPLUG_EVENT_LOOP:
+	case LIBUSB_OPTION_REAPER_THREADS:
+	case LIBUSB_OPTION_EVENT_SHARDS:
+	case LIBUSB_OPTION_SHARD_POLICY:
+	case LIBUSB_OPTION_SHARD_NEXT:
+	case LIBUSB_OPTION_IO_URING:
+	case LIBUSB_OPTION_BULK_URB_SIZE:
+	case LIBUSB_OPTION_BULK_URB_WINDOW:
 		if (usbi_backend.set_option)
 			r = usbi_backend.set_option(ctx, option, ap);
 		else
@@ -2235,6 +3038,14 @@ static enum libusb_log_level get_env_debug_level(void)
 	}
 	return level;
 }
+
+/* usbi_log_level only ever grows, so that a context logging at a lower
+ * level does not silence another one. */
+static void raise_log_level(enum libusb_log_level level)
+{
+	if ((int)level > usbi_log_level)
+		usbi_log_level = (int)level;
+}
 #endif
 
 /** \ingroup libusb_lib
@@ -2281,6 +3092,11 @@ int API_EXPORTED libusb_init(libusb_context **context)
 	ctx->debug = get_env_debug_level();
 	if (ctx->debug != LIBUSB_LOG_LEVEL_NONE)
 		ctx->debug_fixed = 1;
+	if (!log_level_resolved) {
+		usbi_log_level = LIBUSB_LOG_LEVEL_NONE;
+		log_level_resolved = 1;
+	}
+	raise_log_level(ctx->debug);
 #endif
 
 	/* default context should be initialized before calling usbi_dbg */
@@ -2296,6 +3112,10 @@ int API_EXPORTED libusb_init(libusb_context **context)
 	usbi_mutex_init(&ctx->usb_devs_lock);
 	usbi_mutex_init(&ctx->open_devs_lock);
 	usbi_mutex_init(&ctx->hotplug_cbs_lock);
+	usbi_mutex_init(&ctx->scan_lock);
+	usbi_cond_init(&ctx->scan_cond);
+	if (usbi_backend.scan_devices)
+		ctx->device_scan = default_device_scan;
 	list_init(&ctx->usb_devs);
 	list_init(&ctx->open_devs);
 	list_init(&ctx->hotplug_cbs);
@@ -2319,6 +3139,11 @@ int API_EXPORTED libusb_init(libusb_context **context)
 	if (r < 0)
 		goto err_backend_exit;
 
+	if (ctx->device_scan != LIBUSB_DEVICE_SCAN_EAGER) {
+		ctx->scan_state = USBI_SCAN_PENDING;
+		start_scan_thread(ctx);
+	}
+
 	usbi_mutex_static_unlock(&default_context_lock);
 
 	if (context)
@@ -2349,6 +3174,8 @@ err_free_ctx:
 	usbi_mutex_destroy(&ctx->open_devs_lock);
 	usbi_mutex_destroy(&ctx->usb_devs_lock);
 	usbi_mutex_destroy(&ctx->hotplug_cbs_lock);
+	usbi_cond_destroy(&ctx->scan_cond);
+	usbi_mutex_destroy(&ctx->scan_lock);
 
 	free(ctx);
 err_unlock:
@@ -2397,6 +3224,9 @@ void API_EXPORTED libusb_exit(struct libusb_context *ctx)
 	list_del (&ctx->list);
 	usbi_mutex_static_unlock(&active_contexts_lock);
 
+	usbi_stop_event_thread(ctx);
+	stop_scan_thread(ctx);
+
 	if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
 		usbi_hotplug_deregister(ctx, 1);
 
@@ -2427,13 +3257,21 @@ void API_EXPORTED libusb_exit(struct libusb_context *ctx)
 	if (!list_empty(&ctx->open_devs))
 		usbi_warn(ctx, "application left some devices open");
 
-	usbi_io_exit(ctx);
+	/* backend threads may still report to the event loop until they are
+	 * stopped, so tear down the io state last */
 	if (usbi_backend.exit)
 		usbi_backend.exit(ctx);
+	usbi_io_exit(ctx);
 
 	usbi_mutex_destroy(&ctx->open_devs_lock);
 	usbi_mutex_destroy(&ctx->usb_devs_lock);
 	usbi_mutex_destroy(&ctx->hotplug_cbs_lock);
+	usbi_cond_destroy(&ctx->scan_cond);
+	usbi_mutex_destroy(&ctx->scan_lock);
+#if defined(ENABLE_LOGGING) && defined(HAVE_ASYNC_LOG)
+	if (ctx->log_async)
+		log_async_stop();
+#endif
 	free(ctx);
 
 	if (destroying_default_context) {
@@ -2553,10 +3391,279 @@ static void usbi_log_str(enum libusb_log_level level, const char *str)
 	UNUSED(level);
 }
 
+/* Writes the message header to buf, which holds USBI_MAX_LOG_LEN bytes, and
+ * returns its length */
+static int log_header(char *buf, enum libusb_log_level level,
+	int global_debug, int tid, const char *function,
+	const struct timespec *now)
+{
+	const char *prefix;
+	int header_len;
+
+	switch (level) {
+	case LIBUSB_LOG_LEVEL_ERROR:
+		prefix = "error";
+		break;
+	case LIBUSB_LOG_LEVEL_WARNING:
+		prefix = "warning";
+		break;
+	case LIBUSB_LOG_LEVEL_INFO:
+		prefix = "info";
+		break;
+	case LIBUSB_LOG_LEVEL_DEBUG:
+		prefix = "debug";
+		break;
+	default:
+		prefix = "unknown";
+		break;
+	}
+
+	if (global_debug) {
+		header_len = snprintf(buf, USBI_MAX_LOG_LEN,
+			"[%2ld.%06ld] [%08x] libusb: %s [%s] ",
+			(long)now->tv_sec, (long)(now->tv_nsec / 1000L), tid, prefix, function);
+	} else {
+		header_len = snprintf(buf, USBI_MAX_LOG_LEN,
+			"libusb: %s [%s] ", prefix, function);
+	}
+
+	if (header_len < 0 || header_len >= USBI_MAX_LOG_LEN) {
+		/* Somehow snprintf failed to write to the buffer,
+		 * remove the header so something useful is output. */
+		header_len = 0;
+	}
+	/* Make sure buffer is NUL terminated */
+	buf[header_len] = '\0';
+	return header_len;
+}
+
+/* Appends the line terminator after text_len bytes of text written behind
+ * the header, truncating the text if needed */
+static void log_terminate(char *buf, int header_len, int text_len)
+{
+	if (text_len < 0 || text_len + header_len >= USBI_MAX_LOG_LEN) {
+		/* Truncated log output. On some platforms a -1 return value means
+		 * that the output was truncated. */
+		text_len = USBI_MAX_LOG_LEN - header_len;
+	}
+	if (header_len + text_len + (int)sizeof(USBI_LOG_LINE_END) >= USBI_MAX_LOG_LEN) {
+		/* Need to truncate the text slightly to fit on the terminator. */
+		text_len -= (header_len + text_len + (int)sizeof(USBI_LOG_LINE_END)) - USBI_MAX_LOG_LEN;
+	}
+	strcpy(buf + header_len + text_len, USBI_LOG_LINE_END);
+}
+
+#ifdef HAVE_ASYNC_LOG
+/* Asynchronous log sink.
+ *
+ * Logging threads format the message text into a slot of a bounded ring and
+ * move on; a single log thread adds the header and hands the line to
+ * usbi_log_str(). The text has to be formatted by the caller since the
+ * arguments may not outlive the call, but the header, the write to stderr,
+ * syslog or the global log handler, and any locking they do happen on the
+ * log thread. Slots are claimed with a compare-and-swap on the head and
+ * carry a sequence number telling whether they are free, being written or
+ * ready, so producers never block. When the ring is full the message is
+ * dropped and counted, and the log thread reports how many were lost.
+ *
+ * The sink is shared by all contexts and runs while at least one of them
+ * has enabled LIBUSB_OPTION_LOG_ASYNC. */
+#define LOG_ASYNC_ENTRIES	256
+
+struct log_entry {
+	unsigned int seq;
+	enum libusb_log_level level;
+	int global_debug;
+	int tid;
+	const char *function;
+	struct timespec time;
+	char text[USBI_MAX_LOG_LEN];
+};
+
+static struct {
+	struct log_entry entries[LOG_ASYNC_ENTRIES];
+	unsigned int head;
+	unsigned int tail;
+	unsigned int dropped;
+	int initialized;
+	int active;
+	int sleeping;
+	int stop;
+	int users;
+	pthread_t thread;
+} log_ring;
+
+static usbi_mutex_static_t log_async_lock = USBI_MUTEX_INITIALIZER;
+static usbi_mutex_t log_ring_lock;
+static usbi_cond_t log_ring_cond;
+
+static int log_async_enabled(struct libusb_context *ctx)
+{
+#ifndef ENABLE_DEBUG_LOGGING
+	/* a per context log handler is called from the thread that logs */
+	if (ctx && ctx->log_handler)
+		return 0;
+#else
+	UNUSED(ctx);
+#endif
+	return __atomic_load_n(&log_ring.active, __ATOMIC_ACQUIRE);
+}
+
+static void log_async_push(enum libusb_log_level level, int global_debug,
+	const char *function, const struct timespec *now, const char *format,
+	va_list args)
+{
+	struct log_entry *entry;
+	unsigned int pos, seq;
+
+	pos = __atomic_load_n(&log_ring.head, __ATOMIC_RELAXED);
+	for (;;) {
+		entry = &log_ring.entries[pos % LOG_ASYNC_ENTRIES];
+		seq = __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE);
+		if (seq == pos) {
+			if (__atomic_compare_exchange_n(&log_ring.head, &pos, pos + 1,
+					1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if ((int)(seq - pos) < 0) {
+			/* the log thread has not freed this slot yet */
+			__atomic_fetch_add(&log_ring.dropped, 1, __ATOMIC_RELAXED);
+			return;
+		} else {
+			pos = __atomic_load_n(&log_ring.head, __ATOMIC_RELAXED);
+		}
+	}
+
+	entry->level = level;
+	entry->global_debug = global_debug;
+	entry->tid = usbi_get_tid();
+	entry->function = function;
+	entry->time = *now;
+	vsnprintf(entry->text, sizeof(entry->text), format, args);
+	__atomic_store_n(&entry->seq, pos + 1, __ATOMIC_RELEASE);
+
+	/* pairs with the fence in log_async_thread_main(): either we see the
+	 * log thread going to sleep, or it sees this entry before sleeping */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&log_ring.sleeping, __ATOMIC_RELAXED)) {
+		usbi_mutex_lock(&log_ring_lock);
+		usbi_cond_broadcast(&log_ring_cond);
+		usbi_mutex_unlock(&log_ring_lock);
+	}
+}
+
+static int log_async_ready(void)
+{
+	struct log_entry *entry = &log_ring.entries[log_ring.tail % LOG_ASYNC_ENTRIES];
+
+	return __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE) == log_ring.tail + 1;
+}
+
+static void *log_async_thread_main(void *arg)
+{
+	struct timeval tv = { 0, 100000 };
+	struct log_entry *entry;
+	char buf[USBI_MAX_LOG_LEN];
+	unsigned int dropped;
+	int header_len, stop;
+
+	UNUSED(arg);
+
+	for (;;) {
+		if (log_async_ready()) {
+			entry = &log_ring.entries[log_ring.tail % LOG_ASYNC_ENTRIES];
+			header_len = log_header(buf, entry->level, entry->global_debug,
+				entry->tid, entry->function, &entry->time);
+			log_terminate(buf, header_len, snprintf(buf + header_len,
+				sizeof(buf) - (size_t)header_len, "%s", entry->text));
+			usbi_log_str(entry->level, buf);
+
+			__atomic_store_n(&entry->seq, log_ring.tail + LOG_ASYNC_ENTRIES,
+				__ATOMIC_RELEASE);
+			log_ring.tail++;
+			continue;
+		}
+
+		dropped = __atomic_exchange_n(&log_ring.dropped, 0, __ATOMIC_RELAXED);
+		if (dropped) {
+			snprintf(buf, sizeof(buf), "libusb: warning [%s] %u messages dropped"
+				USBI_LOG_LINE_END, __FUNCTION__, dropped);
+			usbi_log_str(LIBUSB_LOG_LEVEL_WARNING, buf);
+		}
+
+		/* the ring is drained; exit if asked to, otherwise sleep until
+		 * a message comes in. The timeout is only a safety net. */
+		usbi_mutex_lock(&log_ring_lock);
+		stop = log_ring.stop;
+		if (!stop) {
+			__atomic_store_n(&log_ring.sleeping, 1, __ATOMIC_RELAXED);
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			if (!log_async_ready())
+				usbi_cond_timedwait(&log_ring_cond, &log_ring_lock, &tv);
+			__atomic_store_n(&log_ring.sleeping, 0, __ATOMIC_RELAXED);
+		}
+		usbi_mutex_unlock(&log_ring_lock);
+		if (stop)
+			break;
+	}
+
+	return NULL;
+}
+
+static int log_async_start(void)
+{
+	unsigned int i;
+	int r = 0;
+
+	usbi_mutex_static_lock(&log_async_lock);
+	if (log_ring.users++)
+		goto out;
+
+	if (!log_ring.initialized) {
+		for (i = 0; i < LOG_ASYNC_ENTRIES; i++)
+			log_ring.entries[i].seq = i;
+		/* never destroyed, a logging thread may still be waking
+		 * the log thread while it stops */
+		usbi_mutex_init(&log_ring_lock);
+		usbi_cond_init(&log_ring_cond);
+		log_ring.initialized = 1;
+	}
+
+	log_ring.stop = 0;
+	if (pthread_create(&log_ring.thread, NULL, log_async_thread_main, NULL)) {
+		log_ring.users--;
+		r = LIBUSB_ERROR_OTHER;
+		goto out;
+	}
+	__atomic_store_n(&log_ring.active, 1, __ATOMIC_RELEASE);
+
+out:
+	usbi_mutex_static_unlock(&log_async_lock);
+	return r;
+}
+
+/* Stops the log thread once its last user is gone, after it has written out
+ * every message in the ring */
+static void log_async_stop(void)
+{
+	usbi_mutex_static_lock(&log_async_lock);
+	if (--log_ring.users)
+		goto out;
+
+	__atomic_store_n(&log_ring.active, 0, __ATOMIC_RELEASE);
+	usbi_mutex_lock(&log_ring_lock);
+	log_ring.stop = 1;
+	usbi_cond_broadcast(&log_ring_cond);
+	usbi_mutex_unlock(&log_ring_lock);
+	pthread_join(log_ring.thread, NULL);
+
+out:
+	usbi_mutex_static_unlock(&log_async_lock);
+}
+#endif /* HAVE_ASYNC_LOG */
+
 void usbi_log_v(struct libusb_context *ctx, enum libusb_log_level level,
 	const char *function, const char *format, va_list args)
 {
-	const char *prefix;
 	char buf[USBI_MAX_LOG_LEN];
 	struct timespec now;
 	int global_debug, header_len, text_len;
@@ -2567,12 +3674,17 @@ void usbi_log_v(struct libusb_context *ctx, enum libusb_log_level level,
 	UNUSED(ctx);
 #else
 	enum libusb_log_level ctx_level = LIBUSB_LOG_LEVEL_NONE;
+	static int env_level = -1;
 
 	USBI_GET_CONTEXT(ctx);
 	if (ctx)
 		ctx_level = ctx->debug;
-	else
-		ctx_level = get_env_debug_level();
+	else {
+		/* no context yet, read LIBUSB_DEBUG once rather than per message */
+		if (env_level < 0)
+			env_level = (int)get_env_debug_level();
+		ctx_level = (enum libusb_log_level)env_level;
+	}
 
 	if (ctx_level == LIBUSB_LOG_LEVEL_NONE)
 		return;
@@ -2599,54 +3711,21 @@ void usbi_log_v(struct libusb_context *ctx, enum libusb_log_level level,
 	now.tv_sec -= timestamp_origin.tv_sec;
 	now.tv_nsec -= timestamp_origin.tv_nsec;
 
-	switch (level) {
-	case LIBUSB_LOG_LEVEL_NONE:
+	if (level == LIBUSB_LOG_LEVEL_NONE)
 		return;
-	case LIBUSB_LOG_LEVEL_ERROR:
-		prefix = "error";
-		break;
-	case LIBUSB_LOG_LEVEL_WARNING:
-		prefix = "warning";
-		break;
-	case LIBUSB_LOG_LEVEL_INFO:
-		prefix = "info";
-		break;
-	case LIBUSB_LOG_LEVEL_DEBUG:
-		prefix = "debug";
-		break;
-	default:
-		prefix = "unknown";
-		break;
-	}
 
-	if (global_debug) {
-		header_len = snprintf(buf, sizeof(buf),
-			"[%2ld.%06ld] [%08x] libusb: %s [%s] ",
-			(long)now.tv_sec, (long)(now.tv_nsec / 1000L), usbi_get_tid(), prefix, function);
-	} else {
-		header_len = snprintf(buf, sizeof(buf),
-			"libusb: %s [%s] ", prefix, function);
+#ifdef HAVE_ASYNC_LOG
+	if (log_async_enabled(ctx)) {
+		log_async_push(level, global_debug, function, &now, format, args);
+		return;
 	}
+#endif
 
-	if (header_len < 0 || header_len >= (int)sizeof(buf)) {
-		/* Somehow snprintf failed to write to the buffer,
-		 * remove the header so something useful is output. */
-		header_len = 0;
-	}
-	/* Make sure buffer is NUL terminated */
-	buf[header_len] = '\0';
+	header_len = log_header(buf, level, global_debug, usbi_get_tid(),
+		function, &now);
 	text_len = vsnprintf(buf + header_len, sizeof(buf) - (size_t)header_len,
 		format, args);
-	if (text_len < 0 || text_len + header_len >= (int)sizeof(buf)) {
-		/* Truncated log output. On some platforms a -1 return value means
-		 * that the output was truncated. */
-		text_len = (int)sizeof(buf) - header_len;
-	}
-	if (header_len + text_len + (int)sizeof(USBI_LOG_LINE_END) >= (int)sizeof(buf)) {
-		/* Need to truncate the text slightly to fit on the terminator. */
-		text_len -= (header_len + text_len + (int)sizeof(USBI_LOG_LINE_END)) - (int)sizeof(buf);
-	}
-	strcpy(buf + header_len + text_len, USBI_LOG_LINE_END);
+	log_terminate(buf, header_len, text_len);
 
 	usbi_log_str(level, buf);
 
@@ -221,6 +221,9 @@ void usbi_hotplug_notification(struct libusb_context *ctx, struct libusb_device
 	message->event = event;
 	message->device = dev;
 
+	usbi_trace(ctx, LIBUSB_TRACE_HOTPLUG, dev, 0, -1, event,
+		((unsigned int)dev->bus_number << 8) | dev->device_address);
+
 	/* Take the event data lock and add this message to the list.
 	 * Only signal an event if there are no prior pending events. */
 	usbi_mutex_lock(&ctx->event_data_lock);
@@ -238,6 +241,7 @@ int API_EXPORTED libusb_hotplug_register_callback(libusb_context *ctx,
 	libusb_hotplug_callback_handle *callback_handle)
 {
 	struct libusb_hotplug_callback *new_callback;
+	int r;
 
 	/* check for sane values */
 	if ((!events || (~(LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT) & events)) ||
@@ -256,6 +260,11 @@ int API_EXPORTED libusb_hotplug_register_callback(libusb_context *ctx,
 
 	USBI_GET_CONTEXT(ctx);
 
+	/* devices found by a deferred scan must not be reported as arrivals */
+	r = usbi_wait_device_scan(ctx);
+	if (r < 0)
+		return r;
+
 	new_callback = calloc(1, sizeof(*new_callback));
 	if (!new_callback) {
 		return LIBUSB_ERROR_NO_MEM;
@@ -33,6 +33,9 @@
 #ifdef USBI_TIMERFD_AVAILABLE
 #include <sys/timerfd.h>
 #endif
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
 
 #include "libusbi.h"
 #include "hotplug.h"
@@ -1117,6 +1120,11 @@ printf("completed!\n");
  * give up the events lock if instructed.
  */
 
+static void trace_ring_release(void *arg);
+#ifdef USBI_CAPTURE
+static void capture_destroy(struct libusb_context *ctx);
+#endif
+
 int usbi_io_init(struct libusb_context *ctx)
 {
 	int r;
@@ -1127,10 +1135,18 @@ int usbi_io_init(struct libusb_context *ctx)
 	usbi_cond_init(&ctx->event_waiters_cond);
 	usbi_mutex_init(&ctx->event_data_lock);
 	usbi_tls_key_create(&ctx->event_handling_key);
+	usbi_mutex_init(&ctx->trace_lock);
+	usbi_tls_key_create_dtor(&ctx->trace_key, trace_ring_release);
+	usbi_mutex_init(&ctx->coalescers_lock);
 	list_init(&ctx->flying_transfers);
+	list_init(&ctx->event_waiters);
+	ctx->event_thread_cpu = -1;
+	ctx->epoll_fd = -1;
 	list_init(&ctx->ipollfds);
 	list_init(&ctx->hotplug_msgs);
 	list_init(&ctx->completed_transfers);
+	list_init(&ctx->deferred_transfers);
+	list_init(&ctx->coalescers);
 
 	/* FIXME should use an eventfd on kernels that support it */
 	r = usbi_pipe(ctx->event_pipe);
@@ -1174,11 +1190,16 @@ err:
 	usbi_cond_destroy(&ctx->event_waiters_cond);
 	usbi_mutex_destroy(&ctx->event_data_lock);
 	usbi_tls_key_delete(ctx->event_handling_key);
+	usbi_mutex_destroy(&ctx->trace_lock);
+	usbi_tls_key_delete(ctx->trace_key);
+	usbi_mutex_destroy(&ctx->coalescers_lock);
 	return r;
 }
 
 void usbi_io_exit(struct libusb_context *ctx)
 {
+	unsigned int i;
+
 	usbi_remove_pollfd(ctx, ctx->event_pipe[0]);
 	usbi_close(ctx->event_pipe[0]);
 	usbi_close(ctx->event_pipe[1]);
@@ -1187,6 +1208,17 @@ void usbi_io_exit(struct libusb_context *ctx)
 		usbi_remove_pollfd(ctx, ctx->timerfd);
 		close(ctx->timerfd);
 	}
+#endif
+	/* release any fds the backend registered for the lifetime of the
+	 * context (e.g. a hotplug monitor serviced from this event loop) */
+	while (!list_empty(&ctx->ipollfds)) {
+		struct usbi_pollfd *ipollfd = list_first_entry(&ctx->ipollfds,
+			struct usbi_pollfd, list);
+		usbi_remove_pollfd(ctx, ipollfd->pollfd.fd);
+	}
+#ifdef HAVE_SYS_EPOLL_H
+	if (ctx->epoll_fd >= 0)
+		close(ctx->epoll_fd);
 #endif
 	usbi_mutex_destroy(&ctx->flying_transfers_lock);
 	usbi_mutex_destroy(&ctx->events_lock);
@@ -1194,6 +1226,16 @@ void usbi_io_exit(struct libusb_context *ctx)
 	usbi_cond_destroy(&ctx->event_waiters_cond);
 	usbi_mutex_destroy(&ctx->event_data_lock);
 	usbi_tls_key_delete(ctx->event_handling_key);
+	/* delete the key first so that no exiting thread releases a ring that
+	 * is being freed */
+	usbi_tls_key_delete(ctx->trace_key);
+	for (i = 0; i < ctx->trace_num_rings; i++)
+		free(ctx->trace_rings[i]);
+#ifdef USBI_CAPTURE
+	capture_destroy(ctx);
+#endif
+	usbi_mutex_destroy(&ctx->trace_lock);
+	usbi_mutex_destroy(&ctx->coalescers_lock);
 	free(ctx->pollfds);
 }
 
@@ -1258,20 +1300,31 @@ struct libusb_transfer * LIBUSB_CALL libusb_alloc_transfer(
 	struct libusb_transfer *transfer;
 	size_t os_alloc_size;
 	size_t alloc_size;
+	size_t frames_offset;
 	struct usbi_transfer *itransfer;
+	int i;
 
 	assert(iso_packets >= 0);
 
+	/* the frames of the iso packets go after the os private data */
 	os_alloc_size = usbi_backend.transfer_priv_size;
-	alloc_size = sizeof(struct usbi_transfer)
+	frames_offset = sizeof(struct usbi_transfer)
 		+ sizeof(struct libusb_transfer)
 		+ (sizeof(struct libusb_iso_packet_descriptor) * (size_t)iso_packets)
 		+ os_alloc_size;
+	frames_offset = (frames_offset + sizeof(int) - 1) & ~(sizeof(int) - 1);
+	alloc_size = frames_offset + sizeof(int) * (size_t)iso_packets;
 	itransfer = calloc(1, alloc_size);
 	if (!itransfer)
 		return NULL;
 
 	itransfer->num_iso_packets = iso_packets;
+	itransfer->iso_start_frame = LIBUSB_ISO_START_ASAP;
+	if (iso_packets) {
+		itransfer->iso_frames = (int *)((unsigned char *)itransfer + frames_offset);
+		for (i = 0; i < iso_packets; i++)
+			itransfer->iso_frames[i] = -1;
+	}
 	usbi_mutex_init(&itransfer->lock);
 	transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
 	usbi_dbg("transfer %p", transfer);
@@ -1456,243 +1509,3166 @@ static int remove_from_flying_list(struct usbi_transfer *transfer)
 	return r;
 }
 
-/** \ingroup libusb_asyncio
- * Submit a transfer. This function will fire off the USB transfer and then
- * return immediately.
- *
- * \param transfer the transfer to submit
- * \returns 0 on success
- * \returns LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
- * \returns LIBUSB_ERROR_BUSY if the transfer has already been submitted.
- * \returns LIBUSB_ERROR_NOT_SUPPORTED if the transfer flags are not supported
- * by the operating system.
- * \returns LIBUSB_ERROR_INVALID_PARAM if the transfer size is larger than
- * the operating system and/or hardware can support
- * \returns another LIBUSB_ERROR code on other failure
- */
-int API_EXPORTED libusb_submit_transfer(struct libusb_transfer *transfer)
+/* map a latency in microseconds to its log-linear histogram bucket, see
+ * LIBUSB_STATS_HISTOGRAM_BUCKETS */
+static unsigned int stats_bucket(uint64_t usec)
 {
-	struct usbi_transfer *itransfer =
-		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
-	struct libusb_context *ctx = TRANSFER_CTX(transfer);
-	int r;
+	unsigned int msb = 0, bucket;
 
-	usbi_dbg("transfer %p", transfer);
+	if (usec < 4)
+		return (unsigned int)usec;
 
-	/*
-	 * Important note on locking, this function takes / releases locks
-	 * in the following order:
-	 *  take flying_transfers_lock
-	 *  take itransfer->lock
-	 *  clear transfer
-	 *  add to flying_transfers list
-	 *  release flying_transfers_lock
-	 *  submit transfer
-	 *  release itransfer->lock
-	 *  if submit failed:
-	 *   take flying_transfers_lock
-	 *   remove from flying_transfers list
-	 *   release flying_transfers_lock
-	 *
-	 * Note that it takes locks in the order a-b and then releases them
-	 * in the same order a-b. This is somewhat unusual but not wrong,
-	 * release order is not important as long as *all* locks are released
-	 * before re-acquiring any locks.
-	 *
-	 * This means that the ordering of first releasing itransfer->lock
-	 * and then re-acquiring the flying_transfers_list on error is
-	 * important and must not be changed!
-	 *
-	 * This is done this way because when we take both locks we must always
-	 * take flying_transfers_lock first to avoid ab-ba style deadlocks with
-	 * the timeout handling and usbi_handle_disconnect paths.
-	 *
-	 * And we cannot release itransfer->lock before the submission is
-	 * complete otherwise timeout handling for transfers with short
-	 * timeouts may run before submission.
-	 */
-	usbi_mutex_lock(&ctx->flying_transfers_lock);
-	usbi_mutex_lock(&itransfer->lock);
-	if (itransfer->state_flags & USBI_TRANSFER_IN_FLIGHT) {
-		usbi_mutex_unlock(&ctx->flying_transfers_lock);
-		usbi_mutex_unlock(&itransfer->lock);
-		return LIBUSB_ERROR_BUSY;
-	}
-	itransfer->transferred = 0;
-	itransfer->state_flags = 0;
-	itransfer->timeout_flags = 0;
-	r = add_to_flying_list(itransfer);
-	if (r) {
-		usbi_mutex_unlock(&ctx->flying_transfers_lock);
-		usbi_mutex_unlock(&itransfer->lock);
-		return r;
+	while (usec >> (msb + 1))
+		msb++;
+
+	bucket = (msb - 1) * 4 + (unsigned int)((usec >> (msb - 2)) & 3);
+	if (bucket >= LIBUSB_STATS_HISTOGRAM_BUCKETS)
+		bucket = LIBUSB_STATS_HISTOGRAM_BUCKETS - 1;
+
+	return bucket;
+}
+
+static void stats_record_latency(uint32_t *histogram,
+	const struct timespec *from, const struct timespec *to)
+{
+	int64_t usec = (int64_t)(to->tv_sec - from->tv_sec) * 1000000 +
+		(to->tv_nsec - from->tv_nsec) / 1000;
+
+	if (usec < 0)
+		usec = 0;
+	histogram[stats_bucket((uint64_t)usec)]++;
+}
+
+/* get the statistics of an endpoint, allocating them on first use. Callers
+ * of this function must hold the device handle lock. */
+static struct libusb_endpoint_stats *endpoint_stats(
+	struct libusb_device_handle *dev_handle, unsigned char endpoint)
+{
+	unsigned int i = (endpoint & 0x0f) | ((endpoint & LIBUSB_ENDPOINT_IN) >> 3);
+
+	if (!dev_handle->stats[i])
+		dev_handle->stats[i] = calloc(1, sizeof(*dev_handle->stats[i]));
+
+	return dev_handle->stats[i];
+}
+
+static void stats_transfer_submitted(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct libusb_device_handle *dev_handle = transfer->dev_handle;
+	struct libusb_endpoint_stats *stats;
+
+	usbi_mutex_lock(&dev_handle->lock);
+	stats = endpoint_stats(dev_handle, transfer->endpoint);
+	if (stats)
+		stats->submitted++;
+	usbi_mutex_unlock(&dev_handle->lock);
+}
+
+static void stats_transfer_completed(struct usbi_transfer *itransfer,
+	enum libusb_transfer_status status)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct libusb_device_handle *dev_handle = transfer->dev_handle;
+	struct libusb_endpoint_stats *stats;
+	uint64_t bytes = 0;
+	int i;
+
+	if (!dev_handle)
+		return;
+
+	usbi_backend.clock_gettime(USBI_CLOCK_MONOTONIC, &itransfer->stats_complete_time);
+	itransfer->stats_flags |= USBI_TRANSFER_STATS_COMPLETED;
+
+	if (transfer->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+		for (i = 0; i < transfer->num_iso_packets; i++)
+			bytes += transfer->iso_packet_desc[i].actual_length;
+	} else {
+		bytes = (uint64_t)itransfer->transferred;
 	}
-	/*
-	 * We must release the flying transfers lock here, because with
-	 * some backends the submit_transfer method is synchroneous.
-	 */
-	usbi_mutex_unlock(&ctx->flying_transfers_lock);
 
-	r = usbi_backend.submit_transfer(itransfer);
-	if (r == LIBUSB_SUCCESS) {
-		itransfer->state_flags |= USBI_TRANSFER_IN_FLIGHT;
-		/* keep a reference to this device */
-		libusb_ref_device(transfer->dev_handle->dev);
+	usbi_mutex_lock(&dev_handle->lock);
+	stats = endpoint_stats(dev_handle, transfer->endpoint);
+	if (!stats)
+		goto out;
+
+	switch (status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		stats->completed++;
+		break;
+	case LIBUSB_TRANSFER_STALL:
+		stats->stalls++;
+		break;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		stats->timeouts++;
+		break;
+	case LIBUSB_TRANSFER_CANCELLED:
+		stats->cancelled++;
+		break;
+	default:
+		stats->errors++;
+		break;
 	}
-	usbi_mutex_unlock(&itransfer->lock);
+	stats->bytes += bytes;
 
-	if (r != LIBUSB_SUCCESS)
-		remove_from_flying_list(itransfer);
+	if (itransfer->stats_flags & USBI_TRANSFER_STATS_SUBMITTED)
+		stats_record_latency(stats->submit_to_complete,
+			&itransfer->stats_submit_time, &itransfer->stats_complete_time);
 
-	return r;
+out:
+	usbi_mutex_unlock(&dev_handle->lock);
+}
+
+static void stats_callback_invoked(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct libusb_device_handle *dev_handle = transfer->dev_handle;
+	struct libusb_endpoint_stats *stats;
+	struct timespec now;
+
+	usbi_backend.clock_gettime(USBI_CLOCK_MONOTONIC, &now);
+
+	usbi_mutex_lock(&dev_handle->lock);
+	stats = endpoint_stats(dev_handle, transfer->endpoint);
+	if (stats)
+		stats_record_latency(stats->complete_to_callback,
+			&itransfer->stats_complete_time, &now);
+	usbi_mutex_unlock(&dev_handle->lock);
 }
 
 /** \ingroup libusb_asyncio
- * Asynchronously cancel a previously submitted transfer.
- * This function returns immediately, but this does not indicate cancellation
- * is complete. Your callback function will be invoked at some later time
- * with a transfer status of
- * \ref libusb_transfer_status::LIBUSB_TRANSFER_CANCELLED
- * "LIBUSB_TRANSFER_CANCELLED."
- *
- * \param transfer the transfer to cancel
+ * Retrieve the transfer statistics of an endpoint. Statistics are only
+ * collected while \ref LIBUSB_OPTION_ENDPOINT_STATS is enabled for the
+ * context of the device handle. Once the option has been disabled again,
+ * the statistics gathered until then are returned.
+ *
+ * Latencies are recorded for transfers that were submitted while statistics
+ * were being collected. The time to the callback is taken when libusb is
+ * about to invoke the callback.
+ *
+ * \param dev_handle a device handle
+ * \param endpoint the address of the endpoint (0 for the default control
+ * endpoint)
+ * \param stats output location for the statistics, all zero for an endpoint
+ * without transfers
  * \returns 0 on success
- * \returns LIBUSB_ERROR_NOT_FOUND if the transfer is not in progress,
- * already complete, or already cancelled.
- * \returns a LIBUSB_ERROR code on failure
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if statistics were never collected
+ * for the context
  */
-int API_EXPORTED libusb_cancel_transfer(struct libusb_transfer *transfer)
+int API_EXPORTED libusb_get_endpoint_stats(libusb_device_handle *dev_handle,
+	unsigned char endpoint, struct libusb_endpoint_stats *stats)
 {
-	struct usbi_transfer *itransfer =
-		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
-	int r;
-
-	usbi_dbg("transfer %p", transfer );
-	usbi_mutex_lock(&itransfer->lock);
-	if (!(itransfer->state_flags & USBI_TRANSFER_IN_FLIGHT)
-			|| (itransfer->state_flags & USBI_TRANSFER_CANCELLING)) {
-		r = LIBUSB_ERROR_NOT_FOUND;
-		goto out;
-	}
-	r = usbi_backend.cancel_transfer(itransfer);
-	if (r < 0) {
-		if (r != LIBUSB_ERROR_NOT_FOUND &&
-		    r != LIBUSB_ERROR_NO_DEVICE)
-			usbi_err(TRANSFER_CTX(transfer),
-				"cancel transfer failed error %d", r);
-		else
-			usbi_dbg("cancel transfer failed error %d", r);
+	unsigned int i = (endpoint & 0x0f) | ((endpoint & LIBUSB_ENDPOINT_IN) >> 3);
 
-		if (r == LIBUSB_ERROR_NO_DEVICE)
-			itransfer->state_flags |= USBI_TRANSFER_DEVICE_DISAPPEARED;
-	}
+	if (!HANDLE_CTX(dev_handle)->endpoint_stats_used)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
 
-	itransfer->state_flags |= USBI_TRANSFER_CANCELLING;
+	usbi_mutex_lock(&dev_handle->lock);
+	if (dev_handle->stats[i])
+		*stats = *dev_handle->stats[i];
+	else
+		memset(stats, 0, sizeof(*stats));
+	usbi_mutex_unlock(&dev_handle->lock);
 
-out:
-	usbi_mutex_unlock(&itransfer->lock);
-	return r;
+	return 0;
 }
 
 /** \ingroup libusb_asyncio
- * Set a transfers bulk stream id. Note users are advised to use
- * libusb_fill_bulk_stream_transfer() instead of calling this function
- * directly.
- *
- * Since version 1.0.19, \ref LIBUSB_API_VERSION >= 0x01000103
+ * Reset the transfer statistics of all endpoints of all device handles of a
+ * context.
  *
- * \param transfer the transfer to set the stream id for
- * \param stream_id the stream id to set
- * \see libusb_alloc_streams()
+ * \param ctx the context to operate on, or NULL for the default context
  */
-void API_EXPORTED libusb_transfer_set_stream_id(
-	struct libusb_transfer *transfer, uint32_t stream_id)
+void API_EXPORTED libusb_reset_stats(libusb_context *ctx)
 {
-	struct usbi_transfer *itransfer =
-		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+	struct libusb_device_handle *dev_handle;
+	int i;
 
-	itransfer->stream_id = stream_id;
+	USBI_GET_CONTEXT(ctx);
+
+	usbi_mutex_lock(&ctx->open_devs_lock);
+	list_for_each_entry(dev_handle, &ctx->open_devs, list, struct libusb_device_handle) {
+		usbi_mutex_lock(&dev_handle->lock);
+		for (i = 0; i < USBI_NUM_ENDPOINT_STATS; i++) {
+			if (dev_handle->stats[i])
+				memset(dev_handle->stats[i], 0, sizeof(*dev_handle->stats[i]));
+		}
+		usbi_mutex_unlock(&dev_handle->lock);
+	}
+	usbi_mutex_unlock(&ctx->open_devs_lock);
 }
 
 /** \ingroup libusb_asyncio
- * Get a transfers bulk stream id.
- *
- * Since version 1.0.19, \ref LIBUSB_API_VERSION >= 0x01000103
- *
- * \param transfer the transfer to get the stream id for
- * \returns the stream id for the transfer
+ * Retrieve how bulk transfers on an endpoint are split into URBs, see
+ * \ref LIBUSB_OPTION_BULK_URB_SIZE. With \ref LIBUSB_BULK_URB_SIZE_AUTO
+ * this is the URB size the next transfer on the endpoint will use, together
+ * with the throughput measured for it.
+ *
+ * \param dev_handle a device handle
+ * \param endpoint the address of a bulk endpoint
+ * \param params output location for the parameters
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED on platforms that do not split bulk
+ * transfers this way
  */
-uint32_t API_EXPORTED libusb_transfer_get_stream_id(
-	struct libusb_transfer *transfer)
+int API_EXPORTED libusb_get_bulk_urb_params(libusb_device_handle *dev_handle,
+	unsigned char endpoint, struct libusb_bulk_urb_params *params)
 {
-	struct usbi_transfer *itransfer =
-		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+	if (!usbi_backend.get_bulk_urb_params)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
 
-	return itransfer->stream_id;
+	return usbi_backend.get_bulk_urb_params(dev_handle, endpoint, params);
 }
 
-/* Handle completion of a transfer (completion might be an error condition).
- * This will invoke the user-supplied callback function, which may end up
- * freeing the transfer. Therefore you cannot use the transfer structure
- * after calling this function, and you should free all backend-specific
- * data before calling it.
- * Do not call this function with the usbi_transfer lock held. User-specified
- * callback functions may attempt to directly resubmit the transfer, which
- * will attempt to take the lock. */
-int usbi_handle_transfer_completion(struct usbi_transfer *itransfer,
-	enum libusb_transfer_status status)
+/* A trace ring, only written by the thread it belongs to. head counts the
+ * events recorded so far; the latest is at (head - 1) & mask. in_use is
+ * cleared when the thread exits so that another thread can take the ring
+ * over, keeping the events recorded so far. */
+struct usbi_trace_ring {
+	uint64_t head;
+	uint64_t mask;
+	uint32_t thread;
+	int in_use;
+	struct libusb_trace_event events[ZERO_SIZED_ARRAY];
+};
+
+/* given to threads that found all rings taken, so they stop trying */
+static struct usbi_trace_ring no_trace_ring;
+
+/* the rings are read without locking by libusb_trace_dump(), possibly from
+ * a signal handler, so publish them with release/acquire ordering */
+#if defined(__GNUC__)
+#define trace_store_release(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define trace_load_acquire(p)		__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#else
+#define trace_store_release(p, v)	(*(p) = (v))
+#define trace_load_acquire(p)		(*(p))
+#endif
+
+int usbi_set_trace_ring(struct libusb_context *ctx, int size)
 {
-	struct libusb_transfer *transfer =
-		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
-	struct libusb_device_handle *dev_handle = transfer->dev_handle;
-	uint8_t flags;
-	int r;
+	unsigned int trace_size = 1;
+	int r = LIBUSB_SUCCESS;
 
-	r = remove_from_flying_list(itransfer);
-	if (r < 0)
-		usbi_err(ITRANSFER_CTX(itransfer), "failed to set timer for next timeout, errno=%d", errno);
+	if (size < 1 || size > USBI_MAX_TRACE_EVENTS)
+		return LIBUSB_ERROR_INVALID_PARAM;
 
-	usbi_mutex_lock(&itransfer->lock);
-	itransfer->state_flags &= ~USBI_TRANSFER_IN_FLIGHT;
-	usbi_mutex_unlock(&itransfer->lock);
+	while (trace_size < (unsigned int)size)
+		trace_size <<= 1;
 
-	if (status == LIBUSB_TRANSFER_COMPLETED
-			&& transfer->flags & LIBUSB_TRANSFER_SHORT_NOT_OK) {
-		int rqlen = transfer->length;
-		if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL)
-			rqlen -= LIBUSB_CONTROL_SETUP_SIZE;
-		if (rqlen != itransfer->transferred) {
-			usbi_dbg("interpreting short transfer as error");
-			status = LIBUSB_TRANSFER_ERROR;
-		}
-	}
+	usbi_mutex_lock(&ctx->trace_lock);
+	if (ctx->trace_size)
+		r = LIBUSB_ERROR_BUSY;
+	else
+		ctx->trace_size = trace_size;
+	usbi_mutex_unlock(&ctx->trace_lock);
 
-	flags = transfer->flags;
-	transfer->status = status;
-	transfer->actual_length = itransfer->transferred;
-	usbi_dbg("transfer %p has callback %p", transfer, transfer->callback);
-	if (transfer->callback)
-		transfer->callback(transfer);
-	/* transfer might have been freed by the above call, do not use from
-	 * this point. */
-	if (flags & LIBUSB_TRANSFER_FREE_TRANSFER)
-		libusb_free_transfer(transfer);
-	libusb_unref_device(dev_handle->dev);
 	return r;
 }
 
-/* Similar to usbi_handle_transfer_completion() but exclusively for transfers
- * that were asynchronously cancelled. The same concerns w.r.t. freeing of
- * transfers exist here.
- * Do not call this function with the usbi_transfer lock held. User-specified
- * callback functions may attempt to directly resubmit the transfer, which
- * will attempt to take the lock. */
-int usbi_handle_transfer_cancellation(struct usbi_transfer *transfer)
+/* TLS destructor of trace_key, run when a thread with a ring exits */
+static void trace_ring_release(void *arg)
 {
-	struct libusb_context *ctx = ITRANSFER_CTX(transfer);
-	uint8_t timed_out;
+	struct usbi_trace_ring *ring = arg;
 
-	usbi_mutex_lock(&ctx->flying_transfers_lock);
+	if (ring != &no_trace_ring)
+		trace_store_release(&ring->in_use, 0);
+}
+
+static struct usbi_trace_ring *add_trace_ring(struct libusb_context *ctx)
+{
+	struct usbi_trace_ring *ring = &no_trace_ring;
+	unsigned int i, n;
+
+	usbi_mutex_lock(&ctx->trace_lock);
+	n = ctx->trace_num_rings;
+
+	/* take over the ring of a thread that has exited */
+	for (i = 0; i < n; i++) {
+		if (!trace_load_acquire(&ctx->trace_rings[i]->in_use)) {
+			ring = ctx->trace_rings[i];
+			ring->thread = ctx->trace_next_thread++;
+			ring->in_use = 1;
+			goto out;
+		}
+	}
+
+	if (n < USBI_MAX_TRACE_THREADS) {
+		ring = malloc(sizeof(*ring) +
+			ctx->trace_size * sizeof(struct libusb_trace_event));
+		if (ring) {
+			ring->head = 0;
+			ring->mask = ctx->trace_size - 1;
+			ring->thread = ctx->trace_next_thread++;
+			ring->in_use = 1;
+			ctx->trace_rings[n] = ring;
+			trace_store_release(&ctx->trace_num_rings, n + 1);
+		} else {
+			ring = &no_trace_ring;
+		}
+	}
+
+out:
+	usbi_mutex_unlock(&ctx->trace_lock);
+
+	usbi_tls_key_set(ctx->trace_key, ring);
+	return ring;
+}
+
+/* Record an event in the calling thread's trace ring. Use the usbi_trace()
+ * macro rather than calling this directly. errno is preserved so that
+ * events can be recorded between a system call and its error handling. */
+void usbi_trace_record(struct libusb_context *ctx,
+	enum libusb_trace_event_type type, const void *object,
+	unsigned char endpoint, int urb, int status, unsigned int length)
+{
+	struct usbi_trace_ring *ring;
+	struct libusb_trace_event *event;
+	struct timespec now;
+	int saved_errno = errno;
+
+	ring = usbi_tls_key_get(ctx->trace_key);
+	if (!ring)
+		ring = add_trace_ring(ctx);
+	if (ring == &no_trace_ring)
+		goto out;
+
+	usbi_backend.clock_gettime(USBI_CLOCK_MONOTONIC, &now);
+
+	event = &ring->events[ring->head & ring->mask];
+	event->timestamp = (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+	event->object = (uint64_t)(uintptr_t)object;
+	event->thread = ring->thread;
+	event->status = status;
+	event->length = length;
+	event->urb = (int16_t)urb;
+	event->type = (uint8_t)type;
+	event->endpoint = endpoint;
+	trace_store_release(&ring->head, ring->head + 1);
+
+out:
+	errno = saved_errno;
+}
+
+#if !defined(OS_WINDOWS) && !defined(OS_WINCE)
+static int trace_write(int fd, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	ssize_t r;
+
+	while (len) {
+		r = write(fd, p, len);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return LIBUSB_ERROR_IO;
+		}
+		p += r;
+		len -= (size_t)r;
+	}
+
+	return 0;
+}
+#endif
+
+/** \ingroup libusb_asyncio
+ * Write the contents of a context's trace rings to a file descriptor. See
+ * \ref LIBUSB_OPTION_TRACE_RING.
+ *
+ * The dump starts with a \ref libusb_trace_header followed by the recorded
+ * events. The tracedump example program turns dumps into readable
+ * timelines or Chrome trace JSON.
+ *
+ * This function takes no locks and allocates no memory, so it may be called
+ * from a signal handler, for example to dump the trace of a stalled process
+ * on SIGUSR1 or SIGABRT. Events recorded while the dump is being written
+ * may or may not be included, and the oldest event of a ring that wraps
+ * around during the dump may be garbled.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param fd the file descriptor to write to
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if tracing is not enabled for the
+ * context or not available on the platform
+ * \returns LIBUSB_ERROR_IO if writing to fd failed
+ */
+int API_EXPORTED libusb_trace_dump(libusb_context *ctx, int fd)
+{
+#if !defined(OS_WINDOWS) && !defined(OS_WINCE)
+	struct libusb_trace_header header;
+	uint64_t heads[USBI_MAX_TRACE_THREADS];
+	uint64_t count, start, first;
+	unsigned int i, num_rings;
+	int r;
+
+	USBI_GET_CONTEXT(ctx);
+	if (!ctx->trace_size)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	num_rings = trace_load_acquire(&ctx->trace_num_rings);
+
+	header.magic = LIBUSB_TRACE_MAGIC;
+	header.version = LIBUSB_TRACE_VERSION;
+	header.event_size = sizeof(struct libusb_trace_event);
+	header.num_events = 0;
+	header.num_threads = num_rings;
+	for (i = 0; i < num_rings; i++) {
+		heads[i] = trace_load_acquire(&ctx->trace_rings[i]->head);
+		count = heads[i] < ctx->trace_size ? heads[i] : ctx->trace_size;
+		header.num_events += (uint32_t)count;
+	}
+
+	r = trace_write(fd, &header, sizeof(header));
+	if (r < 0)
+		return r;
+
+	for (i = 0; i < num_rings; i++) {
+		struct usbi_trace_ring *ring = ctx->trace_rings[i];
+
+		count = heads[i] < ctx->trace_size ? heads[i] : ctx->trace_size;
+		start = heads[i] - count;
+
+		/* oldest events up to the end of the ring, then the rest */
+		first = ctx->trace_size - (start & ring->mask);
+		if (first > count)
+			first = count;
+		r = trace_write(fd, &ring->events[start & ring->mask],
+			(size_t)first * sizeof(struct libusb_trace_event));
+		if (r == 0 && count > first)
+			r = trace_write(fd, &ring->events[0],
+				(size_t)(count - first) * sizeof(struct libusb_trace_event));
+		if (r < 0)
+			return r;
+	}
+
+	return 0;
+#else
+	UNUSED(ctx);
+	UNUSED(fd);
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+/* Transfer capture.
+ *
+ * Every submission and completion is turned into a usbmon packet, in the
+ * format of the Linux kernel's binary USB monitor (pcap link type
+ * LINKTYPE_USB_LINUX_MMAPPED), and written to a pcapng file that Wireshark
+ * decodes like a usbmon capture. The packet is built by the thread that
+ * submits or completes the transfer, since the buffer may be reused as
+ * soon as the call returns, in a slot of a bounded ring. A writer thread
+ * wraps the packets in pcapng blocks and writes them out in batches. Slots
+ * are claimed as in the asynchronous log sink in core.c: when the writer
+ * falls behind, packets are dropped and counted rather than making the I/O
+ * path wait. */
+#ifdef USBI_CAPTURE
+
+#define USBMON_HEADER_SIZE	64
+#define USBMON_ISO_DESC_SIZE	16
+
+#define PCAPNG_SHB		0x0A0D0D0A
+#define PCAPNG_IDB		0x00000001
+#define PCAPNG_EPB		0x00000006
+#define PCAPNG_BOM		0x1A2B3C4D
+#define LINKTYPE_USB_LINUX_MMAPPED	220
+
+#define CAPTURE_BUFFER_SIZE	65536
+
+/* usbmon reports Linux errno values, whatever the platform */
+#define USBMON_ENOENT		2
+#define USBMON_EIO		5
+#define USBMON_ENOMEM		12
+#define USBMON_EBUSY		16
+#define USBMON_EXDEV		18
+#define USBMON_ENODEV		19
+#define USBMON_EINVAL		22
+#define USBMON_EPIPE		32
+#define USBMON_EPROTO		71
+#define USBMON_EOVERFLOW	75
+#define USBMON_EOPNOTSUPP	95
+#define USBMON_ESHUTDOWN	108
+#define USBMON_EINPROGRESS	115
+
+/* URB transfer flags */
+#define USBMON_SHORT_NOT_OK	0x0001
+#define USBMON_ZERO_PACKET	0x0040
+#define USBMON_DIR_IN		0x0200
+
+struct usbmon_header {
+	uint64_t id;
+	uint8_t type;
+	uint8_t xfer_type;
+	uint8_t epnum;
+	uint8_t devnum;
+	uint16_t busnum;
+	char flag_setup;
+	char flag_data;
+	int64_t ts_sec;
+	int32_t ts_usec;
+	int32_t status;
+	uint32_t length;
+	uint32_t len_cap;
+	union {
+		uint8_t setup[LIBUSB_CONTROL_SETUP_SIZE];
+		struct {
+			int32_t error_count;
+			int32_t numdesc;
+		} iso;
+	} s;
+	int32_t interval;
+	int32_t start_frame;
+	uint32_t xfer_flags;
+	uint32_t ndesc;
+};
+
+struct usbmon_iso_desc {
+	int32_t status;
+	uint32_t offset;
+	uint32_t length;
+	uint32_t pad;
+};
+
+struct pcapng_shb {
+	uint32_t type;
+	uint32_t length;
+	uint32_t bom;
+	uint16_t major;
+	uint16_t minor;
+	uint32_t section_length[2];
+	uint32_t length2;
+};
+
+struct pcapng_idb {
+	uint32_t type;
+	uint32_t length;
+	uint16_t linktype;
+	uint16_t reserved;
+	uint32_t snaplen;
+	uint32_t length2;
+};
+
+struct pcapng_epb {
+	uint32_t type;
+	uint32_t length;
+	uint32_t interface;
+	uint32_t ts_high;
+	uint32_t ts_low;
+	uint32_t cap_len;
+	uint32_t orig_len;
+};
+
+struct capture_entry {
+	unsigned int seq;
+	unsigned int generation;
+	uint32_t cap_len;
+	uint32_t orig_len;
+	uint64_t timestamp;
+	unsigned char packet[USBI_CAPTURE_SNAPLEN];
+};
+
+/* generation is bumped when a capture stops. Packets are stamped with the
+ * generation they were recorded in, and the writer discards those of any
+ * other than write_generation, the one current when its capture started,
+ * so that a packet racing the end of a capture never ends up in the file
+ * of the next one. */
+struct usbi_capture {
+	struct libusb_context *ctx;
+	struct capture_entry entries[USBI_CAPTURE_ENTRIES];
+	unsigned int head;
+	unsigned int tail;
+	unsigned int generation;
+	unsigned int write_generation;
+	uint64_t packets;
+	uint64_t bytes;
+	uint64_t dropped;
+	int fd;
+	int error;
+	int sleeping;
+	int stop;
+	pthread_t thread;
+	usbi_mutex_t lock;
+	usbi_cond_t cond;
+	size_t buffer_len;
+	unsigned char buffer[CAPTURE_BUFFER_SIZE];
+};
+
+static uint8_t usbmon_xfer_type(unsigned char type)
+{
+	switch (type) {
+	case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
+		return 0;
+	case LIBUSB_TRANSFER_TYPE_INTERRUPT:
+		return 1;
+	case LIBUSB_TRANSFER_TYPE_CONTROL:
+		return 2;
+	default:
+		return 3;
+	}
+}
+
+static int32_t usbmon_status(enum libusb_transfer_status status)
+{
+	switch (status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		return 0;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+	case LIBUSB_TRANSFER_CANCELLED:
+		return -USBMON_ENOENT;
+	case LIBUSB_TRANSFER_STALL:
+		return -USBMON_EPIPE;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		return -USBMON_ESHUTDOWN;
+	case LIBUSB_TRANSFER_OVERFLOW:
+		return -USBMON_EOVERFLOW;
+	default:
+		return -USBMON_EPROTO;
+	}
+}
+
+static int32_t usbmon_error(int error)
+{
+	switch (error) {
+	case LIBUSB_ERROR_INVALID_PARAM:
+		return -USBMON_EINVAL;
+	case LIBUSB_ERROR_NO_DEVICE:
+		return -USBMON_ENODEV;
+	case LIBUSB_ERROR_BUSY:
+		return -USBMON_EBUSY;
+	case LIBUSB_ERROR_PIPE:
+		return -USBMON_EPIPE;
+	case LIBUSB_ERROR_NO_MEM:
+		return -USBMON_ENOMEM;
+	case LIBUSB_ERROR_NOT_SUPPORTED:
+		return -USBMON_EOPNOTSUPP;
+	default:
+		return -USBMON_EIO;
+	}
+}
+
+/* Gather up to len bytes of a scatter-gather transfer's data, as submitted
+ * or, once completed, as transferred */
+static void capture_gather_iov(struct usbi_transfer *itransfer,
+	unsigned char *dest, uint32_t len, int completed)
+{
+	uint32_t n;
+	int i;
+
+	for (i = 0; i < itransfer->num_iov && len; i++) {
+		struct libusb_iovec *iov = &itransfer->iov[i];
+
+		n = (uint32_t)(completed ? iov->actual_length : iov->length);
+		if (n > len)
+			n = len;
+		memcpy(dest, iov->buffer, n);
+		dest += n;
+		len -= n;
+	}
+}
+
+/* Capture a transfer event. Use the usbi_capture() macro rather than
+ * calling this directly. For a completion status is the transfer status,
+ * for a submission error the LIBUSB_ERROR code. */
+void usbi_capture_record(struct libusb_context *ctx,
+	struct usbi_transfer *itransfer, char type, int status)
+{
+	struct usbi_capture *cap = __atomic_load_n(&ctx->capture, __ATOMIC_ACQUIRE);
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct libusb_device *dev = transfer->dev_handle->dev;
+	const unsigned char *data = transfer->buffer;
+	struct capture_entry *entry;
+	struct usbmon_header hdr;
+	struct usbmon_iso_desc desc;
+	struct timespec now;
+	uint32_t length, data_len = 0, header_len, offset = 0;
+	unsigned int pos, seq, generation;
+	int in = transfer->endpoint & LIBUSB_ENDPOINT_IN;
+	int i, ndesc = 0, saved_errno = errno;
+
+	if (!cap)
+		goto out;
+
+	/* read in the opposite order to capture_stop() writing them: either
+	 * the packet gets the generation of a capture that has ended, or it
+	 * sees that the capture has ended */
+	generation = __atomic_load_n(&cap->generation, __ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&ctx->capture_active, __ATOMIC_SEQ_CST))
+		goto out;
+
+	pos = __atomic_load_n(&cap->head, __ATOMIC_RELAXED);
+	for (;;) {
+		entry = &cap->entries[pos % USBI_CAPTURE_ENTRIES];
+		seq = __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE);
+		if (seq == pos) {
+			if (__atomic_compare_exchange_n(&cap->head, &pos, pos + 1,
+					1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if ((int)(seq - pos) < 0) {
+			/* the writer has not freed this slot yet */
+			__atomic_fetch_add(&cap->dropped, 1, __ATOMIC_RELAXED);
+			goto out;
+		} else {
+			pos = __atomic_load_n(&cap->head, __ATOMIC_RELAXED);
+		}
+	}
+
+	usbi_backend.clock_gettime(USBI_CLOCK_REALTIME, &now);
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.id = (uint64_t)(uintptr_t)transfer;
+	hdr.type = (uint8_t)type;
+	hdr.xfer_type = usbmon_xfer_type(transfer->type);
+	hdr.epnum = transfer->endpoint;
+	hdr.devnum = dev->device_address;
+	hdr.busnum = dev->bus_number;
+	hdr.flag_setup = '-';
+	hdr.ts_sec = now.tv_sec;
+	hdr.ts_usec = (int32_t)(now.tv_nsec / 1000);
+	if (transfer->flags & LIBUSB_TRANSFER_SHORT_NOT_OK)
+		hdr.xfer_flags |= USBMON_SHORT_NOT_OK;
+	if (transfer->flags & LIBUSB_TRANSFER_ADD_ZERO_PACKET)
+		hdr.xfer_flags |= USBMON_ZERO_PACKET;
+
+	length = transfer->length > 0 ? (uint32_t)transfer->length : 0;
+	if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL) {
+		/* the setup packet goes in the header, the data stage after it;
+		 * the direction is that of the request */
+		in = length >= LIBUSB_CONTROL_SETUP_SIZE && (data[0] & LIBUSB_ENDPOINT_IN);
+		if (in)
+			hdr.epnum |= LIBUSB_ENDPOINT_IN;
+		if (type == 'S' && length >= LIBUSB_CONTROL_SETUP_SIZE) {
+			memcpy(hdr.s.setup, data, LIBUSB_CONTROL_SETUP_SIZE);
+			hdr.flag_setup = 0;
+		}
+		data += LIBUSB_CONTROL_SETUP_SIZE;
+		length = length > LIBUSB_CONTROL_SETUP_SIZE ?
+			length - LIBUSB_CONTROL_SETUP_SIZE : 0;
+	}
+	if (in)
+		hdr.xfer_flags |= USBMON_DIR_IN;
+
+	switch (type) {
+	case 'S':
+		hdr.status = -USBMON_EINPROGRESS;
+		hdr.length = length;
+		if (!in)
+			data_len = length;
+		break;
+	case 'C':
+		hdr.status = usbmon_status((enum libusb_transfer_status)status);
+		hdr.length = (uint32_t)transfer->actual_length;
+		if (transfer->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS)
+			for (i = 0; i < transfer->num_iso_packets; i++)
+				hdr.length += transfer->iso_packet_desc[i].actual_length;
+		/* isochronous packets sit at their offsets in the buffer */
+		if (in)
+			data_len = transfer->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS ?
+				length : (uint32_t)transfer->actual_length;
+		break;
+	default:
+		hdr.status = usbmon_error(status);
+		hdr.length = length;
+		break;
+	}
+	hdr.flag_data = data_len ? 0 : (in ? '<' : '>');
+
+	header_len = USBMON_HEADER_SIZE;
+	if (transfer->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+		ndesc = transfer->num_iso_packets;
+		if (ndesc > (USBI_CAPTURE_SNAPLEN - USBMON_HEADER_SIZE) / USBMON_ISO_DESC_SIZE)
+			ndesc = (USBI_CAPTURE_SNAPLEN - USBMON_HEADER_SIZE) / USBMON_ISO_DESC_SIZE;
+		hdr.s.iso.numdesc = transfer->num_iso_packets;
+		hdr.ndesc = (uint32_t)ndesc;
+
+		for (i = 0; i < transfer->num_iso_packets; i++) {
+			struct libusb_iso_packet_descriptor *pkt = &transfer->iso_packet_desc[i];
+
+			if (type == 'C' && pkt->status != LIBUSB_TRANSFER_COMPLETED)
+				hdr.s.iso.error_count++;
+			if (i >= ndesc)
+				continue;
+			desc.status = type == 'C' ? usbmon_status(pkt->status) : -USBMON_EXDEV;
+			desc.offset = offset;
+			desc.length = type == 'C' ? pkt->actual_length : pkt->length;
+			desc.pad = 0;
+			memcpy(entry->packet + header_len, &desc, sizeof(desc));
+			header_len += USBMON_ISO_DESC_SIZE;
+			offset += pkt->length;
+		}
+	}
+
+	hdr.len_cap = data_len;
+	if (hdr.len_cap > USBI_CAPTURE_SNAPLEN - header_len)
+		hdr.len_cap = USBI_CAPTURE_SNAPLEN - header_len;
+	memcpy(entry->packet, &hdr, sizeof(hdr));
+	if (hdr.len_cap && usbi_transfer_has_iov(itransfer))
+		capture_gather_iov(itransfer, entry->packet + header_len,
+			hdr.len_cap, type == 'C');
+	else if (hdr.len_cap)
+		memcpy(entry->packet + header_len, data, hdr.len_cap);
+
+	entry->cap_len = header_len + hdr.len_cap;
+	entry->orig_len = USBMON_HEADER_SIZE +
+		(uint32_t)transfer->num_iso_packets * USBMON_ISO_DESC_SIZE * (ndesc > 0) +
+		data_len;
+	entry->timestamp = (uint64_t)now.tv_sec * 1000000 + (uint64_t)(now.tv_nsec / 1000);
+	entry->generation = generation;
+	__atomic_store_n(&entry->seq, pos + 1, __ATOMIC_RELEASE);
+
+	/* pairs with the fence in capture_thread_main() */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&cap->sleeping, __ATOMIC_RELAXED)) {
+		usbi_mutex_lock(&cap->lock);
+		usbi_cond_broadcast(&cap->cond);
+		usbi_mutex_unlock(&cap->lock);
+	}
+
+out:
+	errno = saved_errno;
+}
+
+static void capture_flush(struct usbi_capture *cap)
+{
+	if (cap->buffer_len && !cap->error &&
+	    trace_write(cap->fd, cap->buffer, cap->buffer_len) < 0) {
+		cap->error = errno;
+		usbi_err(cap->ctx, "capture write failed errno=%d, dropping further packets",
+			cap->error);
+	}
+	cap->buffer_len = 0;
+}
+
+static void capture_append(struct usbi_capture *cap, const void *data,
+	size_t len)
+{
+	memcpy(cap->buffer + cap->buffer_len, data, len);
+	cap->buffer_len += len;
+}
+
+static void capture_write_packet(struct usbi_capture *cap,
+	const struct capture_entry *entry)
+{
+	static const unsigned char pad[3];
+	struct pcapng_epb epb;
+	uint32_t padded = (entry->cap_len + 3) & ~3U;
+
+	epb.type = PCAPNG_EPB;
+	epb.length = (uint32_t)sizeof(epb) + padded + 4;
+	epb.interface = 0;
+	epb.ts_high = (uint32_t)(entry->timestamp >> 32);
+	epb.ts_low = (uint32_t)entry->timestamp;
+	epb.cap_len = entry->cap_len;
+	epb.orig_len = entry->orig_len;
+
+	if (cap->buffer_len + epb.length > sizeof(cap->buffer))
+		capture_flush(cap);
+	capture_append(cap, &epb, sizeof(epb));
+	capture_append(cap, entry->packet, entry->cap_len);
+	capture_append(cap, pad, padded - entry->cap_len);
+	capture_append(cap, &epb.length, sizeof(epb.length));
+}
+
+static int capture_ready(struct usbi_capture *cap)
+{
+	struct capture_entry *entry = &cap->entries[cap->tail % USBI_CAPTURE_ENTRIES];
+
+	return __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE) == cap->tail + 1;
+}
+
+static void *capture_thread_main(void *arg)
+{
+	struct usbi_capture *cap = arg;
+	unsigned int generation = cap->write_generation;
+	struct timeval tv = { 0, 100000 };
+	struct capture_entry *entry;
+	int stop;
+
+	for (;;) {
+		if (capture_ready(cap)) {
+			entry = &cap->entries[cap->tail % USBI_CAPTURE_ENTRIES];
+			if (entry->generation != generation) {
+				/* left over from the previous capture */
+			} else if (!cap->error) {
+				capture_write_packet(cap, entry);
+				__atomic_fetch_add(&cap->packets, 1, __ATOMIC_RELAXED);
+				__atomic_fetch_add(&cap->bytes, entry->cap_len, __ATOMIC_RELAXED);
+			} else {
+				__atomic_fetch_add(&cap->dropped, 1, __ATOMIC_RELAXED);
+			}
+			__atomic_store_n(&entry->seq, cap->tail + USBI_CAPTURE_ENTRIES,
+				__ATOMIC_RELEASE);
+			cap->tail++;
+			continue;
+		}
+
+		/* the ring is drained, write out the batch; exit if asked to,
+		 * otherwise sleep until a packet comes in */
+		capture_flush(cap);
+
+		usbi_mutex_lock(&cap->lock);
+		stop = cap->stop;
+		if (!stop) {
+			__atomic_store_n(&cap->sleeping, 1, __ATOMIC_RELAXED);
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			if (!capture_ready(cap))
+				usbi_cond_timedwait(&cap->cond, &cap->lock, &tv);
+			__atomic_store_n(&cap->sleeping, 0, __ATOMIC_RELAXED);
+		}
+		usbi_mutex_unlock(&cap->lock);
+		if (stop)
+			break;
+	}
+
+	return NULL;
+}
+
+/* stops the writer after it has written out every packet in the ring;
+ * called with trace_lock held */
+static void capture_stop(struct libusb_context *ctx)
+{
+	struct usbi_capture *cap = ctx->capture;
+
+	if (!ctx->capture_active)
+		return;
+
+	__atomic_store_n(&ctx->capture_active, 0, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&cap->generation, cap->generation + 1, __ATOMIC_SEQ_CST);
+	usbi_mutex_lock(&cap->lock);
+	cap->stop = 1;
+	usbi_cond_broadcast(&cap->cond);
+	usbi_mutex_unlock(&cap->lock);
+	pthread_join(cap->thread, NULL);
+}
+
+static void capture_destroy(struct libusb_context *ctx)
+{
+	struct usbi_capture *cap = ctx->capture;
+
+	if (!cap)
+		return;
+
+	usbi_mutex_lock(&ctx->trace_lock);
+	capture_stop(ctx);
+	usbi_mutex_unlock(&ctx->trace_lock);
+	usbi_mutex_destroy(&cap->lock);
+	usbi_cond_destroy(&cap->cond);
+	free(cap);
+}
+
+static int capture_start(struct libusb_context *ctx, int fd)
+{
+	struct usbi_capture *cap = ctx->capture;
+	struct pcapng_shb shb;
+	struct pcapng_idb idb;
+	unsigned int i;
+
+	if (!cap) {
+		cap = malloc(sizeof(*cap));
+		if (!cap)
+			return LIBUSB_ERROR_NO_MEM;
+		for (i = 0; i < USBI_CAPTURE_ENTRIES; i++)
+			cap->entries[i].seq = i;
+		cap->head = cap->tail = 0;
+		cap->generation = 0;
+		cap->sleeping = 0;
+		cap->ctx = ctx;
+		usbi_mutex_init(&cap->lock);
+		usbi_cond_init(&cap->cond);
+		__atomic_store_n(&ctx->capture, cap, __ATOMIC_RELEASE);
+	}
+
+	cap->fd = fd;
+	cap->error = 0;
+	cap->stop = 0;
+	cap->packets = cap->bytes = cap->dropped = 0;
+	cap->buffer_len = 0;
+	cap->write_generation = cap->generation;
+
+	shb.type = PCAPNG_SHB;
+	shb.length = sizeof(shb);
+	shb.bom = PCAPNG_BOM;
+	shb.major = 1;
+	shb.minor = 0;
+	shb.section_length[0] = shb.section_length[1] = 0xffffffff;
+	shb.length2 = sizeof(shb);
+	capture_append(cap, &shb, sizeof(shb));
+
+	idb.type = PCAPNG_IDB;
+	idb.length = sizeof(idb);
+	idb.linktype = LINKTYPE_USB_LINUX_MMAPPED;
+	idb.reserved = 0;
+	idb.snaplen = USBI_CAPTURE_SNAPLEN;
+	idb.length2 = sizeof(idb);
+	capture_append(cap, &idb, sizeof(idb));
+
+	capture_flush(cap);
+	if (cap->error)
+		return LIBUSB_ERROR_IO;
+
+	if (pthread_create(&cap->thread, NULL, capture_thread_main, cap))
+		return LIBUSB_ERROR_OTHER;
+	__atomic_store_n(&ctx->capture_active, 1, __ATOMIC_SEQ_CST);
+
+	return LIBUSB_SUCCESS;
+}
+#else
+void usbi_capture_record(struct libusb_context *ctx,
+	struct usbi_transfer *itransfer, char type, int status)
+{
+	UNUSED(ctx);
+	UNUSED(itransfer);
+	UNUSED(type);
+	UNUSED(status);
+}
+#endif /* USBI_CAPTURE */
+
+int usbi_set_capture(struct libusb_context *ctx, int fd)
+{
+#ifdef USBI_CAPTURE
+	int r = LIBUSB_SUCCESS;
+
+	if (fd < -1)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	usbi_mutex_lock(&ctx->trace_lock);
+	if (fd == -1)
+		capture_stop(ctx);
+	else if (ctx->capture_active)
+		r = LIBUSB_ERROR_BUSY;
+	else
+		r = capture_start(ctx, fd);
+	usbi_mutex_unlock(&ctx->trace_lock);
+
+	return r;
+#else
+	UNUSED(ctx);
+	UNUSED(fd);
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+/** \ingroup libusb_misc
+ * Get the counters of the transfer capture started with
+ * \ref LIBUSB_OPTION_CAPTURE_FD. They are reset when a capture is started.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param stats output location for the counters
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if capture is not available on this
+ * platform
+ */
+int API_EXPORTED libusb_get_capture_stats(libusb_context *ctx,
+	struct libusb_capture_stats *stats)
+{
+#ifdef USBI_CAPTURE
+	struct usbi_capture *cap;
+
+	USBI_GET_CONTEXT(ctx);
+	memset(stats, 0, sizeof(*stats));
+	cap = __atomic_load_n(&ctx->capture, __ATOMIC_ACQUIRE);
+	if (cap) {
+		stats->packets = __atomic_load_n(&cap->packets, __ATOMIC_RELAXED);
+		stats->bytes = __atomic_load_n(&cap->bytes, __ATOMIC_RELAXED);
+		stats->dropped = __atomic_load_n(&cap->dropped, __ATOMIC_RELAXED);
+	}
+	return LIBUSB_SUCCESS;
+#else
+	UNUSED(ctx);
+	UNUSED(stats);
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+/** \ingroup libusb_misc
+ * Get the contention statistics of libusb's internal locks.
+ *
+ * Only available when libusb was configured with --enable-lock-profiling.
+ * Locks are grouped in classes, one for each lock of the library's
+ * structures (e.g. "ctx->events_lock", or "itransfer->lock" for the locks
+ * of all transfers), with the statistics of all contexts added up.
+ *
+ * \param stats array to fill in
+ * \param count number of elements in stats
+ * \returns the number of lock classes, which may be larger than count
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if lock profiling is not compiled in
+ */
+int API_EXPORTED libusb_get_lock_stats(struct libusb_lock_stats *stats,
+	int count)
+{
+#ifdef USBI_LOCK_PROFILING
+	return usbi_get_lock_stats(stats, count);
+#else
+	UNUSED(stats);
+	UNUSED(count);
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+/** \ingroup libusb_misc
+ * Reset the lock contention statistics returned by libusb_get_lock_stats().
+ */
+void API_EXPORTED libusb_reset_lock_stats(void)
+{
+#ifdef USBI_LOCK_PROFILING
+	usbi_reset_lock_stats();
+#endif
+}
+
+/** \ingroup libusb_asyncio
+ * Submit a transfer. This function will fire off the USB transfer and then
+ * return immediately.
+ *
+ * \param transfer the transfer to submit
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+ * \returns LIBUSB_ERROR_BUSY if the transfer has already been submitted.
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if the transfer flags or scatter-gather
+ * segments are not supported by the operating system.
+ * \returns LIBUSB_ERROR_INVALID_PARAM if the transfer size is larger than
+ * the operating system and/or hardware can support, or the segments set with
+ * libusb_transfer_set_iov() do not add up to the transfer length
+ * \returns another LIBUSB_ERROR code on other failure
+ */
+int API_EXPORTED libusb_submit_transfer(struct libusb_transfer *transfer)
+{
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+	struct libusb_context *ctx = TRANSFER_CTX(transfer);
+	int r;
+	int i;
+
+	usbi_dbg("transfer %p", transfer);
+
+	if (usbi_transfer_has_iov(itransfer)) {
+		int length = 0;
+
+		if (!(usbi_backend.caps & USBI_CAP_BULK_IOV))
+			return LIBUSB_ERROR_NOT_SUPPORTED;
+		if (transfer->type != LIBUSB_TRANSFER_TYPE_BULK &&
+		    transfer->type != LIBUSB_TRANSFER_TYPE_BULK_STREAM)
+			return LIBUSB_ERROR_INVALID_PARAM;
+		for (i = 0; i < itransfer->num_iov; i++) {
+			if (itransfer->iov[i].length < 0)
+				return LIBUSB_ERROR_INVALID_PARAM;
+			length += itransfer->iov[i].length;
+		}
+		if (length != transfer->length)
+			return LIBUSB_ERROR_INVALID_PARAM;
+	}
+
+	/*
+	 * Important note on locking, this function takes / releases locks
+	 * in the following order:
+	 *  take flying_transfers_lock
+	 *  take itransfer->lock
+	 *  clear transfer
+	 *  add to flying_transfers list
+	 *  release flying_transfers_lock
+	 *  submit transfer
+	 *  release itransfer->lock
+	 *  if submit failed:
+	 *   take flying_transfers_lock
+	 *   remove from flying_transfers list
+	 *   release flying_transfers_lock
+	 *
+	 * Note that it takes locks in the order a-b and then releases them
+	 * in the same order a-b. This is somewhat unusual but not wrong,
+	 * release order is not important as long as *all* locks are released
+	 * before re-acquiring any locks.
+	 *
+	 * This means that the ordering of first releasing itransfer->lock
+	 * and then re-acquiring the flying_transfers_list on error is
+	 * important and must not be changed!
+	 *
+	 * This is done this way because when we take both locks we must always
+	 * take flying_transfers_lock first to avoid ab-ba style deadlocks with
+	 * the timeout handling and usbi_handle_disconnect paths.
+	 *
+	 * And we cannot release itransfer->lock before the submission is
+	 * complete otherwise timeout handling for transfers with short
+	 * timeouts may run before submission.
+	 */
+	usbi_mutex_lock(&ctx->flying_transfers_lock);
+	usbi_mutex_lock(&itransfer->lock);
+	if (itransfer->state_flags & USBI_TRANSFER_IN_FLIGHT) {
+		usbi_mutex_unlock(&ctx->flying_transfers_lock);
+		usbi_mutex_unlock(&itransfer->lock);
+		return LIBUSB_ERROR_BUSY;
+	}
+	itransfer->transferred = 0;
+	itransfer->state_flags = 0;
+	itransfer->timeout_flags = 0;
+	itransfer->stats_flags = 0;
+	if (usbi_transfer_has_iov(itransfer))
+		for (i = 0; i < itransfer->num_iov; i++)
+			itransfer->iov[i].actual_length = 0;
+	for (i = 0; i < itransfer->num_iso_packets; i++)
+		itransfer->iso_frames[i] = -1;
+	r = add_to_flying_list(itransfer);
+	if (r) {
+		usbi_mutex_unlock(&ctx->flying_transfers_lock);
+		usbi_mutex_unlock(&itransfer->lock);
+		return r;
+	}
+	/*
+	 * We must release the flying transfers lock here, because with
+	 * some backends the submit_transfer method is synchroneous.
+	 */
+	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+
+	usbi_trace(ctx, LIBUSB_TRACE_SUBMIT, transfer, transfer->endpoint, -1,
+		0, (unsigned int)transfer->length);
+
+	/* the transfer may complete as soon as it is submitted */
+	if (ctx->endpoint_stats) {
+		usbi_backend.clock_gettime(USBI_CLOCK_MONOTONIC, &itransfer->stats_submit_time);
+		itransfer->stats_flags |= USBI_TRANSFER_STATS_SUBMITTED;
+	}
+
+	usbi_capture(ctx, itransfer, 'S', 0);
+	r = usbi_backend.submit_transfer(itransfer);
+	if (r == LIBUSB_SUCCESS) {
+		itransfer->state_flags |= USBI_TRANSFER_IN_FLIGHT;
+		/* keep a reference to this device */
+		libusb_ref_device(transfer->dev_handle->dev);
+		if (itransfer->stats_flags & USBI_TRANSFER_STATS_SUBMITTED)
+			stats_transfer_submitted(itransfer);
+	}
+	usbi_mutex_unlock(&itransfer->lock);
+
+	if (r != LIBUSB_SUCCESS) {
+		usbi_capture(ctx, itransfer, 'E', r);
+		remove_from_flying_list(itransfer);
+	}
+
+	return r;
+}
+
+/** \ingroup libusb_asyncio
+ * Asynchronously cancel a previously submitted transfer.
+ * This function returns immediately, but this does not indicate cancellation
+ * is complete. Your callback function will be invoked at some later time
+ * with a transfer status of
+ * \ref libusb_transfer_status::LIBUSB_TRANSFER_CANCELLED
+ * "LIBUSB_TRANSFER_CANCELLED."
+ *
+ * \param transfer the transfer to cancel
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NOT_FOUND if the transfer is not in progress,
+ * already complete, or already cancelled.
+ * \returns a LIBUSB_ERROR code on failure
+ */
+int API_EXPORTED libusb_cancel_transfer(struct libusb_transfer *transfer)
+{
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+	int r;
+
+	usbi_dbg("transfer %p", transfer );
+	usbi_mutex_lock(&itransfer->lock);
+	if (!(itransfer->state_flags & USBI_TRANSFER_IN_FLIGHT)
+			|| (itransfer->state_flags & USBI_TRANSFER_CANCELLING)) {
+		r = LIBUSB_ERROR_NOT_FOUND;
+		goto out;
+	}
+	r = usbi_backend.cancel_transfer(itransfer);
+	if (r < 0) {
+		if (r != LIBUSB_ERROR_NOT_FOUND &&
+		    r != LIBUSB_ERROR_NO_DEVICE)
+			usbi_err(TRANSFER_CTX(transfer),
+				"cancel transfer failed error %d", r);
+		else
+			usbi_dbg("cancel transfer failed error %d", r);
+
+		if (r == LIBUSB_ERROR_NO_DEVICE)
+			itransfer->state_flags |= USBI_TRANSFER_DEVICE_DISAPPEARED;
+	}
+
+	usbi_trace(TRANSFER_CTX(transfer), LIBUSB_TRACE_CANCEL, transfer,
+		transfer->endpoint, -1, r, (unsigned int)transfer->length);
+	itransfer->state_flags |= USBI_TRANSFER_CANCELLING;
+
+out:
+	usbi_mutex_unlock(&itransfer->lock);
+	return r;
+}
+
+/** \ingroup libusb_asyncio
+ * Set a transfers bulk stream id. Note users are advised to use
+ * libusb_fill_bulk_stream_transfer() instead of calling this function
+ * directly.
+ *
+ * Since version 1.0.19, \ref LIBUSB_API_VERSION >= 0x01000103
+ *
+ * \param transfer the transfer to set the stream id for
+ * \param stream_id the stream id to set
+ * \see libusb_alloc_streams()
+ */
+void API_EXPORTED libusb_transfer_set_stream_id(
+	struct libusb_transfer *transfer, uint32_t stream_id)
+{
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+
+	itransfer->stream_id = stream_id;
+}
+
+/** \ingroup libusb_asyncio
+ * Get a transfers bulk stream id.
+ *
+ * Since version 1.0.19, \ref LIBUSB_API_VERSION >= 0x01000103
+ *
+ * \param transfer the transfer to get the stream id for
+ * \returns the stream id for the transfer
+ */
+uint32_t API_EXPORTED libusb_transfer_get_stream_id(
+	struct libusb_transfer *transfer)
+{
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+
+	return itransfer->stream_id;
+}
+
+/** \ingroup libusb_asyncio
+ * Set the scatter-gather segments of a bulk transfer. The segments are used
+ * instead of the transfer buffer for as long as that is NULL, so the transfer
+ * goes back to an ordinary one when it is filled in again with a buffer.
+ * Note users are advised to use libusb_fill_bulk_transfer_iov() instead of
+ * calling this function directly, which also sets the transfer length to the
+ * total length of the segments.
+ *
+ * \param transfer the transfer to set the segments for
+ * \param iov array of segments, which must stay valid until the transfer
+ * has completed
+ * \param num_iov number of segments in iov
+ */
+void API_EXPORTED libusb_transfer_set_iov(struct libusb_transfer *transfer,
+	struct libusb_iovec *iov, int num_iov)
+{
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+
+	itransfer->iov = iov;
+	itransfer->num_iov = iov ? num_iov : 0;
+}
+
+/** \ingroup libusb_asyncio
+ * Set the (micro)frame an isochronous transfer is to start in. Frame
+ * numbers are those of the host controller, see libusb_get_frame_number().
+ * The first packet of the transfer is scheduled in that frame, and the
+ * others follow at the service interval of the endpoint. Submission fails
+ * with LIBUSB_ERROR_INVALID_PARAM if the frame has already begun or is too
+ * far ahead for the host controller.
+ *
+ * Transfers start as soon as possible by default, or after the transfers
+ * already queued on the endpoint. The start frame is kept across
+ * submissions, so a transfer resubmitted from its callback must be given a
+ * new one, or \ref LIBUSB_ISO_START_ASAP.
+ *
+ * \param transfer the transfer to set the start frame for
+ * \param start_frame the frame number, or \ref LIBUSB_ISO_START_ASAP
+ */
+void API_EXPORTED libusb_transfer_set_iso_start_frame(
+	struct libusb_transfer *transfer, int start_frame)
+{
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+
+	itransfer->iso_start_frame = start_frame;
+}
+
+/** \ingroup libusb_asyncio
+ * Get the (micro)frame an isochronous packet was scheduled in, as reported
+ * by the host controller on completion. The frame of packet 0 is the one
+ * the transfer actually started in.
+ *
+ * Frame numbers wrap around as those of the host controller do, but not
+ * consistently across a transfer. On Linux, the packets of a transfer are
+ * scheduled in groups of up to 128, and only the first packet of each group
+ * reports the frame counter of the host controller. The others in the group
+ * are reported as an offset from it, without wrapping. The frames of two
+ * packets in different groups may thus be on either side of a wrap, so
+ * compare them modulo the size of the frame counter, which depends on the
+ * host controller.
+ *
+ * \param transfer a completed isochronous transfer
+ * \param packet the packet to get the frame of
+ * \returns the frame number, or -1 if it is not known, as on platforms
+ * that do not report it
+ */
+int API_EXPORTED libusb_get_iso_packet_frame(struct libusb_transfer *transfer,
+	unsigned int packet)
+{
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+
+	if (packet >= (unsigned int)itransfer->num_iso_packets)
+		return -1;
+
+	return itransfer->iso_frames[packet];
+}
+
+/** \ingroup libusb_asyncio
+ * Get the current (micro)frame number of the bus a device is on, to pick
+ * the start frame of isochronous transfers with
+ * libusb_transfer_set_iso_start_frame(). At high speed and above frame
+ * numbers count microframes on most host controllers, and otherwise frames.
+ *
+ * On Linux, where usbfs does not report the frame number directly, it is
+ * extrapolated from the frames that isochronous transfers of the device
+ * handle completed in, so at least one must have completed; start it as
+ * soon as possible. This has two limits. The frame number lags that of the
+ * host controller by the time it took to reap the last transfer, so leave
+ * some frames of margin when picking a start frame. And it counts on where
+ * the frame counter of the host controller wraps around, unlike the frames
+ * reported by libusb_get_iso_packet_frame(), so compare the two modulo the
+ * size of that counter, which depends on the host controller, rather than
+ * directly.
+ *
+ * \param dev_handle a device handle
+ * \param frame_number output location for the frame number
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NOT_FOUND if no frame number is known yet
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if the platform does not report
+ * frame numbers
+ */
+int API_EXPORTED libusb_get_frame_number(libusb_device_handle *dev_handle,
+	int *frame_number)
+{
+	if (!usbi_backend.get_frame_number)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	return usbi_backend.get_frame_number(dev_handle, frame_number);
+}
+
+/* A control batch keeps up to depth transfers cycling through its entries,
+ * each one taking the next entry as soon as it completes. The transfers are
+ * allocated on submission and freed before the callback runs, so that the
+ * batch can be freed or resubmitted from it. */
+struct usbi_control_batch {
+	usbi_mutex_t lock;
+	int max_entries;
+	int active;
+	int stopping;
+	int next;
+	int in_flight;
+	int first_failed;
+	int num_slots;
+	struct libusb_transfer **slots;
+	int *slot_entry;
+
+	/* must come last */
+	struct libusb_control_batch batch;
+};
+
+#define CONTROL_BATCH_TO_USBI(b) \
+	((struct usbi_control_batch *)((unsigned char *)(b) - \
+		offsetof(struct usbi_control_batch, batch)))
+
+/** \ingroup libusb_asyncio
+ * Allocate a control batch with room for a number of requests. The batch is
+ * zeroed apart from the number of entries and a depth of 1; fill in the
+ * requests and the other fields before submitting it. Free it with
+ * libusb_free_control_batch().
+ *
+ * \param num_entries the number of requests to allocate
+ * \returns a newly allocated batch, or NULL on error
+ */
+DEFAULT_VISIBILITY
+struct libusb_control_batch * LIBUSB_CALL libusb_alloc_control_batch(
+	int num_entries)
+{
+	struct usbi_control_batch *ibatch;
+
+	if (num_entries < 0)
+		return NULL;
+
+	ibatch = calloc(1, sizeof(*ibatch) +
+		sizeof(struct libusb_control_batch_entry) * (size_t)num_entries);
+	if (!ibatch)
+		return NULL;
+
+	usbi_mutex_init(&ibatch->lock);
+	ibatch->max_entries = num_entries;
+	ibatch->batch.num_entries = num_entries;
+	ibatch->batch.depth = 1;
+	return &ibatch->batch;
+}
+
+/** \ingroup libusb_asyncio
+ * Free a control batch. It is legal to call this function with NULL, but
+ * not with a batch that has been submitted and not yet completed. The data
+ * buffers of the requests are not freed.
+ *
+ * \param batch the batch to free
+ */
+void API_EXPORTED libusb_free_control_batch(struct libusb_control_batch *batch)
+{
+	struct usbi_control_batch *ibatch;
+
+	if (!batch)
+		return;
+
+	ibatch = CONTROL_BATCH_TO_USBI(batch);
+	usbi_mutex_destroy(&ibatch->lock);
+	free(ibatch);
+}
+
+static void LIBUSB_CALL control_batch_cb(struct libusb_transfer *transfer);
+
+static void control_batch_free_slots(struct usbi_control_batch *ibatch)
+{
+	int i;
+
+	for (i = 0; i < ibatch->num_slots; i++)
+		libusb_free_transfer(ibatch->slots[i]);
+	free(ibatch->slots);
+	free(ibatch->slot_entry);
+	ibatch->slots = NULL;
+	ibatch->slot_entry = NULL;
+	ibatch->num_slots = 0;
+}
+
+static int control_batch_alloc_slots(struct usbi_control_batch *ibatch)
+{
+	struct libusb_control_batch *batch = &ibatch->batch;
+	struct libusb_transfer *transfer;
+	int i, depth = batch->depth, max_length = 0;
+
+	if (depth < 1)
+		depth = 1;
+	if (depth > batch->num_entries)
+		depth = batch->num_entries;
+
+	for (i = 0; i < batch->num_entries; i++) {
+		if (batch->entries[i].wLength > max_length)
+			max_length = batch->entries[i].wLength;
+	}
+
+	ibatch->slots = calloc((size_t)depth, sizeof(*ibatch->slots));
+	ibatch->slot_entry = malloc((size_t)depth * sizeof(*ibatch->slot_entry));
+	if (!ibatch->slots || !ibatch->slot_entry)
+		goto err;
+
+	for (i = 0; i < depth; i++) {
+		transfer = libusb_alloc_transfer(0);
+		if (!transfer)
+			goto err;
+		ibatch->slots[ibatch->num_slots++] = transfer;
+		transfer->buffer = malloc(LIBUSB_CONTROL_SETUP_SIZE + (size_t)max_length);
+		if (!transfer->buffer)
+			goto err;
+		libusb_fill_control_transfer(transfer, batch->dev_handle,
+			transfer->buffer, control_batch_cb, ibatch, batch->timeout);
+		transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+		ibatch->slot_entry[i] = -1;
+	}
+
+	return 0;
+
+err:
+	control_batch_free_slots(ibatch);
+	return LIBUSB_ERROR_NO_MEM;
+}
+
+/* the first request in batch order that failed sets the batch status */
+static void control_batch_failed(struct usbi_control_batch *ibatch, int index,
+	enum libusb_transfer_status status)
+{
+	struct libusb_control_batch *batch = &ibatch->batch;
+	int i;
+
+	if (ibatch->first_failed < 0 || index < ibatch->first_failed) {
+		ibatch->first_failed = index;
+		batch->status = status;
+	}
+
+	if (ibatch->stopping || !(batch->flags & LIBUSB_CONTROL_BATCH_STOP_ON_ERROR))
+		return;
+
+	ibatch->stopping = 1;
+	for (i = 0; i < ibatch->num_slots; i++) {
+		if (ibatch->slot_entry[i] >= 0)
+			libusb_cancel_transfer(ibatch->slots[i]);
+	}
+}
+
+/* send the next request on an idle slot; with the batch lock held */
+static int control_batch_send(struct usbi_control_batch *ibatch, int slot)
+{
+	struct libusb_control_batch *batch = &ibatch->batch;
+	struct libusb_control_batch_entry *entry = &batch->entries[ibatch->next];
+	struct libusb_transfer *transfer = ibatch->slots[slot];
+	int r;
+
+	libusb_fill_control_setup(transfer->buffer, entry->bmRequestType,
+		entry->bRequest, entry->wValue, entry->wIndex, entry->wLength);
+	if (!(entry->bmRequestType & LIBUSB_ENDPOINT_IN) && entry->wLength)
+		memcpy(transfer->buffer + LIBUSB_CONTROL_SETUP_SIZE, entry->data,
+			entry->wLength);
+	transfer->length = LIBUSB_CONTROL_SETUP_SIZE + entry->wLength;
+
+	r = libusb_submit_transfer(transfer);
+	if (r < 0)
+		return r;
+
+	ibatch->slot_entry[slot] = ibatch->next++;
+	ibatch->in_flight++;
+	return 0;
+}
+
+static void LIBUSB_CALL control_batch_cb(struct libusb_transfer *transfer)
+{
+	struct usbi_control_batch *ibatch = transfer->user_data;
+	struct libusb_control_batch *batch = &ibatch->batch;
+	struct libusb_control_batch_entry *entry;
+	int slot, index, done, r;
+
+	usbi_mutex_lock(&ibatch->lock);
+	for (slot = 0; slot < ibatch->num_slots; slot++) {
+		if (ibatch->slots[slot] == transfer)
+			break;
+	}
+	index = ibatch->slot_entry[slot];
+	ibatch->slot_entry[slot] = -1;
+	ibatch->in_flight--;
+
+	entry = &batch->entries[index];
+	entry->status = transfer->status;
+	entry->actual_length = transfer->actual_length;
+	if ((entry->bmRequestType & LIBUSB_ENDPOINT_IN) && transfer->actual_length > 0)
+		memcpy(entry->data, libusb_control_transfer_get_data(transfer),
+			(size_t)transfer->actual_length);
+
+	if (transfer->status == LIBUSB_TRANSFER_COMPLETED)
+		batch->num_completed++;
+	else
+		control_batch_failed(ibatch, index, transfer->status);
+
+	if (!ibatch->stopping && ibatch->next < batch->num_entries) {
+		index = ibatch->next;
+		r = control_batch_send(ibatch, slot);
+		if (r < 0) {
+			batch->entries[index].status = r == LIBUSB_ERROR_NO_DEVICE ?
+				LIBUSB_TRANSFER_NO_DEVICE : LIBUSB_TRANSFER_ERROR;
+			control_batch_failed(ibatch, index, batch->entries[index].status);
+			ibatch->stopping = 1;
+		}
+	}
+
+	done = !ibatch->in_flight &&
+		(ibatch->stopping || ibatch->next == batch->num_entries);
+	if (done) {
+		control_batch_free_slots(ibatch);
+		ibatch->active = 0;
+	}
+	usbi_mutex_unlock(&ibatch->lock);
+
+	if (done && batch->callback)
+		batch->callback(batch);
+}
+
+/** \ingroup libusb_asyncio
+ * Submit a control batch. Its requests are sent to the control endpoint in
+ * order, with up to \ref libusb_control_batch::depth "depth" of them queued
+ * at the device at a time, so that the next request does not wait for the
+ * round trip of the previous one. The batch callback is invoked once, after
+ * every request has completed or been skipped, with the outcome of each one
+ * in its entry.
+ *
+ * The requests are carried by transfers allocated for the batch, so a batch
+ * of any length costs a handful of allocations rather than one per request.
+ * A request that fails to be submitted ends the batch, and with
+ * \ref LIBUSB_CONTROL_BATCH_STOP_ON_ERROR so does one that fails. Requests
+ * already queued behind a failed one may have reached the device before
+ * they are cancelled.
+ *
+ * \param batch the batch to submit
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if the batch is not valid
+ * \returns LIBUSB_ERROR_BUSY if the batch has already been submitted
+ * \returns LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+ * \returns another LIBUSB_ERROR code on other failure, in which case no
+ * request was sent and the callback will not be invoked
+ */
+int API_EXPORTED libusb_submit_control_batch(struct libusb_control_batch *batch)
+{
+	struct usbi_control_batch *ibatch = CONTROL_BATCH_TO_USBI(batch);
+	int i, r = 0;
+
+	if (!batch->dev_handle || batch->num_entries < 1 ||
+	    batch->num_entries > ibatch->max_entries)
+		return LIBUSB_ERROR_INVALID_PARAM;
+	for (i = 0; i < batch->num_entries; i++) {
+		if (batch->entries[i].wLength && !batch->entries[i].data)
+			return LIBUSB_ERROR_INVALID_PARAM;
+	}
+
+	usbi_mutex_lock(&ibatch->lock);
+	if (ibatch->active) {
+		r = LIBUSB_ERROR_BUSY;
+		goto out;
+	}
+
+	r = control_batch_alloc_slots(ibatch);
+	if (r < 0)
+		goto out;
+
+	for (i = 0; i < batch->num_entries; i++) {
+		batch->entries[i].status = LIBUSB_TRANSFER_CANCELLED;
+		batch->entries[i].actual_length = 0;
+	}
+	batch->status = LIBUSB_TRANSFER_COMPLETED;
+	batch->num_completed = 0;
+	ibatch->first_failed = -1;
+	ibatch->stopping = 0;
+	ibatch->next = 0;
+	ibatch->in_flight = 0;
+
+	for (i = 0; i < ibatch->num_slots; i++) {
+		r = control_batch_send(ibatch, i);
+		if (r < 0)
+			break;
+	}
+
+	if (!ibatch->in_flight) {
+		/* nothing went out */
+		control_batch_free_slots(ibatch);
+		goto out;
+	}
+
+	ibatch->active = 1;
+	if (r < 0) {
+		batch->entries[ibatch->next].status = r == LIBUSB_ERROR_NO_DEVICE ?
+			LIBUSB_TRANSFER_NO_DEVICE : LIBUSB_TRANSFER_ERROR;
+		control_batch_failed(ibatch, ibatch->next,
+			batch->entries[ibatch->next].status);
+		ibatch->stopping = 1;
+		r = 0;
+	}
+
+out:
+	usbi_mutex_unlock(&ibatch->lock);
+	return r;
+}
+
+/** \ingroup libusb_asyncio
+ * Cancel a submitted control batch: no further requests are sent, and the
+ * ones in flight are cancelled. The batch callback is invoked once they
+ * have all completed, with the requests that were not sent reading
+ * \ref LIBUSB_TRANSFER_CANCELLED.
+ *
+ * \param batch the batch to cancel
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NOT_FOUND if the batch is not in progress or
+ * already being cancelled
+ */
+int API_EXPORTED libusb_cancel_control_batch(struct libusb_control_batch *batch)
+{
+	struct usbi_control_batch *ibatch = CONTROL_BATCH_TO_USBI(batch);
+	int i, r = 0;
+
+	usbi_mutex_lock(&ibatch->lock);
+	if (!ibatch->active || ibatch->stopping) {
+		r = LIBUSB_ERROR_NOT_FOUND;
+	} else {
+		ibatch->stopping = 1;
+		for (i = 0; i < ibatch->num_slots; i++) {
+			if (ibatch->slot_entry[i] >= 0)
+				libusb_cancel_transfer(ibatch->slots[i]);
+		}
+		if (ibatch->first_failed < 0 || ibatch->next < ibatch->first_failed) {
+			ibatch->first_failed = ibatch->next;
+			batch->status = LIBUSB_TRANSFER_CANCELLED;
+		}
+	}
+	usbi_mutex_unlock(&ibatch->lock);
+
+	return r;
+}
+
+/* A bulk coalescer copies the data of queued writes into its buffer and
+ * sends it in transfers of its own. Both the writes and those transfers are
+ * kept in order, and each transfer is retired in turn, handing its bytes to
+ * the writes at the head of the queue: a write completes once all of its
+ * bytes have been accounted for. Coalescers with a delay are also on a list
+ * of the context, so that the event handling code can send their bytes once
+ * the delay has run out. */
+struct libusb_bulk_coalescer {
+	struct libusb_context *ctx;
+	struct list_head list;
+	libusb_device_handle *dev_handle;
+	unsigned char endpoint;
+	int max_packet_size;
+	int max_bytes;
+	unsigned int max_delay_us;
+
+	usbi_mutex_t lock;
+	unsigned char *buffer;
+	int buffer_len;
+	int buffer_size;
+	/* smallest non-zero timeout of the writes in the buffer */
+	unsigned int timeout;
+	/* time by which the buffer must be sent, when a delay is set */
+	struct timeval deadline;
+	/* writes that have not completed yet, linked by their list */
+	struct list_head writes;
+	/* transfers that have not been retired yet */
+	struct list_head flushes;
+};
+
+struct coalescer_flush {
+	struct list_head list;
+	struct libusb_bulk_coalescer *coalescer;
+	struct libusb_transfer *transfer;
+	int done;
+};
+
+static void LIBUSB_CALL coalescer_transfer_cb(struct libusb_transfer *transfer);
+
+/* hand length bytes to the writes at the head of the queue, moving the
+ * writes that are done to the done list */
+static void coalescer_account(struct libusb_bulk_coalescer *coalescer,
+	int length, enum libusb_transfer_status status, struct list_head *done)
+{
+	struct usbi_transfer *itransfer;
+	struct libusb_transfer *transfer;
+	int n;
+
+	while (length > 0 && !list_empty(&coalescer->writes)) {
+		itransfer = list_first_entry(&coalescer->writes, struct usbi_transfer, list);
+		transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+
+		n = MIN(transfer->length - itransfer->transferred, length);
+		itransfer->transferred += n;
+		if (status == LIBUSB_TRANSFER_COMPLETED)
+			transfer->actual_length += n;
+		else if (transfer->status == LIBUSB_TRANSFER_COMPLETED)
+			transfer->status = status;
+		length -= n;
+
+		if (itransfer->transferred == transfer->length) {
+			list_del(&itransfer->list);
+			list_add_tail(&itransfer->list, done);
+		}
+	}
+}
+
+/* retire the transfers that are done, in the order they were sent; with the
+ * coalescer lock held */
+static void coalescer_retire(struct libusb_bulk_coalescer *coalescer,
+	struct list_head *done)
+{
+	struct coalescer_flush *flush;
+	struct libusb_transfer *transfer;
+	enum libusb_transfer_status status;
+
+	while (!list_empty(&coalescer->flushes)) {
+		flush = list_first_entry(&coalescer->flushes, struct coalescer_flush, list);
+		if (!flush->done)
+			break;
+
+		transfer = flush->transfer;
+		status = transfer->status;
+		if (status == LIBUSB_TRANSFER_COMPLETED)
+			status = LIBUSB_TRANSFER_ERROR;
+		coalescer_account(coalescer, transfer->actual_length,
+			LIBUSB_TRANSFER_COMPLETED, done);
+		coalescer_account(coalescer,
+			transfer->length - transfer->actual_length, status, done);
+
+		list_del(&flush->list);
+		libusb_free_transfer(transfer);
+		free(flush);
+	}
+}
+
+/* send the first length bytes of the buffer; with the coalescer lock held.
+ * Nothing changes if memory runs out. A failed submission drops the bytes,
+ * moving the writes that carried the last of them to the done list, and
+ * returns the error of the submission; callers tell the two apart by the
+ * length of the buffer. */
+static int coalescer_send(struct libusb_bulk_coalescer *coalescer, int length,
+	uint8_t flags, struct list_head *done)
+{
+	struct coalescer_flush *flush;
+	struct libusb_transfer *transfer;
+	unsigned char *buffer;
+	int r;
+
+	flush = malloc(sizeof(*flush));
+	transfer = libusb_alloc_transfer(0);
+	buffer = malloc((size_t)coalescer->buffer_size);
+	if (!flush || !transfer || !buffer) {
+		free(flush);
+		libusb_free_transfer(transfer);
+		free(buffer);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	/* the transfer takes the buffer, and the bytes it does not carry move
+	 * to a new one */
+	libusb_fill_bulk_transfer(transfer, coalescer->dev_handle,
+		coalescer->endpoint, coalescer->buffer, length,
+		coalescer_transfer_cb, flush, coalescer->timeout);
+	transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER | flags;
+	coalescer->buffer_len -= length;
+	if (coalescer->buffer_len) {
+		memcpy(buffer, coalescer->buffer + length,
+			(size_t)coalescer->buffer_len);
+	} else {
+		coalescer->timeout = 0;
+		timerclear(&coalescer->deadline);
+	}
+	coalescer->buffer = buffer;
+
+	flush->coalescer = coalescer;
+	flush->transfer = transfer;
+	flush->done = 0;
+	list_add_tail(&flush->list, &coalescer->flushes);
+
+	r = libusb_submit_transfer(transfer);
+	if (r < 0) {
+		usbi_dbg("coalesced transfer of %d bytes failed: %d", length, r);
+		transfer->status = r == LIBUSB_ERROR_NO_DEVICE ?
+			LIBUSB_TRANSFER_NO_DEVICE : LIBUSB_TRANSFER_ERROR;
+		transfer->actual_length = 0;
+		flush->done = 1;
+		coalescer_retire(coalescer, done);
+		return r;
+	}
+
+	return 0;
+}
+
+/* invoke the callbacks of transfers that completed without going through
+ * the event handling code, linked by their list; without any lock held */
+static void complete_transfer_list(struct list_head *done)
+{
+	struct usbi_transfer *itransfer, *tmp;
+	struct libusb_transfer *transfer;
+	uint8_t flags;
+
+	list_for_each_entry_safe(itransfer, tmp, done, list, struct usbi_transfer) {
+		transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+		list_del(&itransfer->list);
+		flags = transfer->flags;
+		if (transfer->callback)
+			transfer->callback(transfer);
+		/* transfer might have been freed by the above call */
+		if (flags & LIBUSB_TRANSFER_FREE_TRANSFER)
+			libusb_free_transfer(transfer);
+	}
+}
+
+/* hand transfers that completed without going through the event handling
+ * code, linked by their list, to the event handler, which invokes their
+ * callbacks the next time it runs. Used where the callbacks may not run from
+ * the function that completed them. */
+static void defer_transfer_list(struct libusb_context *ctx,
+	struct list_head *done)
+{
+	struct usbi_transfer *itransfer, *tmp;
+	int pending_events;
+
+	if (list_empty(done))
+		return;
+
+	usbi_mutex_lock(&ctx->event_data_lock);
+	pending_events = usbi_pending_events(ctx);
+	list_for_each_entry_safe(itransfer, tmp, done, list, struct usbi_transfer) {
+		list_del(&itransfer->list);
+		list_add_tail(&itransfer->list, &ctx->deferred_transfers);
+	}
+	if (!pending_events)
+		usbi_signal_event(ctx);
+	usbi_mutex_unlock(&ctx->event_data_lock);
+}
+
+/* have the event handler recompute its timeout for a new coalescer
+ * deadline. This wakes the thread handling events whichever thread that
+ * is, including the calling one, whose next wait then covers the deadline. */
+static void signal_coalescer_deadline(struct libusb_context *ctx)
+{
+	int pending_events;
+
+	usbi_mutex_lock(&ctx->event_data_lock);
+	pending_events = usbi_pending_events(ctx);
+	ctx->event_flags |= USBI_EVENT_COALESCER_DEADLINE;
+	if (!pending_events)
+		usbi_signal_event(ctx);
+	usbi_mutex_unlock(&ctx->event_data_lock);
+}
+
+static void LIBUSB_CALL coalescer_transfer_cb(struct libusb_transfer *transfer)
+{
+	struct coalescer_flush *flush = transfer->user_data;
+	struct libusb_bulk_coalescer *coalescer = flush->coalescer;
+	struct list_head done;
+
+	list_init(&done);
+	usbi_mutex_lock(&coalescer->lock);
+	flush->done = 1;
+	coalescer_retire(coalescer, &done);
+
+	/* without a delay, what was written while transfers were in flight is
+	 * sent as soon as they have all completed */
+	if (!coalescer->max_delay_us && coalescer->buffer_len &&
+	    list_empty(&coalescer->flushes))
+		coalescer_send(coalescer, coalescer->buffer_len, 0, &done);
+	usbi_mutex_unlock(&coalescer->lock);
+
+	complete_transfer_list(&done);
+}
+
+/* send the buffers of coalescers whose delay has run out */
+static void handle_coalescer_deadlines(struct libusb_context *ctx)
+{
+	struct libusb_bulk_coalescer *coalescer;
+	struct timespec systime_ts;
+	struct timeval systime;
+	struct list_head done;
+
+	/* most contexts have no coalescers, spare them the lock */
+	if (!__atomic_load_n(&ctx->num_coalescers, __ATOMIC_ACQUIRE))
+		return;
+
+	list_init(&done);
+	usbi_backend.clock_gettime(USBI_CLOCK_MONOTONIC, &systime_ts);
+	TIMESPEC_TO_TIMEVAL(&systime, &systime_ts);
+
+	usbi_mutex_lock(&ctx->coalescers_lock);
+	list_for_each_entry(coalescer, &ctx->coalescers, list, struct libusb_bulk_coalescer) {
+		usbi_mutex_lock(&coalescer->lock);
+		if (timerisset(&coalescer->deadline) &&
+		    !timercmp(&systime, &coalescer->deadline, <))
+			coalescer_send(coalescer, coalescer->buffer_len, 0, &done);
+		usbi_mutex_unlock(&coalescer->lock);
+	}
+	usbi_mutex_unlock(&ctx->coalescers_lock);
+
+	complete_transfer_list(&done);
+}
+
+/* the earliest time by which a coalescer buffer must be sent, left cleared
+ * if there is none */
+static void get_coalescer_deadline(struct libusb_context *ctx,
+	struct timeval *deadline)
+{
+	struct libusb_bulk_coalescer *coalescer;
+
+	timerclear(deadline);
+	if (!__atomic_load_n(&ctx->num_coalescers, __ATOMIC_ACQUIRE))
+		return;
+
+	usbi_mutex_lock(&ctx->coalescers_lock);
+	list_for_each_entry(coalescer, &ctx->coalescers, list, struct libusb_bulk_coalescer) {
+		usbi_mutex_lock(&coalescer->lock);
+		if (timerisset(&coalescer->deadline) && (!timerisset(deadline) ||
+		    timercmp(&coalescer->deadline, deadline, <)))
+			*deadline = coalescer->deadline;
+		usbi_mutex_unlock(&coalescer->lock);
+	}
+	usbi_mutex_unlock(&ctx->coalescers_lock);
+}
+
+/** \ingroup libusb_asyncio
+ * Allocate a write coalescer for a bulk OUT endpoint. Writes queued with
+ * libusb_submit_coalesced_transfer() are copied into a buffer and sent
+ * together, trading some latency for far fewer transfers when an
+ * application writes many small pieces of data.
+ *
+ * Once the buffer holds max_bytes or more, as many whole packets as it
+ * holds are sent. Otherwise, with a max_delay_us of 0, the buffer is sent
+ * straight away when none of the coalescer's transfers are in flight, and
+ * as soon as they have all completed when some are. With a non-zero
+ * max_delay_us, the buffer is held until that many microseconds after the
+ * oldest byte in it was written. That delay is handled by the event
+ * handling functions; applications running their own event loop must use
+ * libusb_get_next_timeout() for it, even where
+ * libusb_pollfds_handle_timeouts() returns 1.
+ *
+ * \param dev_handle a handle for the device to write to
+ * \param endpoint the address of a bulk OUT endpoint
+ * \param max_bytes the number of buffered bytes at which data is sent
+ * regardless of the delay, rounded up to one packet
+ * \param max_delay_us how long written bytes may be held, in microseconds
+ * \returns a newly allocated coalescer, or NULL on error
+ */
+DEFAULT_VISIBILITY
+struct libusb_bulk_coalescer * LIBUSB_CALL libusb_alloc_bulk_coalescer(
+	libusb_device_handle *dev_handle, unsigned char endpoint, int max_bytes,
+	unsigned int max_delay_us)
+{
+	struct libusb_context *ctx = HANDLE_CTX(dev_handle);
+	struct libusb_bulk_coalescer *coalescer;
+	int max_packet_size;
+
+	if ((endpoint & LIBUSB_ENDPOINT_IN) || max_bytes < 1)
+		return NULL;
+
+	max_packet_size = libusb_get_max_packet_size(dev_handle->dev, endpoint);
+	if (max_packet_size <= 0)
+		return NULL;
+	if (max_bytes < max_packet_size)
+		max_bytes = max_packet_size;
+
+	coalescer = calloc(1, sizeof(*coalescer));
+	if (!coalescer)
+		return NULL;
+
+	coalescer->buffer = malloc((size_t)max_bytes);
+	if (!coalescer->buffer) {
+		free(coalescer);
+		return NULL;
+	}
+
+	usbi_mutex_init(&coalescer->lock);
+	list_init(&coalescer->writes);
+	list_init(&coalescer->flushes);
+	coalescer->ctx = ctx;
+	coalescer->dev_handle = dev_handle;
+	coalescer->endpoint = endpoint;
+	coalescer->max_packet_size = max_packet_size;
+	coalescer->max_bytes = max_bytes;
+	coalescer->max_delay_us = max_delay_us;
+	coalescer->buffer_size = max_bytes;
+
+	if (max_delay_us) {
+		usbi_mutex_lock(&ctx->coalescers_lock);
+		list_add_tail(&coalescer->list, &ctx->coalescers);
+		__atomic_add_fetch(&ctx->num_coalescers, 1, __ATOMIC_RELEASE);
+		usbi_mutex_unlock(&ctx->coalescers_lock);
+	}
+
+	return coalescer;
+}
+
+/** \ingroup libusb_asyncio
+ * Free a write coalescer. It is legal to call this function with NULL. Any
+ * buffered bytes are dropped without being sent, so flush the coalescer and
+ * wait for the callbacks of all its writes before freeing it.
+ *
+ * \param coalescer the coalescer to free
+ */
+void API_EXPORTED libusb_free_bulk_coalescer(
+	struct libusb_bulk_coalescer *coalescer)
+{
+	if (!coalescer)
+		return;
+
+	if (coalescer->max_delay_us) {
+		usbi_mutex_lock(&coalescer->ctx->coalescers_lock);
+		list_del(&coalescer->list);
+		__atomic_sub_fetch(&coalescer->ctx->num_coalescers, 1, __ATOMIC_RELEASE);
+		usbi_mutex_unlock(&coalescer->ctx->coalescers_lock);
+	}
+
+	usbi_mutex_destroy(&coalescer->lock);
+	free(coalescer->buffer);
+	free(coalescer);
+}
+
+/** \ingroup libusb_asyncio
+ * Queue a write on a coalescer instead of submitting it. The transfer is
+ * filled in as for libusb_submit_transfer(), as a bulk transfer to the
+ * endpoint and device of the coalescer, and its data is copied before this
+ * function returns.
+ *
+ * The callback of the transfer is invoked once all of its bytes have been
+ * sent, or have failed to be, with writes completing in the order they were
+ * queued. A write whose bytes all went out reads
+ * \ref LIBUSB_TRANSFER_COMPLETED, otherwise it reads the status of the first
+ * transfer that failed to carry some of them; its
+ * \ref libusb_transfer::actual_length "actual_length" counts the bytes that
+ * were sent. The timeout of the transfers that are sent is the smallest
+ * non-zero timeout of the writes they carry.
+ *
+ * A write flagged with \ref LIBUSB_TRANSFER_ADD_ZERO_PACKET flushes the
+ * coalescer, and the transfer carrying it ends with a zero length packet if
+ * it is a multiple of the packet size. The transfer may not be submitted
+ * again, or cancelled, until its callback has been invoked.
+ *
+ * \param coalescer the coalescer to write to
+ * \param transfer the write to queue
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if the transfer does not match the
+ * coalescer or has no data
+ * \returns another LIBUSB_ERROR code on other failure, in which case the
+ * write was not queued. When this is because a transfer of the coalescer
+ * could not be submitted, the writes queued before it whose bytes that
+ * transfer carried fail too; their callbacks are invoked by the event
+ * handling functions, never from within this function.
+ */
+int API_EXPORTED libusb_submit_coalesced_transfer(
+	struct libusb_bulk_coalescer *coalescer, struct libusb_transfer *transfer)
+{
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+	struct libusb_context *ctx = coalescer->ctx;
+	struct timespec systime_ts;
+	struct timeval deadline, delay;
+	struct list_head done;
+	unsigned char *buffer;
+	unsigned int timeout;
+	int size, buffer_len, wake = 0, r = 0;
+
+	if (transfer->dev_handle != coalescer->dev_handle ||
+	    transfer->endpoint != coalescer->endpoint ||
+	    transfer->type != LIBUSB_TRANSFER_TYPE_BULK ||
+	    transfer->length < 1 || !transfer->buffer)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	list_init(&done);
+	usbi_mutex_lock(&coalescer->lock);
+	if (transfer->length > coalescer->buffer_size - coalescer->buffer_len) {
+		size = coalescer->buffer_size;
+		while (size < coalescer->buffer_len + transfer->length)
+			size *= 2;
+		buffer = realloc(coalescer->buffer, (size_t)size);
+		if (!buffer) {
+			r = LIBUSB_ERROR_NO_MEM;
+			goto out;
+		}
+		coalescer->buffer = buffer;
+		coalescer->buffer_size = size;
+	}
+
+	memcpy(coalescer->buffer + coalescer->buffer_len, transfer->buffer,
+		(size_t)transfer->length);
+	deadline = coalescer->deadline;
+	timeout = coalescer->timeout;
+	if (!coalescer->buffer_len && coalescer->max_delay_us) {
+		usbi_backend.clock_gettime(USBI_CLOCK_MONOTONIC, &systime_ts);
+		TIMESPEC_TO_TIMEVAL(&coalescer->deadline, &systime_ts);
+		delay.tv_sec = coalescer->max_delay_us / 1000000;
+		delay.tv_usec = coalescer->max_delay_us % 1000000;
+		timeradd(&coalescer->deadline, &delay, &coalescer->deadline);
+		/* an idle event loop must learn about the new deadline */
+		wake = list_empty(&coalescer->flushes);
+	}
+	coalescer->buffer_len += transfer->length;
+	if (transfer->timeout && (!coalescer->timeout ||
+	    transfer->timeout < coalescer->timeout))
+		coalescer->timeout = transfer->timeout;
+
+	itransfer->transferred = 0;
+	transfer->actual_length = 0;
+	transfer->status = LIBUSB_TRANSFER_COMPLETED;
+	list_add_tail(&itransfer->list, &coalescer->writes);
+
+	buffer_len = coalescer->buffer_len;
+	if (transfer->flags & LIBUSB_TRANSFER_ADD_ZERO_PACKET)
+		r = coalescer_send(coalescer, coalescer->buffer_len,
+			LIBUSB_TRANSFER_ADD_ZERO_PACKET, &done);
+	else if (coalescer->buffer_len >= coalescer->max_bytes)
+		r = coalescer_send(coalescer, coalescer->buffer_len -
+			coalescer->buffer_len % coalescer->max_packet_size, 0, &done);
+	else if (!coalescer->max_delay_us && list_empty(&coalescer->flushes))
+		r = coalescer_send(coalescer, coalescer->buffer_len, 0, &done);
+
+	if (r < 0 && coalescer->buffer_len == buffer_len) {
+		/* the buffer is untouched, so take the write back out */
+		list_del(&itransfer->list);
+		coalescer->buffer_len -= transfer->length;
+		coalescer->deadline = deadline;
+		coalescer->timeout = timeout;
+		wake = 0;
+	} else if (r < 0) {
+		/* the submission failed, which is reported for this write by the
+		 * return value alone. Its bytes still buffered are last in the
+		 * buffer, so they go with it. */
+		list_del(&itransfer->list);
+		coalescer->buffer_len -= transfer->length - itransfer->transferred;
+		if (!coalescer->buffer_len) {
+			coalescer->timeout = 0;
+			timerclear(&coalescer->deadline);
+		}
+		wake = 0;
+	}
+
+out:
+	usbi_mutex_unlock(&coalescer->lock);
+
+	if (wake)
+		signal_coalescer_deadline(ctx);
+	defer_transfer_list(ctx, &done);
+	return r;
+}
+
+/** \ingroup libusb_asyncio
+ * Send the bytes buffered by a write coalescer straight away.
+ *
+ * \param coalescer the coalescer to flush
+ * \returns 0 on success, including when nothing was buffered
+ * \returns LIBUSB_ERROR_NO_MEM on memory allocation failure, in which case
+ * the bytes stay buffered
+ * \returns another LIBUSB_ERROR code if the transfer carrying the bytes could
+ * not be submitted, in which case the writes they belong to fail, with
+ * their callbacks invoked by the event handling functions
+ */
+int API_EXPORTED libusb_flush_bulk_coalescer(
+	struct libusb_bulk_coalescer *coalescer)
+{
+	struct list_head done;
+	int r = 0;
+
+	list_init(&done);
+	usbi_mutex_lock(&coalescer->lock);
+	if (coalescer->buffer_len)
+		r = coalescer_send(coalescer, coalescer->buffer_len, 0, &done);
+	usbi_mutex_unlock(&coalescer->lock);
+
+	defer_transfer_list(coalescer->ctx, &done);
+	return r;
+}
+
+/* A stream scheduler hands out the streams it allocated to requests, each a
+ * group of transfers sharing one stream. Streams with room for another
+ * request wait in a ring, once for every request they can take, and go
+ * back at its tail when a request on them completes, so that consecutive
+ * requests are spread over the streams. Requests that find no room wait in
+ * a queue per class. While in flight, the transfers of a request carry the
+ * callback of the scheduler, and get their own back before it is invoked. */
+struct libusb_stream_scheduler {
+	libusb_device_handle *dev_handle;
+	unsigned char *endpoints;
+	int num_endpoints;
+	int num_classes;
+	enum libusb_stream_scheduler_policy policy;
+
+	usbi_mutex_t lock;
+	uint32_t *free_streams;
+	int ring_size;
+	int ring_head;
+	int num_free;
+	int next_class;
+	struct list_head *queues;
+	struct list_head active;
+};
+
+struct usbi_stream_request {
+	struct list_head list;
+	struct libusb_stream_scheduler *scheduler;
+	uint32_t stream_id;
+	int remaining;
+	int num_transfers;
+	struct {
+		struct libusb_transfer *transfer;
+		libusb_transfer_cb_fn callback;
+		unsigned char type;
+		uint32_t stream_id;
+	} slots[ZERO_SIZED_ARRAY];
+};
+
+static void LIBUSB_CALL stream_transfer_cb(struct libusb_transfer *transfer);
+
+static void stream_put(struct libusb_stream_scheduler *scheduler,
+	uint32_t stream_id)
+{
+	scheduler->free_streams[(scheduler->ring_head + scheduler->num_free) %
+		scheduler->ring_size] = stream_id;
+	scheduler->num_free++;
+}
+
+static uint32_t stream_take(struct libusb_stream_scheduler *scheduler)
+{
+	uint32_t stream_id = scheduler->free_streams[scheduler->ring_head];
+
+	scheduler->ring_head = (scheduler->ring_head + 1) % scheduler->ring_size;
+	scheduler->num_free--;
+	return stream_id;
+}
+
+/* give a transfer of a request its callback back, failing it with status
+ * if it is not going to be sent */
+static void stream_detach(struct usbi_stream_request *request, int slot,
+	enum libusb_transfer_status status, struct list_head *failed)
+{
+	struct libusb_transfer *transfer = request->slots[slot].transfer;
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+
+	transfer->callback = request->slots[slot].callback;
+	itransfer->stream_request = NULL;
+	if (!failed)
+		return;
+
+	transfer->status = status;
+	transfer->actual_length = 0;
+	list_add_tail(&itransfer->list, failed);
+}
+
+/* submit the transfers of a request on the next free stream; with the
+ * scheduler lock held. When the first one cannot be submitted and undo is
+ * set, the request and its transfers are left as they were and the error
+ * returned. Otherwise the transfers that could not be submitted are failed,
+ * and those already in flight cancelled. */
+static int stream_request_start(struct libusb_stream_scheduler *scheduler,
+	struct usbi_stream_request *request, int undo, struct list_head *failed)
+{
+	struct libusb_transfer *transfer;
+	enum libusb_transfer_status status;
+	int i, j, r = 0;
+
+	request->stream_id = stream_take(scheduler);
+	request->remaining = request->num_transfers;
+	list_add_tail(&request->list, &scheduler->active);
+
+	for (i = 0; i < request->num_transfers; i++) {
+		transfer = request->slots[i].transfer;
+		transfer->type = LIBUSB_TRANSFER_TYPE_BULK_STREAM;
+		libusb_transfer_set_stream_id(transfer, request->stream_id);
+		transfer->callback = stream_transfer_cb;
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer)->stream_request = request;
+		r = libusb_submit_transfer(transfer);
+		if (r < 0)
+			break;
+	}
+	if (!r)
+		return 0;
+
+	usbi_dbg("stream %u request failed to submit: %d",
+		(unsigned)request->stream_id, r);
+	if (!i && undo) {
+		transfer = request->slots[0].transfer;
+		stream_detach(request, 0, LIBUSB_TRANSFER_ERROR, NULL);
+		transfer->type = request->slots[0].type;
+		libusb_transfer_set_stream_id(transfer, request->slots[0].stream_id);
+		list_del(&request->list);
+		stream_put(scheduler, request->stream_id);
+		return r;
+	}
+
+	status = r == LIBUSB_ERROR_NO_DEVICE ?
+		LIBUSB_TRANSFER_NO_DEVICE : LIBUSB_TRANSFER_ERROR;
+	for (j = 0; j < i; j++)
+		libusb_cancel_transfer(request->slots[j].transfer);
+	for (j = i; j < request->num_transfers; j++)
+		stream_detach(request, j, status, failed);
+
+	request->remaining = i;
+	if (!request->remaining) {
+		list_del(&request->list);
+		stream_put(scheduler, request->stream_id);
+		free(request);
+	}
+	return 0;
+}
+
+/* start waiting requests while there are free streams; with the scheduler
+ * lock held */
+static void stream_scheduler_run(struct libusb_stream_scheduler *scheduler,
+	struct list_head *failed)
+{
+	struct usbi_stream_request *request;
+	int i, request_class;
+
+	while (scheduler->num_free) {
+		request = NULL;
+		for (i = 0; i < scheduler->num_classes && !request; i++) {
+			if (scheduler->policy == LIBUSB_STREAM_SCHEDULER_PRIORITY)
+				request_class = i;
+			else
+				request_class = (scheduler->next_class + i) %
+					scheduler->num_classes;
+			if (list_empty(&scheduler->queues[request_class]))
+				continue;
+
+			request = list_first_entry(&scheduler->queues[request_class],
+				struct usbi_stream_request, list);
+			list_del(&request->list);
+			scheduler->next_class = (request_class + 1) %
+				scheduler->num_classes;
+		}
+		if (!request)
+			break;
+
+		stream_request_start(scheduler, request, 0, failed);
+	}
+}
+
+static void LIBUSB_CALL stream_transfer_cb(struct libusb_transfer *transfer)
+{
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+	struct usbi_stream_request *request = itransfer->stream_request;
+	struct libusb_stream_scheduler *scheduler = request->scheduler;
+	struct list_head failed;
+	int slot;
+
+	list_init(&failed);
+	usbi_mutex_lock(&scheduler->lock);
+	for (slot = 0; request->slots[slot].transfer != transfer; slot++)
+		;
+	stream_detach(request, slot, LIBUSB_TRANSFER_COMPLETED, NULL);
+
+	if (!--request->remaining) {
+		list_del(&request->list);
+		stream_put(scheduler, request->stream_id);
+		free(request);
+		stream_scheduler_run(scheduler, &failed);
+	}
+	usbi_mutex_unlock(&scheduler->lock);
+
+	complete_transfer_list(&failed);
+	if (transfer->callback)
+		transfer->callback(transfer);
+}
+
+/** \ingroup libusb_asyncio
+ * Allocate a scheduler for the bulk streams of a set of endpoints, such as
+ * the data and status pipes of a UAS device. It allocates the streams with
+ * libusb_alloc_streams() and hands them out to the requests submitted to
+ * it with libusb_submit_stream_request(), so that many requests can be in
+ * flight without the application keeping track of stream ids.
+ *
+ * Each stream takes up to stream_depth requests at a time; use 1 where a
+ * stream id identifies a command, as with UAS tags. Requests that find no
+ * stream free wait in the queue of their class, and are started as streams
+ * become free according to policy, see
+ * \ref libusb_stream_scheduler_policy.
+ *
+ * The device may grant fewer streams than were asked for, in which case
+ * the scheduler makes do with those.
+ *
+ * \param dev_handle a device handle
+ * \param endpoints array of the bulk endpoints to allocate streams on
+ * \param num_endpoints length of the endpoints array
+ * \param num_streams number of streams to allocate
+ * \param stream_depth number of requests each stream can take at a time
+ * \param num_classes number of request classes
+ * \param policy how to pick the class of the next request to start
+ * \returns a newly allocated scheduler, or NULL on error, including when
+ * the device does not support bulk streams
+ */
+DEFAULT_VISIBILITY
+struct libusb_stream_scheduler * LIBUSB_CALL libusb_alloc_stream_scheduler(
+	libusb_device_handle *dev_handle, unsigned char *endpoints,
+	int num_endpoints, uint32_t num_streams, int stream_depth,
+	int num_classes, enum libusb_stream_scheduler_policy policy)
+{
+	struct libusb_stream_scheduler *scheduler;
+	uint32_t stream_id;
+	int i, r;
+
+	if (num_endpoints < 1 || !num_streams || stream_depth < 1 ||
+	    num_classes < 1)
+		return NULL;
+
+	r = libusb_alloc_streams(dev_handle, num_streams, endpoints, num_endpoints);
+	if (r <= 0) {
+		usbi_dbg("failed to allocate %u streams: %d", (unsigned)num_streams, r);
+		return NULL;
+	}
+	if (r > INT_MAX / stream_depth)
+		goto err_free_streams;
+
+	scheduler = calloc(1, sizeof(*scheduler));
+	if (!scheduler)
+		goto err_free_streams;
+
+	scheduler->ring_size = r * stream_depth;
+	scheduler->endpoints = malloc((size_t)num_endpoints);
+	scheduler->free_streams = malloc((size_t)scheduler->ring_size *
+		sizeof(*scheduler->free_streams));
+	scheduler->queues = malloc((size_t)num_classes *
+		sizeof(*scheduler->queues));
+	if (!scheduler->endpoints || !scheduler->free_streams ||
+	    !scheduler->queues)
+		goto err_free_scheduler;
+
+	usbi_mutex_init(&scheduler->lock);
+	list_init(&scheduler->active);
+	for (i = 0; i < num_classes; i++)
+		list_init(&scheduler->queues[i]);
+	memcpy(scheduler->endpoints, endpoints, (size_t)num_endpoints);
+	scheduler->dev_handle = dev_handle;
+	scheduler->num_endpoints = num_endpoints;
+	scheduler->num_classes = num_classes;
+	scheduler->policy = policy;
+	for (i = 0; i < stream_depth; i++) {
+		for (stream_id = 1; stream_id <= (uint32_t)r; stream_id++)
+			stream_put(scheduler, stream_id);
+	}
+
+	return scheduler;
+
+err_free_scheduler:
+	free(scheduler->endpoints);
+	free(scheduler->free_streams);
+	free(scheduler->queues);
+	free(scheduler);
+err_free_streams:
+	libusb_free_streams(dev_handle, endpoints, num_endpoints);
+	return NULL;
+}
+
+/** \ingroup libusb_asyncio
+ * Free a stream scheduler and the streams it allocated. It is legal to call
+ * this function with NULL, but not with a scheduler that still has
+ * requests waiting or in flight; use libusb_cancel_stream_scheduler() and
+ * wait for the callbacks first.
+ *
+ * \param scheduler the scheduler to free
+ */
+void API_EXPORTED libusb_free_stream_scheduler(
+	struct libusb_stream_scheduler *scheduler)
+{
+	if (!scheduler)
+		return;
+
+	libusb_free_streams(scheduler->dev_handle, scheduler->endpoints,
+		scheduler->num_endpoints);
+	usbi_mutex_destroy(&scheduler->lock);
+	free(scheduler->endpoints);
+	free(scheduler->free_streams);
+	free(scheduler->queues);
+	free(scheduler);
+}
+
+/** \ingroup libusb_asyncio
+ * Submit a request to a stream scheduler. The transfers of the request are
+ * filled in as bulk transfers to endpoints of the scheduler, and are sent
+ * on the same stream, as soon as the scheduler has one free. Their type and
+ * stream id are set by the scheduler.
+ *
+ * The callback of each transfer is invoked as usual once it completes, and
+ * the stream of the request is free again once they all have. A request
+ * whose transfers cannot all be submitted when it is started has the ones
+ * already in flight cancelled, and the others completed with
+ * \ref LIBUSB_TRANSFER_ERROR or \ref LIBUSB_TRANSFER_NO_DEVICE; their
+ * callbacks are invoked by the event handling functions, never from within
+ * this function. The transfers may not be submitted again until their
+ * callback has been invoked; while a request waits for a stream, they can
+ * only be cancelled through libusb_cancel_stream_scheduler().
+ *
+ * \param scheduler the scheduler to submit to
+ * \param transfers array of the transfers of the request
+ * \param num_transfers length of the transfers array
+ * \param request_class class of the request, below the number of classes
+ * of the scheduler
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if a transfer does not match the
+ * scheduler or the class is out of range
+ * \returns another LIBUSB_ERROR code on other failure, in which case the
+ * request was not submitted and its transfers are left unchanged
+ */
+int API_EXPORTED libusb_submit_stream_request(
+	struct libusb_stream_scheduler *scheduler,
+	struct libusb_transfer **transfers, int num_transfers, int request_class)
+{
+	struct usbi_stream_request *request;
+	struct libusb_transfer *transfer;
+	struct list_head failed;
+	int i, j, r = 0;
+
+	if (num_transfers < 1 || request_class < 0 ||
+	    request_class >= scheduler->num_classes)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	for (i = 0; i < num_transfers; i++) {
+		transfer = transfers[i];
+		if (transfer->dev_handle != scheduler->dev_handle ||
+		    (transfer->type != LIBUSB_TRANSFER_TYPE_BULK &&
+		     transfer->type != LIBUSB_TRANSFER_TYPE_BULK_STREAM))
+			return LIBUSB_ERROR_INVALID_PARAM;
+		for (j = 0; j < scheduler->num_endpoints; j++) {
+			if (transfer->endpoint == scheduler->endpoints[j])
+				break;
+		}
+		if (j == scheduler->num_endpoints)
+			return LIBUSB_ERROR_INVALID_PARAM;
+	}
+
+	request = malloc(sizeof(*request) +
+		(size_t)num_transfers * sizeof(request->slots[0]));
+	if (!request)
+		return LIBUSB_ERROR_NO_MEM;
+
+	request->scheduler = scheduler;
+	request->num_transfers = num_transfers;
+	for (i = 0; i < num_transfers; i++) {
+		request->slots[i].transfer = transfers[i];
+		request->slots[i].callback = transfers[i]->callback;
+		request->slots[i].type = transfers[i]->type;
+		request->slots[i].stream_id =
+			libusb_transfer_get_stream_id(transfers[i]);
+	}
+
+	list_init(&failed);
+	usbi_mutex_lock(&scheduler->lock);
+	if (scheduler->num_free) {
+		r = stream_request_start(scheduler, request, 1, &failed);
+		if (r < 0)
+			free(request);
+	} else {
+		list_add_tail(&request->list, &scheduler->queues[request_class]);
+	}
+	usbi_mutex_unlock(&scheduler->lock);
+
+	defer_transfer_list(HANDLE_CTX(scheduler->dev_handle), &failed);
+	return r;
+}
+
+/** \ingroup libusb_asyncio
+ * Cancel the requests of a stream scheduler. Waiting requests are dropped,
+ * with their transfers completing with \ref LIBUSB_TRANSFER_CANCELLED
+ * before this function returns, and the transfers in flight are cancelled.
+ * Requests submitted afterwards are handled as usual.
+ *
+ * \param scheduler the scheduler to cancel the requests of
+ */
+void API_EXPORTED libusb_cancel_stream_scheduler(
+	struct libusb_stream_scheduler *scheduler)
+{
+	struct usbi_stream_request *request, *tmp;
+	struct libusb_transfer *transfer;
+	struct list_head cancelled;
+	int i, j;
+
+	list_init(&cancelled);
+	usbi_mutex_lock(&scheduler->lock);
+	for (i = 0; i < scheduler->num_classes; i++) {
+		list_for_each_entry_safe(request, tmp, &scheduler->queues[i], list,
+				struct usbi_stream_request) {
+			list_del(&request->list);
+			for (j = 0; j < request->num_transfers; j++)
+				stream_detach(request, j, LIBUSB_TRANSFER_CANCELLED,
+					&cancelled);
+			free(request);
+		}
+	}
+
+	list_for_each_entry(request, &scheduler->active, list,
+			struct usbi_stream_request) {
+		for (j = 0; j < request->num_transfers; j++) {
+			transfer = request->slots[j].transfer;
+			if (LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer)->stream_request == request)
+				libusb_cancel_transfer(transfer);
+		}
+	}
+	usbi_mutex_unlock(&scheduler->lock);
+
+	complete_transfer_list(&cancelled);
+}
+
+/* run the callback of a completed transfer and drop the device reference
+ * the transfer held. dev is passed in as transfer->dev_handle may already
+ * have been closed when this runs on a callback worker thread */
+static void invoke_transfer_callback(struct usbi_transfer *itransfer,
+	struct libusb_device *dev)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	uint8_t flags = transfer->flags;
+
+	if ((itransfer->stats_flags & USBI_TRANSFER_STATS_COMPLETED) &&
+	    ITRANSFER_CTX(itransfer)->endpoint_stats)
+		stats_callback_invoked(itransfer);
+
+	usbi_dbg("transfer %p has callback %p", transfer, transfer->callback);
+	if (transfer->callback)
+		transfer->callback(transfer);
+	/* transfer might have been freed by the above call, do not use from
+	 * this point. */
+	if (flags & LIBUSB_TRANSFER_FREE_TRANSFER)
+		libusb_free_transfer(transfer);
+	libusb_unref_device(dev);
+}
+
+#if defined(THREADS_POSIX)
+/* A worker thread running transfer callbacks on behalf of the event thread.
+ * Callbacks for a given endpoint always go to the same worker, which runs them
+ * in the order the transfers completed. */
+struct usbi_callback_worker {
+	struct libusb_context *ctx;
+	pthread_t thread;
+	usbi_mutex_t lock;
+	usbi_cond_t cond;
+	struct list_head queue;
+	int stop;
+};
+
+struct usbi_event_thread {
+	pthread_t thread;
+	int started;
+	int stop;
+	int num_workers;
+	struct usbi_callback_worker workers[ZERO_SIZED_ARRAY];
+};
+
+static void wake_event_waiters(struct libusb_context *ctx, int pass_handling);
+
+static int dispatch_transfer_callback(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct usbi_event_thread *et = ITRANSFER_CTX(itransfer)->event_thread;
+	struct usbi_callback_worker *worker;
+	uintptr_t key;
+
+	if (!et || !et->num_workers)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	key = (uintptr_t)transfer->dev_handle ^ transfer->endpoint;
+	worker = &et->workers[(key ^ (key >> 7)) % et->num_workers];
+
+	/* the handle may be closed once the transfer has left the flying list,
+	 * keep hold of the device while the callback is queued */
+	itransfer->dispatch_dev = transfer->dev_handle->dev;
+
+	usbi_mutex_lock(&worker->lock);
+	list_add_tail(&itransfer->dispatch_list, &worker->queue);
+	usbi_cond_broadcast(&worker->cond);
+	usbi_mutex_unlock(&worker->lock);
+
+	return 0;
+}
+
+/* Let any thread waiting on a transfer's completion know that a callback ran
+ * outside of event handling. That includes a thread waiting in poll() while
+ * handling events itself. */
+void usbi_notify_callbacks_delivered(struct libusb_context *ctx)
+{
+	usbi_mutex_lock(&ctx->event_waiters_lock);
+	wake_event_waiters(ctx, 0);
+	usbi_cond_broadcast(&ctx->event_waiters_cond);
+	usbi_mutex_unlock(&ctx->event_waiters_lock);
+
+	usbi_mutex_lock(&ctx->event_data_lock);
+	if (!usbi_pending_events(ctx))
+		usbi_signal_event(ctx);
+	ctx->event_flags |= USBI_EVENT_CALLBACK_DELIVERED;
+	usbi_mutex_unlock(&ctx->event_data_lock);
+}
+
+static void *callback_worker_main(void *arg)
+{
+	struct usbi_callback_worker *worker = arg;
+	struct libusb_context *ctx = worker->ctx;
+	struct usbi_transfer *itransfer;
+
+	usbi_mutex_lock(&worker->lock);
+	for (;;) {
+		while (list_empty(&worker->queue) && !worker->stop)
+			usbi_cond_wait(&worker->cond, &worker->lock);
+
+		/* only exit once everything queued has been delivered */
+		if (list_empty(&worker->queue))
+			break;
+
+		itransfer = list_first_entry(&worker->queue, struct usbi_transfer,
+			dispatch_list);
+		list_del(&itransfer->dispatch_list);
+		usbi_mutex_unlock(&worker->lock);
+
+		invoke_transfer_callback(itransfer, itransfer->dispatch_dev);
+		usbi_notify_callbacks_delivered(ctx);
+
+		usbi_mutex_lock(&worker->lock);
+	}
+	usbi_mutex_unlock(&worker->lock);
+
+	return NULL;
+}
+
+static void *event_thread_main(void *arg)
+{
+	struct libusb_context *ctx = arg;
+	struct usbi_event_thread *et = ctx->event_thread;
+	struct timeval tv = { 60, 0 };
+	int r;
+
+	usbi_dbg("event thread for context %p entering", ctx);
+
+	for (;;) {
+		usbi_mutex_lock(&ctx->event_waiters_lock);
+		r = et->stop;
+		usbi_mutex_unlock(&ctx->event_waiters_lock);
+		if (r)
+			break;
+
+		r = libusb_handle_events_timeout_completed(ctx, &tv, &et->stop);
+		if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED)
+			usbi_err(ctx, "event handling failed: %s", libusb_error_name(r));
+	}
+
+	usbi_dbg("event thread for context %p exiting", ctx);
+
+	return NULL;
+}
+
+static int apply_event_thread_affinity(struct libusb_context *ctx)
+{
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+	cpu_set_t cpus;
+	int r;
+
+	CPU_ZERO(&cpus);
+	if (ctx->event_thread_cpu < 0) {
+		int i;
+		for (i = 0; i < CPU_SETSIZE; i++)
+			CPU_SET(i, &cpus);
+	} else {
+		CPU_SET(ctx->event_thread_cpu, &cpus);
+	}
+
+	r = pthread_setaffinity_np(ctx->event_thread->thread, sizeof(cpus), &cpus);
+	if (r) {
+		usbi_err(ctx, "failed to set event thread affinity (%d)", r);
+		return LIBUSB_ERROR_OTHER;
+	}
+
+	return LIBUSB_SUCCESS;
+#else
+	UNUSED(ctx);
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+static int apply_event_thread_priority(struct libusb_context *ctx)
+{
+	struct sched_param param;
+	int policy = ctx->event_thread_priority ? SCHED_FIFO : SCHED_OTHER;
+	int r;
+
+	memset(&param, 0, sizeof(param));
+	param.sched_priority = ctx->event_thread_priority;
+
+	r = pthread_setschedparam(ctx->event_thread->thread, policy, &param);
+	if (r) {
+		usbi_err(ctx, "failed to set event thread priority (%d)", r);
+		return r == EPERM ? LIBUSB_ERROR_ACCESS : LIBUSB_ERROR_OTHER;
+	}
+
+	return LIBUSB_SUCCESS;
+}
+
+static void stop_callback_workers(struct usbi_event_thread *et, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		struct usbi_callback_worker *worker = &et->workers[i];
+
+		usbi_mutex_lock(&worker->lock);
+		worker->stop = 1;
+		usbi_cond_broadcast(&worker->cond);
+		usbi_mutex_unlock(&worker->lock);
+
+		pthread_join(worker->thread, NULL);
+		usbi_cond_destroy(&worker->cond);
+		usbi_mutex_destroy(&worker->lock);
+	}
+}
+
+int usbi_start_event_thread(struct libusb_context *ctx, int num_workers)
+{
+	struct usbi_event_thread *et;
+	int i, r;
+
+	if (num_workers < 0 || num_workers > USBI_MAX_CALLBACK_WORKERS)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	if (ctx->event_thread)
+		return LIBUSB_ERROR_BUSY;
+
+	et = calloc(1, sizeof(*et) + num_workers * sizeof(et->workers[0]));
+	if (!et)
+		return LIBUSB_ERROR_NO_MEM;
+
+	for (i = 0; i < num_workers; i++) {
+		struct usbi_callback_worker *worker = &et->workers[i];
+
+		worker->ctx = ctx;
+		usbi_mutex_init(&worker->lock);
+		usbi_cond_init(&worker->cond);
+		list_init(&worker->queue);
+
+		r = pthread_create(&worker->thread, NULL, callback_worker_main, worker);
+		if (r) {
+			usbi_err(ctx, "failed to create callback worker (%d)", r);
+			usbi_cond_destroy(&worker->cond);
+			usbi_mutex_destroy(&worker->lock);
+			stop_callback_workers(et, i);
+			free(et);
+			return LIBUSB_ERROR_OTHER;
+		}
+	}
+	et->num_workers = num_workers;
+	ctx->event_thread = et;
+
+	r = pthread_create(&et->thread, NULL, event_thread_main, ctx);
+	if (r) {
+		usbi_err(ctx, "failed to create event thread (%d)", r);
+		ctx->event_thread = NULL;
+		stop_callback_workers(et, num_workers);
+		free(et);
+		return LIBUSB_ERROR_OTHER;
+	}
+	et->started = 1;
+
+	/* scheduling failures are reported but leave the thread running */
+	if (ctx->event_thread_cpu >= 0)
+		apply_event_thread_affinity(ctx);
+	if (ctx->event_thread_priority)
+		apply_event_thread_priority(ctx);
+
+	usbi_dbg("started event thread with %d callback workers", num_workers);
+	return LIBUSB_SUCCESS;
+}
+
+void usbi_stop_event_thread(struct libusb_context *ctx)
+{
+	struct usbi_event_thread *et = ctx->event_thread;
+
+	if (!et)
+		return;
+
+	usbi_mutex_lock(&ctx->event_waiters_lock);
+	et->stop = 1;
+	usbi_mutex_unlock(&ctx->event_waiters_lock);
+	libusb_interrupt_event_handler(ctx);
+	pthread_join(et->thread, NULL);
+
+	/* deliver whatever is still queued before tearing down the workers */
+	stop_callback_workers(et, et->num_workers);
+
+	ctx->event_thread = NULL;
+	free(et);
+}
+
+int usbi_set_event_thread_affinity(struct libusb_context *ctx, int cpu)
+{
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+	if (cpu < -1 || cpu >= CPU_SETSIZE)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	ctx->event_thread_cpu = cpu;
+	if (ctx->event_thread)
+		return apply_event_thread_affinity(ctx);
+
+	return LIBUSB_SUCCESS;
+#else
+	UNUSED(ctx);
+	UNUSED(cpu);
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+int usbi_set_event_thread_priority(struct libusb_context *ctx, int priority)
+{
+	if (priority < 0 || priority > sched_get_priority_max(SCHED_FIFO))
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	ctx->event_thread_priority = priority;
+	if (ctx->event_thread)
+		return apply_event_thread_priority(ctx);
+
+	return LIBUSB_SUCCESS;
+}
+#else
+static int dispatch_transfer_callback(struct usbi_transfer *itransfer)
+{
+	UNUSED(itransfer);
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+int usbi_start_event_thread(struct libusb_context *ctx, int num_workers)
+{
+	UNUSED(ctx);
+	UNUSED(num_workers);
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+void usbi_stop_event_thread(struct libusb_context *ctx)
+{
+	UNUSED(ctx);
+}
+
+int usbi_set_event_thread_affinity(struct libusb_context *ctx, int cpu)
+{
+	UNUSED(ctx);
+	UNUSED(cpu);
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+int usbi_set_event_thread_priority(struct libusb_context *ctx, int priority)
+{
+	UNUSED(ctx);
+	UNUSED(priority);
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+#endif
+
+/* Handle completion of a transfer (completion might be an error condition).
+ * This will invoke the user-supplied callback function, which may end up
+ * freeing the transfer. Therefore you cannot use the transfer structure
+ * after calling this function, and you should free all backend-specific
+ * data before calling it.
+ * Do not call this function with the usbi_transfer lock held. User-specified
+ * callback functions may attempt to directly resubmit the transfer, which
+ * will attempt to take the lock. */
+int usbi_handle_transfer_completion(struct usbi_transfer *itransfer,
+	enum libusb_transfer_status status)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	int r;
+
+	r = remove_from_flying_list(itransfer);
+	if (r < 0)
+		usbi_err(ITRANSFER_CTX(itransfer), "failed to set timer for next timeout, errno=%d", errno);
+
+	usbi_mutex_lock(&itransfer->lock);
+	itransfer->state_flags &= ~USBI_TRANSFER_IN_FLIGHT;
+	usbi_mutex_unlock(&itransfer->lock);
+
+	if (status == LIBUSB_TRANSFER_COMPLETED
+			&& transfer->flags & LIBUSB_TRANSFER_SHORT_NOT_OK) {
+		int rqlen = transfer->length;
+		if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL)
+			rqlen -= LIBUSB_CONTROL_SETUP_SIZE;
+		if (rqlen != itransfer->transferred) {
+			usbi_dbg("interpreting short transfer as error");
+			status = LIBUSB_TRANSFER_ERROR;
+		}
+	}
+
+	transfer->status = status;
+	transfer->actual_length = itransfer->transferred;
+
+	if (ITRANSFER_CTX(itransfer)->endpoint_stats)
+		stats_transfer_completed(itransfer, status);
+	usbi_trace(ITRANSFER_CTX(itransfer), LIBUSB_TRACE_COMPLETE, transfer,
+		transfer->endpoint, -1, status, (unsigned int)transfer->actual_length);
+	usbi_capture(ITRANSFER_CTX(itransfer), itransfer, 'C', status);
+
+	/* hand the callback to a worker thread if the context has any */
+	if (dispatch_transfer_callback(itransfer) == 0)
+		return r;
+
+	invoke_transfer_callback(itransfer, transfer->dev_handle->dev);
+	return r;
+}
+
+/* Similar to usbi_handle_transfer_completion() but exclusively for transfers
+ * that were asynchronously cancelled. The same concerns w.r.t. freeing of
+ * transfers exist here.
+ * Do not call this function with the usbi_transfer lock held. User-specified
+ * callback functions may attempt to directly resubmit the transfer, which
+ * will attempt to take the lock. */
+int usbi_handle_transfer_cancellation(struct usbi_transfer *transfer)
+{
+	struct libusb_context *ctx = ITRANSFER_CTX(transfer);
+	uint8_t timed_out;
+
+	usbi_mutex_lock(&ctx->flying_transfers_lock);
 	timed_out = transfer->timeout_flags & USBI_TRANSFER_TIMED_OUT;
 	usbi_mutex_unlock(&ctx->flying_transfers_lock);
 
@@ -1706,6 +4682,17 @@ int usbi_handle_transfer_cancellation(struct usbi_transfer *transfer)
 	return usbi_handle_transfer_completion(transfer, LIBUSB_TRANSFER_CANCELLED);
 }
 
+/* Called by a backend that has reaped the last of a transfer's URBs on a
+ * thread of its own but reports the transfer later, outside of its locks.
+ * The transfer is no longer in flight from then on, so that a disconnect
+ * handled meanwhile by usbi_handle_disconnect() leaves it to that thread. */
+void usbi_retire_transfer(struct usbi_transfer *itransfer)
+{
+	usbi_mutex_lock(&itransfer->lock);
+	itransfer->state_flags &= ~USBI_TRANSFER_IN_FLIGHT;
+	usbi_mutex_unlock(&itransfer->lock);
+}
+
 /* Add a completed transfer to the completed_transfers list of the
  * context and signal the event. The backend's handle_transfer_completion()
  * function will be called the next time an event handler runs. */
@@ -1726,6 +4713,72 @@ void usbi_signal_transfer_completion(struct usbi_transfer *transfer)
 	}
 }
 
+/* a thread waiting in libusb_handle_events_timeout_completed() for the thread
+ * that is handling events. see wake_event_waiters() */
+struct usbi_event_waiter {
+	struct list_head list;
+	usbi_cond_t cond;
+	int *completed;
+	int woken;
+};
+
+static void wake_event_waiter(struct usbi_event_waiter *waiter)
+{
+	list_del(&waiter->list);
+	waiter->woken = 1;
+	usbi_cond_broadcast(&waiter->cond);
+}
+
+/* called with the event waiters lock held. rather than waking every waiter,
+ * only wake those whose transfer has completed (or who wait for any event at
+ * all) and, if the events lock has just been released (pass_handling),
+ * exactly one other waiter to take over event handling */
+static void wake_event_waiters(struct libusb_context *ctx, int pass_handling)
+{
+	struct usbi_event_waiter *waiter, *tmp, *next_handler = NULL;
+
+	list_for_each_entry_safe(waiter, tmp, &ctx->event_waiters, list, struct usbi_event_waiter) {
+		if (!waiter->completed || *waiter->completed)
+			wake_event_waiter(waiter);
+		else if (!next_handler)
+			next_handler = waiter;
+	}
+
+	if (pass_handling && next_handler)
+		wake_event_waiter(next_handler);
+}
+
+/* wait, with the event waiters lock held, until wake_event_waiters() picks
+ * this thread. returns 0 when woken, 1 if the timeout expired */
+static int wait_for_event_completed(struct libusb_context *ctx,
+	struct timeval *tv, int *completed)
+{
+	struct usbi_event_waiter waiter;
+	int r = 0;
+
+	waiter.completed = completed;
+	waiter.woken = 0;
+	usbi_cond_init(&waiter.cond);
+	list_add_tail(&waiter.list, &ctx->event_waiters);
+
+	while (!waiter.woken) {
+		r = usbi_cond_timedwait(&waiter.cond, &ctx->event_waiters_lock, tv);
+		if (r)
+			break;
+	}
+
+	if (!waiter.woken)
+		list_del(&waiter.list);
+	usbi_cond_destroy(&waiter.cond);
+
+	if (waiter.woken)
+		return 0;
+	else if (r < 0)
+		return r;
+	else
+		return (r == ETIMEDOUT);
+}
+
 /** \ingroup libusb_poll
  * Attempt to acquire the event handling lock. This lock is used to ensure that
  * only one thread is monitoring libusb event sources at any one time.
@@ -1812,6 +4865,7 @@ void API_EXPORTED libusb_unlock_events(libusb_context *ctx)
 	 * the availability of the events lock when we are modifying pollfds
 	 * (check ctx->device_close)? */
 	usbi_mutex_lock(&ctx->event_waiters_lock);
+	wake_event_waiters(ctx, 1);
 	usbi_cond_broadcast(&ctx->event_waiters_cond);
 	usbi_mutex_unlock(&ctx->event_waiters_lock);
 }
@@ -1996,6 +5050,8 @@ static void handle_timeout(struct usbi_transfer *itransfer)
 	int r;
 
 	itransfer->timeout_flags |= USBI_TRANSFER_TIMEOUT_HANDLED;
+	usbi_trace(TRANSFER_CTX(transfer), LIBUSB_TRACE_TIMEOUT, transfer,
+		transfer->endpoint, -1, 0, (unsigned int)transfer->length);
 	r = libusb_cancel_transfer(transfer);
 	if (r == LIBUSB_SUCCESS)
 		itransfer->timeout_flags |= USBI_TRANSFER_TIMED_OUT;
@@ -2046,6 +5102,50 @@ static int handle_timeouts_locked(struct libusb_context *ctx)
 	return 0;
 }
 
+/* Called by a backend that handles the timeouts of some transfers on a thread
+ * of its own, having set USBI_TRANSFER_OS_HANDLES_TIMEOUT on them. Times out
+ * those of them for which match() returns non-zero and whose timeout has
+ * expired. Returns 1 and the earliest timeout still pending among them in
+ * next_timeout, or 0 if there is none. */
+int usbi_handle_os_timeouts(struct libusb_context *ctx,
+	int (*match)(struct usbi_transfer *itransfer, void *arg), void *arg,
+	struct timeval *next_timeout)
+{
+	struct timespec systime_ts;
+	struct timeval systime;
+	struct usbi_transfer *transfer;
+	int r = 0;
+
+	if (usbi_backend.clock_gettime(USBI_CLOCK_MONOTONIC, &systime_ts) < 0)
+		return 0;
+	TIMESPEC_TO_TIMEVAL(&systime, &systime_ts);
+
+	/* the list is sorted by timeout, so the first unexpired match is the
+	 * next one to expire */
+	usbi_mutex_lock(&ctx->flying_transfers_lock);
+	list_for_each_entry(transfer, &ctx->flying_transfers, list, struct usbi_transfer) {
+		struct timeval *cur_tv = &transfer->timeout;
+
+		if (!timerisset(cur_tv))
+			break;
+
+		if ((transfer->timeout_flags & (USBI_TRANSFER_TIMEOUT_HANDLED | USBI_TRANSFER_OS_HANDLES_TIMEOUT)) !=
+				USBI_TRANSFER_OS_HANDLES_TIMEOUT || !match(transfer, arg))
+			continue;
+
+		if (timercmp(cur_tv, &systime, >)) {
+			*next_timeout = *cur_tv;
+			r = 1;
+			break;
+		}
+
+		handle_timeout(transfer);
+	}
+	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+
+	return r;
+}
+
 static int handle_timeouts(struct libusb_context *ctx)
 {
 	int r;
@@ -2053,6 +5153,7 @@ static int handle_timeouts(struct libusb_context *ctx)
 	usbi_mutex_lock(&ctx->flying_transfers_lock);
 	r = handle_timeouts_locked(ctx);
 	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+	handle_coalescer_deadlines(ctx);
 	return r;
 }
 
@@ -2077,9 +5178,108 @@ out:
 }
 #endif
 
+/* spin on the backend's non-blocking reap for up to the context's busy-poll
+ * budget, bounded by the caller's timeout. returns 1 if any transfer was
+ * reaped, 0 if the budget ran out, having taken the time spent off
+ * timeout_ms, or a LIBUSB_ERROR code on failure */
+static int busy_poll(struct libusb_context *ctx, struct timeval *tv,
+	int *timeout_ms)
+{
+	struct timespec now, start, end;
+	long budget_us = (long)ctx->busy_poll_us;
+	long spent_ms;
+	int r;
+
+	if (tv->tv_sec == 0 && tv->tv_usec < budget_us)
+		budget_us = (long)tv->tv_usec;
+	if (!budget_us)
+		return 0;
+
+	r = usbi_backend.clock_gettime(USBI_CLOCK_MONOTONIC, &start);
+	if (r < 0)
+		return LIBUSB_ERROR_OTHER;
+
+	end = start;
+	end.tv_nsec += budget_us * 1000L;
+	while (end.tv_nsec >= 1000000000) {
+		end.tv_nsec -= 1000000000;
+		end.tv_sec++;
+	}
+
+	do {
+		r = usbi_backend.busy_poll(ctx);
+		if (r > 0) {
+			ctx->busy_poll_hits++;
+			return 1;
+		} else if (r < 0) {
+			return r;
+		}
+
+		usbi_backend.clock_gettime(USBI_CLOCK_MONOTONIC, &now);
+	} while (now.tv_sec < end.tv_sec ||
+		 (now.tv_sec == end.tv_sec && now.tv_nsec < end.tv_nsec));
+
+	spent_ms = (now.tv_sec - start.tv_sec) * 1000L +
+		(now.tv_nsec - start.tv_nsec) / 1000000L;
+	*timeout_ms = spent_ms < *timeout_ms ? *timeout_ms - (int)spent_ms : 0;
+
+	ctx->busy_poll_sleeps++;
+	return 0;
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+#define EPOLL_READY_BATCH	64
+
+/* fill in the revents of fds from the aggregated event fd, without waiting.
+ * only the fds epoll reports as ready are looked at, which saves polling
+ * every open device when few have anything to report. fds that are still
+ * ready beyond the batch size keep the event fd readable and are picked up
+ * on the next call. returns the number of ready fds like poll() */
+static int epoll_ready_fds(struct libusb_context *ctx, struct pollfd *fds,
+	POLL_NFDS_TYPE nfds)
+{
+	struct epoll_event events[EPOLL_READY_BATCH];
+	struct usbi_pollfd *ipollfd;
+	POLL_NFDS_TYPE i;
+	int n, r, num_ready = 0;
+
+	for (i = 0; i < nfds; i++)
+		fds[i].revents = 0;
+
+	/* hold the lock so that no ipollfd is freed while we look at it */
+	usbi_mutex_lock(&ctx->event_data_lock);
+	n = epoll_wait(ctx->epoll_fd, events, EPOLL_READY_BATCH, 0);
+	for (r = 0; r < n; r++) {
+		ipollfd = events[r].data.ptr;
+
+		/* an fd added since fds was built is reported once it has been
+		 * rebuilt, which the event pipe asks for */
+		i = ipollfd->index;
+		if (ipollfd->index < 0 || i >= nfds || fds[i].fd != ipollfd->pollfd.fd)
+			continue;
+
+		if (events[r].events & EPOLLIN)
+			fds[i].revents |= POLLIN;
+		if (events[r].events & EPOLLOUT)
+			fds[i].revents |= POLLOUT;
+		if (events[r].events & EPOLLERR)
+			fds[i].revents |= POLLERR;
+		if (events[r].events & EPOLLHUP)
+			fds[i].revents |= POLLHUP;
+		if (fds[i].revents)
+			num_ready++;
+	}
+	usbi_mutex_unlock(&ctx->event_data_lock);
+
+	return n < 0 ? -1 : num_ready;
+}
+#endif
+
 /* do the actual event handling. assumes that no other thread is concurrently
- * doing the same thing. */
-static int handle_events(struct libusb_context *ctx, struct timeval *tv)
+ * doing the same thing. with ready_only set, only the fds the aggregated
+ * event fd reports as ready are checked and the call never blocks */
+static int handle_events(struct libusb_context *ctx, struct timeval *tv,
+	int ready_only)
 {
 	int r;
 	struct usbi_pollfd *ipollfd;
@@ -2088,6 +5288,7 @@ static int handle_events(struct libusb_context *ctx, struct timeval *tv)
 	struct pollfd *fds = NULL;
 	int i = -1;
 	int timeout_ms;
+	int pollfds_modified = 0;
 
 	/* prevent attempts to recursively handle events (e.g. calling into
 	 * libusb_handle_events() from within a hotplug or transfer callback) */
@@ -2139,12 +5340,14 @@ static int handle_events(struct libusb_context *ctx, struct timeval *tv)
 		list_for_each_entry(ipollfd, &ctx->ipollfds, list, struct usbi_pollfd) {
 			struct libusb_pollfd *pollfd = &ipollfd->pollfd;
 			i++;
+			ipollfd->index = i;
 			ctx->pollfds[i].fd = pollfd->fd;
 			ctx->pollfds[i].events = pollfd->events;
 		}
 
 		/* reset the flag now that we have the updated list */
 		ctx->event_flags &= ~USBI_EVENT_POLLFDS_MODIFIED;
+		pollfds_modified = 1;
 
 		/* if no further pending events, clear the event pipe so that we do
 		 * not immediately return from poll */
@@ -2162,8 +5365,29 @@ static int handle_events(struct libusb_context *ctx, struct timeval *tv)
 	if (tv->tv_usec % 1000)
 		timeout_ms++;
 
+	/* in busy-poll mode, reap completions directly before sleeping. if
+	 * anything completed, only check the other fds without blocking so
+	 * that the completion is returned to the caller straight away */
+	if (ctx->busy_poll_us && usbi_backend.busy_poll) {
+		r = busy_poll(ctx, tv, &timeout_ms);
+		if (r < 0)
+			goto done;
+		else if (r > 0)
+			timeout_ms = 0;
+	}
+
 	usbi_dbg("poll() %d fds with timeout in %dms", nfds, timeout_ms);
-	r = usbi_poll(fds, nfds, timeout_ms);
+#ifdef HAVE_SYS_EPOLL_H
+	/* after the fds changed, check all of them once so that the backend's
+	 * wait_events() learns about the new set */
+	if (ready_only && ctx->epoll_fd >= 0 && !pollfds_modified)
+		r = epoll_ready_fds(ctx, fds, nfds);
+	else
+#endif
+	if (usbi_backend.wait_events)
+		r = usbi_backend.wait_events(ctx, fds, nfds, pollfds_modified, timeout_ms);
+	else
+		r = usbi_poll(fds, nfds, timeout_ms);
 	usbi_dbg("poll() returned %d", r);
 	if (r == 0) {
 		r = handle_timeouts(ctx);
@@ -2180,11 +5404,13 @@ static int handle_events(struct libusb_context *ctx, struct timeval *tv)
 	/* fds[0] is always the event pipe */
 	if (fds[0].revents) {
 		struct list_head hotplug_msgs;
+		struct list_head deferred_transfers;
 		struct usbi_transfer *itransfer;
 		int hotplug_cb_deregistered = 0;
 		int ret = 0;
 
 		list_init(&hotplug_msgs);
+		list_init(&deferred_transfers);
 
 		usbi_dbg("caught a fish on the event pipe");
 
@@ -2200,6 +5426,17 @@ static int handle_events(struct libusb_context *ctx, struct timeval *tv)
 			ctx->event_flags &= ~USBI_EVENT_USER_INTERRUPT;
 		}
 
+		if (ctx->event_flags & USBI_EVENT_CALLBACK_DELIVERED) {
+			usbi_dbg("a callback worker delivered a callback");
+			ctx->event_flags &= ~USBI_EVENT_CALLBACK_DELIVERED;
+		}
+
+		/* the caller computes its next timeout again on return */
+		if (ctx->event_flags & USBI_EVENT_COALESCER_DEADLINE) {
+			usbi_dbg("a write coalescer set a deadline");
+			ctx->event_flags &= ~USBI_EVENT_COALESCER_DEADLINE;
+		}
+
 		if (ctx->event_flags & USBI_EVENT_HOTPLUG_CB_DEREGISTERED) {
 			usbi_dbg("someone unregistered a hotplug cb");
 			ctx->event_flags &= ~USBI_EVENT_HOTPLUG_CB_DEREGISTERED;
@@ -2216,6 +5453,9 @@ static int handle_events(struct libusb_context *ctx, struct timeval *tv)
 			list_cut(&hotplug_msgs, &ctx->hotplug_msgs);
 		}
 
+		/* take the transfers whose callbacks were deferred */
+		list_cut(&deferred_transfers, &ctx->deferred_transfers);
+
 		/* complete any pending transfers */
 		while (ret == 0 && !list_empty(&ctx->completed_transfers)) {
 			itransfer = list_first_entry(&ctx->completed_transfers, struct usbi_transfer, completed_list);
@@ -2251,6 +5491,8 @@ static int handle_events(struct libusb_context *ctx, struct timeval *tv)
 			free(message);
 		}
 
+		complete_transfer_list(&deferred_transfers);
+
 		if (ret) {
 			/* return error code */
 			r = ret;
@@ -2361,7 +5603,7 @@ retry:
 		if (completed == NULL || !*completed) {
 			/* we obtained the event lock: do our own event handling */
 			usbi_dbg("doing our own event handling");
-			r = handle_events(ctx, &poll_timeout);
+			r = handle_events(ctx, &poll_timeout, 0);
 		}
 		libusb_unlock_events(ctx);
 		return r;
@@ -2383,7 +5625,7 @@ retry:
 	}
 
 	usbi_dbg("another thread is doing event handling");
-	r = libusb_wait_for_event(ctx, &poll_timeout);
+	r = wait_for_event_completed(ctx, &poll_timeout, completed);
 
 already_done:
 	libusb_unlock_event_waiters(ctx);
@@ -2493,7 +5735,7 @@ int API_EXPORTED libusb_handle_events_locked(libusb_context *ctx,
 		return handle_timeouts(ctx);
 	}
 
-	return handle_events(ctx, &poll_timeout);
+	return handle_events(ctx, &poll_timeout, 0);
 }
 
 /** \ingroup libusb_poll
@@ -2555,7 +5797,8 @@ int API_EXPORTED libusb_pollfds_handle_timeouts(libusb_context *ctx)
  * A return code of 0 indicates that there are no pending timeouts.
  *
  * On some platforms, this function will always returns 0 (no pending
- * timeouts). See \ref polltime.
+ * timeouts) unless a bulk write coalescer is holding data. See
+ * \ref polltime and libusb_alloc_bulk_coalescer().
  *
  * \param ctx the context to operate on, or NULL for the default context
  * \param tv output location for a relative time against the current
@@ -2573,15 +5816,13 @@ int API_EXPORTED libusb_get_next_timeout(libusb_context *ctx,
 	int r;
 
 	USBI_GET_CONTEXT(ctx);
+
+	/* the delays of write coalescers are not covered by the timerfd */
+	get_coalescer_deadline(ctx, &next_timeout);
 	if (usbi_using_timerfd(ctx))
-		return 0;
+		goto check_timeout;
 
 	usbi_mutex_lock(&ctx->flying_transfers_lock);
-	if (list_empty(&ctx->flying_transfers)) {
-		usbi_mutex_unlock(&ctx->flying_transfers_lock);
-		usbi_dbg("no URBs, no timeout!");
-		return 0;
-	}
 
 	/* find next transfer which hasn't already been processed as timed out */
 	list_for_each_entry(transfer, &ctx->flying_transfers, list, struct usbi_transfer) {
@@ -2592,11 +5833,14 @@ int API_EXPORTED libusb_get_next_timeout(libusb_context *ctx,
 		if (!timerisset(&transfer->timeout))
 			break;
 
-		next_timeout = transfer->timeout;
+		if (!timerisset(&next_timeout) ||
+		    timercmp(&transfer->timeout, &next_timeout, <))
+			next_timeout = transfer->timeout;
 		break;
 	}
 	usbi_mutex_unlock(&ctx->flying_transfers_lock);
 
+check_timeout:
 	if (!timerisset(&next_timeout)) {
 		usbi_dbg("no URB with timeout or all handled by OS; no timeout!");
 		return 0;
@@ -2667,6 +5911,32 @@ static void usbi_fd_notification(struct libusb_context *ctx)
 		usbi_signal_event(ctx);
 }
 
+#ifdef HAVE_SYS_EPOLL_H
+/* Mirror a poll fd into the aggregated event fd, if the application has
+ * asked for one. Callers of this function must hold the event_data_lock. */
+static int epoll_add_pollfd(struct libusb_context *ctx,
+	struct usbi_pollfd *ipollfd)
+{
+	struct epoll_event ev;
+	short events = ipollfd->pollfd.events;
+
+	memset(&ev, 0, sizeof(ev));
+	if (events & POLLIN)
+		ev.events |= EPOLLIN;
+	if (events & POLLOUT)
+		ev.events |= EPOLLOUT;
+	ev.data.ptr = ipollfd;
+
+	if (epoll_ctl(ctx->epoll_fd, EPOLL_CTL_ADD, ipollfd->pollfd.fd, &ev) < 0) {
+		usbi_err(ctx, "failed to add fd %d to event fd errno=%d",
+			ipollfd->pollfd.fd, errno);
+		return LIBUSB_ERROR_OTHER;
+	}
+
+	return 0;
+}
+#endif
+
 /* Add a file descriptor to the list of file descriptors to be monitored.
  * events should be specified as a bitmask of events passed to poll(), e.g.
  * POLLIN and/or POLLOUT. */
@@ -2679,7 +5949,18 @@ int usbi_add_pollfd(struct libusb_context *ctx, int fd, short events)
 	usbi_dbg("add fd %d events %d", fd, events);
 	ipollfd->pollfd.fd = fd;
 	ipollfd->pollfd.events = events;
+	ipollfd->index = -1;
 	usbi_mutex_lock(&ctx->event_data_lock);
+#ifdef HAVE_SYS_EPOLL_H
+	if (ctx->epoll_fd >= 0) {
+		int r = epoll_add_pollfd(ctx, ipollfd);
+		if (r < 0) {
+			usbi_mutex_unlock(&ctx->event_data_lock);
+			free(ipollfd);
+			return r;
+		}
+	}
+#endif
 	list_add_tail(&ipollfd->list, &ctx->ipollfds);
 	ctx->pollfds_cnt++;
 	usbi_fd_notification(ctx);
@@ -2712,6 +5993,11 @@ void usbi_remove_pollfd(struct libusb_context *ctx, int fd)
 
 	list_del(&ipollfd->list);
 	ctx->pollfds_cnt--;
+#ifdef HAVE_SYS_EPOLL_H
+	/* the fd may already have been closed, which removes it implicitly */
+	if (ctx->epoll_fd >= 0)
+		epoll_ctl(ctx->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+#endif
 	usbi_fd_notification(ctx);
 	usbi_mutex_unlock(&ctx->event_data_lock);
 	free(ipollfd);
@@ -2719,6 +6005,37 @@ void usbi_remove_pollfd(struct libusb_context *ctx, int fd)
 		ctx->fd_removed_cb(fd, ctx->fd_cb_user_data);
 }
 
+/** \ingroup libusb_poll
+ * Retrieve the busy-poll counters of a context. See
+ * \ref LIBUSB_OPTION_BUSY_POLL.
+ *
+ * The counters are updated by the thread handling events without any
+ * locking, so values read while events are being handled are approximate.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param spin_hits output location for the number of times spinning found
+ * a completed transfer. May be NULL.
+ * \param fallback_sleeps output location for the number of times the spin
+ * budget ran out and the event handler fell back to poll(). May be NULL.
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if the platform has no busy-poll support
+ */
+int API_EXPORTED libusb_get_busy_poll_stats(libusb_context *ctx,
+	uint64_t *spin_hits, uint64_t *fallback_sleeps)
+{
+	USBI_GET_CONTEXT(ctx);
+
+	if (!usbi_backend.busy_poll)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	if (spin_hits)
+		*spin_hits = ctx->busy_poll_hits;
+	if (fallback_sleeps)
+		*fallback_sleeps = ctx->busy_poll_sleeps;
+
+	return 0;
+}
+
 /** \ingroup libusb_poll
  * Retrieve a list of file descriptors that should be polled by your main loop
  * as libusb event sources.
@@ -2780,6 +6097,112 @@ void API_EXPORTED libusb_free_pollfds(const struct libusb_pollfd **pollfds)
 	free((void *)pollfds);
 }
 
+/** \ingroup libusb_poll
+ * Retrieve a single file descriptor representing all of libusb's event
+ * sources for a context.
+ *
+ * This is an alternative to libusb_get_pollfds() and
+ * libusb_set_pollfd_notifiers() for applications that integrate libusb into
+ * their own main loop. The returned descriptor aggregates the internal event
+ * pipe, the timer used for transfer timeouts and the descriptors of all open
+ * devices, and is kept up to date as devices are opened and closed. It
+ * becomes readable whenever libusb has events to handle; the application
+ * should then call libusb_process_ready_events().
+ *
+ * If libusb_pollfds_handle_timeouts() returns 0, transfer timeouts are not
+ * represented by activity on the descriptor and the application must still
+ * call libusb_process_ready_events() at the times determined by
+ * libusb_get_next_timeout().
+ *
+ * The descriptor is owned by libusb and is closed by libusb_exit(). Repeated
+ * calls return the same descriptor.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \returns a file descriptor (>= 0) on success
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if the platform has no support for
+ * this
+ * \returns another LIBUSB_ERROR code on other failure
+ */
+int API_EXPORTED libusb_get_event_fd(libusb_context *ctx)
+{
+#ifdef HAVE_SYS_EPOLL_H
+	struct usbi_pollfd *ipollfd;
+	int r;
+	USBI_GET_CONTEXT(ctx);
+
+	usbi_mutex_lock(&ctx->event_data_lock);
+	if (ctx->epoll_fd >= 0) {
+		r = ctx->epoll_fd;
+		goto out;
+	}
+
+	ctx->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (ctx->epoll_fd < 0) {
+		usbi_err(ctx, "failed to create event fd errno=%d", errno);
+		ctx->epoll_fd = -1;
+		r = LIBUSB_ERROR_OTHER;
+		goto out;
+	}
+
+	list_for_each_entry(ipollfd, &ctx->ipollfds, list, struct usbi_pollfd) {
+		r = epoll_add_pollfd(ctx, ipollfd);
+		if (r < 0) {
+			close(ctx->epoll_fd);
+			ctx->epoll_fd = -1;
+			goto out;
+		}
+	}
+
+	usbi_dbg("event fd %d", ctx->epoll_fd);
+	r = ctx->epoll_fd;
+
+out:
+	usbi_mutex_unlock(&ctx->event_data_lock);
+	return r;
+#else
+	UNUSED(ctx);
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+/** \ingroup libusb_poll
+ * Handle the events that are ready for a context, without blocking.
+ *
+ * This is intended to be called when the descriptor returned by
+ * libusb_get_event_fd() becomes readable, and at the times given by
+ * libusb_get_next_timeout() where needed. It handles completed transfers,
+ * expired timeouts and hotplug events that are pending and returns
+ * straight away, even if no event was pending.
+ *
+ * Only the descriptors the event fd reports as ready are checked, so the
+ * cost of a call does not grow with the number of open devices.
+ *
+ * Unlike libusb_handle_events_timeout() with a zero timeout, this function
+ * never waits for another thread to finish handling events. If another
+ * thread is handling events for the context, it returns
+ * LIBUSB_ERROR_BUSY and the pending events are left to that thread.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_BUSY if another thread is handling events
+ * \returns another LIBUSB_ERROR code on other failure
+ * \ref libusb_mtasync
+ */
+int API_EXPORTED libusb_process_ready_events(libusb_context *ctx)
+{
+	struct timeval poll_timeout = { 0, 0 };
+	int r;
+
+	USBI_GET_CONTEXT(ctx);
+	if (libusb_try_lock_events(ctx))
+		return LIBUSB_ERROR_BUSY;
+
+	r = handle_events(ctx, &poll_timeout, 1);
+	libusb_unlock_events(ctx);
+
+	return r;
+}
+
 /* Backends may call this from handle_events to report disconnection of a
  * device. This function ensures transfers get cancelled appropriately.
  * Callers of this function must hold the events_lock.
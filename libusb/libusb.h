@@ -1175,6 +1175,11 @@ enum libusb_transfer_flags {
 	LIBUSB_TRANSFER_ADD_ZERO_PACKET = 1U << 3,
 };
 
+/** \ingroup libusb_asyncio
+ * Start frame of isochronous transfers that are to start as soon as
+ * possible. See libusb_transfer_set_iso_start_frame(). */
+#define LIBUSB_ISO_START_ASAP	(-1)
+
 /** \ingroup libusb_asyncio
  * Isochronous packet descriptor. */
 struct libusb_iso_packet_descriptor {
@@ -1188,6 +1193,21 @@ struct libusb_iso_packet_descriptor {
 	enum libusb_transfer_status status;
 };
 
+/** \ingroup libusb_asyncio
+ * Segment of a scatter-gather bulk transfer. See
+ * libusb_fill_bulk_transfer_iov(). */
+struct libusb_iovec {
+	/** Data buffer of this segment */
+	unsigned char *buffer;
+
+	/** Length of this segment */
+	int length;
+
+	/** Amount of data that was actually transferred into or out of this
+	 * segment */
+	int actual_length;
+};
+
 struct libusb_transfer;
 
 /** \ingroup libusb_asyncio
@@ -1259,6 +1279,126 @@ struct libusb_transfer {
 	struct libusb_iso_packet_descriptor iso_packet_desc[ZERO_SIZED_ARRAY];
 };
 
+/** \ingroup libusb_asyncio
+ * One control request of a \ref libusb_control_batch.
+ */
+struct libusb_control_batch_entry {
+	/** Request type, see \ref libusb_control_setup::bmRequestType. The
+	 * direction bit selects whether data is read into or written from
+	 * data. */
+	uint8_t bmRequestType;
+
+	/** Request */
+	uint8_t bRequest;
+
+	/** Value, in host-endian byte order */
+	uint16_t wValue;
+
+	/** Index, in host-endian byte order */
+	uint16_t wIndex;
+
+	/** Length of the data stage */
+	uint16_t wLength;
+
+	/** Data stage buffer of wLength bytes, or NULL if wLength is 0 */
+	unsigned char *data;
+
+	/** Status of the request. Read-only, and only valid in the batch
+	 * callback. Requests that were never sent read
+	 * \ref LIBUSB_TRANSFER_CANCELLED. */
+	enum libusb_transfer_status status;
+
+	/** Number of data bytes transferred. Read-only, and only valid in the
+	 * batch callback. */
+	int actual_length;
+};
+
+/** \ingroup libusb_asyncio
+ * Control batch flags */
+enum libusb_control_batch_flags {
+	/** Send no further requests once one has failed, and cancel the ones
+	 * already in flight */
+	LIBUSB_CONTROL_BATCH_STOP_ON_ERROR = 1 << 0,
+};
+
+struct libusb_control_batch;
+
+/** \ingroup libusb_asyncio
+ * Control batch completion callback, invoked once all requests of the batch
+ * have completed, failed or been skipped.
+ * \param batch The \ref libusb_control_batch that has completed
+ */
+typedef void (LIBUSB_CALL *libusb_control_batch_cb_fn)(
+	struct libusb_control_batch *batch);
+
+/** \ingroup libusb_asyncio
+ * A list of control requests that are sent to the control endpoint of a
+ * device in order, several at a time. Allocate it with
+ * libusb_alloc_control_batch() and submit it with
+ * libusb_submit_control_batch().
+ */
+struct libusb_control_batch {
+	/** Handle of the device that the requests will be sent to */
+	libusb_device_handle *dev_handle;
+
+	/** A bitwise OR combination of \ref libusb_control_batch_flags */
+	uint8_t flags;
+
+	/** Maximum number of requests in flight at once. Values below 1 are
+	 * treated as 1. */
+	int depth;
+
+	/** Timeout of each request in milliseconds, 0 for none */
+	unsigned int timeout;
+
+	/** Status of the batch: \ref LIBUSB_TRANSFER_COMPLETED when every
+	 * request completed, otherwise the status of the first one that did
+	 * not. Read-only, and only valid in the batch callback. */
+	enum libusb_transfer_status status;
+
+	/** Number of requests that completed successfully. Read-only, and only
+	 * valid in the batch callback. */
+	int num_completed;
+
+	/** Callback function, invoked once the whole batch is done */
+	libusb_control_batch_cb_fn callback;
+
+	/** User context data to pass to the callback function */
+	void *user_data;
+
+	/** Number of requests to send, at most as many as were allocated */
+	int num_entries;
+
+	/** The requests */
+	struct libusb_control_batch_entry entries[ZERO_SIZED_ARRAY];
+};
+
+/** \ingroup libusb_asyncio
+ * A write coalescer for one bulk OUT endpoint, which merges small writes
+ * into fewer, larger transfers. Allocate it with
+ * libusb_alloc_bulk_coalescer() and queue writes with
+ * libusb_submit_coalesced_transfer(). */
+struct libusb_bulk_coalescer;
+
+/** \ingroup libusb_asyncio
+ * Policies deciding which waiting request a
+ * \ref libusb_stream_scheduler "stream scheduler" starts when a stream
+ * becomes free */
+enum libusb_stream_scheduler_policy {
+	/** Take turns between the request classes, starting the oldest
+	 * waiting request of each */
+	LIBUSB_STREAM_SCHEDULER_ROUND_ROBIN = 0,
+
+	/** Start the oldest waiting request of the lowest class */
+	LIBUSB_STREAM_SCHEDULER_PRIORITY = 1,
+};
+
+/** \ingroup libusb_asyncio
+ * A scheduler handing out the bulk streams of a set of endpoints to
+ * requests. Allocate it with libusb_alloc_stream_scheduler() and submit
+ * requests with libusb_submit_stream_request(). */
+struct libusb_stream_scheduler;
+
 /** \ingroup libusb_misc
  * Capabilities supported by an instance of libusb on the current running
  * platform. Test if the loaded library supports a given capability by calling
@@ -1409,6 +1549,35 @@ int LIBUSB_CALL libusb_clear_halt(libusb_device_handle *dev_handle,
 	unsigned char endpoint);
 int LIBUSB_CALL libusb_reset_device(libusb_device_handle *dev_handle);
 
+/** \ingroup libusb_dev
+ * Periodic bandwidth reserved on the bus of a device and on its transaction
+ * translator, in nanoseconds of bus time per millisecond. See
+ * libusb_get_periodic_bandwidth().
+ */
+struct libusb_periodic_bandwidth {
+	/** Bus time reserved by the isochronous and interrupt endpoints of
+	 * claimed interfaces on the bus of the device */
+	uint32_t bus_used;
+
+	/** Bus time periodic endpoints may reserve on the bus: 80% of each
+	 * microframe on high speed buses, 90% on others */
+	uint32_t bus_budget;
+
+	/** Full or low speed bus time reserved on the transaction translator
+	 * the device is behind, 0 if it is not behind one */
+	uint32_t tt_used;
+
+	/** Bus time periodic endpoints may reserve on the transaction
+	 * translator, 0 if the device is not behind one */
+	uint32_t tt_budget;
+};
+
+int LIBUSB_CALL libusb_get_periodic_bandwidth(
+	libusb_device_handle *dev_handle,
+	struct libusb_periodic_bandwidth *bandwidth);
+int LIBUSB_CALL libusb_get_fitting_altsetting(
+	libusb_device_handle *dev_handle, int interface_number);
+
 int LIBUSB_CALL libusb_alloc_streams(libusb_device_handle *dev_handle,
 	uint32_t num_streams, unsigned char *endpoints, int num_endpoints);
 int LIBUSB_CALL libusb_free_streams(libusb_device_handle *dev_handle,
@@ -1509,6 +1678,42 @@ void LIBUSB_CALL libusb_transfer_set_stream_id(
 	struct libusb_transfer *transfer, uint32_t stream_id);
 uint32_t LIBUSB_CALL libusb_transfer_get_stream_id(
 	struct libusb_transfer *transfer);
+void LIBUSB_CALL libusb_transfer_set_iov(struct libusb_transfer *transfer,
+	struct libusb_iovec *iov, int num_iov);
+void LIBUSB_CALL libusb_transfer_set_iso_start_frame(
+	struct libusb_transfer *transfer, int start_frame);
+int LIBUSB_CALL libusb_get_iso_packet_frame(struct libusb_transfer *transfer,
+	unsigned int packet);
+int LIBUSB_CALL libusb_get_frame_number(libusb_device_handle *dev_handle,
+	int *frame_number);
+
+struct libusb_control_batch * LIBUSB_CALL libusb_alloc_control_batch(
+	int num_entries);
+int LIBUSB_CALL libusb_submit_control_batch(struct libusb_control_batch *batch);
+int LIBUSB_CALL libusb_cancel_control_batch(struct libusb_control_batch *batch);
+void LIBUSB_CALL libusb_free_control_batch(struct libusb_control_batch *batch);
+
+struct libusb_bulk_coalescer * LIBUSB_CALL libusb_alloc_bulk_coalescer(
+	libusb_device_handle *dev_handle, unsigned char endpoint, int max_bytes,
+	unsigned int max_delay_us);
+int LIBUSB_CALL libusb_submit_coalesced_transfer(
+	struct libusb_bulk_coalescer *coalescer, struct libusb_transfer *transfer);
+int LIBUSB_CALL libusb_flush_bulk_coalescer(
+	struct libusb_bulk_coalescer *coalescer);
+void LIBUSB_CALL libusb_free_bulk_coalescer(
+	struct libusb_bulk_coalescer *coalescer);
+
+struct libusb_stream_scheduler * LIBUSB_CALL libusb_alloc_stream_scheduler(
+	libusb_device_handle *dev_handle, unsigned char *endpoints,
+	int num_endpoints, uint32_t num_streams, int stream_depth,
+	int num_classes, enum libusb_stream_scheduler_policy policy);
+int LIBUSB_CALL libusb_submit_stream_request(
+	struct libusb_stream_scheduler *scheduler,
+	struct libusb_transfer **transfers, int num_transfers, int request_class);
+void LIBUSB_CALL libusb_cancel_stream_scheduler(
+	struct libusb_stream_scheduler *scheduler);
+void LIBUSB_CALL libusb_free_stream_scheduler(
+	struct libusb_stream_scheduler *scheduler);
 
 /** \ingroup libusb_asyncio
  * Helper function to populate the required \ref libusb_transfer fields
@@ -1612,6 +1817,47 @@ static inline void libusb_fill_bulk_stream_transfer(
 	libusb_transfer_set_stream_id(transfer, stream_id);
 }
 
+/** \ingroup libusb_asyncio
+ * Helper function to populate the required \ref libusb_transfer fields
+ * for a bulk transfer which scatters or gathers its data over several
+ * buffers, avoiding a copy into one contiguous buffer. The segments are
+ * transferred in order as one bulk transfer; a short read ends the transfer
+ * in whichever segment it happens. On completion the actual_length field
+ * of each segment holds the amount of data transferred in it, and the
+ * transfer's own actual_length the total.
+ *
+ * The transfer buffer is left NULL and its length set to the total length
+ * of the segments. The iov array must stay valid until the transfer has
+ * completed. Not all platforms support scatter-gather transfers,
+ * libusb_submit_transfer() returns LIBUSB_ERROR_NOT_SUPPORTED where not.
+ * On Linux, IN transfers additionally need a kernel which supports bulk
+ * continuation (2.6.32 or newer), as a short read could otherwise leave
+ * the following segments partly filled.
+ *
+ * \param transfer the transfer to populate
+ * \param dev_handle handle of the device that will handle the transfer
+ * \param endpoint address of the endpoint where this transfer will be sent
+ * \param iov array of segments
+ * \param num_iov number of segments in iov
+ * \param callback callback function to be invoked on transfer completion
+ * \param user_data user data to pass to callback function
+ * \param timeout timeout for the transfer in milliseconds
+ */
+static inline void libusb_fill_bulk_transfer_iov(
+	struct libusb_transfer *transfer, libusb_device_handle *dev_handle,
+	unsigned char endpoint, struct libusb_iovec *iov, int num_iov,
+	libusb_transfer_cb_fn callback, void *user_data, unsigned int timeout)
+{
+	int length = 0;
+	int i;
+
+	for (i = 0; i < num_iov; i++)
+		length += iov[i].length;
+	libusb_fill_bulk_transfer(transfer, dev_handle, endpoint, NULL,
+				  length, callback, user_data, timeout);
+	libusb_transfer_set_iov(transfer, iov, num_iov);
+}
+
 /** \ingroup libusb_asyncio
  * Helper function to populate the required \ref libusb_transfer fields
  * for an interrupt transfer.
@@ -1844,6 +2090,8 @@ int LIBUSB_CALL libusb_handle_events_locked(libusb_context *ctx,
 int LIBUSB_CALL libusb_pollfds_handle_timeouts(libusb_context *ctx);
 int LIBUSB_CALL libusb_get_next_timeout(libusb_context *ctx,
 	struct timeval *tv);
+int LIBUSB_CALL libusb_get_event_fd(libusb_context *ctx);
+int LIBUSB_CALL libusb_process_ready_events(libusb_context *ctx);
 
 /** \ingroup libusb_poll
  * File descriptor for polling
@@ -2020,6 +2268,28 @@ int LIBUSB_CALL libusb_hotplug_register_callback(libusb_context *ctx,
 void LIBUSB_CALL libusb_hotplug_deregister_callback(libusb_context *ctx,
 						libusb_hotplug_callback_handle callback_handle);
 
+/** \ingroup libusb_lib
+ * Policies for assigning device handles to event loop shards, see
+ * \ref LIBUSB_OPTION_SHARD_POLICY.
+ */
+enum libusb_shard_policy {
+	/** Assign handles to shards in turn (the default) */
+	LIBUSB_SHARD_POLICY_ROUND_ROBIN = 0,
+
+	/** Assign handles to the shard with the fewest open handles */
+	LIBUSB_SHARD_POLICY_LEAST_LOADED = 1,
+
+	/** Assign handles to the shard selected with
+	 * \ref LIBUSB_OPTION_SHARD_NEXT */
+	LIBUSB_SHARD_POLICY_EXPLICIT = 2,
+};
+
+/** \ingroup libusb_lib
+ * Value of \ref LIBUSB_OPTION_BULK_URB_SIZE that has libusb learn the URB
+ * size of each bulk endpoint from the throughput it observes.
+ */
+#define LIBUSB_BULK_URB_SIZE_AUTO	(-1)
+
 /** \ingroup libusb_lib
  * Available option values for libusb_set_option().
  */
@@ -2055,10 +2325,650 @@ enum libusb_option {
 	 * Only valid on Windows.
 	 */
 	LIBUSB_OPTION_USE_USBDK,
+
+	/** Service the hotplug monitor from this context's event loop.
+	 *
+	 * By default libusb monitors hotplug events from an internal thread.
+	 * With this option set the monitor thread is stopped and its file
+	 * descriptor is added to the context's poll fds instead, so hotplug
+	 * events are processed by libusb_handle_events() and friends on the
+	 * thread handling events for this context.
+	 *
+	 * Hotplug events are shared by all contexts, so while this option is in
+	 * effect other contexts only see devices arriving and leaving while
+	 * events are being handled on this one. Only one context may have the
+	 * option set at a time; setting it on a second context fails with
+	 * LIBUSB_ERROR_BUSY. The monitor thread is restarted when the context
+	 * is exited.
+	 *
+	 * This option takes no arguments and should be set immediately after
+	 * calling libusb_init().
+	 *
+	 * Only valid on Linux.
+	 */
+	LIBUSB_OPTION_HOTPLUG_EVENT_LOOP,
+
+	/** Busy-poll for completed transfers before sleeping.
+	 *
+	 * This option takes an int argument giving a spin budget in
+	 * microseconds, between 0 and 1000000. When non-zero, the thread handling
+	 * events for this context repeatedly asks the backend for completed
+	 * transfers without blocking, for up to the spin budget (or the event
+	 * handling timeout, if shorter), before falling back to sleeping in
+	 * poll(). This trades CPU time for lower and more consistent completion
+	 * latency. A budget of 0 (the default) disables busy polling.
+	 *
+	 * Use libusb_get_busy_poll_stats() to see how often spinning found a
+	 * completion compared to how often it fell back to poll().
+	 *
+	 * Only valid on Linux.
+	 */
+	LIBUSB_OPTION_BUSY_POLL,
+
+	/** Reap transfers of each device handle on a dedicated thread.
+	 *
+	 * This option takes an int argument; non-zero enables it, zero disables
+	 * it. It only affects device handles opened after the option is set, so
+	 * a subset of devices can be given reaper threads by toggling it around
+	 * calls to libusb_open().
+	 *
+	 * Each such handle gets a thread which blocks in the usbfs REAPURB ioctl
+	 * waiting for the handle's transfers to complete and processes them as
+	 * soon as they do, in parallel with other devices. Transfer callbacks
+	 * are still invoked by the thread handling events for the context.
+	 *
+	 * When the handle is closed, its thread is woken up with SIGURG, for
+	 * which libusb installs a handler that does nothing if the signal is
+	 * ignored or has its default action. The application must not set it
+	 * back to SIG_IGN or SIG_DFL while reaper threads run, or closing their
+	 * handles hangs.
+	 *
+	 * Only valid on Linux.
+	 */
+	LIBUSB_OPTION_REAPER_THREADS,
+
+	/** Have libusb handle events for this context on its own thread.
+	 *
+	 * This option takes an int argument giving the number of callback worker
+	 * threads, between 0 and 64. libusb starts a thread that handles events
+	 * for the context until libusb_exit() is called, so the application does
+	 * not need to call libusb_handle_events() itself (synchronous I/O and
+	 * other event handling functions keep working).
+	 *
+	 * With 0 workers, transfer callbacks run on the event thread. Otherwise
+	 * they are handed to the workers, so that the event thread keeps reaping
+	 * transfers while callbacks run. Callbacks for the same endpoint of a
+	 * device handle always run in completion order on the same worker;
+	 * callbacks for different endpoints may run in parallel.
+	 *
+	 * The option can only be set once per context; further attempts fail
+	 * with LIBUSB_ERROR_BUSY.
+	 *
+	 * Only valid on platforms using POSIX threads.
+	 */
+	LIBUSB_OPTION_EVENT_THREAD,
+
+	/** Pin the event thread started by \ref LIBUSB_OPTION_EVENT_THREAD to a
+	 * CPU.
+	 *
+	 * This option takes an int argument giving the CPU number, or -1 to allow
+	 * all CPUs (the default). It can be set before or after the event thread
+	 * is started.
+	 *
+	 * Only valid on Linux.
+	 */
+	LIBUSB_OPTION_EVENT_THREAD_AFFINITY,
+
+	/** Set the scheduling priority of the event thread started by
+	 * \ref LIBUSB_OPTION_EVENT_THREAD.
+	 *
+	 * This option takes an int argument. 0 (the default) runs the thread
+	 * under the normal scheduling policy, a value between 1 and the maximum
+	 * SCHED_FIFO priority runs it under SCHED_FIFO with that priority, which
+	 * usually requires privileges. It can be set before or after the event
+	 * thread is started.
+	 *
+	 * Only valid on platforms using POSIX threads.
+	 */
+	LIBUSB_OPTION_EVENT_THREAD_PRIORITY,
+
+	/** Split event handling for this context across several event loops.
+	 *
+	 * This option takes an int argument giving the number of shards, between
+	 * 1 and 64. Shard 0 is the context's own event loop, run by
+	 * libusb_handle_events() and friends. Each further shard is a thread
+	 * that polls and reaps the transfers of the device handles assigned to
+	 * it, times them out and calls their callbacks, so devices on different
+	 * shards complete in parallel without involving the context's own event
+	 * loop. Hotplug events and disconnections are still processed by the
+	 * context's own event loop.
+	 *
+	 * As with callbacks called while handling events, the callbacks of
+	 * transfers on a shard must not wait for the completion of other
+	 * transfers on the same shard, e.g. through the synchronous I/O
+	 * functions.
+	 *
+	 * Device handles are assigned to a shard when they are opened, according
+	 * to \ref LIBUSB_OPTION_SHARD_POLICY, and stay on it until closed. Handles
+	 * opened with \ref LIBUSB_OPTION_REAPER_THREADS in effect are not
+	 * assigned to a shard.
+	 *
+	 * The option can only be set once per context; further attempts fail
+	 * with LIBUSB_ERROR_BUSY.
+	 *
+	 * Only valid on Linux.
+	 */
+	LIBUSB_OPTION_EVENT_SHARDS,
+
+	/** Select how device handles are assigned to event loop shards.
+	 *
+	 * This option takes an int argument, one of \ref libusb_shard_policy.
+	 * The default is \ref LIBUSB_SHARD_POLICY_ROUND_ROBIN.
+	 *
+	 * Only valid on Linux.
+	 */
+	LIBUSB_OPTION_SHARD_POLICY,
+
+	/** Select the shard the next device handles are assigned to.
+	 *
+	 * This option takes an int argument giving the shard index, between 0
+	 * and the number of shards minus one. It only applies while
+	 * \ref LIBUSB_SHARD_POLICY_EXPLICIT is in effect, and fails with
+	 * LIBUSB_ERROR_NOT_SUPPORTED otherwise. The selection remains until it
+	 * is changed or the policy is set again.
+	 *
+	 * Only valid on Linux.
+	 */
+	LIBUSB_OPTION_SHARD_NEXT,
+
+	/** Wait for events through io_uring instead of poll().
+	 *
+	 * With this option set, the thread handling events keeps a poll
+	 * request for each of the context's file descriptors armed in an
+	 * io_uring instance. Only the requests that fired are re-armed, and
+	 * that is done in the same system call that waits for the next events,
+	 * so an event handling iteration costs one io_uring_enter() regardless
+	 * of how many devices are open. Transfers are still submitted and
+	 * reaped with usbfs ioctls, which io_uring cannot issue.
+	 *
+	 * This option takes no arguments and should be set immediately after
+	 * calling libusb_init(), before any events are handled. It fails with
+	 * LIBUSB_ERROR_NOT_SUPPORTED if the kernel does not provide io_uring
+	 * with extended wait arguments (Linux 5.11).
+	 *
+	 * Only valid on Linux.
+	 */
+	LIBUSB_OPTION_IO_URING,
+
+	/** Collect per-endpoint transfer statistics.
+	 *
+	 * This option takes an int argument; non-zero enables it, zero disables
+	 * it. While enabled, libusb counts the transfers of each endpoint of
+	 * the context's device handles by outcome and records their latencies,
+	 * see libusb_get_endpoint_stats(). Disabling the option keeps the
+	 * statistics gathered so far. Statistics are not collected by default,
+	 * which costs nothing.
+	 */
+	LIBUSB_OPTION_ENDPOINT_STATS,
+
+	/** Record transfer lifecycle events in per-thread trace rings.
+	 *
+	 * This option takes an int argument giving the number of events each
+	 * ring holds, between 1 and 1048576, rounded up to a power of two. Each
+	 * thread that submits, reaps, completes, cancels or times out transfers
+	 * of the context, or reports hotplug events, gets a ring the first time
+	 * it records an event, and records compact binary events into it (see
+	 * \ref libusb_trace_event) without locking or formatting. Once a ring is
+	 * full, the oldest events are overwritten. Use libusb_trace_dump() to
+	 * write the rings out. Up to 64 threads have a ring at a time; the ring
+	 * of a thread that exits goes to the next thread needing one, events
+	 * and all.
+	 *
+	 * The option can only be set once per context; further attempts fail
+	 * with LIBUSB_ERROR_BUSY.
+	 */
+	LIBUSB_OPTION_TRACE_RING,
+
+	/** Hand log messages to a background thread.
+	 *
+	 * This option takes an int argument; non-zero enables it, zero disables
+	 * it. While enabled, a thread logging a message only formats its text
+	 * into a lock-free ring; a background thread adds the header and writes
+	 * it to stderr, the system log or the global log callback (which is
+	 * then called from that thread). Messages are dropped, and the number
+	 * dropped reported, if the ring fills up. Contexts with a log callback
+	 * set with \ref LIBUSB_LOG_CB_CONTEXT keep logging synchronously.
+	 *
+	 * The sink is shared by all contexts and runs as long as one of them
+	 * has the option enabled. Pending messages are written out when it is
+	 * disabled or the context is closed with libusb_exit().
+	 *
+	 * Only available with POSIX threads when logging is compiled in.
+	 */
+	LIBUSB_OPTION_LOG_ASYNC,
+
+	/** Capture transfers to a pcapng file.
+	 *
+	 * This option takes an int argument, a file descriptor open for
+	 * writing, or -1 to stop capturing. Every transfer submission and
+	 * completion on the context is written to it as a packet of the Linux
+	 * usbmon link type, so that Wireshark decodes the capture like one
+	 * taken with usbmon: setup packets, isochronous packet descriptors,
+	 * status, timestamps and up to 2 kB of data per packet. The file
+	 * descriptor is not closed when capture stops.
+	 *
+	 * Packets are written in batches by a background thread. If it falls
+	 * behind, packets are dropped rather than holding up I/O; see
+	 * libusb_get_capture_stats(). Pending packets are written out when
+	 * capture stops or the context is closed with libusb_exit().
+	 *
+	 * Returns LIBUSB_ERROR_BUSY if a capture is already running and
+	 * LIBUSB_ERROR_IO if the file headers cannot be written. Only
+	 * available with POSIX threads.
+	 */
+	LIBUSB_OPTION_CAPTURE_FD,
+
+	/** Split large bulk transfers into URBs of a given size, submitted
+	 * through a bounded window.
+	 *
+	 * This option takes an int argument. 0 (the default) leaves the split
+	 * to what the kernel supports: one URB for the whole transfer where the
+	 * host controller can scatter-gather, 16 kB URBs all submitted at once
+	 * otherwise. A multiple of 1024 between 1024 and 67108864 splits bulk
+	 * transfers longer than that into URBs of that size. Only
+	 * \ref LIBUSB_OPTION_BULK_URB_WINDOW of them are in flight at a time,
+	 * each further one being submitted as an earlier one completes, so
+	 * large buffers neither need the kernel to allocate them in one piece
+	 * nor all of their URBs up front.
+	 *
+	 * \ref LIBUSB_BULK_URB_SIZE_AUTO picks the URB size of each endpoint
+	 * of a device handle between 16 kB and 1 MB: every size is tried in
+	 * turn, after which the one with the best observed throughput is used
+	 * and its neighbours are tried now and then to follow changes. Sizes
+	 * the kernel fails to allocate are not tried again. Use
+	 * libusb_get_bulk_urb_params() to see the choice.
+	 *
+	 * The option applies to transfers submitted after it is set. Transfers
+	 * with scatter-gather segments are not affected.
+	 *
+	 * Only valid on Linux.
+	 */
+	LIBUSB_OPTION_BULK_URB_SIZE,
+
+	/** Set the number of URBs of a bulk transfer in flight at a time.
+	 *
+	 * This option takes an int argument between 1 and 64, the default is 4.
+	 * It only applies to transfers split by
+	 * \ref LIBUSB_OPTION_BULK_URB_SIZE.
+	 *
+	 * Only valid on Linux.
+	 */
+	LIBUSB_OPTION_BULK_URB_WINDOW,
+
+	/** Set when contexts scan for the devices in the system, to one of the
+	 * values of \ref libusb_device_scan. The default is
+	 * \ref LIBUSB_DEVICE_SCAN_EAGER.
+	 *
+	 * Since the scan happens in libusb_init(), this option is set with a
+	 * NULL context before it and applies to every context initialized
+	 * after that. Short-lived programs that open a device they already
+	 * have a file descriptor for with libusb_wrap_sys_device() never have
+	 * to pay for the scan with \ref LIBUSB_DEVICE_SCAN_LAZY.
+	 *
+	 * Only has an effect on Linux; other platforms always scan in
+	 * libusb_init() or whenever libusb_get_device_list() is called.
+	 */
+	LIBUSB_OPTION_DEVICE_SCAN,
+};
+
+/** \ingroup libusb_lib
+ * When a context scans for devices, see \ref LIBUSB_OPTION_DEVICE_SCAN.
+ */
+enum libusb_device_scan {
+	/** Scan in libusb_init() */
+	LIBUSB_DEVICE_SCAN_EAGER = 0,
+
+	/** Scan when the devices are first asked for by
+	 * libusb_get_device_list(), libusb_hotplug_register_callback() or
+	 * libusb_wait_device_scan() */
+	LIBUSB_DEVICE_SCAN_LAZY = 1,
+
+	/** Scan from a thread started by libusb_init(). Functions that need
+	 * the devices wait for it to finish. Where threads are not available
+	 * this is the same as \ref LIBUSB_DEVICE_SCAN_LAZY. */
+	LIBUSB_DEVICE_SCAN_BACKGROUND = 2,
 };
 
+int LIBUSB_CALL libusb_wait_device_scan(libusb_context *ctx);
+
 int LIBUSB_CALL libusb_set_option(libusb_context *ctx, enum libusb_option option, ...);
 
+int LIBUSB_CALL libusb_get_busy_poll_stats(libusb_context *ctx,
+	uint64_t *spin_hits, uint64_t *fallback_sleeps);
+
+/** \ingroup libusb_asyncio
+ * Number of buckets in the latency histograms of
+ * \ref libusb_endpoint_stats.
+ *
+ * The histograms are log-linear in microseconds: buckets 0 to 3 count
+ * latencies of 0 to 3 us. Above that, each power of two is split into four
+ * buckets of equal width: with m = bucket / 4 + 1 and s = bucket % 4, the
+ * bucket counts latencies from (4 + s) << (m - 2) up to but not including
+ * (5 + s) << (m - 2) us. The last bucket also counts all longer latencies.
+ */
+#define LIBUSB_STATS_HISTOGRAM_BUCKETS	104
+
+/** \ingroup libusb_asyncio
+ * Transfer statistics of an endpoint, see libusb_get_endpoint_stats().
+ */
+struct libusb_endpoint_stats {
+	/** Number of transfers submitted */
+	uint64_t submitted;
+
+	/** Number of transfers that completed successfully */
+	uint64_t completed;
+
+	/** Number of transfers that failed with
+	 * \ref LIBUSB_TRANSFER_ERROR, \ref LIBUSB_TRANSFER_OVERFLOW or
+	 * \ref LIBUSB_TRANSFER_NO_DEVICE */
+	uint64_t errors;
+
+	/** Number of transfers that ended with \ref LIBUSB_TRANSFER_STALL */
+	uint64_t stalls;
+
+	/** Number of transfers that timed out */
+	uint64_t timeouts;
+
+	/** Number of transfers that were cancelled */
+	uint64_t cancelled;
+
+	/** Number of bytes transferred, whatever the outcome of the transfer */
+	uint64_t bytes;
+
+	/** Time from libusb_submit_transfer() to the transfer completing */
+	uint32_t submit_to_complete[LIBUSB_STATS_HISTOGRAM_BUCKETS];
+
+	/** Time from the transfer completing to its callback being invoked */
+	uint32_t complete_to_callback[LIBUSB_STATS_HISTOGRAM_BUCKETS];
+};
+
+int LIBUSB_CALL libusb_get_endpoint_stats(libusb_device_handle *dev_handle,
+	unsigned char endpoint, struct libusb_endpoint_stats *stats);
+void LIBUSB_CALL libusb_reset_stats(libusb_context *ctx);
+
+/** \ingroup libusb_asyncio
+ * How the bulk transfers of an endpoint are split into URBs, see
+ * libusb_get_bulk_urb_params() and \ref LIBUSB_OPTION_BULK_URB_SIZE.
+ */
+struct libusb_bulk_urb_params {
+	/** Size of the URBs the next transfer longer than that is split into,
+	 * or 0 if transfers are split according to the kernel's capabilities */
+	int urb_size;
+
+	/** Maximum number of URBs of a transfer in flight at a time, or 0 if
+	 * transfers are split according to the kernel's capabilities */
+	int window;
+
+	/** Non-zero if urb_size was picked by \ref LIBUSB_BULK_URB_SIZE_AUTO */
+	int auto_tuned;
+
+	/** Throughput observed with urb_size, in bytes per second, or 0 if not
+	 * measured yet */
+	uint64_t throughput;
+
+	/** Number of transfers the choice is based on */
+	unsigned int transfers;
+};
+
+int LIBUSB_CALL libusb_get_bulk_urb_params(libusb_device_handle *dev_handle,
+	unsigned char endpoint, struct libusb_bulk_urb_params *params);
+
+/** \ingroup libusb_asyncio
+ * Types of events recorded in trace rings, see \ref LIBUSB_OPTION_TRACE_RING.
+ */
+enum libusb_trace_event_type {
+	/** libusb_submit_transfer() was called */
+	LIBUSB_TRACE_SUBMIT = 1,
+
+	/** The backend handed a URB of the transfer to the operating system.
+	 * status is 0 or a negative errno value */
+	LIBUSB_TRACE_SUBMIT_URB = 2,
+
+	/** The backend reaped a URB of the transfer. status is the URB status
+	 * as reported by the operating system and length the bytes transferred */
+	LIBUSB_TRACE_REAP_URB = 3,
+
+	/** The transfer completed. status is the \ref libusb_transfer_status
+	 * and length the bytes transferred */
+	LIBUSB_TRACE_COMPLETE = 4,
+
+	/** libusb_cancel_transfer() was called. status is its return value */
+	LIBUSB_TRACE_CANCEL = 5,
+
+	/** The transfer timed out and is being cancelled */
+	LIBUSB_TRACE_TIMEOUT = 6,
+
+	/** A hotplug event was reported. object is the libusb_device, status
+	 * the \ref libusb_hotplug_event and length holds the bus number in bits
+	 * 8-15 and the device address in bits 0-7 */
+	LIBUSB_TRACE_HOTPLUG = 7,
+};
+
+/** \ingroup libusb_asyncio
+ * An event recorded in a trace ring.
+ */
+struct libusb_trace_event {
+	/** CLOCK_MONOTONIC time of the event in nanoseconds */
+	uint64_t timestamp;
+
+	/** Address of the libusb_transfer (or libusb_device for hotplug
+	 * events) the event is about */
+	uint64_t object;
+
+	/** Index of the trace ring, i.e. of the thread recording the event */
+	uint32_t thread;
+
+	/** Event specific status, see \ref libusb_trace_event_type */
+	int32_t status;
+
+	/** Transfer length or number of bytes transferred */
+	uint32_t length;
+
+	/** Index of the URB within the transfer, or -1 */
+	int16_t urb;
+
+	/** A \ref libusb_trace_event_type */
+	uint8_t type;
+
+	/** Endpoint address of the transfer */
+	uint8_t endpoint;
+};
+
+/** \ingroup libusb_asyncio
+ * Magic number at the start of trace dumps ("LUTR" in little endian) */
+#define LIBUSB_TRACE_MAGIC	0x5254554cU
+
+/** \ingroup libusb_asyncio
+ * Version of the trace dump format */
+#define LIBUSB_TRACE_VERSION	1
+
+/** \ingroup libusb_asyncio
+ * Header of a trace dump written by libusb_trace_dump(). It is followed by
+ * num_events \ref libusb_trace_event records, in host byte order, grouped by
+ * thread and ordered from oldest to newest within each thread.
+ */
+struct libusb_trace_header {
+	/** \ref LIBUSB_TRACE_MAGIC */
+	uint32_t magic;
+
+	/** \ref LIBUSB_TRACE_VERSION */
+	uint16_t version;
+
+	/** Size of each event record in bytes */
+	uint16_t event_size;
+
+	/** Number of event records following the header */
+	uint32_t num_events;
+
+	/** Number of threads (trace rings) the events came from */
+	uint32_t num_threads;
+};
+
+int LIBUSB_CALL libusb_trace_dump(libusb_context *ctx, int fd);
+
+/** \ingroup libusb_misc
+ * Counters of the transfer capture, see \ref LIBUSB_OPTION_CAPTURE_FD
+ * and libusb_get_capture_stats().
+ */
+struct libusb_capture_stats {
+	/** Number of packets written */
+	uint64_t packets;
+
+	/** Number of bytes of packet data written, without file overhead */
+	uint64_t bytes;
+
+	/** Number of packets dropped because the writer fell behind or the
+	 * file could not be written to */
+	uint64_t dropped;
+};
+
+int LIBUSB_CALL libusb_get_capture_stats(libusb_context *ctx,
+	struct libusb_capture_stats *stats);
+
+/** \ingroup libusb_misc
+ * Contention statistics of a class of libusb internal locks, see
+ * libusb_get_lock_stats(). Times are in nanoseconds.
+ */
+struct libusb_lock_stats {
+	/** Name of the lock class, e.g. "ctx->events_lock" */
+	const char *name;
+
+	/** Number of times a lock of the class was acquired */
+	uint64_t acquisitions;
+
+	/** Number of acquisitions that had to wait for another thread, plus
+	 * the number of failed attempts to take a lock without waiting */
+	uint64_t contended;
+
+	/** Total time spent waiting in contended acquisitions */
+	uint64_t wait_ns;
+
+	/** Longest wait for an acquisition */
+	uint64_t max_wait_ns;
+
+	/** Total time locks of the class were held */
+	uint64_t hold_ns;
+
+	/** Longest time a lock of the class was held */
+	uint64_t max_hold_ns;
+};
+
+int LIBUSB_CALL libusb_get_lock_stats(struct libusb_lock_stats *stats,
+	int count);
+void LIBUSB_CALL libusb_reset_lock_stats(void);
+
+/** \ingroup libusb_dev
+ * Callback moving the data of a transfer on an endpoint of a loopback
+ * device, see libusb_loopback_add_device(). For an IN endpoint it fills in
+ * up to length bytes of data, for an OUT endpoint it consumes them.
+ * Isochronous transfers call it once per packet.
+ *
+ * It is called on the thread submitting the transfer, or on an internal
+ * thread for endpoints with a latency or bandwidth, and may itself use the
+ * loopback API, e.g. libusb_loopback_remove_device() to inject an unplug.
+ *
+ * \param endpoint the address of the endpoint
+ * \param data the transfer buffer
+ * \param length the length of the buffer
+ * \param user_data the user_data of the endpoint
+ * \returns the number of bytes transferred, or a LIBUSB_ERROR code to fail
+ * the transfer; LIBUSB_ERROR_PIPE also halts the endpoint
+ */
+typedef int (LIBUSB_CALL *libusb_loopback_data_cb)(unsigned char endpoint,
+	unsigned char *data, int length, void *user_data);
+
+/** \ingroup libusb_dev
+ * Callback answering a request on the control endpoint of a loopback
+ * device that is not handled by libusb itself, see
+ * libusb_loopback_add_device().
+ *
+ * Like \ref libusb_loopback_data_cb it may itself use the loopback API.
+ *
+ * \param setup the setup packet, in bus endian order
+ * \param data the data stage, wLength bytes long
+ * \param user_data the user_data of the device
+ * \returns the number of bytes transferred in the data stage, or a
+ * LIBUSB_ERROR code; LIBUSB_ERROR_PIPE stalls the request
+ */
+typedef int (LIBUSB_CALL *libusb_loopback_control_cb)(
+	const struct libusb_control_setup *setup, unsigned char *data,
+	void *user_data);
+
+/** \ingroup libusb_dev
+ * An endpoint of a loopback device. Only the endpoint address is required;
+ * zero leaves the rest of the model out.
+ */
+struct libusb_loopback_endpoint {
+	/** Endpoint address, including the direction bit */
+	unsigned char endpoint;
+
+	/** Time from the end of a transfer on the wire until it completes, in
+	 * microseconds */
+	unsigned int latency_us;
+
+	/** Bandwidth of the endpoint in bytes per second. Isochronous
+	 * transfers also take one (micro)frame per packet. */
+	unsigned int bandwidth;
+
+	/** Stall every Nth transfer submitted to the endpoint. The endpoint
+	 * stays halted until the halt is cleared. */
+	unsigned int stall_every;
+
+	/** Drop every Nth transfer submitted to the endpoint, so that it only
+	 * ends when it times out or is cancelled */
+	unsigned int drop_every;
+
+	/** Data callback, or NULL to return a running byte count on IN
+	 * endpoints and discard the data of OUT endpoints */
+	libusb_loopback_data_cb data_cb;
+
+	/** User data passed to the data callback */
+	void *user_data;
+};
+
+/** \ingroup libusb_dev
+ * Description of a loopback device, see libusb_loopback_add_device().
+ */
+struct libusb_loopback_device {
+	/** Device descriptor followed by all configuration descriptors, as
+	 * returned by the device */
+	const unsigned char *descriptors;
+
+	/** Total length of descriptors */
+	int descriptors_length;
+
+	/** Speed the device runs at */
+	enum libusb_speed speed;
+
+	/** Endpoints of the device, other than endpoint 0 */
+	const struct libusb_loopback_endpoint *endpoints;
+
+	/** Number of entries in endpoints */
+	int num_endpoints;
+
+	/** Callback for requests on endpoint 0, or NULL to stall them */
+	libusb_loopback_control_cb control_cb;
+
+	/** User data passed to the control callback */
+	void *user_data;
+};
+
+int LIBUSB_CALL libusb_loopback_add_device(libusb_context *ctx,
+	const struct libusb_loopback_device *config, libusb_device **dev);
+int LIBUSB_CALL libusb_loopback_remove_device(libusb_device *dev);
+ssize_t LIBUSB_CALL libusb_replay_load(libusb_context *ctx, const char *path,
+	unsigned int rate, libusb_device ***list);
+
 #ifdef __cplusplus
 }
 #endif
@@ -86,12 +86,40 @@ extern "C" {
 /* Backend specific capabilities */
 #define USBI_CAP_HAS_HID_ACCESS			0x00010000
 #define USBI_CAP_SUPPORTS_DETACH_KERNEL_DRIVER	0x00020000
+#define USBI_CAP_BULK_IOV			0x00040000
 
 /* Maximum number of bytes in a log line */
 #define USBI_MAX_LOG_LEN	1024
 /* Terminator for log lines */
 #define USBI_LOG_LINE_END	"\n"
 
+/* Maximum busy-poll spin budget in microseconds */
+#define USBI_MAX_BUSY_POLL_US	1000000
+
+/* Maximum number of callback worker threads per context */
+#define USBI_MAX_CALLBACK_WORKERS	64
+
+/* Maximum number of event loop shards per context */
+#define USBI_MAX_EVENT_SHARDS	64
+
+/* Number of endpoint addresses statistics are kept for (16 per direction) */
+#define USBI_NUM_ENDPOINT_STATS	32
+
+/* Maximum number of threads with a trace ring per context */
+#define USBI_MAX_TRACE_THREADS	64
+/* Maximum number of events in each trace ring */
+#define USBI_MAX_TRACE_EVENTS	(1 << 20)
+
+/* Number of transfer events the capture writer can fall behind by */
+#define USBI_CAPTURE_ENTRIES	512
+/* Largest captured packet, including the usbmon header */
+#define USBI_CAPTURE_SNAPLEN	2048
+
+/* transfer capture needs a writer thread and atomics */
+#if defined(THREADS_POSIX) && defined(__GNUC__)
+#define USBI_CAPTURE
+#endif
+
 /* The following is used to silence warnings for unused variables */
 #define UNUSED(var)		do { (void)(var); } while(0)
 
@@ -216,6 +244,11 @@ static inline void *usbi_reallocf(void *ptr, size_t size)
 	} while (0)
 #endif
 
+/* Messages more verbose than this level are compiled out */
+#ifndef USBI_COMPILED_LOG_LEVEL
+#define USBI_COMPILED_LOG_LEVEL	LIBUSB_LOG_LEVEL_DEBUG
+#endif
+
 #ifdef ENABLE_LOGGING
 
 #if defined(_MSC_VER) && (_MSC_VER < 1900)
@@ -232,9 +265,23 @@ void usbi_log(struct libusb_context *ctx, enum libusb_log_level level,
 void usbi_log_v(struct libusb_context *ctx, enum libusb_log_level level,
 	const char *function, const char *format, va_list args) USBI_PRINTFLIKE(4, 0);
 
+/* The most verbose level any context or LIBUSB_DEBUG asks for. Messages
+ * above it are dropped before their arguments are evaluated. */
+#ifdef ENABLE_DEBUG_LOGGING
+#define usbi_log_enabled(level)	((level) <= USBI_COMPILED_LOG_LEVEL)
+#else
+extern int usbi_log_level;
+#define usbi_log_enabled(level)					\
+	((level) <= USBI_COMPILED_LOG_LEVEL && (int)(level) <= usbi_log_level)
+#endif
+
 #if !defined(_MSC_VER) || (_MSC_VER >= 1400)
 
-#define _usbi_log(ctx, level, ...) usbi_log(ctx, level, __FUNCTION__, __VA_ARGS__)
+#define _usbi_log(ctx, level, ...)					\
+	do {								\
+		if (usbi_log_enabled(level))				\
+			usbi_log(ctx, level, __FUNCTION__, __VA_ARGS__);	\
+	} while (0)
 
 #define usbi_err(ctx, ...) _usbi_log(ctx, LIBUSB_LOG_LEVEL_ERROR, __VA_ARGS__)
 #define usbi_warn(ctx, ...) _usbi_log(ctx, LIBUSB_LOG_LEVEL_WARNING, __VA_ARGS__)
@@ -246,6 +293,8 @@ void usbi_log_v(struct libusb_context *ctx, enum libusb_log_level level,
 #define LOG_BODY(ctxt, level)				\
 {							\
 	va_list args;					\
+	if (!usbi_log_enabled(level))			\
+		return;					\
 	va_start(args, format);				\
 	usbi_log_v(ctxt, level, "", format, args);	\
 	va_end(args);					\
@@ -264,10 +313,16 @@ static inline void usbi_dbg(const char *format, ...)
 
 #else /* ENABLE_LOGGING */
 
-#define usbi_err(ctx, fmt, args...) __android_log_print(ANDROID_LOG_DEBUG, "libusb", fmt, ##args)
-#define usbi_warn(ctx, fmt, args...) __android_log_print(ANDROID_LOG_DEBUG, "libusb", fmt, ##args)
-#define usbi_info(ctx, fmt, args...) __android_log_print(ANDROID_LOG_DEBUG, "libusb", fmt, ##args)
-#define usbi_dbg(fmt, args...) __android_log_print(ANDROID_LOG_DEBUG, "libusb", fmt, ##args)
+#define _usbi_log(level, fmt, args...)					\
+	do {								\
+		if ((level) <= USBI_COMPILED_LOG_LEVEL)			\
+			__android_log_print(ANDROID_LOG_DEBUG, "libusb", fmt, ##args);	\
+	} while (0)
+
+#define usbi_err(ctx, fmt, args...) _usbi_log(LIBUSB_LOG_LEVEL_ERROR, fmt, ##args)
+#define usbi_warn(ctx, fmt, args...) _usbi_log(LIBUSB_LOG_LEVEL_WARNING, fmt, ##args)
+#define usbi_info(ctx, fmt, args...) _usbi_log(LIBUSB_LOG_LEVEL_INFO, fmt, ##args)
+#define usbi_dbg(fmt, args...) _usbi_log(LIBUSB_LOG_LEVEL_DEBUG, fmt, ##args)
 
 #endif /* ENABLE_LOGGING */
 
@@ -300,19 +355,72 @@ extern struct libusb_context *usbi_default_context;
 /* Forward declaration for use in context (fully defined inside poll abstraction) */
 struct pollfd;
 
+enum usbi_scan_state {
+	USBI_SCAN_DONE = 0,
+	USBI_SCAN_PENDING,
+	USBI_SCAN_RUNNING,
+};
+
 struct libusb_context {
 #if defined(ENABLE_LOGGING) && !defined(ENABLE_DEBUG_LOGGING)
 	enum libusb_log_level debug;
 	int debug_fixed;
 	libusb_log_cb log_handler;
 #endif
+#ifdef ENABLE_LOGGING
+	/* this context keeps the asynchronous log sink running */
+	int log_async;
+#endif
 
 	/* internal event pipe, used for signalling occurrence of an internal event. */
 	int event_pipe[2];
 
+	/* busy-poll budget in microseconds (0 if disabled), and how often the
+	 * spin found a completion vs. ran out and fell back to poll(). Only
+	 * touched by the thread handling events. */
+	unsigned int busy_poll_us;
+	uint64_t busy_poll_hits;
+	uint64_t busy_poll_sleeps;
+
+	/* collect per-endpoint transfer statistics (LIBUSB_OPTION_ENDPOINT_STATS),
+	 * and whether they have ever been collected for this context */
+	int endpoint_stats;
+	int endpoint_stats_used;
+
+	/* per-thread trace rings (LIBUSB_OPTION_TRACE_RING). trace_size is the
+	 * number of events per ring, 0 while tracing is disabled. Rings are
+	 * only ever added, under trace_lock, and published by incrementing
+	 * trace_num_rings so that they can be dumped without locking. The ring
+	 * of a thread that exits is handed to the next thread needing one,
+	 * which records under the thread number trace_next_thread gives it. */
+	unsigned int trace_size;
+	usbi_mutex_t trace_lock;
+	usbi_tls_key_t trace_key;
+	struct usbi_trace_ring *trace_rings[USBI_MAX_TRACE_THREADS];
+	unsigned int trace_num_rings;
+	unsigned int trace_next_thread;
+
+	/* transfer capture (LIBUSB_OPTION_CAPTURE_FD), started and stopped
+	 * under trace_lock. capture_active is read without the lock, see
+	 * usbi_capture_active(). Once started, capture stays allocated until
+	 * the context is destroyed. */
+	int capture_active;
+	struct usbi_capture *capture;
+
 	struct list_head usb_devs;
 	usbi_mutex_t usb_devs_lock;
 
+	/* initial scan of usb_devs, deferred by LIBUSB_OPTION_DEVICE_SCAN
+	 * until the devices are first asked for or done by scan_thread */
+	enum libusb_device_scan device_scan;
+	enum usbi_scan_state scan_state;
+	usbi_mutex_t scan_lock;
+	usbi_cond_t scan_cond;
+#if defined(THREADS_POSIX)
+	pthread_t scan_thread;
+	int scan_thread_started;
+#endif
+
 	/* A list of open handles. Backends are free to traverse this if required.
 	 */
 	struct list_head open_devs;
@@ -352,6 +460,18 @@ struct libusb_context {
 	usbi_mutex_t event_waiters_lock;
 	usbi_cond_t event_waiters_cond;
 
+	/* threads waiting in libusb_handle_events_timeout_completed(), each
+	 * with its own condition so that they can be woken individually.
+	 * Protected by event_waiters_lock. */
+	struct list_head event_waiters;
+
+	/* library owned event handling thread and callback workers, if
+	 * enabled with LIBUSB_OPTION_EVENT_THREAD, and the CPU (-1 for any) and
+	 * SCHED_FIFO priority (0 for the default policy) to run it with */
+	struct usbi_event_thread *event_thread;
+	int event_thread_cpu;
+	int event_thread_priority;
+
 	/* A lock to protect internal context event data. */
 	usbi_mutex_t event_data_lock;
 
@@ -369,12 +489,29 @@ struct libusb_context {
 	struct pollfd *pollfds;
 	POLL_NFDS_TYPE pollfds_cnt;
 
+	/* Aggregated event fd mirroring ipollfds, created on demand by
+	 * libusb_get_event_fd(). Protected by event_data_lock. */
+	int epoll_fd;
+
 	/* A list of pending hotplug messages. Protected by event_data_lock. */
 	struct list_head hotplug_msgs;
 
 	/* A list of pending completed transfers. Protected by event_data_lock. */
 	struct list_head completed_transfers;
 
+	/* A list of transfers that failed without reaching the backend, whose
+	 * callbacks are invoked by the event handling code. Linked by their list.
+	 * Protected by event_data_lock. */
+	struct list_head deferred_transfers;
+
+	/* Bulk write coalescers with a delay, whose buffers are sent by the
+	 * event handling code. Take this lock before that of a coalescer.
+	 * num_coalescers is updated under it, and read atomically without it
+	 * to skip the list while it is empty. */
+	struct list_head coalescers;
+	usbi_mutex_t coalescers_lock;
+	unsigned int num_coalescers;
+
 #ifdef USBI_TIMERFD_AVAILABLE
 	/* used for timeout handling, if supported by OS.
 	 * this timerfd is maintained to trigger on the next pending timeout */
@@ -395,6 +532,13 @@ enum usbi_event_flags {
 
 	/* A hotplug callback deregistration is pending */
 	USBI_EVENT_HOTPLUG_CB_DEREGISTERED = 1U << 2,
+
+	/* A callback worker thread has delivered a transfer callback */
+	USBI_EVENT_CALLBACK_DELIVERED = 1U << 3,
+
+	/* A write coalescer has set a deadline the event handler must wake up
+	 * for */
+	USBI_EVENT_COALESCER_DEADLINE = 1U << 4,
 };
 
 /* Macros for managing event handling state */
@@ -410,7 +554,8 @@ enum usbi_event_flags {
 /* Update the following macro if new event sources are added */
 #define usbi_pending_events(ctx) \
 	((ctx)->event_flags || (ctx)->device_close \
-	 || !list_empty(&(ctx)->hotplug_msgs) || !list_empty(&(ctx)->completed_transfers))
+	 || !list_empty(&(ctx)->hotplug_msgs) || !list_empty(&(ctx)->completed_transfers) \
+	 || !list_empty(&(ctx)->deferred_transfers))
 
 #ifdef USBI_TIMERFD_AVAILABLE
 #define usbi_using_timerfd(ctx) ((ctx)->timerfd >= 0)
@@ -443,10 +588,17 @@ struct libusb_device {
 };
 
 struct libusb_device_handle {
-	/* lock protects claimed_interfaces */
+	/* lock protects claimed_interfaces, altsettings and stats */
 	usbi_mutex_t lock;
 	unsigned long claimed_interfaces;
 
+	/* alternate setting last activated on each claimed interface */
+	uint8_t altsettings[USB_MAXINTERFACES];
+
+	/* per-endpoint statistics, allocated on first use while the context
+	 * collects them (LIBUSB_OPTION_ENDPOINT_STATS) */
+	struct libusb_endpoint_stats *stats[USBI_NUM_ENDPOINT_STATS];
+
 	struct list_head list;
 	struct libusb_device *dev;
 	int auto_detach_kernel_driver;
@@ -476,12 +628,36 @@ struct usbi_transfer {
 	int num_iso_packets;
 	struct list_head list;
 	struct list_head completed_list;
+	struct list_head dispatch_list;
+	/* device the transfer held a reference on, while its callback is
+	 * queued for a worker thread */
+	struct libusb_device *dispatch_dev;
 	struct timeval timeout;
 	int transferred;
 	uint32_t stream_id;
+
+	/* scatter-gather segments, used instead of the transfer buffer while
+	 * that is NULL, see usbi_transfer_has_iov() */
+	struct libusb_iovec *iov;
+	int num_iov;
+
+	/* stream scheduler request the transfer is in flight for, if any */
+	struct usbi_stream_request *stream_request;
+
+	/* frame to start an isochronous transfer in, or LIBUSB_ISO_START_ASAP,
+	 * and the frame each packet was scheduled in, -1 where not known */
+	int iso_start_frame;
+	int *iso_frames;
+
 	uint8_t state_flags;   /* Protected by usbi_transfer->lock */
 	uint8_t timeout_flags; /* Protected by the flying_stransfers_lock */
 
+	/* when the transfer was submitted and completed, recorded while the
+	 * context collects endpoint statistics */
+	uint8_t stats_flags;
+	struct timespec stats_submit_time;
+	struct timespec stats_complete_time;
+
 	/* this lock is held during libusb_submit_transfer() and
 	 * libusb_cancel_transfer() (allowing the OS backend to prevent duplicate
 	 * cancellation, submission-during-cancellation, etc). the OS backend
@@ -505,6 +681,14 @@ enum usbi_transfer_state_flags {
 	USBI_TRANSFER_DEVICE_DISAPPEARED = 1U << 2,
 };
 
+enum usbi_transfer_stats_flags {
+	/* stats_submit_time is valid */
+	USBI_TRANSFER_STATS_SUBMITTED = 1U << 0,
+
+	/* stats_complete_time is valid */
+	USBI_TRANSFER_STATS_COMPLETED = 1U << 1,
+};
+
 enum usbi_transfer_timeout_flags {
 	/* Set by backend submit_transfer() if the OS handles timeout */
 	USBI_TRANSFER_OS_HANDLES_TIMEOUT = 1U << 0,
@@ -523,6 +707,12 @@ enum usbi_transfer_timeout_flags {
 	((struct usbi_transfer *)(((unsigned char *)(transfer))		\
 		- sizeof(struct usbi_transfer)))
 
+static inline int usbi_transfer_has_iov(struct usbi_transfer *transfer)
+{
+	return transfer->num_iov > 0 &&
+		!USBI_TRANSFER_TO_LIBUSB_TRANSFER(transfer)->buffer;
+}
+
 static inline void *usbi_transfer_get_os_priv(struct usbi_transfer *transfer)
 {
 	assert(transfer->num_iso_packets >= 0);
@@ -550,12 +740,60 @@ struct libusb_device *usbi_alloc_device(struct libusb_context *ctx,
 struct libusb_device *usbi_get_device_by_session_id(struct libusb_context *ctx,
 	unsigned long session_id);
 int usbi_sanitize_device(struct libusb_device *dev);
+int usbi_get_endpoint_interval(struct libusb_device_handle *dev_handle,
+	unsigned char endpoint);
+int usbi_wait_device_scan(struct libusb_context *ctx);
 void usbi_handle_disconnect(struct libusb_device_handle *dev_handle);
 
 int usbi_handle_transfer_completion(struct usbi_transfer *itransfer,
 	enum libusb_transfer_status status);
 int usbi_handle_transfer_cancellation(struct usbi_transfer *transfer);
+void usbi_retire_transfer(struct usbi_transfer *itransfer);
+int usbi_handle_os_timeouts(struct libusb_context *ctx,
+	int (*match)(struct usbi_transfer *itransfer, void *arg), void *arg,
+	struct timeval *next_timeout);
+void usbi_notify_callbacks_delivered(struct libusb_context *ctx);
+int usbi_start_event_thread(struct libusb_context *ctx, int num_workers);
+void usbi_stop_event_thread(struct libusb_context *ctx);
+int usbi_set_event_thread_affinity(struct libusb_context *ctx, int cpu);
+int usbi_set_event_thread_priority(struct libusb_context *ctx, int priority);
 void usbi_signal_transfer_completion(struct usbi_transfer *transfer);
+int usbi_set_trace_ring(struct libusb_context *ctx, int size);
+void usbi_trace_record(struct libusb_context *ctx,
+	enum libusb_trace_event_type type, const void *object,
+	unsigned char endpoint, int urb, int status, unsigned int length);
+
+/* Record an event in the calling thread's trace ring. Costs a single branch
+ * while tracing is disabled. */
+#define usbi_trace(ctx, ...) \
+	do { \
+		if ((ctx)->trace_size) \
+			usbi_trace_record((ctx), __VA_ARGS__); \
+	} while (0)
+
+int usbi_set_capture(struct libusb_context *ctx, int fd);
+void usbi_capture_record(struct libusb_context *ctx,
+	struct usbi_transfer *itransfer, char type, int status);
+
+#ifdef USBI_CAPTURE
+#define usbi_capture_active(ctx) \
+	__atomic_load_n(&(ctx)->capture_active, __ATOMIC_RELAXED)
+#else
+#define usbi_capture_active(ctx) ((ctx)->capture_active)
+#endif
+
+/* Capture a transfer event: 'S'ubmission, 'C'ompletion or submission
+ * 'E'rror. Costs a single branch while capture is disabled. */
+#define usbi_capture(ctx, ...) \
+	do { \
+		if (usbi_capture_active(ctx)) \
+			usbi_capture_record((ctx), __VA_ARGS__); \
+	} while (0)
+
+#ifdef USBI_LOCK_PROFILING
+int usbi_get_lock_stats(struct libusb_lock_stats *stats, int count);
+void usbi_reset_lock_stats(void);
+#endif
 
 int usbi_parse_descriptor(const unsigned char *source, const char *descriptor,
 	void *dest, int host_endian);
@@ -583,6 +821,9 @@ struct usbi_pollfd {
 	struct libusb_pollfd pollfd;
 
 	struct list_head list;
+
+	/* position in ctx->pollfds, -1 until the array is next rebuilt */
+	int index;
 };
 
 int usbi_add_pollfd(struct libusb_context *ctx, int fd, short events);
@@ -1157,6 +1398,102 @@ struct usbi_os_backend {
 	 */
 	int (*handle_transfer_completion)(struct usbi_transfer *itransfer);
 
+	/* Reap any already completed transfers without blocking. Optional.
+	 *
+	 * This function is called repeatedly by the thread handling events
+	 * before it goes to sleep in poll(), for as long as the busy-poll budget
+	 * set with LIBUSB_OPTION_BUSY_POLL allows. It must never block. Complete
+	 * transfers exactly as handle_events would.
+	 *
+	 * Return the number of transfers that were reaped (0 if none), or a
+	 * LIBUSB_ERROR code on failure.
+	 */
+	int (*busy_poll)(struct libusb_context *ctx);
+
+	/* Wait for events on the context's poll fds. Optional.
+	 *
+	 * This function replaces poll() in the event handler, e.g. to wait
+	 * through a mechanism other than the poll() system call. It has the
+	 * semantics of poll(): fill in the revents field of fds and return the
+	 * number of fds with events, 0 on timeout, or -1 with errno set on
+	 * failure. modified is non-zero when the set of fds has changed since
+	 * the previous call.
+	 */
+	int (*wait_events)(struct libusb_context *ctx, struct pollfd *fds,
+		POLL_NFDS_TYPE nfds, int modified, int timeout);
+
+	/* Attach an emulated device described by config to the context.
+	 * Optional.
+	 *
+	 * The device must be enumerated and connected to the context before
+	 * this function returns, so that hotplug callbacks learn about it like
+	 * any other device. If dev is non-NULL, return a referenced pointer to
+	 * the new device in it.
+	 *
+	 * Return 0 on success, or a LIBUSB_ERROR code on failure.
+	 */
+	int (*add_loopback_device)(struct libusb_context *ctx,
+		const struct libusb_loopback_device *config,
+		struct libusb_device **dev);
+
+	/* Unplug an emulated device added with add_loopback_device. Optional.
+	 *
+	 * Transfers in flight on the device fail as on a real disconnect.
+	 *
+	 * Return:
+	 * - 0 on success
+	 * - LIBUSB_ERROR_INVALID_PARAM if the device is not emulated
+	 * - LIBUSB_ERROR_NO_DEVICE if it was already removed
+	 */
+	int (*remove_loopback_device)(struct libusb_device *dev);
+
+	/* Attach the devices recorded in a capture file as emulated devices
+	 * that replay the recorded traffic. Optional.
+	 *
+	 * rate is the replay speed in percent of the recorded one, 0 meaning
+	 * as fast as possible. Append each new device to the discovered_devs
+	 * list, enumerated and connected like in add_loopback_device.
+	 *
+	 * Return:
+	 * - 0 on success
+	 * - LIBUSB_ERROR_IO if the file cannot be read
+	 * - LIBUSB_ERROR_NOT_SUPPORTED if it is not a usbmon capture
+	 * - another LIBUSB_ERROR code on other failure
+	 */
+	int (*load_replay)(struct libusb_context *ctx, const char *path,
+		unsigned int rate, struct discovered_devs **devs);
+
+	/* Report how bulk transfers on an endpoint of a device handle are
+	 * split into URBs (LIBUSB_OPTION_BULK_URB_SIZE). Optional.
+	 *
+	 * Return 0 on success or a LIBUSB_ERROR code on failure.
+	 */
+	int (*get_bulk_urb_params)(struct libusb_device_handle *dev_handle,
+		unsigned char endpoint, struct libusb_bulk_urb_params *params);
+
+	/* Report the current (micro)frame number of the bus a device is on,
+	 * in the units of usbi_transfer::iso_frames. Optional.
+	 *
+	 * Return:
+	 * - 0 on success
+	 * - LIBUSB_ERROR_NOT_FOUND if it is not known yet
+	 * - another LIBUSB_ERROR code on other failure
+	 */
+	int (*get_frame_number)(struct libusb_device_handle *dev_handle,
+		int *frame_number);
+
+	/* Enumerate the devices present in the system, for a context whose
+	 * scan was deferred by LIBUSB_OPTION_DEVICE_SCAN. Backends that
+	 * implement this must skip the scan in init() unless
+	 * ctx->device_scan is LIBUSB_DEVICE_SCAN_EAGER, and must allow it to
+	 * run without any of their global locks held by the caller.
+	 *
+	 * Optional, backends that leave it NULL always scan in init().
+	 *
+	 * Return 0 on success or a LIBUSB_ERROR code on failure.
+	 */
+	int (*scan_devices)(struct libusb_context *ctx);
+
 	/* Get time from specified clock. At least two clocks must be implemented
 	   by the backend: USBI_CLOCK_REALTIME, and USBI_CLOCK_MONOTONIC.
 
@@ -0,0 +1,354 @@
+/* -*- Mode: C; c-basic-offset:8 ; indent-tabs-mode:t -*- */
+/*
+ * Linux io_uring event waiting for libusb
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "libusbi.h"
+#include "linux_usbfs.h"
+
+/* The ring replaces poll() in the event handler. Each poll fd has a poll
+ * request armed in the ring. Requests that have not fired stay armed across
+ * iterations; requests that fired are re-armed together with the next wait,
+ * so an iteration costs a single io_uring_enter() however many fds there
+ * are. A freshly armed poll request completes immediately if its fd is
+ * already ready, which keeps the level-triggered behaviour of poll() that
+ * the event pipe relies on.
+ */
+
+#define URING_ENTRIES		64
+
+/* user_data of requests whose completion is not interesting */
+#define URING_IGNORE		UINT64_MAX
+
+struct linux_uring {
+	struct libusb_context *ctx;
+	int fd;
+
+	void *sq_ring;
+	size_t sq_ring_size;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int sq_mask;
+	unsigned int sq_entries;
+	unsigned int *sq_array;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+
+	void *cq_ring;
+	size_t cq_ring_size;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int cq_mask;
+	struct io_uring_cqe *cqes;
+
+	/* poll fds the armed requests belong to. user_data of a poll request is
+	 * the generation in the upper 32 bits and the index in the lower */
+	struct pollfd *fds;
+	unsigned char *armed;
+	POLL_NFDS_TYPE nfds;
+	uint32_t generation;
+};
+
+static int uring_enter(int fd, unsigned int to_submit,
+	unsigned int min_complete, unsigned int flags, void *arg, size_t argsz)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		flags, arg, argsz);
+}
+
+/* number of queued requests not yet consumed by the kernel */
+static unsigned int uring_pending(struct linux_uring *ring)
+{
+	return *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+}
+
+/* hand queued requests to the kernel without waiting for completions */
+static int uring_flush(struct linux_uring *ring)
+{
+	int r;
+
+	while (uring_pending(ring)) {
+		r = uring_enter(ring->fd, uring_pending(ring), 0, 0, NULL, 0);
+		if (r == 0 || (r < 0 && errno != EINTR)) {
+			usbi_err(ring->ctx, "io_uring submit failed errno=%d", errno);
+			return LIBUSB_ERROR_IO;
+		}
+	}
+
+	return 0;
+}
+
+static struct io_uring_sqe *uring_get_sqe(struct linux_uring *ring)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int tail = *ring->sq_tail;
+
+	if (uring_pending(ring) == ring->sq_entries) {
+		if (uring_flush(ring) < 0)
+			return NULL;
+	}
+
+	sqe = &ring->sqes[tail & ring->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sq_array[tail & ring->sq_mask] = tail & ring->sq_mask;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	return sqe;
+}
+
+static int uring_arm(struct linux_uring *ring, POLL_NFDS_TYPE i)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(ring);
+
+	if (!sqe)
+		return LIBUSB_ERROR_IO;
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = ring->fds[i].fd;
+	sqe->poll32_events = (uint16_t)ring->fds[i].events;
+	sqe->user_data = ((uint64_t)ring->generation << 32) | (uint32_t)i;
+	ring->armed[i] = 1;
+
+	return 0;
+}
+
+/* cancel the requests for the previous set of poll fds and take a copy of
+ * the new set */
+static int uring_set_fds(struct linux_uring *ring, struct pollfd *fds,
+	POLL_NFDS_TYPE nfds)
+{
+	struct io_uring_sqe *sqe;
+	struct pollfd *new_fds;
+	unsigned char *new_armed;
+	POLL_NFDS_TYPE i;
+
+	for (i = 0; i < ring->nfds; i++) {
+		if (!ring->armed[i])
+			continue;
+		sqe = uring_get_sqe(ring);
+		if (!sqe)
+			return LIBUSB_ERROR_IO;
+		sqe->opcode = IORING_OP_POLL_REMOVE;
+		sqe->fd = -1;
+		sqe->addr = ((uint64_t)ring->generation << 32) | (uint32_t)i;
+		sqe->user_data = URING_IGNORE;
+		ring->armed[i] = 0;
+	}
+	ring->generation++;
+
+	if (nfds > ring->nfds) {
+		new_fds = realloc(ring->fds, nfds * sizeof(*new_fds));
+		if (!new_fds)
+			return LIBUSB_ERROR_NO_MEM;
+		ring->fds = new_fds;
+
+		new_armed = realloc(ring->armed, nfds);
+		if (!new_armed)
+			return LIBUSB_ERROR_NO_MEM;
+		ring->armed = new_armed;
+	}
+
+	memcpy(ring->fds, fds, nfds * sizeof(*fds));
+	memset(ring->armed, 0, nfds);
+	ring->nfds = nfds;
+
+	return 0;
+}
+
+int linux_uring_create(struct libusb_context *ctx, struct linux_uring **ring_out)
+{
+	struct linux_uring *ring;
+	struct io_uring_params p;
+	void *sq_ring, *cq_ring, *sqes;
+
+	ring = calloc(1, sizeof(*ring));
+	if (!ring)
+		return LIBUSB_ERROR_NO_MEM;
+	ring->ctx = ctx;
+
+	memset(&p, 0, sizeof(p));
+	ring->fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	if (ring->fd < 0) {
+		usbi_dbg("io_uring not available errno=%d", errno);
+		free(ring);
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	}
+
+	/* waiting with a timeout needs IORING_ENTER_EXT_ARG (Linux 5.11) */
+	if (!(p.features & IORING_FEAT_EXT_ARG)) {
+		usbi_dbg("io_uring lacks extended wait arguments");
+		close(ring->fd);
+		free(ring);
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	}
+
+	ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (sq_ring == MAP_FAILED)
+		goto err_close;
+
+	cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	if (cq_ring == MAP_FAILED)
+		goto err_unmap_sq;
+
+	sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED)
+		goto err_unmap_cq;
+
+	ring->sq_ring = sq_ring;
+	ring->sq_head = (unsigned int *)((char *)sq_ring + p.sq_off.head);
+	ring->sq_tail = (unsigned int *)((char *)sq_ring + p.sq_off.tail);
+	ring->sq_mask = *(unsigned int *)((char *)sq_ring + p.sq_off.ring_mask);
+	ring->sq_entries = p.sq_entries;
+	ring->sq_array = (unsigned int *)((char *)sq_ring + p.sq_off.array);
+	ring->sqes = sqes;
+
+	ring->cq_ring = cq_ring;
+	ring->cq_head = (unsigned int *)((char *)cq_ring + p.cq_off.head);
+	ring->cq_tail = (unsigned int *)((char *)cq_ring + p.cq_off.tail);
+	ring->cq_mask = *(unsigned int *)((char *)cq_ring + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)((char *)cq_ring + p.cq_off.cqes);
+
+	usbi_dbg("io_uring event waiting enabled (fd %d)", ring->fd);
+	*ring_out = ring;
+	return LIBUSB_SUCCESS;
+
+err_unmap_cq:
+	munmap(cq_ring, ring->cq_ring_size);
+err_unmap_sq:
+	munmap(sq_ring, ring->sq_ring_size);
+err_close:
+	usbi_err(ctx, "failed to map io_uring errno=%d", errno);
+	close(ring->fd);
+	free(ring);
+	return LIBUSB_ERROR_OTHER;
+}
+
+void linux_uring_destroy(struct linux_uring *ring)
+{
+	if (!ring)
+		return;
+
+	/* closing the ring cancels the outstanding poll requests */
+	munmap(ring->sqes, ring->sqes_size);
+	munmap(ring->cq_ring, ring->cq_ring_size);
+	munmap(ring->sq_ring, ring->sq_ring_size);
+	close(ring->fd);
+	free(ring->fds);
+	free(ring->armed);
+	free(ring);
+}
+
+/* Wait for events on fds like poll(). modified is set when the poll fds
+ * have changed since the previous call. */
+int linux_uring_wait(struct linux_uring *ring, struct pollfd *fds,
+	POLL_NFDS_TYPE nfds, int modified, int timeout)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	struct io_uring_cqe *cqe;
+	unsigned int head, tail;
+	POLL_NFDS_TYPE i;
+	uint64_t user_data;
+	int r, num_ready = 0;
+
+	if (modified || nfds != ring->nfds) {
+		r = uring_set_fds(ring, fds, nfds);
+		if (r < 0)
+			goto err;
+	}
+
+	for (i = 0; i < nfds; i++) {
+		fds[i].revents = 0;
+		if (!ring->armed[i]) {
+			r = uring_arm(ring, i);
+			if (r < 0)
+				goto err;
+		}
+	}
+
+	memset(&arg, 0, sizeof(arg));
+	if (timeout >= 0) {
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (timeout % 1000) * 1000000L;
+		arg.ts = (uint64_t)(uintptr_t)&ts;
+	}
+
+	r = uring_enter(ring->fd, uring_pending(ring), timeout ? 1 : 0,
+		IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+	if (r < 0 && errno != ETIME) {
+		if (errno == EINTR)
+			return -1;
+		usbi_err(ring->ctx, "io_uring wait failed errno=%d", errno);
+		r = LIBUSB_ERROR_IO;
+		goto err;
+	}
+
+	head = *ring->cq_head;
+	tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++) {
+		cqe = &ring->cqes[head & ring->cq_mask];
+		user_data = cqe->user_data;
+
+		if (user_data == URING_IGNORE ||
+		    (uint32_t)(user_data >> 32) != ring->generation)
+			continue;
+
+		i = (POLL_NFDS_TYPE)(uint32_t)user_data;
+		if (i >= nfds)
+			continue;
+
+		ring->armed[i] = 0;
+		if (!fds[i].revents)
+			num_ready++;
+		if (cqe->res < 0)
+			fds[i].revents |= (cqe->res == -EBADF) ? POLLNVAL : POLLERR;
+		else
+			fds[i].revents |= (short)cqe->res;
+	}
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+	return num_ready;
+
+err:
+	/* start over with a fresh set of requests on the next call */
+	ring->nfds = 0;
+	errno = EIO;
+	return -1;
+}
+
+#endif /* HAVE_LINUX_IO_URING_H */
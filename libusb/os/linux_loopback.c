@@ -0,0 +1,1253 @@
+/* -*- Mode: C; c-basic-offset:8 ; indent-tabs-mode:t -*- */
+/*
+ * Linux in-process loopback devices for libusb
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "libusbi.h"
+#include "linux_usbfs.h"
+
+/* Loopback devices are emulated underneath usbfs: opening one hands the
+ * backend a file descriptor that stands in for a usbfs device node, and the
+ * usbfs ioctls issued on it are routed here. Everything above, from URB
+ * submission and reaping to shards, reaper threads and io_uring, runs as it
+ * does for a real device.
+ *
+ * The stand-in is the write end of a pipe shrunk to a single buffer, with
+ * the emulator holding the read end. The pipe is kept full while nothing is
+ * waiting to be reaped, so the fd polls POLLOUT exactly when there are
+ * completed URBs, and the read end is closed when the device is unplugged,
+ * which makes the fd poll POLLERR. That is all a usbfs fd ever reports.
+ *
+ * URBs complete as they are submitted unless their endpoint models latency
+ * or bandwidth, in which case they wait on a list sorted by due time for
+ * the timer thread. All emulator state is protected by loopback_lock. The
+ * data and control callbacks of a device are called with it dropped, so
+ * that they can use the loopback API themselves (to unplug the device, for
+ * instance); the file the URB came in on is pinned meanwhile, and with it
+ * the device, and its close is put off until the callback has returned.
+ *
+ * A device can instead be driven by linux_loopback_ops, which take over the
+ * timing and the outcome of its URBs; the replay of recorded captures is
+ * built on them.
+ */
+
+#define REQUEST_TYPE_MASK	(0x03 << 5)
+#define RECIPIENT_MASK		0x1f
+
+/* never completes; used for URBs that the fault model drops */
+#define DUE_NEVER		UINT64_MAX
+
+struct loopback_endpoint {
+	struct libusb_loopback_endpoint config;
+	unsigned int submitted;
+	int halted;
+	int continuation_disabled;
+	unsigned int num_streams;
+	unsigned int iso_interval;
+	uint64_t busy_until;
+	unsigned char pattern;
+};
+
+struct loopback_device {
+	struct list_head list;
+	struct libusb_context *ctx;
+	uint8_t devaddr;
+	int connected;
+	int open_files;
+	unsigned char *descriptors;
+	int descriptors_len;
+	enum libusb_speed speed;
+	struct loopback_endpoint *endpoints;
+	int num_endpoints;
+	libusb_loopback_control_cb control_cb;
+	void *user_data;
+	const struct linux_loopback_ops *ops;
+	void *ops_data;
+	uint8_t active_config;
+};
+
+struct loopback_file {
+	struct list_head list;
+	struct loopback_device *dev;
+	int fd;
+	int read_fd;
+	int ready;
+	int interrupted;
+	struct list_head done;
+
+	/* callbacks running for the file, and whether it was closed (but not
+	 * freed) meanwhile */
+	int refs;
+	int closed;
+};
+
+struct loopback_urb {
+	struct list_head list;
+	struct loopback_file *file;
+	struct loopback_endpoint *ep;
+	struct usbfs_urb *urb;
+	void *cookie;
+	uint64_t due;
+	int stall;
+};
+
+unsigned char linux_loopback_fds[LINUX_LOOPBACK_FD_MAP];
+int linux_loopback_high_fds;
+
+static pthread_mutex_t loopback_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reap_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+
+/* the timer thread runs while timer_generation is what it was started
+ * with; stopping it bumps the generation, so a thread started while the
+ * previous one is still being joined does not keep that one running */
+static pthread_cond_t timer_cond;
+static int timer_cond_initialized;
+static pthread_t timer_thread;
+static int timer_running;
+static unsigned int timer_generation;
+static int lists_initialized;
+static struct list_head loopback_devices;
+static struct list_head loopback_files;
+static struct list_head loopback_pending;
+
+static uint64_t loopback_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/* the bus counts microframes at high speed and above, and frames below,
+ * in a counter that wraps like that of an EHCI controller */
+static uint64_t frame_ns(struct loopback_device *ldev)
+{
+	return ldev->speed >= LIBUSB_SPEED_HIGH ? 125000 : 1000000;
+}
+
+static int frame_wrap(struct loopback_device *ldev)
+{
+	return ldev->speed >= LIBUSB_SPEED_HIGH ? 16384 : 2048;
+}
+
+static void init_lists(void)
+{
+	if (lists_initialized)
+		return;
+	list_init(&loopback_devices);
+	list_init(&loopback_files);
+	list_init(&loopback_pending);
+	lists_initialized = 1;
+}
+
+static struct loopback_device *find_device(struct libusb_context *ctx,
+	uint8_t devaddr)
+{
+	struct loopback_device *ldev;
+
+	list_for_each_entry(ldev, &loopback_devices, list, struct loopback_device) {
+		if (ldev->ctx == ctx && ldev->devaddr == devaddr && ldev->connected)
+			return ldev;
+	}
+	return NULL;
+}
+
+static void set_loopback_fd(int fd, int set)
+{
+	if (fd < LINUX_LOOPBACK_FD_MAP)
+		__atomic_store_n(&linux_loopback_fds[fd], set ? 1 : 0, __ATOMIC_RELEASE);
+	else
+		__atomic_add_fetch(&linux_loopback_high_fds, set ? 1 : -1, __ATOMIC_RELEASE);
+}
+
+static struct loopback_file *find_file(int fd)
+{
+	struct loopback_file *file;
+
+	if (!lists_initialized)
+		return NULL;
+	list_for_each_entry(file, &loopback_files, list, struct loopback_file) {
+		if (file->fd == fd && !file->closed)
+			return file;
+	}
+	return NULL;
+}
+
+static struct loopback_endpoint *find_endpoint(struct loopback_device *ldev,
+	unsigned int endpoint)
+{
+	int i;
+
+	for (i = 0; i < ldev->num_endpoints; i++) {
+		if (ldev->endpoints[i].config.endpoint == endpoint)
+			return &ldev->endpoints[i];
+	}
+	return NULL;
+}
+
+/* the service interval of an isochronous endpoint, in (micro)frames, from
+ * its first endpoint descriptor */
+static unsigned int iso_interval(struct loopback_device *ldev,
+	unsigned int endpoint)
+{
+	unsigned char *desc = ldev->descriptors;
+	int pos, interval;
+
+	for (pos = 0; pos + 1 < ldev->descriptors_len && desc[pos]; pos += desc[pos]) {
+		if (desc[pos + 1] != LIBUSB_DT_ENDPOINT ||
+		    pos + LIBUSB_DT_ENDPOINT_SIZE > ldev->descriptors_len ||
+		    desc[pos + 2] != endpoint)
+			continue;
+		interval = MIN(MAX(desc[pos + 6], 1), 16);
+		return 1U << (interval - 1);
+	}
+	return 1;
+}
+
+static void free_device(struct loopback_device *ldev)
+{
+	list_del(&ldev->list);
+	free(ldev->descriptors);
+	free(ldev->endpoints);
+	free(ldev);
+}
+
+static void free_file(struct loopback_file *file)
+{
+	struct loopback_urb *lurb, *tmp;
+
+	/* like usbfs, forget whatever was never reaped */
+	list_for_each_entry_safe(lurb, tmp, &loopback_pending, list, struct loopback_urb) {
+		if (lurb->file == file) {
+			list_del(&lurb->list);
+			free(lurb);
+		}
+	}
+	list_for_each_entry_safe(lurb, tmp, &file->done, list, struct loopback_urb) {
+		list_del(&lurb->list);
+		free(lurb);
+	}
+
+	list_del(&file->list);
+	set_loopback_fd(file->fd, 0);
+	file->dev->open_files--;
+	if (file->read_fd >= 0)
+		close(file->read_fd);
+	close(file->fd);
+	free(file);
+}
+
+static void get_file(struct loopback_file *file)
+{
+	file->refs++;
+}
+
+/* free the file once the last callback running for it has returned, if it
+ * was closed meanwhile */
+static void put_file(struct loopback_file *file)
+{
+	struct loopback_device *ldev = file->dev;
+
+	if (--file->refs)
+		return;
+	pthread_cond_broadcast(&idle_cond);
+	if (file->closed) {
+		free_file(file);
+		if (!ldev->connected && !ldev->open_files)
+			free_device(ldev);
+	}
+}
+
+/* keep the pipe empty, so that the fd polls POLLOUT, exactly while the file
+ * has URBs to reap */
+static void update_ready(struct loopback_file *file)
+{
+	int ready = !list_empty(&file->done);
+	char dummy = 0;
+	ssize_t r;
+
+	if (file->read_fd < 0 || ready == file->ready)
+		return;
+
+	if (ready)
+		r = read(file->read_fd, &dummy, 1);
+	else
+		r = write(file->fd, &dummy, 1);
+	if (r != 1)
+		usbi_warn(file->dev->ctx, "loopback pipe %s failed errno=%d",
+			ready ? "read" : "write", errno);
+	file->ready = ready;
+}
+
+static void finish_urb(struct loopback_urb *lurb)
+{
+	list_add_tail(&lurb->list, &lurb->file->done);
+	update_ready(lurb->file);
+	pthread_cond_broadcast(&reap_cond);
+}
+
+static void cancel_urb(struct loopback_urb *lurb, int status)
+{
+	struct usbfs_urb *urb = lurb->urb;
+	int i;
+
+	urb->status = status;
+	urb->actual_length = 0;
+	if (urb->type == USBFS_URB_TYPE_ISO) {
+		for (i = 0; i < urb->number_of_packets; i++) {
+			urb->iso_frame_desc[i].actual_length = 0;
+			urb->iso_frame_desc[i].status = (unsigned int)status;
+		}
+	}
+	finish_urb(lurb);
+}
+
+static int error_status(int error)
+{
+	switch (error) {
+	case LIBUSB_ERROR_PIPE:
+		return -EPIPE;
+	case LIBUSB_ERROR_OVERFLOW:
+		return -EOVERFLOW;
+	default:
+		return -EPROTO;
+	}
+}
+
+/* returns the number of bytes transferred or a libusb error. drops
+ * loopback_lock around the data callback, the caller pins the file */
+static int transfer_data(struct loopback_endpoint *ep, unsigned char *data,
+	int length)
+{
+	int i, r;
+
+	if (ep->config.data_cb) {
+		pthread_mutex_unlock(&loopback_lock);
+		r = ep->config.data_cb(ep->config.endpoint, data, length,
+			ep->config.user_data);
+		pthread_mutex_lock(&loopback_lock);
+		return r > length ? length : r;
+	}
+
+	/* without a callback, IN endpoints return a running byte count and
+	 * OUT endpoints sink everything */
+	if (ep->config.endpoint & LIBUSB_ENDPOINT_IN) {
+		for (i = 0; i < length; i++)
+			data[i] = ep->pattern++;
+	}
+	return length;
+}
+
+static int get_descriptor(struct loopback_device *ldev, uint8_t type,
+	uint8_t index, unsigned char *data, int length)
+{
+	unsigned char *desc = ldev->descriptors + DEVICE_DESC_LENGTH;
+	int remaining = ldev->descriptors_len - DEVICE_DESC_LENGTH;
+	int desc_len = 0;
+
+	switch (type) {
+	case LIBUSB_DT_DEVICE:
+		desc = ldev->descriptors;
+		desc_len = DEVICE_DESC_LENGTH;
+		break;
+	case LIBUSB_DT_CONFIG:
+		while (remaining >= LIBUSB_DT_CONFIG_SIZE) {
+			desc_len = desc[2] | desc[3] << 8;
+			if (desc_len > remaining)
+				desc_len = remaining;
+			if (desc_len < LIBUSB_DT_CONFIG_SIZE) {
+				desc_len = 0;
+				break;
+			}
+			if (!index--)
+				break;
+			desc += desc_len;
+			remaining -= desc_len;
+			desc_len = 0;
+		}
+		if (!desc_len)
+			return -EPIPE;
+		break;
+	default:
+		/* string and class descriptors are up to the control callback */
+		return -ENOSYS;
+	}
+
+	if (desc_len > length)
+		desc_len = length;
+	memcpy(data, desc, desc_len);
+	return desc_len;
+}
+
+/* standard requests that are answered from the device configuration;
+ * returns -ENOSYS for requests left to the control callback */
+static int standard_request(struct loopback_device *ldev,
+	struct libusb_control_setup *setup, unsigned char *data, int length)
+{
+	uint16_t wValue = libusb_le16_to_cpu(setup->wValue);
+	uint16_t wIndex = libusb_le16_to_cpu(setup->wIndex);
+	struct loopback_endpoint *ep;
+
+	switch (setup->bRequest) {
+	case LIBUSB_REQUEST_GET_STATUS:
+		if (length > 2)
+			length = 2;
+		memset(data, 0, length);
+		if ((setup->bmRequestType & RECIPIENT_MASK) == LIBUSB_RECIPIENT_ENDPOINT &&
+		    length > 0) {
+			ep = find_endpoint(ldev, wIndex & 0xff);
+			data[0] = ep && ep->halted;
+		}
+		return length;
+	case LIBUSB_REQUEST_GET_DESCRIPTOR:
+		return get_descriptor(ldev, wValue >> 8, wValue & 0xff, data,
+			length);
+	case LIBUSB_REQUEST_GET_CONFIGURATION:
+		if (length < 1)
+			return 0;
+		data[0] = ldev->active_config;
+		return 1;
+	case LIBUSB_REQUEST_SET_CONFIGURATION:
+		ldev->active_config = wValue & 0xff;
+		return 0;
+	case LIBUSB_REQUEST_SET_INTERFACE:
+		return 0;
+	case LIBUSB_REQUEST_CLEAR_FEATURE:
+		if ((setup->bmRequestType & RECIPIENT_MASK) != LIBUSB_RECIPIENT_ENDPOINT ||
+		    wValue != 0)
+			return -ENOSYS;
+		ep = find_endpoint(ldev, wIndex & 0xff);
+		if (!ep)
+			return -EPIPE;
+		ep->halted = 0;
+		return 0;
+	default:
+		return -ENOSYS;
+	}
+}
+
+/* buffer holds the setup packet followed by up to max_length bytes of data;
+ * returns the number of data bytes transferred or a negative errno. drops
+ * loopback_lock around the control callback, the caller pins the file */
+static int control_request(struct loopback_device *ldev, unsigned char *buffer,
+	int max_length)
+{
+	struct libusb_control_setup *setup = (struct libusb_control_setup *)buffer;
+	unsigned char *data = buffer + LIBUSB_CONTROL_SETUP_SIZE;
+	int length = libusb_le16_to_cpu(setup->wLength);
+	int r = -ENOSYS;
+
+	if (length > max_length)
+		length = max_length;
+
+	if ((setup->bmRequestType & REQUEST_TYPE_MASK) == LIBUSB_REQUEST_TYPE_STANDARD)
+		r = standard_request(ldev, setup, data, length);
+	if (r != -ENOSYS)
+		return r;
+
+	if (!ldev->control_cb)
+		return -EPIPE;
+
+	pthread_mutex_unlock(&loopback_lock);
+	r = ldev->control_cb(setup, data, ldev->user_data);
+	pthread_mutex_lock(&loopback_lock);
+	if (r < 0)
+		return error_status(r);
+	return r > length ? length : r;
+}
+
+/* like usbfs, a failed or short bulk URB cancels the continuation URBs
+ * queued behind it on the endpoint and refuses new ones, until a URB that
+ * starts a new transfer comes along */
+static void cancel_continuation(struct loopback_urb *failed)
+{
+	struct loopback_urb *lurb, *tmp;
+
+	failed->ep->continuation_disabled = 1;
+	list_for_each_entry_safe(lurb, tmp, &loopback_pending, list, struct loopback_urb) {
+		if (lurb->ep == failed->ep && lurb->file == failed->file &&
+		    (lurb->urb->flags & USBFS_URB_BULK_CONTINUATION)) {
+			list_del(&lurb->list);
+			cancel_urb(lurb, -ECONNRESET);
+		}
+	}
+}
+
+static void complete_urb(struct loopback_urb *lurb)
+{
+	struct usbfs_urb *urb = lurb->urb;
+	struct loopback_endpoint *ep = lurb->ep;
+	struct loopback_file *file = lurb->file;
+	struct loopback_device *ldev = file->dev;
+	unsigned char *data;
+	int i, r;
+
+	get_file(file);
+	urb->status = 0;
+	urb->actual_length = 0;
+
+	if (urb->type == USBFS_URB_TYPE_CONTROL) {
+		r = -ENOSYS;
+		if (ldev->ops)
+			r = ldev->ops->complete(ldev->ops_data, urb, lurb->cookie);
+		if (r == -ENOSYS) {
+			r = control_request(ldev, urb->buffer,
+				urb->buffer_length - LIBUSB_CONTROL_SETUP_SIZE);
+			if (r < 0)
+				urb->status = r;
+			else
+				urb->actual_length = r;
+		}
+	} else if (ep->halted || lurb->stall) {
+		ep->halted = 1;
+		urb->status = -EPIPE;
+	} else if (ldev->ops) {
+		ldev->ops->complete(ldev->ops_data, urb, lurb->cookie);
+		if (urb->status == -EPIPE)
+			ep->halted = 1;
+	} else if (urb->type == USBFS_URB_TYPE_ISO) {
+		data = urb->buffer;
+		for (i = 0; i < urb->number_of_packets; i++) {
+			struct usbfs_iso_packet_desc *pkt = &urb->iso_frame_desc[i];
+
+			r = transfer_data(ep, data, (int)pkt->length);
+			pkt->actual_length = r < 0 ? 0 : (unsigned int)r;
+			pkt->status = r < 0 ? (unsigned int)error_status(r) : 0;
+			urb->actual_length += pkt->actual_length;
+			data += pkt->length;
+		}
+	} else {
+		r = transfer_data(ep, urb->buffer, urb->buffer_length);
+		if (r < 0) {
+			urb->status = error_status(r);
+			if (r == LIBUSB_ERROR_PIPE)
+				ep->halted = 1;
+		} else {
+			urb->actual_length = r;
+			if (r < urb->buffer_length &&
+			    (urb->flags & USBFS_URB_SHORT_NOT_OK))
+				urb->status = -EREMOTEIO;
+		}
+	}
+
+	finish_urb(lurb);
+	if (urb->type == USBFS_URB_TYPE_BULK && urb->status < 0)
+		cancel_continuation(lurb);
+	put_file(file);
+}
+
+static void *timer_thread_main(void *arg)
+{
+	unsigned int generation = (unsigned int)(uintptr_t)arg;
+	struct loopback_urb *lurb;
+	struct timespec ts;
+	uint64_t now;
+
+	pthread_mutex_lock(&loopback_lock);
+	while (timer_generation == generation) {
+		now = loopback_now();
+		while (!list_empty(&loopback_pending)) {
+			lurb = list_first_entry(&loopback_pending, struct loopback_urb, list);
+			if (lurb->due > now)
+				break;
+			list_del(&lurb->list);
+			complete_urb(lurb);
+		}
+
+		if (list_empty(&loopback_pending) ||
+		    list_first_entry(&loopback_pending, struct loopback_urb, list)->due == DUE_NEVER) {
+			pthread_cond_wait(&timer_cond, &loopback_lock);
+		} else {
+			lurb = list_first_entry(&loopback_pending, struct loopback_urb, list);
+			ts.tv_sec = (time_t)(lurb->due / 1000000000ULL);
+			ts.tv_nsec = (long)(lurb->due % 1000000000ULL);
+			pthread_cond_timedwait(&timer_cond, &loopback_lock, &ts);
+		}
+	}
+	pthread_mutex_unlock(&loopback_lock);
+
+	return NULL;
+}
+
+static int start_timer_thread(void)
+{
+	pthread_condattr_t attr;
+	int r;
+
+	if (timer_running)
+		return 0;
+
+	if (!timer_cond_initialized) {
+		pthread_condattr_init(&attr);
+		pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+		r = pthread_cond_init(&timer_cond, &attr);
+		pthread_condattr_destroy(&attr);
+		if (r)
+			return LIBUSB_ERROR_OTHER;
+		timer_cond_initialized = 1;
+	}
+
+	r = pthread_create(&timer_thread, NULL, timer_thread_main,
+		(void *)(uintptr_t)timer_generation);
+	if (r)
+		return LIBUSB_ERROR_OTHER;
+	timer_running = 1;
+
+	return 0;
+}
+
+static void queue_urb(struct loopback_urb *lurb)
+{
+	struct list_head *pos;
+
+	/* URBs mostly come due after everything already queued */
+	for (pos = loopback_pending.prev; pos != &loopback_pending; pos = pos->prev) {
+		if (list_entry(pos, struct loopback_urb, list)->due <= lurb->due)
+			break;
+	}
+	list_add(&lurb->list, pos);
+
+	if (loopback_pending.next == &lurb->list)
+		pthread_cond_signal(&timer_cond);
+}
+
+static int submit_urb(struct loopback_file *file, struct usbfs_urb *urb)
+{
+	struct loopback_device *ldev = file->dev;
+	struct loopback_endpoint *ep = NULL;
+	struct loopback_urb *lurb;
+	uint64_t now, start, duration = 0;
+	uint64_t frame = 0;
+
+	if (!ldev->connected)
+		return -ENODEV;
+
+	if (urb->type != USBFS_URB_TYPE_CONTROL) {
+		ep = find_endpoint(ldev, urb->endpoint);
+		if (!ep)
+			return -ENOENT;
+	}
+
+	if (urb->type == USBFS_URB_TYPE_BULK) {
+		/* once streams are allocated, every URB must name one */
+		if (ep->num_streams ? !urb->stream_id ||
+		    urb->stream_id > ep->num_streams : urb->stream_id)
+			return -EINVAL;
+		if (!(urb->flags & USBFS_URB_BULK_CONTINUATION))
+			ep->continuation_disabled = 0;
+		else if (ep->continuation_disabled)
+			return -EREMOTEIO;
+	}
+
+	now = loopback_now();
+
+	/* an isochronous URB starts in the frame after the ones already queued
+	 * on its endpoint, or in the requested one if the endpoint is idle */
+	if (urb->type == USBFS_URB_TYPE_ISO && !ldev->ops) {
+		start = ep->busy_until > now ? ep->busy_until : now;
+		frame = (start + frame_ns(ldev) - 1) / frame_ns(ldev);
+		if (!(urb->flags & USBFS_URB_ISO_ASAP) && ep->busy_until <= now) {
+			int wrap = frame_wrap(ldev);
+			int ahead = (urb->start_frame - (int)(now / frame_ns(ldev) % wrap)) % wrap;
+
+			if (ahead < 0)
+				ahead += wrap;
+			if (ahead == 0 || ahead >= wrap / 2)
+				return -EXDEV;
+			frame = now / frame_ns(ldev) + ahead;
+		}
+		urb->start_frame = (int)(frame % frame_wrap(ldev));
+	}
+
+	lurb = calloc(1, sizeof(*lurb));
+	if (!lurb)
+		return -ENOMEM;
+	lurb->file = file;
+	lurb->ep = ep;
+	lurb->urb = urb;
+
+	lurb->due = now;
+
+	if (ldev->ops) {
+		int64_t delay = ldev->ops->submit(ldev->ops_data, urb, now,
+			&lurb->cookie);
+
+		lurb->due = delay < 0 ? DUE_NEVER : now + (uint64_t)delay;
+	} else if (ep) {
+		ep->submitted++;
+		if (ep->config.drop_every && ep->submitted % ep->config.drop_every == 0)
+			lurb->due = DUE_NEVER;
+		else if (ep->config.stall_every && ep->submitted % ep->config.stall_every == 0)
+			lurb->stall = 1;
+
+		/* an isochronous URB takes one packet per service interval */
+		if (urb->type == USBFS_URB_TYPE_ISO)
+			duration = (uint64_t)urb->number_of_packets *
+				ep->iso_interval * frame_ns(ldev);
+		if (ep->config.bandwidth) {
+			uint64_t wire = (uint64_t)urb->buffer_length * 1000000000ULL /
+				ep->config.bandwidth;
+
+			if (wire > duration)
+				duration = wire;
+		}
+
+		/* transfers on one endpoint take turns on the bus */
+		if (urb->type == USBFS_URB_TYPE_ISO)
+			start = frame * frame_ns(ldev);
+		else
+			start = ep->busy_until > now ? ep->busy_until : now;
+		ep->busy_until = start + duration;
+		if (lurb->due != DUE_NEVER)
+			lurb->due = start + duration + ep->config.latency_us * 1000ULL;
+	}
+
+	if (lurb->due <= now)
+		complete_urb(lurb);
+	else
+		queue_urb(lurb);
+
+	return 0;
+}
+
+static int discard_urb(struct loopback_file *file, struct usbfs_urb *urb)
+{
+	struct loopback_urb *lurb;
+
+	list_for_each_entry(lurb, &loopback_pending, list, struct loopback_urb) {
+		if (lurb->urb == urb && lurb->file == file) {
+			list_del(&lurb->list);
+			cancel_urb(lurb, -ENOENT);
+			return 0;
+		}
+	}
+
+	return -EINVAL;
+}
+
+static int reap_urb(struct loopback_file *file, void **urbp, int block)
+{
+	struct loopback_urb *lurb;
+
+	while (list_empty(&file->done)) {
+		if (!file->dev->connected)
+			return -ENODEV;
+		if (!block)
+			return -EAGAIN;
+		if (file->interrupted) {
+			file->interrupted = 0;
+			return -EINTR;
+		}
+		pthread_cond_wait(&reap_cond, &loopback_lock);
+	}
+
+	lurb = list_first_entry(&file->done, struct loopback_urb, list);
+	list_del(&lurb->list);
+	update_ready(file);
+	*urbp = lurb->urb;
+	free(lurb);
+
+	return 0;
+}
+
+static int sync_control(struct loopback_file *file,
+	struct usbfs_ctrltransfer *ctrl)
+{
+	struct loopback_device *ldev = file->dev;
+	struct libusb_control_setup *setup;
+	struct usbfs_urb urb;
+	unsigned char *buffer;
+	void *cookie = NULL;
+	int r = -ENOSYS;
+
+	if (!file->dev->connected)
+		return -ENODEV;
+
+	buffer = malloc(LIBUSB_CONTROL_SETUP_SIZE + ctrl->wLength);
+	if (!buffer)
+		return -ENOMEM;
+
+	setup = (struct libusb_control_setup *)buffer;
+	setup->bmRequestType = ctrl->bmRequestType;
+	setup->bRequest = ctrl->bRequest;
+	setup->wValue = libusb_cpu_to_le16(ctrl->wValue);
+	setup->wIndex = libusb_cpu_to_le16(ctrl->wIndex);
+	setup->wLength = libusb_cpu_to_le16(ctrl->wLength);
+	if (!(ctrl->bmRequestType & LIBUSB_ENDPOINT_IN))
+		memcpy(buffer + LIBUSB_CONTROL_SETUP_SIZE, ctrl->data, ctrl->wLength);
+
+	/* the ops answer at once, whatever timing they ask for */
+	if (ldev->ops) {
+		memset(&urb, 0, sizeof(urb));
+		urb.type = USBFS_URB_TYPE_CONTROL;
+		urb.buffer = buffer;
+		urb.buffer_length = LIBUSB_CONTROL_SETUP_SIZE + ctrl->wLength;
+		ldev->ops->submit(ldev->ops_data, &urb, loopback_now(), &cookie);
+		r = ldev->ops->complete(ldev->ops_data, &urb, cookie);
+		if (r != -ENOSYS)
+			r = urb.status ? urb.status : urb.actual_length;
+	}
+	if (r == -ENOSYS) {
+		get_file(file);
+		r = control_request(ldev, buffer, ctrl->wLength);
+		put_file(file);
+	}
+	if (r > 0 && (ctrl->bmRequestType & LIBUSB_ENDPOINT_IN))
+		memcpy(ctrl->data, buffer + LIBUSB_CONTROL_SETUP_SIZE, r);
+
+	free(buffer);
+	return r;
+}
+
+/* the device is gone: kill what is in flight and hang up its files */
+static void disconnect_device(struct loopback_device *ldev)
+{
+	struct loopback_urb *lurb, *tmp;
+	struct loopback_file *file;
+
+	ldev->connected = 0;
+
+	list_for_each_entry_safe(lurb, tmp, &loopback_pending, list, struct loopback_urb) {
+		if (lurb->file->dev != ldev)
+			continue;
+		list_del(&lurb->list);
+		cancel_urb(lurb, -ESHUTDOWN);
+	}
+
+	list_for_each_entry(file, &loopback_files, list, struct loopback_file) {
+		if (file->dev == ldev && file->read_fd >= 0) {
+			close(file->read_fd);
+			file->read_fd = -1;
+		}
+	}
+
+	pthread_cond_broadcast(&reap_cond);
+}
+
+int linux_loopback_add_device(struct libusb_context *ctx,
+	const struct libusb_loopback_device *config,
+	const struct linux_loopback_ops *ops, void *ops_data, uint8_t *devaddr)
+{
+	struct loopback_device *ldev, *it;
+	uint8_t addr;
+	int i, r;
+
+	if (!config || !config->descriptors ||
+	    config->descriptors_length < DEVICE_DESC_LENGTH ||
+	    config->descriptors[1] != LIBUSB_DT_DEVICE ||
+	    config->num_endpoints < 0 ||
+	    (config->num_endpoints && !config->endpoints))
+		return LIBUSB_ERROR_INVALID_PARAM;
+	for (i = 0; i < config->num_endpoints; i++) {
+		if (!(config->endpoints[i].endpoint & LIBUSB_ENDPOINT_ADDRESS_MASK))
+			return LIBUSB_ERROR_INVALID_PARAM;
+	}
+
+	ldev = calloc(1, sizeof(*ldev));
+	if (!ldev)
+		return LIBUSB_ERROR_NO_MEM;
+
+	ldev->descriptors = malloc(config->descriptors_length);
+	if (config->num_endpoints)
+		ldev->endpoints = calloc(config->num_endpoints, sizeof(*ldev->endpoints));
+	if (!ldev->descriptors || (config->num_endpoints && !ldev->endpoints)) {
+		free(ldev->descriptors);
+		free(ldev->endpoints);
+		free(ldev);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	memcpy(ldev->descriptors, config->descriptors, config->descriptors_length);
+	ldev->descriptors_len = config->descriptors_length;
+	for (i = 0; i < config->num_endpoints; i++) {
+		ldev->endpoints[i].config = config->endpoints[i];
+		ldev->endpoints[i].iso_interval =
+			iso_interval(ldev, config->endpoints[i].endpoint);
+	}
+	ldev->num_endpoints = config->num_endpoints;
+	ldev->speed = config->speed;
+	ldev->control_cb = config->control_cb;
+	ldev->user_data = config->user_data;
+	ldev->ops = ops;
+	ldev->ops_data = ops_data;
+	ldev->ctx = ctx;
+	ldev->connected = 1;
+
+	/* devices come up configured with their first configuration */
+	if (ldev->descriptors_len >= DEVICE_DESC_LENGTH + LIBUSB_DT_CONFIG_SIZE)
+		ldev->active_config = ldev->descriptors[DEVICE_DESC_LENGTH + 5];
+
+	pthread_mutex_lock(&loopback_lock);
+	init_lists();
+
+	/* take the lowest address no device of the context is using */
+	for (addr = 1; addr < 128; addr++) {
+		list_for_each_entry(it, &loopback_devices, list, struct loopback_device) {
+			if (it->ctx == ctx && it->devaddr == addr)
+				break;
+		}
+		if (&it->list == &loopback_devices)
+			break;
+	}
+	if (addr == 128) {
+		r = LIBUSB_ERROR_OVERFLOW;
+		goto err_unlock;
+	}
+
+	r = start_timer_thread();
+	if (r < 0)
+		goto err_unlock;
+
+	ldev->devaddr = addr;
+	list_add_tail(&ldev->list, &loopback_devices);
+	pthread_mutex_unlock(&loopback_lock);
+
+	usbi_dbg("added loopback device %u", addr);
+	*devaddr = addr;
+	return 0;
+
+err_unlock:
+	pthread_mutex_unlock(&loopback_lock);
+	free(ldev->descriptors);
+	free(ldev->endpoints);
+	free(ldev);
+	return r;
+}
+
+int linux_loopback_remove_device(struct libusb_context *ctx, uint8_t devaddr)
+{
+	struct loopback_device *ldev;
+
+	pthread_mutex_lock(&loopback_lock);
+	ldev = lists_initialized ? find_device(ctx, devaddr) : NULL;
+	if (!ldev) {
+		pthread_mutex_unlock(&loopback_lock);
+		return LIBUSB_ERROR_NO_DEVICE;
+	}
+
+	disconnect_device(ldev);
+	if (!ldev->open_files)
+		free_device(ldev);
+	pthread_mutex_unlock(&loopback_lock);
+
+	usbi_dbg("removed loopback device %u", devaddr);
+	return 0;
+}
+
+void linux_loopback_exit(struct libusb_context *ctx)
+{
+	struct loopback_device *ldev, *tmp_dev;
+	struct loopback_file *file, *tmp_file;
+	pthread_t thread;
+	int stop;
+
+	pthread_mutex_lock(&loopback_lock);
+	if (!lists_initialized) {
+		pthread_mutex_unlock(&loopback_lock);
+		return;
+	}
+
+restart:
+	list_for_each_entry_safe(ldev, tmp_dev, &loopback_devices, list, struct loopback_device) {
+		if (ldev->ctx != ctx)
+			continue;
+		if (ldev->connected)
+			disconnect_device(ldev);
+		/* handles left open across libusb_exit() are never closed. wait
+		 * for callbacks still running on another thread, which may free
+		 * files and devices as they return */
+		list_for_each_entry_safe(file, tmp_file, &loopback_files, list, struct loopback_file) {
+			if (file->dev != ldev)
+				continue;
+			if (file->refs) {
+				pthread_cond_wait(&idle_cond, &loopback_lock);
+				goto restart;
+			}
+			free_file(file);
+		}
+		free_device(ldev);
+	}
+
+	/* mark the timer stopped before dropping the lock, so that a device
+	 * added meanwhile starts a new thread instead of relying on this one */
+	stop = timer_running && list_empty(&loopback_devices);
+	if (stop) {
+		thread = timer_thread;
+		timer_generation++;
+		timer_running = 0;
+		pthread_cond_broadcast(&timer_cond);
+	}
+	pthread_mutex_unlock(&loopback_lock);
+
+	if (stop)
+		pthread_join(thread, NULL);
+}
+
+int linux_loopback_get_descriptors(struct libusb_device *dev,
+	unsigned char **descriptors)
+{
+	struct loopback_device *ldev;
+	unsigned char *buffer;
+	int len;
+
+	pthread_mutex_lock(&loopback_lock);
+	ldev = lists_initialized ? find_device(DEVICE_CTX(dev), dev->device_address) : NULL;
+	if (!ldev) {
+		pthread_mutex_unlock(&loopback_lock);
+		return LIBUSB_ERROR_NO_DEVICE;
+	}
+
+	len = ldev->descriptors_len;
+	buffer = malloc(len);
+	if (buffer) {
+		memcpy(buffer, ldev->descriptors, len);
+		dev->speed = ldev->speed;
+	}
+	pthread_mutex_unlock(&loopback_lock);
+
+	if (!buffer)
+		return LIBUSB_ERROR_NO_MEM;
+
+	*descriptors = buffer;
+	return len;
+}
+
+int linux_loopback_open(struct libusb_device *dev)
+{
+	struct libusb_context *ctx = DEVICE_CTX(dev);
+	struct loopback_device *ldev;
+	struct loopback_file *file;
+	char dummy = 0;
+	int pipefd[2];
+
+	file = calloc(1, sizeof(*file));
+	if (!file)
+		return LIBUSB_ERROR_NO_MEM;
+
+	if (pipe2(pipefd, O_NONBLOCK | O_CLOEXEC) < 0) {
+		usbi_err(ctx, "failed to create loopback pipe errno=%d", errno);
+		free(file);
+		return LIBUSB_ERROR_OTHER;
+	}
+
+	/* a single byte has to fill the pipe */
+	if (fcntl(pipefd[1], F_SETPIPE_SZ, 1) < 0 ||
+	    write(pipefd[1], &dummy, 1) != 1) {
+		usbi_err(ctx, "failed to set up loopback pipe errno=%d", errno);
+		goto err_close;
+	}
+
+	pthread_mutex_lock(&loopback_lock);
+	ldev = lists_initialized ? find_device(ctx, dev->device_address) : NULL;
+	if (!ldev) {
+		pthread_mutex_unlock(&loopback_lock);
+		close(pipefd[0]);
+		close(pipefd[1]);
+		free(file);
+		return LIBUSB_ERROR_NO_DEVICE;
+	}
+
+	file->dev = ldev;
+	file->fd = pipefd[1];
+	file->read_fd = pipefd[0];
+	list_init(&file->done);
+	list_add_tail(&file->list, &loopback_files);
+	ldev->open_files++;
+	set_loopback_fd(pipefd[1], 1);
+	pthread_mutex_unlock(&loopback_lock);
+
+	return pipefd[1];
+
+err_close:
+	close(pipefd[0]);
+	close(pipefd[1]);
+	free(file);
+	return LIBUSB_ERROR_OTHER;
+}
+
+int linux_loopback_close(int fd)
+{
+	struct loopback_file *file;
+	struct loopback_device *ldev;
+
+	pthread_mutex_lock(&loopback_lock);
+	file = find_file(fd);
+	if (!file) {
+		pthread_mutex_unlock(&loopback_lock);
+		return 0;
+	}
+
+	/* a callback running for the file frees it when it returns */
+	if (file->refs) {
+		file->closed = 1;
+		pthread_mutex_unlock(&loopback_lock);
+		return 1;
+	}
+
+	ldev = file->dev;
+	free_file(file);
+	if (!ldev->connected && !ldev->open_files)
+		free_device(ldev);
+	pthread_mutex_unlock(&loopback_lock);
+
+	return 1;
+}
+
+/* streams only exist on SuperSpeed devices, where as many as are asked for
+ * are granted */
+static int set_streams(struct loopback_device *ldev,
+	struct usbfs_streams *streams, int alloc)
+{
+	struct loopback_endpoint *ep;
+	unsigned int i;
+
+	if (!ldev->connected)
+		return -ENODEV;
+	if (ldev->speed < LIBUSB_SPEED_SUPER || !streams->num_eps ||
+	    (alloc && !streams->num_streams))
+		return -EINVAL;
+
+	for (i = 0; i < streams->num_eps; i++) {
+		if (!find_endpoint(ldev, streams->eps[i]))
+			return -EINVAL;
+	}
+
+	for (i = 0; i < streams->num_eps; i++) {
+		ep = find_endpoint(ldev, streams->eps[i]);
+		ep->num_streams = alloc ? streams->num_streams : 0;
+	}
+
+	return alloc ? (int)streams->num_streams : 0;
+}
+
+int linux_loopback_ioctl(int fd, unsigned long request, void *arg, int *result)
+{
+	struct loopback_file *file;
+	struct loopback_device *ldev;
+	struct loopback_endpoint *ep;
+	struct usbfs_connectinfo *ci;
+	int i, r;
+
+	pthread_mutex_lock(&loopback_lock);
+	file = find_file(fd);
+	if (!file) {
+		pthread_mutex_unlock(&loopback_lock);
+		return 0;
+	}
+	ldev = file->dev;
+
+	switch (request) {
+	case IOCTL_USBFS_SUBMITURB:
+		r = submit_urb(file, arg);
+		break;
+	case IOCTL_USBFS_DISCARDURB:
+		r = discard_urb(file, arg);
+		break;
+	case IOCTL_USBFS_REAPURB:
+		r = reap_urb(file, arg, 1);
+		break;
+	case IOCTL_USBFS_REAPURBNDELAY:
+		r = reap_urb(file, arg, 0);
+		break;
+	case IOCTL_USBFS_CONTROL:
+		r = sync_control(file, arg);
+		break;
+	case IOCTL_USBFS_GET_CAPABILITIES:
+		*(uint32_t *)arg = USBFS_CAP_ZERO_PACKET | USBFS_CAP_BULK_CONTINUATION |
+			USBFS_CAP_BULK_SCATTER_GATHER | USBFS_CAP_REAP_AFTER_DISCONNECT;
+		r = 0;
+		break;
+	case IOCTL_USBFS_CONNECTINFO:
+		ci = arg;
+		ci->devnum = ldev->devaddr;
+		ci->slow = ldev->speed == LIBUSB_SPEED_LOW;
+		r = 0;
+		break;
+	case IOCTL_USBFS_SETCONFIG:
+		r = ldev->connected ? 0 : -ENODEV;
+		if (!r)
+			ldev->active_config = *(int *)arg < 0 ? 0 : (uint8_t)*(int *)arg;
+		break;
+	case IOCTL_USBFS_CLEAR_HALT:
+		ep = find_endpoint(ldev, *(unsigned int *)arg);
+		r = ldev->connected ? (ep ? 0 : -ENOENT) : -ENODEV;
+		if (!r)
+			ep->halted = 0;
+		break;
+	case IOCTL_USBFS_RESET:
+		r = ldev->connected ? 0 : -ENODEV;
+		for (i = 0; !r && i < ldev->num_endpoints; i++)
+			ldev->endpoints[i].halted = 0;
+		break;
+	case IOCTL_USBFS_CLAIMINTF:
+	case IOCTL_USBFS_RELEASEINTF:
+	case IOCTL_USBFS_SETINTF:
+	case IOCTL_USBFS_DISCONNECT_CLAIM:
+		r = ldev->connected ? 0 : -ENODEV;
+		break;
+	case IOCTL_USBFS_ALLOC_STREAMS:
+	case IOCTL_USBFS_FREE_STREAMS:
+		r = set_streams(ldev, arg, request == IOCTL_USBFS_ALLOC_STREAMS);
+		break;
+	case IOCTL_USBFS_GETDRIVER:
+	case IOCTL_USBFS_IOCTL:
+		/* no kernel driver is ever bound */
+		r = -ENODATA;
+		break;
+	default:
+		r = -ENOTTY;
+		break;
+	}
+	pthread_mutex_unlock(&loopback_lock);
+
+	if (r < 0) {
+		errno = -r;
+		*result = -1;
+	} else {
+		*result = r;
+	}
+	return 1;
+}
+
+/* a signal does not interrupt the wait of a blocking reap on a loopback fd
+ * like it does REAPURB; this makes the next one (or the current one) fail
+ * with EINTR instead */
+void linux_loopback_interrupt(int fd)
+{
+	struct loopback_file *file;
+
+	pthread_mutex_lock(&loopback_lock);
+	file = find_file(fd);
+	if (file) {
+		file->interrupted = 1;
+		pthread_cond_broadcast(&reap_cond);
+	}
+	pthread_mutex_unlock(&loopback_lock);
+}
@@ -39,12 +39,20 @@
 
 #include <sys/socket.h>
 #include <linux/netlink.h>
+#ifdef HAVE_LINUX_FILTER_H
+#include <linux/filter.h>
+#endif
 
 #include "libusbi.h"
 #include "linux_usbfs.h"
 
 #define NL_GROUP_KERNEL 1
 
+/* number of messages drained from the socket per receive call, and the
+ * maximum size of a single uevent message */
+#define NL_MSG_BATCH	8
+#define NL_MSG_SIZE	2048
+
 #ifndef SOCK_CLOEXEC
 #define SOCK_CLOEXEC	0
 #endif
@@ -59,6 +67,41 @@ static pthread_t libusb_linux_event_thread;
 
 static void *linux_netlink_event_thread_main(void *arg);
 
+#ifdef HAVE_LINUX_FILTER_H
+/* Kernel uevents start with an "<action>@<devpath>" header. We are only ever
+ * interested in "add" and "remove" actions, so have the kernel drop all other
+ * messages (bind, unbind, change, move, online, offline...) before they get
+ * queued on the socket and wake up the event thread. The SUBSYSTEM and
+ * DEVTYPE keys live at variable offsets which classic BPF cannot scan for,
+ * so those are still checked in linux_netlink_parse().
+ *
+ * Note that absolute loads are performed in network byte order. */
+static struct sock_filter netlink_filter_insns[] = {
+	BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 0),
+	/* "add@" */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x61646440, 3, 0),
+	/* "remo" */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x72656d6f, 0, 3),
+	BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 3),
+	/* "ove@" */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x6f766540, 0, 1),
+	BPF_STMT(BPF_RET | BPF_K, 0xffffffff),
+	BPF_STMT(BPF_RET | BPF_K, 0),
+};
+
+static void netlink_attach_filter(int fd)
+{
+	struct sock_fprog prog = {
+		.len = ARRAYSIZE(netlink_filter_insns),
+		.filter = netlink_filter_insns,
+	};
+
+	/* not fatal, all messages are validated again in userspace */
+	if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) == -1)
+		usbi_dbg("failed to attach netlink socket filter (%d)", errno);
+}
+#endif
+
 static int set_fd_cloexec_nb(int fd, int socktype)
 {
 	int flags;
@@ -131,38 +174,70 @@ int linux_netlink_start_event_monitor(void)
 		goto err_close_socket;
 	}
 
+#ifdef HAVE_LINUX_FILTER_H
+	netlink_attach_filter(linux_netlink_socket);
+#endif
+
+	ret = linux_netlink_start_event_thread();
+	if (ret != LIBUSB_SUCCESS)
+		goto err_close_socket;
+
+	return LIBUSB_SUCCESS;
+
+err_close_socket:
+	close(linux_netlink_socket);
+	linux_netlink_socket = -1;
+err:
+	return LIBUSB_ERROR_OTHER;
+}
+
+int linux_netlink_stop_event_monitor(void)
+{
+	assert(linux_netlink_socket != -1);
+
+	linux_netlink_stop_event_thread();
+
+	close(linux_netlink_socket);
+	linux_netlink_socket = -1;
+
+	return LIBUSB_SUCCESS;
+}
+
+int linux_netlink_start_event_thread(void)
+{
+	int ret;
+
+	assert(linux_netlink_socket != -1);
+	assert(netlink_control_pipe[0] == -1);
+
 	ret = usbi_pipe(netlink_control_pipe);
 	if (ret) {
 		usbi_err(NULL, "failed to create netlink control pipe");
-		goto err_close_socket;
+		return LIBUSB_ERROR_OTHER;
 	}
 
 	ret = pthread_create(&libusb_linux_event_thread, NULL, linux_netlink_event_thread_main, NULL);
 	if (ret != 0) {
 		usbi_err(NULL, "failed to create netlink event thread (%d)", ret);
-		goto err_close_pipe;
+		close(netlink_control_pipe[0]);
+		close(netlink_control_pipe[1]);
+		netlink_control_pipe[0] = -1;
+		netlink_control_pipe[1] = -1;
+		return LIBUSB_ERROR_OTHER;
 	}
 
 	return LIBUSB_SUCCESS;
-
-err_close_pipe:
-	close(netlink_control_pipe[0]);
-	close(netlink_control_pipe[1]);
-	netlink_control_pipe[0] = -1;
-	netlink_control_pipe[1] = -1;
-err_close_socket:
-	close(linux_netlink_socket);
-	linux_netlink_socket = -1;
-err:
-	return LIBUSB_ERROR_OTHER;
 }
 
-int linux_netlink_stop_event_monitor(void)
+void linux_netlink_stop_event_thread(void)
 {
 	char dummy = 1;
 	ssize_t r;
 
-	assert(linux_netlink_socket != -1);
+	/* the thread is not running when the monitor is being serviced
+	 * from a context's event loop */
+	if (netlink_control_pipe[1] == -1)
+		return;
 
 	/* Write some dummy data to the control pipe and
 	 * wait for the thread to exit */
@@ -172,37 +247,85 @@ int linux_netlink_stop_event_monitor(void)
 
 	pthread_join(libusb_linux_event_thread, NULL);
 
-	close(linux_netlink_socket);
-	linux_netlink_socket = -1;
-
 	/* close and reset control pipe */
 	close(netlink_control_pipe[0]);
 	close(netlink_control_pipe[1]);
 	netlink_control_pipe[0] = -1;
 	netlink_control_pipe[1] = -1;
+}
 
-	return LIBUSB_SUCCESS;
+int linux_netlink_get_monitor_fd(void)
+{
+	return linux_netlink_socket;
 }
 
-static const char *netlink_message_parse(const char *buffer, size_t len, const char *key)
+/* the uevent keys we are interested in, as found by netlink_message_parse() */
+struct netlink_uevent {
+	const char *action;
+	const char *subsystem;
+	const char *devtype;
+	const char *busnum;
+	const char *devnum;
+	const char *devpath;
+	const char *device;
+};
+
+#define NL_KEY_MATCHES(entry, keylen, key) \
+	((keylen) == sizeof(key) - 1 && memcmp(entry, key, sizeof(key) - 1) == 0)
+
+/* walk the NUL separated KEY=value pairs of a message once, picking out all
+ * the keys we need. buffer must be NUL terminated at buffer[len]. */
+static void netlink_message_parse(const char *buffer, size_t len,
+	struct netlink_uevent *uevent)
 {
 	const char *end = buffer + len;
-	size_t keylen = strlen(key);
+
+	memset(uevent, 0, sizeof(*uevent));
 
 	while (buffer < end && *buffer) {
-		if (strncmp(buffer, key, keylen) == 0 && buffer[keylen] == '=')
-			return buffer + keylen + 1;
-		buffer += strlen(buffer) + 1;
-	}
+		size_t entry_len = strlen(buffer);
+		const char *eq = memchr(buffer, '=', entry_len);
+
+		if (eq) {
+			size_t keylen = (size_t)(eq - buffer);
+			const char *value = eq + 1;
+
+			switch (buffer[0]) {
+			case 'A':
+				if (NL_KEY_MATCHES(buffer, keylen, "ACTION"))
+					uevent->action = value;
+				break;
+			case 'B':
+				if (NL_KEY_MATCHES(buffer, keylen, "BUSNUM"))
+					uevent->busnum = value;
+				break;
+			case 'D':
+				if (NL_KEY_MATCHES(buffer, keylen, "DEVTYPE"))
+					uevent->devtype = value;
+				else if (NL_KEY_MATCHES(buffer, keylen, "DEVNUM"))
+					uevent->devnum = value;
+				else if (NL_KEY_MATCHES(buffer, keylen, "DEVPATH"))
+					uevent->devpath = value;
+				else if (NL_KEY_MATCHES(buffer, keylen, "DEVICE"))
+					uevent->device = value;
+				break;
+			case 'S':
+				if (NL_KEY_MATCHES(buffer, keylen, "SUBSYSTEM"))
+					uevent->subsystem = value;
+				break;
+			}
+		}
 
-	return NULL;
+		buffer += entry_len + 1;
+	}
 }
 
 /* parse parts of netlink message common to both libudev and the kernel */
 static int linux_netlink_parse(const char *buffer, size_t len, int *detached,
 	const char **sys_name, uint8_t *busnum, uint8_t *devaddr)
 {
-	const char *tmp, *slash;
+	struct netlink_uevent uevent;
+	const char *slash;
 
 	errno = 0;
 
@@ -211,58 +334,54 @@ static int linux_netlink_parse(const char *buffer, size_t len, int *detached,
 	*busnum   = 0;
 	*devaddr  = 0;
 
-	tmp = netlink_message_parse(buffer, len, "ACTION");
-	if (!tmp) {
+	netlink_message_parse(buffer, len, &uevent);
+
+	if (!uevent.action) {
 		return -1;
-	} else if (strcmp(tmp, "remove") == 0) {
+	} else if (strcmp(uevent.action, "remove") == 0) {
 		*detached = 1;
-	} else if (strcmp(tmp, "add") != 0) {
-		usbi_dbg("unknown device action %s", tmp);
+	} else if (strcmp(uevent.action, "add") != 0) {
+		usbi_dbg("unknown device action %s", uevent.action);
 		return -1;
 	}
 
 	/* check that this is a usb message */
-	tmp = netlink_message_parse(buffer, len, "SUBSYSTEM");
-	if (!tmp || strcmp(tmp, "usb") != 0) {
+	if (!uevent.subsystem || strcmp(uevent.subsystem, "usb") != 0) {
 		/* not usb. ignore */
 		return -1;
 	}
 
 	/* check that this is an actual usb device */
-	tmp = netlink_message_parse(buffer, len, "DEVTYPE");
-	if (!tmp || strcmp(tmp, "usb_device") != 0) {
+	if (!uevent.devtype || strcmp(uevent.devtype, "usb_device") != 0) {
 		/* not usb. ignore */
 		return -1;
 	}
 
-	tmp = netlink_message_parse(buffer, len, "BUSNUM");
-	if (tmp) {
-		*busnum = (uint8_t)(strtoul(tmp, NULL, 10) & 0xff);
+	if (uevent.busnum) {
+		*busnum = (uint8_t)(strtoul(uevent.busnum, NULL, 10) & 0xff);
 		if (errno) {
 			errno = 0;
 			return -1;
 		}
 
-		tmp = netlink_message_parse(buffer, len, "DEVNUM");
-		if (NULL == tmp)
+		if (NULL == uevent.devnum)
 			return -1;
 
-		*devaddr = (uint8_t)(strtoul(tmp, NULL, 10) & 0xff);
+		*devaddr = (uint8_t)(strtoul(uevent.devnum, NULL, 10) & 0xff);
 		if (errno) {
 			errno = 0;
 			return -1;
 		}
 	} else {
 		/* no bus number. try "DEVICE" */
-		tmp = netlink_message_parse(buffer, len, "DEVICE");
-		if (!tmp) {
+		if (!uevent.device) {
 			/* not usb. ignore */
 			return -1;
 		}
 
 		/* Parse a device path such as /dev/bus/usb/003/004 */
-		slash = strrchr(tmp, '/');
-		if (!slash)
+		slash = strrchr(uevent.device, '/');
+		if (!slash || slash - uevent.device < 3)
 			return -1;
 
 		*busnum = (uint8_t)(strtoul(slash - 3, NULL, 10) & 0xff);
@@ -280,11 +399,10 @@ static int linux_netlink_parse(const char *buffer, size_t len, int *detached,
 		return 0;
 	}
 
-	tmp = netlink_message_parse(buffer, len, "DEVPATH");
-	if (!tmp)
+	if (!uevent.devpath)
 		return -1;
 
-	slash = strrchr(tmp, '/');
+	slash = strrchr(uevent.devpath, '/');
 	if (slash)
 		*sys_name = slash + 1;
 
@@ -292,44 +410,28 @@ static int linux_netlink_parse(const char *buffer, size_t len, int *detached,
 	return 0;
 }
 
-static int linux_netlink_read_message(void)
+static int linux_netlink_handle_message(struct msghdr *msg, char *msg_buffer,
+	size_t len)
 {
-	char cred_buffer[CMSG_SPACE(sizeof(struct ucred))];
-	char msg_buffer[2048];
 	const char *sys_name = NULL;
 	uint8_t busnum, devaddr;
 	int detached, r;
-	ssize_t len;
 	struct cmsghdr *cmsg;
 	struct ucred *cred;
-	struct sockaddr_nl sa_nl;
-	struct iovec iov = { .iov_base = msg_buffer, .iov_len = sizeof(msg_buffer) };
-	struct msghdr msg = {
-		.msg_iov = &iov, .msg_iovlen = 1,
-		.msg_control = cred_buffer, .msg_controllen = sizeof(cred_buffer),
-		.msg_name = &sa_nl, .msg_namelen = sizeof(sa_nl)
-	};
-
-	/* read netlink message */
-	len = recvmsg(linux_netlink_socket, &msg, 0);
-	if (len == -1) {
-		if (errno != EAGAIN && errno != EINTR)
-			usbi_err(NULL, "error receiving message from netlink (%d)", errno);
-		return -1;
-	}
+	struct sockaddr_nl *sa_nl = msg->msg_name;
 
-	if (len < 32 || (msg.msg_flags & MSG_TRUNC)) {
+	if (len < 32 || (msg->msg_flags & MSG_TRUNC)) {
 		usbi_err(NULL, "invalid netlink message length");
 		return -1;
 	}
 
-	if (sa_nl.nl_groups != NL_GROUP_KERNEL || sa_nl.nl_pid != 0) {
+	if (sa_nl->nl_groups != NL_GROUP_KERNEL || sa_nl->nl_pid != 0) {
 		usbi_dbg("ignoring netlink message from unknown group/PID (%u/%u)",
-			 (unsigned int)sa_nl.nl_groups, (unsigned int)sa_nl.nl_pid);
+			 (unsigned int)sa_nl->nl_groups, (unsigned int)sa_nl->nl_pid);
 		return -1;
 	}
 
-	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg = CMSG_FIRSTHDR(msg);
 	if (!cmsg || cmsg->cmsg_type != SCM_CREDENTIALS) {
 		usbi_dbg("ignoring netlink message with no sender credentials");
 		return -1;
@@ -341,7 +443,10 @@ static int linux_netlink_read_message(void)
 		return -1;
 	}
 
-	r = linux_netlink_parse(msg_buffer, (size_t)len, &detached, &sys_name, &busnum, &devaddr);
+	/* the kernel terminates every key, but don't rely on it */
+	msg_buffer[len] = '\0';
+
+	r = linux_netlink_parse(msg_buffer, len, &detached, &sys_name, &busnum, &devaddr);
 	if (r)
 		return r;
 
@@ -357,6 +462,82 @@ static int linux_netlink_read_message(void)
 	return 0;
 }
 
+#ifdef HAVE_RECVMMSG
+typedef struct mmsghdr netlink_msg;
+#else
+/* same layout as struct mmsghdr, which only comes with recvmmsg() */
+typedef struct {
+	struct msghdr msg_hdr;
+	unsigned int msg_len;
+} netlink_msg;
+#endif
+
+/* receive up to count messages in one go. returns the number of messages
+ * received or -1 on error. */
+static int linux_netlink_recv(netlink_msg *msgs, unsigned int count)
+{
+	ssize_t len;
+
+#ifdef HAVE_RECVMMSG
+	static int has_recvmmsg = 1;
+
+	if (has_recvmmsg) {
+		int r = recvmmsg(linux_netlink_socket, msgs, count, 0, NULL);
+		if (r != -1 || errno != ENOSYS)
+			return r;
+		usbi_dbg("recvmmsg not available, falling back to recvmsg");
+		has_recvmmsg = 0;
+	}
+#endif
+	UNUSED(count);
+
+	len = recvmsg(linux_netlink_socket, &msgs[0].msg_hdr, 0);
+	if (len == -1)
+		return -1;
+
+	msgs[0].msg_len = (unsigned int)len;
+	return 1;
+}
+
+/* drain a batch of pending messages from the netlink socket. returns 0 if at
+ * least one message was received (whether it was of interest or not), or -1
+ * if there was nothing to read. */
+static int linux_netlink_read_message(void)
+{
+	char cred_buffer[NL_MSG_BATCH][CMSG_SPACE(sizeof(struct ucred))];
+	char msg_buffer[NL_MSG_BATCH][NL_MSG_SIZE + 1];
+	struct sockaddr_nl sa_nl[NL_MSG_BATCH];
+	struct iovec iov[NL_MSG_BATCH];
+	netlink_msg msgs[NL_MSG_BATCH];
+	int i, count;
+
+	memset(msgs, 0, sizeof(msgs));
+	for (i = 0; i < NL_MSG_BATCH; i++) {
+		iov[i].iov_base = msg_buffer[i];
+		iov[i].iov_len = NL_MSG_SIZE;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_control = cred_buffer[i];
+		msgs[i].msg_hdr.msg_controllen = sizeof(cred_buffer[i]);
+		msgs[i].msg_hdr.msg_name = &sa_nl[i];
+		msgs[i].msg_hdr.msg_namelen = sizeof(sa_nl[i]);
+	}
+
+	/* read netlink messages */
+	count = linux_netlink_recv(msgs, NL_MSG_BATCH);
+	if (count == -1) {
+		if (errno != EAGAIN && errno != EINTR)
+			usbi_err(NULL, "error receiving message from netlink (%d)", errno);
+		return -1;
+	}
+
+	for (i = 0; i < count; i++)
+		linux_netlink_handle_message(&msgs[i].msg_hdr, msg_buffer[i],
+			msgs[i].msg_len);
+
+	return 0;
+}
+
 static void *linux_netlink_event_thread_main(void *arg)
 {
 	char dummy;
@@ -0,0 +1,1025 @@
+/* -*- Mode: C; c-basic-offset:8 ; indent-tabs-mode:t -*- */
+/*
+ * Linux replay of recorded USB captures for libusb
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "libusbi.h"
+#include "linux_usbfs.h"
+
+/* A capture is read into memory as a whole and turned into a list of
+ * completed transfers per device and endpoint, paired with their
+ * submissions by URB id. Each recorded device becomes a loopback device
+ * whose URBs are driven by the ops below instead of the emulator's model:
+ * control requests are looked up by their setup packet, everything else
+ * takes the next recorded completion of its endpoint. The recorded data
+ * is not copied; records point into the file buffer, which lives as long
+ * as the replay.
+ *
+ * The ops are called with the emulator lock held, which also protects the
+ * replay cursors. Replays are torn down with their context, after the
+ * emulator has let go of their devices.
+ */
+
+#define PCAPNG_SHB		0x0a0d0d0a
+#define PCAPNG_IDB		0x00000001
+#define PCAPNG_SPB		0x00000003
+#define PCAPNG_EPB		0x00000006
+#define PCAPNG_BYTE_ORDER	0x1a2b3c4d
+#define PCAP_MAGIC		0xa1b2c3d4
+#define PCAP_MAGIC_NS		0xa1b23c4d
+
+#define LINKTYPE_USB_LINUX		189
+#define LINKTYPE_USB_LINUX_MMAPPED	220
+
+#define USBMON_HEADER_LEN		48
+#define USBMON_MMAPPED_HEADER_LEN	64
+#define USBMON_ISO_DESC_LEN		16
+
+#define USBMON_XFER_ISO		0
+#define USBMON_XFER_INTR	1
+#define USBMON_XFER_CONTROL	2
+#define USBMON_XFER_BULK	3
+
+#define MAX_INTERFACES		32
+#define MAX_CONFIGS		8
+#define MAX_ENDPOINTS		30
+
+/* the layout of a usbmon packet header; the first 48 bytes are all there
+ * is of it with LINKTYPE_USB_LINUX */
+struct usbmon_packet {
+	uint64_t id;
+	uint8_t type;
+	uint8_t xfer_type;
+	uint8_t epnum;
+	uint8_t devnum;
+	uint16_t busnum;
+	char flag_setup;
+	char flag_data;
+	int64_t ts_sec;
+	int32_t ts_usec;
+	int32_t status;
+	uint32_t length;
+	uint32_t len_cap;
+	uint8_t setup[LIBUSB_CONTROL_SETUP_SIZE];
+	int32_t interval;
+	int32_t start_frame;
+	uint32_t xfer_flags;
+	uint32_t ndesc;
+};
+
+struct usbmon_iso_packet {
+	int32_t status;
+	uint32_t offset;
+	uint32_t length;
+	uint32_t pad;
+};
+
+struct replay_record {
+	uint64_t submitted;
+	uint64_t completed;
+	int status;
+	uint32_t length;
+	uint8_t setup[LIBUSB_CONTROL_SETUP_SIZE];
+	const unsigned char *data;
+	uint32_t data_len;
+	const unsigned char *packets;
+	int num_packets;
+	int used;
+};
+
+struct replay_endpoint {
+	unsigned char address;
+	uint8_t xfer_type;
+	uint32_t max_length;
+	struct replay_record *records;
+	int num_records;
+	int max_records;
+	int next;
+};
+
+struct replay_device {
+	struct replay *replay;
+	uint16_t busnum;
+	uint8_t devnum;
+	unsigned char device_desc[DEVICE_DESC_LENGTH];
+	int have_device_desc;
+	const unsigned char *configs[MAX_CONFIGS];
+	uint32_t config_len[MAX_CONFIGS];
+	struct replay_endpoint control;
+	struct replay_endpoint endpoints[MAX_ENDPOINTS];
+	int num_endpoints;
+};
+
+/* a submission waiting for its completion */
+struct replay_submit {
+	uint64_t id;
+	uint16_t busnum;
+	uint8_t devnum;
+	uint64_t ts;
+	int have_setup;
+	uint8_t setup[LIBUSB_CONTROL_SETUP_SIZE];
+};
+
+struct replay {
+	struct list_head list;
+	struct libusb_context *ctx;
+	unsigned int rate;
+	unsigned char *file;
+	struct replay_device **devices;
+	int num_devices;
+
+	/* the recorded instant that corresponds to wall_origin */
+	int started;
+	uint64_t wall_origin;
+	uint64_t capture_origin;
+
+	/* only used while parsing */
+	struct replay_submit *submits;
+	int num_submits;
+	int max_submits;
+};
+
+static pthread_mutex_t replay_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct list_head replays = { &replays, &replays };
+
+/* grow an array of elements of the given size to hold one more */
+static int grow(void **array, int count, int *max, size_t size)
+{
+	void *p;
+	int n;
+
+	if (count < *max)
+		return 0;
+
+	n = *max ? *max * 2 : 16;
+	p = realloc(*array, (size_t)n * size);
+	if (!p)
+		return LIBUSB_ERROR_NO_MEM;
+	*array = p;
+	*max = n;
+	return 0;
+}
+
+static struct replay_device *get_device(struct replay *replay,
+	uint16_t busnum, uint8_t devnum)
+{
+	struct replay_device *rdev, **devices;
+	int i;
+
+	for (i = 0; i < replay->num_devices; i++) {
+		rdev = replay->devices[i];
+		if (rdev->busnum == busnum && rdev->devnum == devnum)
+			return rdev;
+	}
+
+	rdev = calloc(1, sizeof(*rdev));
+	if (!rdev)
+		return NULL;
+	devices = realloc(replay->devices,
+		(size_t)(replay->num_devices + 1) * sizeof(*devices));
+	if (!devices) {
+		free(rdev);
+		return NULL;
+	}
+
+	rdev->replay = replay;
+	rdev->busnum = busnum;
+	rdev->devnum = devnum;
+	replay->devices = devices;
+	replay->devices[replay->num_devices++] = rdev;
+	return rdev;
+}
+
+static struct replay_endpoint *find_endpoint(struct replay_device *rdev,
+	unsigned char address)
+{
+	int i;
+
+	for (i = 0; i < rdev->num_endpoints; i++) {
+		if (rdev->endpoints[i].address == address)
+			return &rdev->endpoints[i];
+	}
+	return NULL;
+}
+
+static struct replay_endpoint *get_endpoint(struct replay_device *rdev,
+	unsigned char address, uint8_t xfer_type)
+{
+	struct replay_endpoint *ep = find_endpoint(rdev, address);
+
+	if (ep || rdev->num_endpoints == MAX_ENDPOINTS)
+		return ep;
+
+	ep = &rdev->endpoints[rdev->num_endpoints++];
+	ep->address = address;
+	ep->xfer_type = xfer_type;
+	return ep;
+}
+
+static struct replay_submit *find_submit(struct replay *replay,
+	const struct usbmon_packet *hdr)
+{
+	int i;
+
+	for (i = replay->num_submits - 1; i >= 0; i--) {
+		struct replay_submit *submit = &replay->submits[i];
+
+		if (submit->id == hdr->id && submit->busnum == hdr->busnum &&
+		    submit->devnum == hdr->devnum)
+			return submit;
+	}
+	return NULL;
+}
+
+static void remove_submit(struct replay *replay, struct replay_submit *submit)
+{
+	*submit = replay->submits[--replay->num_submits];
+}
+
+/* keep the descriptors the device returned while it was enumerated */
+static void note_descriptor(struct replay_device *rdev,
+	const struct replay_record *rec)
+{
+	uint16_t wValue = (uint16_t)(rec->setup[2] | rec->setup[3] << 8);
+	uint8_t index = wValue & 0xff;
+	uint32_t total;
+
+	if (rec->setup[0] != LIBUSB_ENDPOINT_IN ||
+	    rec->setup[1] != LIBUSB_REQUEST_GET_DESCRIPTOR || rec->status)
+		return;
+
+	switch (wValue >> 8) {
+	case LIBUSB_DT_DEVICE:
+		if (rec->data_len >= DEVICE_DESC_LENGTH &&
+		    rec->data[1] == LIBUSB_DT_DEVICE) {
+			memcpy(rdev->device_desc, rec->data, DEVICE_DESC_LENGTH);
+			rdev->have_device_desc = 1;
+		}
+		break;
+	case LIBUSB_DT_CONFIG:
+		if (index >= MAX_CONFIGS || rec->data_len < LIBUSB_DT_CONFIG_SIZE ||
+		    rec->data[1] != LIBUSB_DT_CONFIG)
+			break;
+		/* the first read usually only fetches the header */
+		total = rec->data[2] | rec->data[3] << 8;
+		if (rec->data_len < total || rec->data_len <= rdev->config_len[index])
+			break;
+		rdev->configs[index] = rec->data;
+		rdev->config_len[index] = total;
+		break;
+	}
+}
+
+static int add_record(struct replay_endpoint *ep, const struct replay_record *rec)
+{
+	int r;
+
+	r = grow((void **)&ep->records, ep->num_records, &ep->max_records,
+		sizeof(*rec));
+	if (r < 0)
+		return r;
+	ep->records[ep->num_records++] = *rec;
+	return 0;
+}
+
+static int parse_packet(struct replay *replay, const unsigned char *packet,
+	uint32_t len, uint32_t header_len)
+{
+	struct usbmon_packet hdr;
+	struct replay_submit *submit;
+	struct replay_device *rdev;
+	struct replay_endpoint *ep;
+	struct replay_record rec;
+	uint32_t ndesc = 0;
+	uint64_t ts;
+	int r;
+
+	if (len < header_len)
+		return 0;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(&hdr, packet, header_len);
+
+	/* address 0 only exists while a device is being enumerated */
+	if (!hdr.devnum)
+		return 0;
+
+	ts = (uint64_t)hdr.ts_sec * 1000000 + (uint64_t)hdr.ts_usec;
+	submit = find_submit(replay, &hdr);
+
+	switch (hdr.type) {
+	case 'S':
+		if (submit)
+			remove_submit(replay, submit);
+		r = grow((void **)&replay->submits, replay->num_submits,
+			&replay->max_submits, sizeof(*submit));
+		if (r < 0)
+			return r;
+		submit = &replay->submits[replay->num_submits++];
+		submit->id = hdr.id;
+		submit->busnum = hdr.busnum;
+		submit->devnum = hdr.devnum;
+		submit->ts = ts;
+		submit->have_setup = hdr.xfer_type == USBMON_XFER_CONTROL &&
+			hdr.flag_setup == 0;
+		memcpy(submit->setup, hdr.setup, sizeof(submit->setup));
+		return 0;
+	case 'C':
+		break;
+	default:
+		/* a submission error; nothing reached the device */
+		if (submit)
+			remove_submit(replay, submit);
+		return 0;
+	}
+
+	memset(&rec, 0, sizeof(rec));
+	rec.submitted = submit ? submit->ts : ts;
+	rec.completed = ts;
+	rec.status = hdr.status;
+	rec.length = hdr.length;
+
+	if (header_len == USBMON_MMAPPED_HEADER_LEN && hdr.ndesc) {
+		ndesc = hdr.ndesc;
+		if (ndesc > (len - header_len) / USBMON_ISO_DESC_LEN)
+			ndesc = (len - header_len) / USBMON_ISO_DESC_LEN;
+		rec.packets = packet + header_len;
+		rec.num_packets = (int)ndesc;
+		header_len += ndesc * USBMON_ISO_DESC_LEN;
+	}
+	rec.data = packet + header_len;
+	rec.data_len = hdr.len_cap;
+	if (rec.data_len > len - header_len)
+		rec.data_len = len - header_len;
+
+	rdev = get_device(replay, hdr.busnum, hdr.devnum);
+	if (!rdev)
+		return LIBUSB_ERROR_NO_MEM;
+
+	if (hdr.xfer_type == USBMON_XFER_CONTROL) {
+		/* the completion does not repeat the setup packet */
+		if (!submit || !submit->have_setup) {
+			if (submit)
+				remove_submit(replay, submit);
+			return 0;
+		}
+		memcpy(rec.setup, submit->setup, sizeof(rec.setup));
+		remove_submit(replay, submit);
+		note_descriptor(rdev, &rec);
+		return add_record(&rdev->control, &rec);
+	}
+
+	if (submit)
+		remove_submit(replay, submit);
+
+	ep = get_endpoint(rdev, hdr.epnum, hdr.xfer_type);
+	if (!ep)
+		return 0;
+	if (hdr.length > ep->max_length)
+		ep->max_length = hdr.length;
+	return add_record(ep, &rec);
+}
+
+static int parse_pcapng(struct replay *replay, const unsigned char *buf,
+	size_t len)
+{
+	uint16_t linktypes[MAX_INTERFACES];
+	uint32_t type, block_len, body_len, magic, iface, cap_len, header_len;
+	const unsigned char *body;
+	int num_interfaces = 0, usbmon = 0, r;
+	size_t offset = 0;
+
+	while (len - offset >= 12) {
+		memcpy(&type, buf + offset, 4);
+		memcpy(&block_len, buf + offset + 4, 4);
+		body = buf + offset + 8;
+
+		if (type == PCAPNG_SHB) {
+			memcpy(&magic, body, 4);
+			if (magic != PCAPNG_BYTE_ORDER) {
+				usbi_err(replay->ctx, "capture has foreign byte order");
+				return LIBUSB_ERROR_NOT_SUPPORTED;
+			}
+			num_interfaces = 0;
+		}
+		if (block_len < 12 || block_len % 4 || block_len > len - offset) {
+			usbi_warn(replay->ctx, "capture truncated at offset %zu", offset);
+			break;
+		}
+		body_len = block_len - 12;
+
+		switch (type) {
+		case PCAPNG_IDB:
+			if (body_len >= 8 && num_interfaces < MAX_INTERFACES) {
+				memcpy(&linktypes[num_interfaces], body, 2);
+				if (linktypes[num_interfaces] == LINKTYPE_USB_LINUX ||
+				    linktypes[num_interfaces] == LINKTYPE_USB_LINUX_MMAPPED)
+					usbmon = 1;
+				num_interfaces++;
+			}
+			break;
+		case PCAPNG_EPB:
+		case PCAPNG_SPB:
+			if (type == PCAPNG_EPB) {
+				if (body_len < 20)
+					break;
+				memcpy(&iface, body, 4);
+				memcpy(&cap_len, body + 12, 4);
+				body += 20;
+				body_len -= 20;
+			} else {
+				if (body_len < 4)
+					break;
+				iface = 0;
+				memcpy(&cap_len, body, 4);
+				body += 4;
+				body_len -= 4;
+			}
+			if (iface >= (uint32_t)num_interfaces)
+				break;
+			if (linktypes[iface] == LINKTYPE_USB_LINUX)
+				header_len = USBMON_HEADER_LEN;
+			else if (linktypes[iface] == LINKTYPE_USB_LINUX_MMAPPED)
+				header_len = USBMON_MMAPPED_HEADER_LEN;
+			else
+				break;
+			if (cap_len > body_len)
+				cap_len = body_len;
+			r = parse_packet(replay, body, cap_len, header_len);
+			if (r < 0)
+				return r;
+			break;
+		}
+
+		offset += block_len;
+	}
+
+	return usbmon ? 0 : LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+static int parse_pcap(struct replay *replay, const unsigned char *buf,
+	size_t len)
+{
+	uint32_t linktype, cap_len, header_len;
+	size_t offset = 24;
+	int r;
+
+	memcpy(&linktype, buf + 20, 4);
+	if (linktype == LINKTYPE_USB_LINUX)
+		header_len = USBMON_HEADER_LEN;
+	else if (linktype == LINKTYPE_USB_LINUX_MMAPPED)
+		header_len = USBMON_MMAPPED_HEADER_LEN;
+	else
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	while (len - offset >= 16) {
+		memcpy(&cap_len, buf + offset + 8, 4);
+		offset += 16;
+		if (cap_len > len - offset) {
+			usbi_warn(replay->ctx, "capture truncated at offset %zu", offset);
+			break;
+		}
+		r = parse_packet(replay, buf + offset, cap_len, header_len);
+		if (r < 0)
+			return r;
+		offset += cap_len;
+	}
+
+	return 0;
+}
+
+static int read_file(struct libusb_context *ctx, const char *path,
+	unsigned char **buf, size_t *len)
+{
+	struct stat st;
+	size_t done = 0;
+	ssize_t r;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		usbi_err(ctx, "failed to open %s errno=%d", path, errno);
+		return LIBUSB_ERROR_IO;
+	}
+	if (fstat(fd, &st) < 0) {
+		usbi_err(ctx, "failed to stat %s errno=%d", path, errno);
+		close(fd);
+		return LIBUSB_ERROR_IO;
+	}
+	/* no capture is shorter than a pcap file header */
+	if (st.st_size < 24) {
+		close(fd);
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	}
+
+	*buf = malloc((size_t)st.st_size);
+	if (!*buf) {
+		close(fd);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	while (done < (size_t)st.st_size) {
+		r = read(fd, *buf + done, (size_t)st.st_size - done);
+		if (r <= 0) {
+			if (r < 0 && errno == EINTR)
+				continue;
+			usbi_err(ctx, "failed to read %s errno=%d", path, errno);
+			close(fd);
+			free(*buf);
+			*buf = NULL;
+			return LIBUSB_ERROR_IO;
+		}
+		done += (size_t)r;
+	}
+
+	close(fd);
+	*len = done;
+	return 0;
+}
+
+/* append a descriptor blob, returning the new length or 0 on failure */
+static size_t append(unsigned char **buf, size_t len, const void *data,
+	size_t size)
+{
+	unsigned char *p = realloc(*buf, len + size);
+
+	if (!p)
+		return 0;
+	memcpy(p + len, data, size);
+	*buf = p;
+	return len + size;
+}
+
+/* a vendor specific interface holding every endpoint seen in the capture */
+static size_t synthesize_config(struct replay_device *rdev, unsigned char **buf,
+	size_t len, enum libusb_speed speed)
+{
+	unsigned char config[LIBUSB_DT_CONFIG_SIZE] = {
+		LIBUSB_DT_CONFIG_SIZE, LIBUSB_DT_CONFIG, 0, 0, 1, 1, 0, 0x80, 50
+	};
+	unsigned char intf[LIBUSB_DT_INTERFACE_SIZE] = {
+		LIBUSB_DT_INTERFACE_SIZE, LIBUSB_DT_INTERFACE, 0, 0, 0,
+		LIBUSB_CLASS_VENDOR_SPEC, 0, 0, 0
+	};
+	unsigned char desc[LIBUSB_DT_ENDPOINT_SIZE];
+	uint16_t total = LIBUSB_DT_CONFIG_SIZE + LIBUSB_DT_INTERFACE_SIZE +
+		rdev->num_endpoints * LIBUSB_DT_ENDPOINT_SIZE;
+	uint32_t max_packet;
+	int i;
+
+	config[2] = total & 0xff;
+	config[3] = total >> 8;
+	intf[4] = (unsigned char)rdev->num_endpoints;
+	len = append(buf, len, config, sizeof(config));
+	if (len)
+		len = append(buf, len, intf, sizeof(intf));
+
+	for (i = 0; len && i < rdev->num_endpoints; i++) {
+		struct replay_endpoint *ep = &rdev->endpoints[i];
+
+		desc[0] = LIBUSB_DT_ENDPOINT_SIZE;
+		desc[1] = LIBUSB_DT_ENDPOINT;
+		desc[2] = ep->address;
+		switch (ep->xfer_type) {
+		case USBMON_XFER_ISO:
+			desc[3] = LIBUSB_TRANSFER_TYPE_ISOCHRONOUS;
+			break;
+		case USBMON_XFER_INTR:
+			desc[3] = LIBUSB_TRANSFER_TYPE_INTERRUPT;
+			break;
+		default:
+			desc[3] = LIBUSB_TRANSFER_TYPE_BULK;
+			break;
+		}
+		if (desc[3] == LIBUSB_TRANSFER_TYPE_BULK) {
+			max_packet = speed >= LIBUSB_SPEED_SUPER ? 1024 :
+				speed == LIBUSB_SPEED_HIGH ? 512 : 64;
+		} else {
+			max_packet = ep->max_length;
+			if (desc[3] == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS &&
+			    rdev->endpoints[i].records)
+				max_packet = ep->max_length /
+					(ep->records[0].num_packets ? ep->records[0].num_packets : 1);
+			if (max_packet < 8)
+				max_packet = 8;
+			if (max_packet > 1024)
+				max_packet = 1024;
+		}
+		desc[4] = max_packet & 0xff;
+		desc[5] = (max_packet >> 8) & 0xff;
+		desc[6] = 1;
+		len = append(buf, len, desc, sizeof(desc));
+	}
+
+	return len;
+}
+
+/* the recorded descriptors, or stand-ins for what was not recorded */
+static int build_descriptors(struct replay_device *rdev, unsigned char **buf,
+	enum libusb_speed *speed)
+{
+	static const unsigned char default_device_desc[DEVICE_DESC_LENGTH] = {
+		DEVICE_DESC_LENGTH, LIBUSB_DT_DEVICE, 0x00, 0x02, 0, 0, 0, 64,
+		0, 0, 0, 0, 0, 0, 0, 0, 0, 1
+	};
+	const unsigned char *config;
+	uint16_t bcdUSB;
+	size_t len;
+	uint32_t i, j;
+	int num_configs = 0;
+
+	if (!rdev->have_device_desc) {
+		usbi_warn(rdev->replay->ctx,
+			"no device descriptor recorded for device %u-%u",
+			rdev->busnum, rdev->devnum);
+		memcpy(rdev->device_desc, default_device_desc, DEVICE_DESC_LENGTH);
+	}
+
+	while (num_configs < MAX_CONFIGS && num_configs < rdev->device_desc[17] &&
+	       rdev->configs[num_configs])
+		num_configs++;
+
+	bcdUSB = (uint16_t)(rdev->device_desc[2] | rdev->device_desc[3] << 8);
+	*speed = bcdUSB >= 0x0300 ? LIBUSB_SPEED_SUPER :
+		bcdUSB >= 0x0200 ? LIBUSB_SPEED_HIGH : LIBUSB_SPEED_FULL;
+
+	/* USB 2.0 devices may well be full speed, which shows in the bulk
+	 * endpoint sizes */
+	if (*speed == LIBUSB_SPEED_HIGH && num_configs) {
+		config = rdev->configs[0];
+		for (i = 0; i + 2 <= rdev->config_len[0] && config[i]; i += config[i]) {
+			if (config[i + 1] == LIBUSB_DT_ENDPOINT &&
+			    i + LIBUSB_DT_ENDPOINT_SIZE <= rdev->config_len[0] &&
+			    (config[i + 3] & 3) == LIBUSB_TRANSFER_TYPE_BULK &&
+			    (config[i + 4] | config[i + 5] << 8) == 64) {
+				*speed = LIBUSB_SPEED_FULL;
+				break;
+			}
+		}
+	}
+
+	*buf = NULL;
+	len = append(buf, 0, rdev->device_desc, DEVICE_DESC_LENGTH);
+	if (len && !num_configs) {
+		(*buf)[17] = 1;
+		len = synthesize_config(rdev, buf, len, *speed);
+	} else if (len) {
+		(*buf)[17] = (unsigned char)num_configs;
+	}
+	for (i = 0; len && i < (uint32_t)num_configs; i++) {
+		len = append(buf, len, rdev->configs[i], rdev->config_len[i]);
+
+		/* endpoints that never saw traffic still have to exist */
+		config = rdev->configs[i];
+		for (j = 0; j + 2 <= rdev->config_len[i] && config[j]; j += config[j]) {
+			if (config[j + 1] == LIBUSB_DT_ENDPOINT &&
+			    j + LIBUSB_DT_ENDPOINT_SIZE <= rdev->config_len[i])
+				get_endpoint(rdev, config[j + 2], USBMON_XFER_BULK);
+		}
+	}
+
+	if (!len) {
+		free(*buf);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+	return (int)len;
+}
+
+/* recorded microseconds to replayed nanoseconds */
+static uint64_t scale(struct replay *replay, uint64_t us)
+{
+	return replay->rate ? us * 1000 * 100 / replay->rate : 0;
+}
+
+static struct replay_record *match_control(struct replay_device *rdev,
+	const unsigned char *setup)
+{
+	struct replay_record *rec, *first = NULL;
+	int i;
+
+	for (i = 0; i < rdev->control.num_records; i++) {
+		rec = &rdev->control.records[i];
+		if (memcmp(rec->setup, setup, 6))
+			continue;
+		if (!rec->used) {
+			rec->used = 1;
+			return rec;
+		}
+		if (!first)
+			first = rec;
+	}
+
+	/* every response has been given out: start over */
+	if (!first)
+		return NULL;
+	for (i = 0; i < rdev->control.num_records; i++) {
+		rec = &rdev->control.records[i];
+		if (!memcmp(rec->setup, setup, 6))
+			rec->used = 0;
+	}
+	first->used = 1;
+	return first;
+}
+
+static int64_t replay_submit(void *data, struct usbfs_urb *urb, uint64_t now,
+	void **cookie)
+{
+	struct replay_device *rdev = data;
+	struct replay *replay = rdev->replay;
+	struct replay_endpoint *ep;
+	struct replay_record *rec;
+	uint64_t due;
+
+	*cookie = NULL;
+
+	if (urb->type == USBFS_URB_TYPE_CONTROL) {
+		rec = match_control(rdev, urb->buffer);
+		*cookie = rec;
+		return rec ? (int64_t)scale(replay, rec->completed - rec->submitted) : 0;
+	}
+
+	ep = find_endpoint(rdev, urb->endpoint);
+	if (!ep || ep->next == ep->num_records)
+		return (urb->endpoint & LIBUSB_ENDPOINT_IN) ? -1 : 0;
+
+	rec = &ep->records[ep->next++];
+	*cookie = rec;
+
+	if (!replay->started) {
+		replay->started = 1;
+		replay->wall_origin = now;
+		replay->capture_origin = rec->submitted;
+	}
+
+	/* the device never answered these */
+	if (rec->status == -ENOENT || rec->status == -ECONNRESET ||
+	    rec->status == -ESHUTDOWN)
+		return -1;
+
+	if (rec->completed <= replay->capture_origin)
+		return 0;
+	due = replay->wall_origin + scale(replay, rec->completed - replay->capture_origin);
+	return due > now ? (int64_t)(due - now) : 0;
+}
+
+/* copy recorded data, which may have been cut short by the snapshot length */
+static void copy_data(unsigned char *dst, const struct replay_record *rec,
+	uint32_t offset, uint32_t length)
+{
+	uint32_t n = 0;
+
+	if (offset < rec->data_len)
+		n = rec->data_len - offset < length ? rec->data_len - offset : length;
+	memcpy(dst, rec->data + offset, n);
+	memset(dst + n, 0, length - n);
+}
+
+static void complete_iso(struct usbfs_urb *urb, const struct replay_record *rec)
+{
+	struct usbmon_iso_packet desc;
+	unsigned char *data = urb->buffer;
+	uint32_t offset = 0, n;
+	int i, in = urb->endpoint & LIBUSB_ENDPOINT_IN;
+
+	for (i = 0; i < urb->number_of_packets; i++) {
+		struct usbfs_iso_packet_desc *pkt = &urb->iso_frame_desc[i];
+
+		if (rec->num_packets) {
+			/* recorded packets beyond ours are lost */
+			memset(&desc, 0, sizeof(desc));
+			if (i < rec->num_packets)
+				memcpy(&desc, rec->packets + i * USBMON_ISO_DESC_LEN,
+					sizeof(desc));
+			offset = desc.offset;
+			n = desc.length;
+		} else {
+			/* without descriptors the data is one stream */
+			n = offset < rec->length ? rec->length - offset : 0;
+			desc.status = 0;
+		}
+		if (n > pkt->length)
+			n = pkt->length;
+
+		if (in)
+			copy_data(data, rec, offset, n);
+		pkt->actual_length = n;
+		pkt->status = (unsigned int)desc.status;
+		urb->actual_length += (int)n;
+		data += pkt->length;
+		if (!rec->num_packets)
+			offset += n;
+	}
+
+	urb->status = rec->status;
+}
+
+static int replay_complete(void *data, struct usbfs_urb *urb, void *cookie)
+{
+	const struct replay_record *rec = cookie;
+	int in = urb->endpoint & LIBUSB_ENDPOINT_IN;
+	uint32_t length = (uint32_t)urb->buffer_length;
+	unsigned char *buffer = urb->buffer;
+
+	UNUSED(data);
+
+	if (urb->type == USBFS_URB_TYPE_CONTROL) {
+		if (!rec)
+			return -ENOSYS;
+		in = buffer[0] & LIBUSB_ENDPOINT_IN;
+		buffer += LIBUSB_CONTROL_SETUP_SIZE;
+		length -= LIBUSB_CONTROL_SETUP_SIZE;
+	} else if (!rec) {
+		/* the recording has run out: OUT data goes nowhere */
+		urb->actual_length = urb->buffer_length;
+		return 0;
+	}
+
+	if (urb->type == USBFS_URB_TYPE_ISO) {
+		complete_iso(urb, rec);
+		return 0;
+	}
+
+	if (rec->length < length)
+		length = rec->length;
+	if (in)
+		copy_data(buffer, rec, 0, length);
+	urb->actual_length = (int)length;
+	urb->status = rec->status;
+
+	if (!urb->status && in && urb->type != USBFS_URB_TYPE_CONTROL) {
+		if (rec->length > (uint32_t)urb->buffer_length)
+			urb->status = -EOVERFLOW;
+		else if (length < (uint32_t)urb->buffer_length &&
+			 (urb->flags & USBFS_URB_SHORT_NOT_OK))
+			urb->status = -EREMOTEIO;
+	}
+	return 0;
+}
+
+static const struct linux_loopback_ops replay_ops = {
+	.submit = replay_submit,
+	.complete = replay_complete,
+};
+
+static void free_replay(struct replay *replay)
+{
+	int i, j;
+
+	for (i = 0; i < replay->num_devices; i++) {
+		struct replay_device *rdev = replay->devices[i];
+
+		for (j = 0; j < rdev->num_endpoints; j++)
+			free(rdev->endpoints[j].records);
+		free(rdev->control.records);
+		free(rdev);
+	}
+	free(replay->devices);
+	free(replay->submits);
+	free(replay->file);
+	free(replay);
+}
+
+static int add_device(struct replay_device *rdev, struct discovered_devs **devs)
+{
+	struct libusb_loopback_endpoint endpoints[MAX_ENDPOINTS];
+	struct libusb_loopback_device config;
+	struct libusb_device *dev;
+	unsigned char *descriptors;
+	enum libusb_speed speed;
+	int i, r;
+
+	r = build_descriptors(rdev, &descriptors, &speed);
+	if (r < 0)
+		return r;
+
+	memset(&config, 0, sizeof(config));
+	memset(endpoints, 0, sizeof(endpoints));
+	for (i = 0; i < rdev->num_endpoints; i++)
+		endpoints[i].endpoint = rdev->endpoints[i].address;
+	config.descriptors = descriptors;
+	config.descriptors_length = r;
+	config.speed = speed;
+	config.endpoints = endpoints;
+	config.num_endpoints = rdev->num_endpoints;
+
+	r = linux_add_loopback_device(rdev->replay->ctx, &config, &replay_ops,
+		rdev, &dev);
+	free(descriptors);
+	if (r < 0)
+		return r;
+	if (!dev)
+		return LIBUSB_ERROR_OTHER;
+
+	usbi_dbg("replaying device %u-%u as %u, %d control and %d endpoints",
+		rdev->busnum, rdev->devnum, dev->device_address,
+		rdev->control.num_records, rdev->num_endpoints);
+
+	*devs = discovered_devs_append(*devs, dev);
+	if (!*devs) {
+		usbi_backend.remove_loopback_device(dev);
+		r = LIBUSB_ERROR_NO_MEM;
+	}
+	libusb_unref_device(dev);
+	return r;
+}
+
+int linux_replay_load(struct libusb_context *ctx, const char *path,
+	unsigned int rate, struct discovered_devs **devs)
+{
+	struct replay *replay;
+	size_t len, first = (*devs)->len, i;
+	uint32_t magic;
+	int j, r;
+
+	replay = calloc(1, sizeof(*replay));
+	if (!replay)
+		return LIBUSB_ERROR_NO_MEM;
+	replay->ctx = ctx;
+	replay->rate = rate;
+
+	r = read_file(ctx, path, &replay->file, &len);
+	if (r < 0)
+		goto err_free;
+
+	memcpy(&magic, replay->file, 4);
+	if (magic == PCAPNG_SHB) {
+		r = parse_pcapng(replay, replay->file, len);
+	} else if (magic == PCAP_MAGIC || magic == PCAP_MAGIC_NS) {
+		r = parse_pcap(replay, replay->file, len);
+	} else {
+		usbi_err(ctx, "%s is not a pcap or pcapng capture", path);
+		r = LIBUSB_ERROR_NOT_SUPPORTED;
+	}
+	if (r < 0)
+		goto err_free;
+
+	free(replay->submits);
+	replay->submits = NULL;
+	replay->num_submits = 0;
+
+	if (!replay->num_devices) {
+		free_replay(replay);
+		return 0;
+	}
+
+	/* the devices are live as soon as they are added */
+	pthread_mutex_lock(&replay_lock);
+	list_add_tail(&replay->list, &replays);
+	pthread_mutex_unlock(&replay_lock);
+
+	for (j = 0; j < replay->num_devices; j++) {
+		r = add_device(replay->devices[j], devs);
+		if (r < 0)
+			goto err_remove;
+	}
+
+	return 0;
+
+err_remove:
+	/* the replay itself goes with the context */
+	for (i = first; *devs && i < (*devs)->len; i++)
+		usbi_backend.remove_loopback_device((*devs)->devices[i]);
+	return r;
+
+err_free:
+	free_replay(replay);
+	return r;
+}
+
+void linux_replay_exit(struct libusb_context *ctx)
+{
+	struct replay *replay, *tmp;
+
+	pthread_mutex_lock(&replay_lock);
+	list_for_each_entry_safe(replay, tmp, &replays, list, struct replay) {
+		if (replay->ctx != ctx)
+			continue;
+		list_del(&replay->list);
+		free_replay(replay);
+	}
+	pthread_mutex_unlock(&replay_lock);
+}
@@ -111,23 +111,12 @@ int linux_udev_start_event_monitor(void)
 		}
 	}
 
-	r = usbi_pipe(udev_control_pipe);
-	if (r) {
-		usbi_err(NULL, "could not create udev control pipe");
+	r = linux_udev_start_event_thread();
+	if (r != LIBUSB_SUCCESS)
 		goto err_free_monitor;
-	}
-
-	r = pthread_create(&linux_event_thread, NULL, linux_udev_event_thread_main, NULL);
-	if (r) {
-		usbi_err(NULL, "creating hotplug event thread (%d)", r);
-		goto err_close_pipe;
-	}
 
 	return LIBUSB_SUCCESS;
 
-err_close_pipe:
-	close(udev_control_pipe[0]);
-	close(udev_control_pipe[1]);
 err_free_monitor:
 	udev_monitor_unref(udev_monitor);
 	udev_monitor = NULL;
@@ -141,20 +130,11 @@ err:
 
 int linux_udev_stop_event_monitor(void)
 {
-	char dummy = 1;
-	int r;
-
 	assert(udev_ctx != NULL);
 	assert(udev_monitor != NULL);
 	assert(udev_monitor_fd != -1);
 
-	/* Write some dummy data to the control pipe and
-	 * wait for the thread to exit */
-	r = write(udev_control_pipe[1], &dummy, sizeof(dummy));
-	if (r <= 0) {
-		usbi_warn(NULL, "udev control pipe signal failed");
-	}
-	pthread_join(linux_event_thread, NULL);
+	linux_udev_stop_event_thread();
 
 	/* Release the udev monitor */
 	udev_monitor_unref(udev_monitor);
@@ -165,13 +145,63 @@ int linux_udev_stop_event_monitor(void)
 	udev_unref(udev_ctx);
 	udev_ctx = NULL;
 
+	return LIBUSB_SUCCESS;
+}
+
+int linux_udev_start_event_thread(void)
+{
+	int r;
+
+	assert(udev_monitor_fd != -1);
+	assert(udev_control_pipe[0] == -1);
+
+	r = usbi_pipe(udev_control_pipe);
+	if (r) {
+		usbi_err(NULL, "could not create udev control pipe");
+		return LIBUSB_ERROR_OTHER;
+	}
+
+	r = pthread_create(&linux_event_thread, NULL, linux_udev_event_thread_main, NULL);
+	if (r) {
+		usbi_err(NULL, "creating hotplug event thread (%d)", r);
+		close(udev_control_pipe[0]);
+		close(udev_control_pipe[1]);
+		udev_control_pipe[0] = -1;
+		udev_control_pipe[1] = -1;
+		return LIBUSB_ERROR_OTHER;
+	}
+
+	return LIBUSB_SUCCESS;
+}
+
+void linux_udev_stop_event_thread(void)
+{
+	char dummy = 1;
+	int r;
+
+	/* the thread is not running when the monitor is being serviced
+	 * from a context's event loop */
+	if (udev_control_pipe[1] == -1)
+		return;
+
+	/* Write some dummy data to the control pipe and
+	 * wait for the thread to exit */
+	r = write(udev_control_pipe[1], &dummy, sizeof(dummy));
+	if (r <= 0) {
+		usbi_warn(NULL, "udev control pipe signal failed");
+	}
+	pthread_join(linux_event_thread, NULL);
+
 	/* close and reset control pipe */
 	close(udev_control_pipe[0]);
 	close(udev_control_pipe[1]);
 	udev_control_pipe[0] = -1;
 	udev_control_pipe[1] = -1;
+}
 
-	return LIBUSB_SUCCESS;
+int linux_udev_get_monitor_fd(void)
+{
+	return udev_monitor_fd;
 }
 
 static void *linux_udev_event_thread_main(void *arg)
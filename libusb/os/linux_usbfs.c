@@ -29,6 +29,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -139,11 +140,32 @@ static usbi_mutex_static_t linux_hotplug_startstop_lock = USBI_MUTEX_INITIALIZER
 /* Serialize scan-devices, event-thread, and poll */
 usbi_mutex_static_t linux_hotplug_lock = USBI_MUTEX_INITIALIZER;
 
+/* context whose event loop services the hotplug monitor fd in place of the
+ * monitor thread (LIBUSB_OPTION_HOTPLUG_EVENT_LOOP), and that fd. Protected
+ * by linux_hotplug_startstop_lock. */
+static struct libusb_context *hotplug_event_ctx = NULL;
+static int hotplug_event_fd = -1;
+
 static int linux_start_event_monitor(void);
 static int linux_stop_event_monitor(void);
+static int linux_start_event_thread(void);
+static void linux_stop_event_thread(void);
+static int linux_get_event_monitor_fd(void);
+static void op_hotplug_poll(void);
 static int linux_scan_devices(struct libusb_context *ctx);
 static int sysfs_scan_device(struct libusb_context *ctx, const char *devname);
 static int detach_kernel_driver_and_claim(struct libusb_device_handle *, int);
+static int start_reaper_thread(struct libusb_device_handle *handle);
+static void stop_reaper_thread(struct libusb_device_handle *handle);
+static struct linux_shard *assign_shard(struct libusb_device_handle *handle);
+static void shard_remove_handle(struct libusb_device_handle *handle);
+static void shard_add_timeout(struct linux_shard *shard,
+	const struct timeval *timeout);
+static int signal_shard(struct linux_shard *shard);
+static int start_shards(struct libusb_context *ctx, int num_shards);
+static void stop_shards(struct libusb_context *ctx);
+static int set_shard_policy(struct libusb_context *ctx, int policy);
+static int set_next_shard(struct libusb_context *ctx, int index);
 
 #if !defined(USE_UDEV)
 static int linux_default_scan_devices (struct libusb_context *ctx);
@@ -162,11 +184,125 @@ struct linux_device_priv {
 	int active_config; /* cache val for !sysfs_can_relate_devices  */
 };
 
+/* An event loop shard: a thread polling and reaping the usbfs fds of the
+ * device handles assigned to it, running the callbacks of the transfers it
+ * reaps and timing out those transfers itself. Shard 0 is the context's own
+ * event loop and has no thread. */
+struct linux_shard {
+	struct libusb_context *ctx;
+	pthread_t thread;
+	int control_pipe[2];
+
+	/* protects handles, completed and stop. held by the thread while it
+	 * reaps */
+	usbi_mutex_t lock;
+	struct list_head handles;
+	struct list_head completed;
+	int stop;
+
+	/* the timeout the thread currently polls for, cleared while it looks
+	 * for the next one or if there is none. a submission with an earlier
+	 * timeout wakes the thread */
+	usbi_mutex_t timeout_lock;
+	struct timeval next_timeout;
+
+	/* handles assigned to this shard, protected by the context's shard_lock */
+	int load;
+};
+
+/* A handle's reaper thread (LIBUSB_OPTION_REAPER_THREADS), blocking in
+ * REAPURB on its usbfs fd. It is told to exit by setting stop and sending it
+ * REAPER_WAKEUP_SIGNAL, which interrupts the ioctl without any device I/O. */
+struct linux_reaper {
+	struct libusb_device_handle *handle;
+	pthread_t thread;
+
+	/* protects stop and exited */
+	usbi_mutex_t lock;
+	usbi_cond_t cond;
+	int stop;
+	int exited;
+};
+
+#define REAPER_WAKEUP_SIGNAL	SIGURG
+
+struct linux_context_priv {
+	/* give handles opened from now on their own reaper thread */
+	int reaper_threads;
+
+	/* event loop shards (LIBUSB_OPTION_EVENT_SHARDS) and how handles are
+	 * assigned to them, protected by shard_lock */
+	usbi_mutex_t shard_lock;
+	struct linux_shard *shards;
+	int num_shards;
+	int shard_policy;
+	int shard_next;
+
+#ifdef HAVE_LINUX_IO_URING_H
+	/* waits for events in place of poll() (LIBUSB_OPTION_IO_URING) */
+	struct linux_uring *uring;
+#endif
+
+	/* URB size of bulk transfers (LIBUSB_OPTION_BULK_URB_SIZE), 0 to split
+	 * them according to the usbfs capabilities, and the number of their
+	 * URBs in flight at a time */
+	int bulk_urb_size;
+	int bulk_urb_window;
+};
+
+/* URB sizes tried by LIBUSB_BULK_URB_SIZE_AUTO, doubling from 16 kB */
+#define BULK_TUNING_MIN_SIZE		16384
+#define BULK_TUNING_SIZES		7
+#define BULK_TUNING_PROBE_INTERVAL	16
+#define BULK_TUNING_ENDPOINT(ep)	(((ep) & 0x0f) | (((ep) & LIBUSB_ENDPOINT_IN) >> 3))
+
+#define DEFAULT_BULK_URB_WINDOW		4
+#define MAX_BULK_URB_WINDOW		64
+#define MAX_BULK_URB_SIZE		(64 * 1024 * 1024)
+
+/* URB size choice of an endpoint under LIBUSB_BULK_URB_SIZE_AUTO */
+struct linux_bulk_tuning {
+	/* throughput per URB size in bytes per second, 0 until measured */
+	uint64_t rate[BULK_TUNING_SIZES];
+
+	/* sizes from limit on could not be allocated by the kernel */
+	int limit;
+
+	/* size used by the next transfer, and the best measured so far */
+	int next;
+	int best;
+	unsigned int transfers;
+};
+
 struct linux_device_handle_priv {
 	int fd;
 	int fd_removed;
 	int fd_keep;
 	uint32_t caps;
+
+	/* event loop shard this handle was assigned to, and the shard thread
+	 * (NULL for the context's own event loop) */
+	int shard_index;
+	struct linux_shard *shard;
+	struct list_head shard_list;
+	struct libusb_device_handle *handle;
+	int shard_error;
+
+	/* the handle's own reaper thread, NULL if it has none */
+	struct linux_reaper *reaper;
+
+	/* per-endpoint URB size choice, allocated on first use */
+	usbi_mutex_t bulk_tuning_lock;
+	struct linux_bulk_tuning *bulk_tuning[USB_MAXENDPOINTS];
+
+	/* service interval of the iso endpoints (0 until looked up), and the
+	 * frame the last iso URB ended in with when it was reaped, from which
+	 * the current frame number is extrapolated */
+	usbi_mutex_t iso_lock;
+	int iso_interval[USB_MAXENDPOINTS];
+	int iso_frame_known;
+	int iso_frame;
+	struct timespec iso_frame_time;
 };
 
 enum reap_action {
@@ -196,8 +332,31 @@ struct linux_transfer_priv {
 	int num_retired;
 	enum libusb_transfer_status reap_status;
 
-	/* next iso packet in user-supplied transfer to be populated */
+	/* bulk URBs submitted so far, out of the first submit_end; those
+	 * beyond the window are submitted as earlier ones retire */
+	int num_submitted;
+	int submit_end;
+	int urb_size;
+	int bulk_continuation;
+
+	/* URB size picked by LIBUSB_BULK_URB_SIZE_AUTO (-1 if not), and when
+	 * the transfer was submitted to measure its throughput */
+	int tuning_index;
+	struct timespec submit_time;
+
+	/* next iso packet in user-supplied transfer to be populated, and the
+	 * service interval of the endpoint in (micro)frames */
 	int iso_packet_offset;
+	int iso_interval;
+
+	/* final result of a transfer reaped by a shard or reaper thread, reported
+	 * by the shard thread or by the event handling thread through
+	 * op_handle_transfer_completion() */
+	int deferred_cancel;
+	enum libusb_transfer_status deferred_status;
+
+	/* shard whose thread handles the timeout of the transfer, if any */
+	struct linux_shard *timeout_shard;
 };
 
 static int _open(const char *path, int flags)
@@ -210,6 +369,22 @@ static int _open(const char *path, int flags)
 		return open(path, flags);
 }
 
+/* usbfs fds of loopback devices are emulated, see linux_loopback.c */
+static int usbfs_ioctl(int fd, unsigned long request, void *arg)
+{
+	int r;
+
+	if (linux_loopback_fd(fd) && linux_loopback_ioctl(fd, request, arg, &r))
+		return r;
+	return ioctl(fd, request, arg);
+}
+
+static void usbfs_close(int fd)
+{
+	if (!linux_loopback_fd(fd) || !linux_loopback_close(fd))
+		close(fd);
+}
+
 static int _get_usbfs_fd(struct libusb_device *dev, mode_t mode, int silent)
 {
 	struct libusb_context *ctx = DEVICE_CTX(dev);
@@ -217,6 +392,9 @@ static int _get_usbfs_fd(struct libusb_device *dev, mode_t mode, int silent)
 	int fd;
 	int delay = 10000;
 
+	if (dev->bus_number == LINUX_LOOPBACK_BUS)
+		return linux_loopback_open(dev);
+
 	if (usbdev_names)
 		snprintf(path, PATH_MAX, "%s/usbdev%d.%d",
 			usbfs_path, dev->bus_number, dev->device_address);
@@ -255,6 +433,11 @@ static int _get_usbfs_fd(struct libusb_device *dev, mode_t mode, int silent)
 	return LIBUSB_ERROR_IO;
 }
 
+static struct linux_context_priv *_context_priv(struct libusb_context *ctx)
+{
+	return (struct linux_context_priv *) ctx->os_priv;
+}
+
 static struct linux_device_priv *_device_priv(struct libusb_device *dev)
 {
 	return (struct linux_device_priv *) dev->os_priv;
@@ -505,24 +688,54 @@ static int op_init(struct libusb_context *ctx)
 		/* start up hotplug event handler */
 		r = linux_start_event_monitor();
 	}
-	if (r == LIBUSB_SUCCESS) {
-		r = linux_scan_devices(ctx);
-		if (r == LIBUSB_SUCCESS)
-			init_count++;
-		else if (init_count == 0)
-			linux_stop_event_monitor();
-	} else
+	if (r == LIBUSB_SUCCESS)
+		init_count++;
+	else
 		usbi_err(ctx, "error starting hotplug event monitor");
 	usbi_mutex_static_unlock(&linux_hotplug_startstop_lock);
 
+	/* the monitor is kept running by init_count, so the scan needs no
+	 * lock other than the one serializing it with hotplug events; it may
+	 * also be left to the core, see LIBUSB_OPTION_DEVICE_SCAN */
+	if (r == LIBUSB_SUCCESS && ctx->device_scan == LIBUSB_DEVICE_SCAN_EAGER) {
+		r = linux_scan_devices(ctx);
+		if (r != LIBUSB_SUCCESS) {
+			usbi_mutex_static_lock(&linux_hotplug_startstop_lock);
+			if (--init_count == 0)
+				linux_stop_event_monitor();
+			usbi_mutex_static_unlock(&linux_hotplug_startstop_lock);
+		}
+	}
+
+	if (r == LIBUSB_SUCCESS) {
+		usbi_mutex_init(&_context_priv(ctx)->shard_lock);
+		_context_priv(ctx)->bulk_urb_window = DEFAULT_BULK_URB_WINDOW;
+	}
+
 	return r;
 }
 
 static void op_exit(struct libusb_context *ctx)
 {
-	UNUSED(ctx);
+	stop_shards(ctx);
+	linux_loopback_exit(ctx);
+	linux_replay_exit(ctx);
+	usbi_mutex_destroy(&_context_priv(ctx)->shard_lock);
+#ifdef HAVE_LINUX_IO_URING_H
+	linux_uring_destroy(_context_priv(ctx)->uring);
+#endif
+
 	usbi_mutex_static_lock(&linux_hotplug_startstop_lock);
 	assert(init_count != 0);
+	if (ctx == hotplug_event_ctx) {
+		usbi_remove_pollfd(ctx, hotplug_event_fd);
+		hotplug_event_ctx = NULL;
+		hotplug_event_fd = -1;
+
+		/* hand the monitor back to a thread for the remaining contexts */
+		if (init_count > 1 && linux_start_event_thread() != LIBUSB_SUCCESS)
+			usbi_err(ctx, "error restarting hotplug event thread");
+	}
 	if (!--init_count) {
 		/* tear down event handler */
 		(void)linux_stop_event_monitor();
@@ -552,6 +765,146 @@ static int linux_stop_event_monitor(void)
 #endif
 }
 
+static int linux_start_event_thread(void)
+{
+#if defined(USE_UDEV)
+	return linux_udev_start_event_thread();
+#elif !defined(__ANDROID__)
+	return linux_netlink_start_event_thread();
+#else
+	return LIBUSB_SUCCESS;
+#endif
+}
+
+static void linux_stop_event_thread(void)
+{
+#if defined(USE_UDEV)
+	linux_udev_stop_event_thread();
+#elif !defined(__ANDROID__)
+	linux_netlink_stop_event_thread();
+#endif
+}
+
+static int linux_get_event_monitor_fd(void)
+{
+#if defined(USE_UDEV)
+	return linux_udev_get_monitor_fd();
+#elif !defined(__ANDROID__)
+	return linux_netlink_get_monitor_fd();
+#else
+	return -1;
+#endif
+}
+
+/* stop the hotplug monitor thread and have ctx poll the monitor fd from its
+ * own event loop instead. hotplug events for all contexts are then only
+ * processed while ctx is handling events. */
+static int linux_enable_hotplug_event_loop(struct libusb_context *ctx)
+{
+	int fd, r = LIBUSB_SUCCESS;
+
+	usbi_mutex_static_lock(&linux_hotplug_startstop_lock);
+	if (hotplug_event_ctx) {
+		if (hotplug_event_ctx != ctx) {
+			usbi_err(ctx, "hotplug monitor already serviced by context %p",
+				 hotplug_event_ctx);
+			r = LIBUSB_ERROR_BUSY;
+		}
+		goto out;
+	}
+
+	fd = linux_get_event_monitor_fd();
+	if (fd == -1) {
+		r = LIBUSB_ERROR_NOT_SUPPORTED;
+		goto out;
+	}
+
+	linux_stop_event_thread();
+
+	r = usbi_add_pollfd(ctx, fd, POLLIN);
+	if (r != LIBUSB_SUCCESS) {
+		if (linux_start_event_thread() != LIBUSB_SUCCESS)
+			usbi_err(ctx, "error restarting hotplug event thread");
+		goto out;
+	}
+
+	usbi_dbg("hotplug monitor fd %d now serviced by context %p", fd, ctx);
+	hotplug_event_ctx = ctx;
+	hotplug_event_fd = fd;
+
+	/* pick up anything that arrived while the thread was being stopped */
+	op_hotplug_poll();
+
+out:
+	usbi_mutex_static_unlock(&linux_hotplug_startstop_lock);
+	return r;
+}
+
+#ifdef HAVE_LINUX_IO_URING_H
+/* the ring is created outside of any lock and only published if no other
+ * thread got there first; the event handler picks it up on its next wait */
+static int enable_uring(struct libusb_context *ctx)
+{
+	struct linux_context_priv *cpriv = _context_priv(ctx);
+	struct linux_uring *uring, *expected = NULL;
+	int r;
+
+	if (__atomic_load_n(&cpriv->uring, __ATOMIC_ACQUIRE))
+		return LIBUSB_SUCCESS;
+
+	r = linux_uring_create(ctx, &uring);
+	if (r < 0)
+		return r;
+
+	if (!__atomic_compare_exchange_n(&cpriv->uring, &expected, uring, 0,
+			__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		linux_uring_destroy(uring);
+
+	return LIBUSB_SUCCESS;
+}
+#endif
+
+static int op_set_option(struct libusb_context *ctx, enum libusb_option option,
+	va_list ap)
+{
+	int arg;
+
+	switch (option) {
+	case LIBUSB_OPTION_HOTPLUG_EVENT_LOOP:
+		return linux_enable_hotplug_event_loop(ctx);
+	case LIBUSB_OPTION_REAPER_THREADS:
+		_context_priv(ctx)->reaper_threads = va_arg(ap, int) != 0;
+		return LIBUSB_SUCCESS;
+	case LIBUSB_OPTION_EVENT_SHARDS:
+		return start_shards(ctx, va_arg(ap, int));
+	case LIBUSB_OPTION_SHARD_POLICY:
+		return set_shard_policy(ctx, va_arg(ap, int));
+	case LIBUSB_OPTION_SHARD_NEXT:
+		return set_next_shard(ctx, va_arg(ap, int));
+	case LIBUSB_OPTION_IO_URING:
+#ifdef HAVE_LINUX_IO_URING_H
+		return enable_uring(ctx);
+#else
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+	case LIBUSB_OPTION_BULK_URB_SIZE:
+		arg = va_arg(ap, int);
+		if (arg != 0 && arg != LIBUSB_BULK_URB_SIZE_AUTO &&
+		    (arg < 1024 || arg > MAX_BULK_URB_SIZE || arg % 1024))
+			return LIBUSB_ERROR_INVALID_PARAM;
+		_context_priv(ctx)->bulk_urb_size = arg;
+		return LIBUSB_SUCCESS;
+	case LIBUSB_OPTION_BULK_URB_WINDOW:
+		arg = va_arg(ap, int);
+		if (arg < 1 || arg > MAX_BULK_URB_WINDOW)
+			return LIBUSB_ERROR_INVALID_PARAM;
+		_context_priv(ctx)->bulk_urb_window = arg;
+		return LIBUSB_SUCCESS;
+	default:
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	}
+}
+
 static int linux_scan_devices(struct libusb_context *ctx)
 {
 	int ret = 0;
@@ -937,7 +1290,7 @@ static int usbfs_get_active_config(struct libusb_device *dev, int fd)
 		.data = &active_config
 	};
 
-	r = ioctl(fd, IOCTL_USBFS_CONTROL, &ctrl);
+	r = usbfs_ioctl(fd, IOCTL_USBFS_CONTROL, &ctrl);
 	if (r < 0) {
 		if (errno == ENODEV)
 			return LIBUSB_ERROR_NO_DEVICE;
@@ -976,6 +1329,20 @@ static int initialize_device(struct libusb_device *dev, uint8_t busnum,
 	dev->bus_number = busnum;
 	dev->device_address = devaddr;
 
+	if (busnum == LINUX_LOOPBACK_BUS && wrapped_fd < 0) {
+		r = linux_loopback_get_descriptors(dev, &priv->descriptors);
+		if (r < 0)
+			return (int)r;
+		priv->descriptors_len = (int)r;
+
+		fd = linux_loopback_open(dev);
+		if (fd < 0)
+			return fd;
+		r = usbfs_get_active_config(dev, fd);
+		usbfs_close(fd);
+		return (int)r;
+	}
+
 	if (sysfs_dir) {
 		priv->sysfs_dir = strdup(sysfs_dir);
 		if (!priv->sysfs_dir)
@@ -1388,11 +1755,12 @@ static int linux_default_scan_devices (struct libusb_context *ctx)
 static int initialize_handle(struct libusb_device_handle *handle, int fd)
 {
 	struct linux_device_handle_priv *hpriv = _device_handle_priv(handle);
+	struct linux_shard *shard;
 	int r;
 
 	hpriv->fd = fd;
 
-	r = ioctl(fd, IOCTL_USBFS_GET_CAPABILITIES, &hpriv->caps);
+	r = usbfs_ioctl(fd, IOCTL_USBFS_GET_CAPABILITIES, &hpriv->caps);
 	if (r < 0) {
 		if (errno == ENOTTY)
 			usbi_dbg("getcap not available");
@@ -1405,7 +1773,39 @@ static int initialize_handle(struct libusb_device_handle *handle, int fd)
 			hpriv->caps |= USBFS_CAP_BULK_CONTINUATION;
 	}
 
-	return usbi_add_pollfd(HANDLE_CTX(handle), hpriv->fd, POLLOUT);
+	hpriv->reaper = NULL;
+	hpriv->shard_index = -1;
+	hpriv->shard = NULL;
+
+	if (_context_priv(HANDLE_CTX(handle))->reaper_threads) {
+		r = start_reaper_thread(handle);
+		if (r < 0)
+			return r;
+	} else {
+		shard = assign_shard(handle);
+		if (!shard) {
+			r = usbi_add_pollfd(HANDLE_CTX(handle), hpriv->fd, POLLOUT);
+			goto out;
+		}
+	}
+
+	/* completions are picked up by the reaper thread or shard, only have
+	 * the event handler watch for POLLERR so disconnects are still
+	 * processed */
+	r = usbi_add_pollfd(HANDLE_CTX(handle), hpriv->fd, 0);
+	if (r < 0) {
+		if (hpriv->reaper)
+			stop_reaper_thread(handle);
+		else
+			shard_remove_handle(handle);
+	}
+
+out:
+	if (r == 0) {
+		usbi_mutex_init(&hpriv->bulk_tuning_lock);
+		usbi_mutex_init(&hpriv->iso_lock);
+	}
+	return r;
 }
 
 static int op_wrap_sys_device(struct libusb_context *ctx,
@@ -1420,7 +1820,7 @@ static int op_wrap_sys_device(struct libusb_context *ctx,
 
 	r = linux_get_device_address(ctx, 1, &busnum, &devaddr, NULL, NULL, fd);
 	if (r < 0) {
-		r = ioctl(fd, IOCTL_USBFS_CONNECTINFO, &ci);
+		r = usbfs_ioctl(fd, IOCTL_USBFS_CONNECTINFO, &ci);
 		if (r < 0) {
 			usbi_err(ctx, "connectinfo failed (%d)", errno);
 			return LIBUSB_ERROR_IO;
@@ -1480,7 +1880,7 @@ static int op_open(struct libusb_device_handle *handle)
 
 	r = initialize_handle(handle, fd);
 	if (r < 0)
-		close(fd);
+		usbfs_close(fd);
 
 	return r;
 }
@@ -1488,11 +1888,20 @@ static int op_open(struct libusb_device_handle *handle)
 static void op_close(struct libusb_device_handle *dev_handle)
 {
 	struct linux_device_handle_priv *hpriv = _device_handle_priv(dev_handle);
+	int i;
+
+	if (hpriv->reaper)
+		stop_reaper_thread(dev_handle);
+	shard_remove_handle(dev_handle);
 	/* fd may have already been removed by POLLERR condition in op_handle_events() */
 	if (!hpriv->fd_removed)
 		usbi_remove_pollfd(HANDLE_CTX(dev_handle), hpriv->fd);
 	if (!hpriv->fd_keep)
-		close(hpriv->fd);
+		usbfs_close(hpriv->fd);
+	for (i = 0; i < USB_MAXENDPOINTS; i++)
+		free(hpriv->bulk_tuning[i]);
+	usbi_mutex_destroy(&hpriv->bulk_tuning_lock);
+	usbi_mutex_destroy(&hpriv->iso_lock);
 }
 
 static int op_get_configuration(struct libusb_device_handle *handle,
@@ -1520,11 +1929,22 @@ static int op_get_configuration(struct libusb_device_handle *handle,
 	return 0;
 }
 
+/* the endpoints of the handle change with its configuration and alternate
+ * settings, so their service intervals are looked up again */
+static void iso_forget_intervals(struct libusb_device_handle *handle)
+{
+	struct linux_device_handle_priv *hpriv = _device_handle_priv(handle);
+
+	usbi_mutex_lock(&hpriv->iso_lock);
+	memset(hpriv->iso_interval, 0, sizeof(hpriv->iso_interval));
+	usbi_mutex_unlock(&hpriv->iso_lock);
+}
+
 static int op_set_configuration(struct libusb_device_handle *handle, int config)
 {
 	struct linux_device_priv *priv = _device_priv(handle->dev);
 	int fd = _device_handle_priv(handle)->fd;
-	int r = ioctl(fd, IOCTL_USBFS_SETCONFIG, &config);
+	int r = usbfs_ioctl(fd, IOCTL_USBFS_SETCONFIG, &config);
 	if (r) {
 		if (errno == EINVAL)
 			return LIBUSB_ERROR_NOT_FOUND;
@@ -1539,6 +1959,7 @@ static int op_set_configuration(struct libusb_device_handle *handle, int config)
 
 	/* update our cached active config descriptor */
 	priv->active_config = config;
+	iso_forget_intervals(handle);
 
 	return LIBUSB_SUCCESS;
 }
@@ -1546,7 +1967,7 @@ static int op_set_configuration(struct libusb_device_handle *handle, int config)
 static int claim_interface(struct libusb_device_handle *handle, int iface)
 {
 	int fd = _device_handle_priv(handle)->fd;
-	int r = ioctl(fd, IOCTL_USBFS_CLAIMINTF, &iface);
+	int r = usbfs_ioctl(fd, IOCTL_USBFS_CLAIMINTF, &iface);
 	if (r) {
 		if (errno == ENOENT)
 			return LIBUSB_ERROR_NOT_FOUND;
@@ -1565,7 +1986,7 @@ static int claim_interface(struct libusb_device_handle *handle, int iface)
 static int release_interface(struct libusb_device_handle *handle, int iface)
 {
 	int fd = _device_handle_priv(handle)->fd;
-	int r = ioctl(fd, IOCTL_USBFS_RELEASEINTF, &iface);
+	int r = usbfs_ioctl(fd, IOCTL_USBFS_RELEASEINTF, &iface);
 	if (r) {
 		if (errno == ENODEV)
 			return LIBUSB_ERROR_NO_DEVICE;
@@ -1586,7 +2007,7 @@ static int op_set_interface(struct libusb_device_handle *handle, int iface,
 
 	setintf.interface = iface;
 	setintf.altsetting = altsetting;
-	r = ioctl(fd, IOCTL_USBFS_SETINTF, &setintf);
+	r = usbfs_ioctl(fd, IOCTL_USBFS_SETINTF, &setintf);
 	if (r) {
 		if (errno == EINVAL)
 			return LIBUSB_ERROR_NOT_FOUND;
@@ -1598,6 +2019,7 @@ static int op_set_interface(struct libusb_device_handle *handle, int iface,
 		return LIBUSB_ERROR_OTHER;
 	}
 
+	iso_forget_intervals(handle);
 	return 0;
 }
 
@@ -1606,7 +2028,7 @@ static int op_clear_halt(struct libusb_device_handle *handle,
 {
 	int fd = _device_handle_priv(handle)->fd;
 	unsigned int _endpoint = endpoint;
-	int r = ioctl(fd, IOCTL_USBFS_CLEAR_HALT, &_endpoint);
+	int r = usbfs_ioctl(fd, IOCTL_USBFS_CLEAR_HALT, &_endpoint);
 	if (r) {
 		if (errno == ENOENT)
 			return LIBUSB_ERROR_NOT_FOUND;
@@ -1638,7 +2060,7 @@ static int op_reset_device(struct libusb_device_handle *handle)
 	}
 
 	usbi_mutex_lock(&handle->lock);
-	r = ioctl(fd, IOCTL_USBFS_RESET, NULL);
+	r = usbfs_ioctl(fd, IOCTL_USBFS_RESET, NULL);
 	if (r) {
 		if (errno == ENODEV) {
 			ret = LIBUSB_ERROR_NOT_FOUND;
@@ -1650,6 +2072,7 @@ static int op_reset_device(struct libusb_device_handle *handle)
 		ret = LIBUSB_ERROR_OTHER;
 		goto out;
 	}
+	iso_forget_intervals(handle);
 
 	/* And re-claim any interfaces which were claimed before the reset */
 	for (i = 0; i < USB_MAXINTERFACES; i++) {
@@ -1691,7 +2114,7 @@ static int do_streams_ioctl(struct libusb_device_handle *handle, long req,
 	streams->num_eps = num_endpoints;
 	memcpy(streams->eps, endpoints, num_endpoints);
 
-	r = ioctl(fd, req, streams);
+	r = usbfs_ioctl(fd, req, streams);
 
 	free(streams);
 
@@ -1758,7 +2181,7 @@ static int op_kernel_driver_active(struct libusb_device_handle *handle,
 	int r;
 
 	getdrv.interface = interface;
-	r = ioctl(fd, IOCTL_USBFS_GETDRIVER, &getdrv);
+	r = usbfs_ioctl(fd, IOCTL_USBFS_GETDRIVER, &getdrv);
 	if (r) {
 		if (errno == ENODATA)
 			return 0;
@@ -1786,11 +2209,11 @@ static int op_detach_kernel_driver(struct libusb_device_handle *handle,
 	command.data = NULL;
 
 	getdrv.interface = interface;
-	r = ioctl(fd, IOCTL_USBFS_GETDRIVER, &getdrv);
+	r = usbfs_ioctl(fd, IOCTL_USBFS_GETDRIVER, &getdrv);
 	if (r == 0 && strcmp(getdrv.driver, "usbfs") == 0)
 		return LIBUSB_ERROR_NOT_FOUND;
 
-	r = ioctl(fd, IOCTL_USBFS_IOCTL, &command);
+	r = usbfs_ioctl(fd, IOCTL_USBFS_IOCTL, &command);
 	if (r) {
 		if (errno == ENODATA)
 			return LIBUSB_ERROR_NOT_FOUND;
@@ -1818,7 +2241,7 @@ static int op_attach_kernel_driver(struct libusb_device_handle *handle,
 	command.ioctl_code = IOCTL_USBFS_CONNECT;
 	command.data = NULL;
 
-	r = ioctl(fd, IOCTL_USBFS_IOCTL, &command);
+	r = usbfs_ioctl(fd, IOCTL_USBFS_IOCTL, &command);
 	if (r < 0) {
 		if (errno == ENODATA)
 			return LIBUSB_ERROR_NOT_FOUND;
@@ -1848,7 +2271,7 @@ static int detach_kernel_driver_and_claim(struct libusb_device_handle *handle,
 	dc.interface = interface;
 	strcpy(dc.driver, "usbfs");
 	dc.flags = USBFS_DISCONNECT_CLAIM_EXCEPT_DRIVER;
-	r = ioctl(fd, IOCTL_USBFS_DISCONNECT_CLAIM, &dc);
+	r = usbfs_ioctl(fd, IOCTL_USBFS_DISCONNECT_CLAIM, &dc);
 	if (r != 0 && errno != ENOTTY) {
 		switch (errno) {
 		case EBUSY:
@@ -1922,7 +2345,7 @@ static int discard_urbs(struct usbi_transfer *itransfer, int first, int last_plu
 		else
 			urb = &tpriv->urbs[i];
 
-		if (0 == ioctl(dpriv->fd, IOCTL_USBFS_DISCARDURB, urb))
+		if (0 == usbfs_ioctl(dpriv->fd, IOCTL_USBFS_DISCARDURB, urb))
 			continue;
 
 		if (EINVAL == errno) {
@@ -1955,17 +2378,250 @@ static void free_iso_urbs(struct linux_transfer_priv *tpriv)
 	tpriv->iso_urbs = NULL;
 }
 
+/* point the URBs of a scatter-gather transfer at its segments, splitting
+ * segments longer than bulk_buffer_len; empty segments get no URB */
+static void map_iov_urbs(struct usbi_transfer *itransfer,
+	struct usbfs_urb *urbs, int bulk_buffer_len)
+{
+	struct usbfs_urb *urb = urbs;
+	int i, offset;
+
+	for (i = 0; i < itransfer->num_iov; i++) {
+		struct libusb_iovec *iov = &itransfer->iov[i];
+
+		for (offset = 0; offset < iov->length; offset += bulk_buffer_len) {
+			urb->buffer = iov->buffer + offset;
+			urb->buffer_length = MIN(iov->length - offset, bulk_buffer_len);
+			urb++;
+		}
+	}
+}
+
+/* hand out the data received or sent by the URBs of a scatter-gather
+ * transfer to the segments they belong to */
+static void update_iov_lengths(struct usbi_transfer *itransfer,
+	struct usbfs_urb *urbs, int num_urbs)
+{
+	struct libusb_iovec *iov = itransfer->iov;
+	int i, remaining = iov->length;
+
+	for (i = 0; i < num_urbs; i++) {
+		while (remaining == 0 && iov < itransfer->iov + itransfer->num_iov - 1)
+			remaining = (++iov)->length;
+		iov->actual_length += urbs[i].actual_length;
+		remaining -= urbs[i].buffer_length;
+	}
+}
+
+/* pick the URB size of the next transfer on an endpoint under
+ * LIBUSB_BULK_URB_SIZE_AUTO, as an index into the tuned sizes */
+static int bulk_tuning_pick(struct libusb_device_handle *handle,
+	unsigned char endpoint)
+{
+	struct linux_device_handle_priv *hpriv = _device_handle_priv(handle);
+	struct linux_bulk_tuning *tuning;
+	int index;
+
+	usbi_mutex_lock(&hpriv->bulk_tuning_lock);
+	tuning = hpriv->bulk_tuning[BULK_TUNING_ENDPOINT(endpoint)];
+	if (!tuning) {
+		tuning = calloc(1, sizeof(*tuning));
+		if (!tuning) {
+			usbi_mutex_unlock(&hpriv->bulk_tuning_lock);
+			return LIBUSB_ERROR_NO_MEM;
+		}
+		tuning->limit = BULK_TUNING_SIZES;
+		hpriv->bulk_tuning[BULK_TUNING_ENDPOINT(endpoint)] = tuning;
+	}
+	index = tuning->next;
+	usbi_mutex_unlock(&hpriv->bulk_tuning_lock);
+
+	return index;
+}
+
+/* the kernel failed to allocate URBs of the given size, stick to smaller
+ * ones from now on */
+static void bulk_tuning_limit(struct libusb_device_handle *handle,
+	unsigned char endpoint, int index)
+{
+	struct linux_device_handle_priv *hpriv = _device_handle_priv(handle);
+	struct linux_bulk_tuning *tuning;
+
+	usbi_mutex_lock(&hpriv->bulk_tuning_lock);
+	tuning = hpriv->bulk_tuning[BULK_TUNING_ENDPOINT(endpoint)];
+	if (index < tuning->limit)
+		tuning->limit = index;
+	if (tuning->next >= tuning->limit)
+		tuning->next = tuning->limit - 1;
+	if (tuning->best >= tuning->limit)
+		tuning->best = tuning->limit - 1;
+	usbi_mutex_unlock(&hpriv->bulk_tuning_lock);
+}
+
+/* account for the throughput of a completed transfer and choose the URB
+ * size of the next one: every size is measured once, after which the best
+ * is used, every BULK_TUNING_PROBE_INTERVAL transfers trying one of its
+ * neighbours instead */
+static void bulk_tuning_record(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct linux_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+	struct linux_device_handle_priv *hpriv =
+		_device_handle_priv(transfer->dev_handle);
+	struct linux_bulk_tuning *tuning;
+	struct timespec now;
+	uint64_t elapsed, rate;
+	int i, probe;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = (uint64_t)(now.tv_sec - tpriv->submit_time.tv_sec) * 1000000000ULL +
+		(uint64_t)now.tv_nsec - (uint64_t)tpriv->submit_time.tv_nsec;
+	if (!elapsed)
+		return;
+	rate = (uint64_t)itransfer->transferred * 1000000000ULL / elapsed;
+
+	usbi_mutex_lock(&hpriv->bulk_tuning_lock);
+	tuning = hpriv->bulk_tuning[BULK_TUNING_ENDPOINT(transfer->endpoint)];
+	if (tpriv->tuning_index >= tuning->limit)
+		goto out;
+	i = tpriv->tuning_index;
+	tuning->rate[i] = tuning->rate[i] ? (3 * tuning->rate[i] + rate) / 4 : rate;
+	tuning->transfers++;
+
+	tuning->best = 0;
+	for (i = 1; i < tuning->limit; i++) {
+		if (tuning->rate[i] > tuning->rate[tuning->best])
+			tuning->best = i;
+	}
+
+	for (i = 0; i < tuning->limit && tuning->rate[i]; i++)
+		;
+	if (i < tuning->limit) {
+		tuning->next = i;
+	} else if (tuning->transfers % BULK_TUNING_PROBE_INTERVAL == 0) {
+		probe = (tuning->transfers / BULK_TUNING_PROBE_INTERVAL) & 1 ? 1 : -1;
+		if (tuning->best + probe < 0 || tuning->best + probe >= tuning->limit)
+			probe = -probe;
+		tuning->next = tuning->best + probe;
+		if (tuning->next < 0 || tuning->next >= tuning->limit)
+			tuning->next = tuning->best;
+	} else {
+		tuning->next = tuning->best;
+	}
+out:
+	usbi_mutex_unlock(&hpriv->bulk_tuning_lock);
+}
+
+static int op_get_bulk_urb_params(struct libusb_device_handle *handle,
+	unsigned char endpoint, struct libusb_bulk_urb_params *params)
+{
+	struct linux_context_priv *cpriv = _context_priv(HANDLE_CTX(handle));
+	struct linux_device_handle_priv *hpriv = _device_handle_priv(handle);
+	struct linux_bulk_tuning *tuning;
+	int urb_size = cpriv->bulk_urb_size;
+
+	memset(params, 0, sizeof(*params));
+	if (!urb_size)
+		return 0;
+
+	params->window = cpriv->bulk_urb_window;
+	if (urb_size != LIBUSB_BULK_URB_SIZE_AUTO) {
+		params->urb_size = urb_size;
+		return 0;
+	}
+
+	params->auto_tuned = 1;
+	params->urb_size = BULK_TUNING_MIN_SIZE;
+	usbi_mutex_lock(&hpriv->bulk_tuning_lock);
+	tuning = hpriv->bulk_tuning[BULK_TUNING_ENDPOINT(endpoint)];
+	if (tuning) {
+		params->urb_size = BULK_TUNING_MIN_SIZE << tuning->next;
+		params->throughput = tuning->rate[tuning->next];
+		params->transfers = tuning->transfers;
+	}
+	usbi_mutex_unlock(&hpriv->bulk_tuning_lock);
+
+	return 0;
+}
+
+/* the URBs of a bulk transfer that are yet to be submitted never will be,
+ * count them as retired */
+static void stop_bulk_submission(struct linux_transfer_priv *tpriv)
+{
+	tpriv->num_retired += tpriv->submit_end - tpriv->num_submitted;
+	tpriv->submit_end = tpriv->num_submitted;
+}
+
+/* set up and submit URB i of a bulk transfer, returns 0 or a negative errno */
+static int submit_bulk_urb(struct usbi_transfer *itransfer, int i)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct linux_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+	struct linux_device_handle_priv *dpriv =
+		_device_handle_priv(transfer->dev_handle);
+	struct usbfs_urb *urb = &tpriv->urbs[i];
+	int is_out = (transfer->endpoint & LIBUSB_ENDPOINT_DIR_MASK)
+		== LIBUSB_ENDPOINT_OUT;
+	int r;
+
+	urb->usercontext = itransfer;
+	switch (transfer->type) {
+	case LIBUSB_TRANSFER_TYPE_BULK:
+		urb->type = USBFS_URB_TYPE_BULK;
+		urb->stream_id = 0;
+		break;
+	case LIBUSB_TRANSFER_TYPE_BULK_STREAM:
+		urb->type = USBFS_URB_TYPE_BULK;
+		urb->stream_id = itransfer->stream_id;
+		break;
+	case LIBUSB_TRANSFER_TYPE_INTERRUPT:
+		urb->type = USBFS_URB_TYPE_INTERRUPT;
+		break;
+	}
+	urb->endpoint = transfer->endpoint;
+	/* don't set the short not ok flag for the last URB */
+	if (tpriv->bulk_continuation && !is_out && (i < tpriv->num_urbs - 1))
+		urb->flags = USBFS_URB_SHORT_NOT_OK;
+	if (!usbi_transfer_has_iov(itransfer)) {
+		/* scatter-gather buffers are set up by map_iov_urbs() */
+		urb->buffer = transfer->buffer + (i * tpriv->urb_size);
+		urb->buffer_length = MIN(transfer->length - i * tpriv->urb_size,
+			tpriv->urb_size);
+	}
+
+	if (i > 0 && tpriv->bulk_continuation)
+		urb->flags |= USBFS_URB_BULK_CONTINUATION;
+
+	/* we have already checked that the flag is supported */
+	if (is_out && i == tpriv->num_urbs - 1 &&
+	    transfer->flags & LIBUSB_TRANSFER_ADD_ZERO_PACKET)
+		urb->flags |= USBFS_URB_ZERO_PACKET;
+
+	r = usbfs_ioctl(dpriv->fd, IOCTL_USBFS_SUBMITURB, urb);
+	if (r < 0)
+		r = -errno;
+	usbi_trace(TRANSFER_CTX(transfer), LIBUSB_TRACE_SUBMIT_URB, transfer,
+		transfer->endpoint, i, r, urb->buffer_length);
+	return r;
+}
+
 static int submit_bulk_transfer(struct usbi_transfer *itransfer)
 {
 	struct libusb_transfer *transfer =
 		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
 	struct linux_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+	struct linux_context_priv *cpriv = _context_priv(ITRANSFER_CTX(itransfer));
 	struct linux_device_handle_priv *dpriv =
 		_device_handle_priv(transfer->dev_handle);
 	struct usbfs_urb *urbs;
 	int is_out = (transfer->endpoint & LIBUSB_ENDPOINT_DIR_MASK)
 		== LIBUSB_ENDPOINT_OUT;
+	int has_iov = usbi_transfer_has_iov(itransfer);
+	int urb_size = cpriv->bulk_urb_size;
 	int bulk_buffer_len, use_bulk_continuation;
+	int num_urbs, window;
 	int r;
 	int i;
 
@@ -1973,6 +2629,21 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer)
 			!(dpriv->caps & USBFS_CAP_ZERO_PACKET))
 		return LIBUSB_ERROR_NOT_SUPPORTED;
 
+	/* without bulk-continuation the kernel carries on with the URBs of the
+	 * next segment after a short read, leaving a hole in the data */
+	if (has_iov && !is_out && !(dpriv->caps & USBFS_CAP_BULK_CONTINUATION))
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	/* transfers split into URBs of a size set by the application
+	 * (LIBUSB_OPTION_BULK_URB_SIZE) are not affected by any of the below.
+	 * Only a window of their URBs is in flight at once, the others are
+	 * submitted as the earlier ones retire. */
+	if (has_iov || transfer->type == LIBUSB_TRANSFER_TYPE_INTERRUPT)
+		urb_size = 0;
+retry:
+	tpriv->tuning_index = -1;
+	window = 0;
+
 	/*
 	 * Older versions of usbfs place a 16kb limit on bulk URBs. We work
 	 * around this by splitting large transfers into 16k blocks, and then
@@ -1992,7 +2663,20 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer)
 	 * short split-transfers to work reliable USBFS_CAP_BULK_CONTINUATION
 	 * is needed, but this is not always available.
 	 */
-	if (dpriv->caps & USBFS_CAP_BULK_SCATTER_GATHER) {
+	if (urb_size) {
+		if (urb_size == LIBUSB_BULK_URB_SIZE_AUTO) {
+			r = bulk_tuning_pick(transfer->dev_handle, transfer->endpoint);
+			if (r < 0)
+				return r;
+			tpriv->tuning_index = r;
+			bulk_buffer_len = BULK_TUNING_MIN_SIZE << r;
+		} else {
+			bulk_buffer_len = urb_size;
+		}
+		use_bulk_continuation = !!(dpriv->caps & USBFS_CAP_BULK_CONTINUATION);
+		window = cpriv->bulk_urb_window;
+		clock_gettime(CLOCK_MONOTONIC, &tpriv->submit_time);
+	} else if (dpriv->caps & USBFS_CAP_BULK_SCATTER_GATHER) {
 		/* Good! Just submit everything in one go */
 		bulk_buffer_len = transfer->length ? transfer->length : 1;
 		use_bulk_continuation = 0;
@@ -2015,15 +2699,30 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer)
 		use_bulk_continuation = 0;
 	}
 
-	int num_urbs = transfer->length / bulk_buffer_len;
-	int last_urb_partial = 0;
+	/* scatter-gather segments each get URBs of their own, chained with
+	 * bulk-continuation so that a short read in one segment ends the
+	 * transfer without the kernel moving on to the next */
+	if (has_iov && (dpriv->caps & USBFS_CAP_BULK_CONTINUATION))
+		use_bulk_continuation = 1;
+
+	if (has_iov) {
+		num_urbs = 0;
+		for (i = 0; i < itransfer->num_iov; i++) {
+			int length = itransfer->iov[i].length;
 
-	if (transfer->length == 0) {
+			num_urbs += length / bulk_buffer_len +
+				(length % bulk_buffer_len > 0);
+		}
+		if (num_urbs == 0)
+			num_urbs = 1;
+	} else if (transfer->length == 0) {
 		num_urbs = 1;
-	} else if ((transfer->length % bulk_buffer_len) > 0) {
-		last_urb_partial = 1;
-		num_urbs++;
+	} else {
+		num_urbs = transfer->length / bulk_buffer_len +
+			(transfer->length % bulk_buffer_len > 0);
 	}
+	if (!window || window > num_urbs)
+		window = num_urbs;
 	usbi_dbg("need %d urbs for new transfer with length %d", num_urbs,
 		transfer->length);
 	urbs = calloc(num_urbs, sizeof(struct usbfs_urb));
@@ -2032,101 +2731,146 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer)
 	tpriv->urbs = urbs;
 	tpriv->num_urbs = num_urbs;
 	tpriv->num_retired = 0;
+	tpriv->num_submitted = 0;
+	tpriv->submit_end = num_urbs;
+	tpriv->urb_size = bulk_buffer_len;
+	tpriv->bulk_continuation = use_bulk_continuation;
 	tpriv->reap_action = NORMAL;
 	tpriv->reap_status = LIBUSB_TRANSFER_COMPLETED;
+	if (has_iov)
+		map_iov_urbs(itransfer, urbs, bulk_buffer_len);
 
-	for (i = 0; i < num_urbs; i++) {
-		struct usbfs_urb *urb = &urbs[i];
-		urb->usercontext = itransfer;
-		switch (transfer->type) {
-		case LIBUSB_TRANSFER_TYPE_BULK:
-			urb->type = USBFS_URB_TYPE_BULK;
-			urb->stream_id = 0;
-			break;
-		case LIBUSB_TRANSFER_TYPE_BULK_STREAM:
-			urb->type = USBFS_URB_TYPE_BULK;
-			urb->stream_id = itransfer->stream_id;
-			break;
-		case LIBUSB_TRANSFER_TYPE_INTERRUPT:
-			urb->type = USBFS_URB_TYPE_INTERRUPT;
-			break;
+	for (i = 0; i < window; i++) {
+		r = submit_bulk_urb(itransfer, i);
+		if (r == 0) {
+			tpriv->num_submitted++;
+			continue;
 		}
-		urb->endpoint = transfer->endpoint;
-		urb->buffer = transfer->buffer + (i * bulk_buffer_len);
-		/* don't set the short not ok flag for the last URB */
-		if (use_bulk_continuation && !is_out && (i < num_urbs - 1))
-			urb->flags = USBFS_URB_SHORT_NOT_OK;
-		if (i == num_urbs - 1 && last_urb_partial)
-			urb->buffer_length = transfer->length % bulk_buffer_len;
-		else if (transfer->length == 0)
-			urb->buffer_length = 0;
-		else
-			urb->buffer_length = bulk_buffer_len;
-
-		if (i > 0 && use_bulk_continuation)
-			urb->flags |= USBFS_URB_BULK_CONTINUATION;
-
-		/* we have already checked that the flag is supported */
-		if (is_out && i == num_urbs - 1 &&
-		    transfer->flags & LIBUSB_TRANSFER_ADD_ZERO_PACKET)
-			urb->flags |= USBFS_URB_ZERO_PACKET;
 
-		r = ioctl(dpriv->fd, IOCTL_USBFS_SUBMITURB, urb);
-		if (r < 0) {
-			if (errno == ENODEV) {
-				r = LIBUSB_ERROR_NO_DEVICE;
-			} else {
-				usbi_err(TRANSFER_CTX(transfer),
-					"submiturb failed error %d errno=%d", r, errno);
-				r = LIBUSB_ERROR_IO;
-			}
-
-			/* if the first URB submission fails, we can simply free up and
-			 * return failure immediately. */
-			if (i == 0) {
-				usbi_dbg("first URB failed, easy peasy");
-				free(urbs);
-				tpriv->urbs = NULL;
-				return r;
+		/* if the first URB submission fails, we can simply free up and
+		 * return failure immediately. an automatically sized URB the
+		 * kernel could not allocate is retried with smaller ones. */
+		if (i == 0) {
+			free(urbs);
+			tpriv->urbs = NULL;
+			if (r == -ENOMEM && tpriv->tuning_index > 0) {
+				usbi_dbg("%d byte URB failed, trying smaller ones",
+					bulk_buffer_len);
+				bulk_tuning_limit(transfer->dev_handle,
+					transfer->endpoint, tpriv->tuning_index);
+				goto retry;
 			}
+			usbi_dbg("first URB failed, easy peasy");
+			if (r == -ENODEV)
+				return LIBUSB_ERROR_NO_DEVICE;
+			usbi_err(TRANSFER_CTX(transfer),
+				"submiturb failed errno=%d", -r);
+			return LIBUSB_ERROR_IO;
+		}
 
-			/* if it's not the first URB that failed, the situation is a bit
-			 * tricky. we may need to discard all previous URBs. there are
-			 * complications:
-			 *  - discarding is asynchronous - discarded urbs will be reaped
-			 *    later. the user must not have freed the transfer when the
-			 *    discarded URBs are reaped, otherwise libusb will be using
-			 *    freed memory.
-			 *  - the earlier URBs may have completed successfully and we do
-			 *    not want to throw away any data.
-			 *  - this URB failing may be no error; EREMOTEIO means that
-			 *    this transfer simply didn't need all the URBs we submitted
-			 * so, we report that the transfer was submitted successfully and
-			 * in case of error we discard all previous URBs. later when
-			 * the final reap completes we can report error to the user,
-			 * or success if an earlier URB was completed successfully.
-			 */
-			tpriv->reap_action = EREMOTEIO == errno ? COMPLETED_EARLY : SUBMIT_FAILED;
+		if (r != -ENODEV)
+			usbi_err(TRANSFER_CTX(transfer),
+				"submiturb failed errno=%d", -r);
+
+		/* if it's not the first URB that failed, the situation is a bit
+		 * tricky. we may need to discard all previous URBs. there are
+		 * complications:
+		 *  - discarding is asynchronous - discarded urbs will be reaped
+		 *    later. the user must not have freed the transfer when the
+		 *    discarded URBs are reaped, otherwise libusb will be using
+		 *    freed memory.
+		 *  - the earlier URBs may have completed successfully and we do
+		 *    not want to throw away any data.
+		 *  - this URB failing may be no error; EREMOTEIO means that
+		 *    this transfer simply didn't need all the URBs we submitted
+		 * so, we report that the transfer was submitted successfully and
+		 * in case of error we discard all previous URBs. later when
+		 * the final reap completes we can report error to the user,
+		 * or success if an earlier URB was completed successfully.
+		 */
+		tpriv->reap_action = -EREMOTEIO == r ? COMPLETED_EARLY : SUBMIT_FAILED;
 
-			/* The URBs we haven't submitted yet we count as already
-			 * retired. */
-			tpriv->num_retired += num_urbs - i;
+		/* The URBs we haven't submitted yet we count as already
+		 * retired. */
+		stop_bulk_submission(tpriv);
 
-			/* If we completed short then don't try to discard. */
-			if (COMPLETED_EARLY == tpriv->reap_action)
-				return 0;
+		/* If we completed short then don't try to discard. */
+		if (COMPLETED_EARLY == tpriv->reap_action)
+			return 0;
 
-			discard_urbs(itransfer, 0, i);
+		discard_urbs(itransfer, 0, i);
 
-			usbi_dbg("reporting successful submission but waiting for %d "
-				"discards before reporting error", i);
-			return 0;
-		}
+		usbi_dbg("reporting successful submission but waiting for %d "
+			"discards before reporting error", i);
+		return 0;
 	}
 
 	return 0;
 }
 
+static int iso_get_interval(struct libusb_device_handle *handle,
+	unsigned char endpoint)
+{
+	struct linux_device_handle_priv *hpriv = _device_handle_priv(handle);
+	int *interval = &hpriv->iso_interval[BULK_TUNING_ENDPOINT(endpoint)];
+	int r;
+
+	usbi_mutex_lock(&hpriv->iso_lock);
+	r = *interval;
+	usbi_mutex_unlock(&hpriv->iso_lock);
+	if (r)
+		return r;
+
+	r = usbi_get_endpoint_interval(handle, endpoint);
+	if (r == LIBUSB_ERROR_NOT_FOUND || r == LIBUSB_ERROR_INVALID_PARAM) {
+		/* let usbfs reject the URB as it always has */
+		r = 1;
+	} else if (r < 0) {
+		return r;
+	}
+
+	usbi_mutex_lock(&hpriv->iso_lock);
+	*interval = r;
+	usbi_mutex_unlock(&hpriv->iso_lock);
+	return r;
+}
+
+static void iso_record_frame(struct libusb_device_handle *handle, int frame)
+{
+	struct linux_device_handle_priv *hpriv = _device_handle_priv(handle);
+
+	usbi_mutex_lock(&hpriv->iso_lock);
+	hpriv->iso_frame = frame;
+	clock_gettime(CLOCK_MONOTONIC, &hpriv->iso_frame_time);
+	hpriv->iso_frame_known = 1;
+	usbi_mutex_unlock(&hpriv->iso_lock);
+}
+
+/* usbfs has no way to read the frame counter of the host controller, so
+ * the frame number is extrapolated from the last iso URB reaped */
+static int op_get_frame_number(struct libusb_device_handle *handle,
+	int *frame_number)
+{
+	struct linux_device_handle_priv *hpriv = _device_handle_priv(handle);
+	struct timespec now;
+	uint64_t elapsed, frame_ns;
+	int r = LIBUSB_ERROR_NOT_FOUND;
+
+	frame_ns = handle->dev->speed >= LIBUSB_SPEED_HIGH ? 125000 : 1000000;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	usbi_mutex_lock(&hpriv->iso_lock);
+	if (hpriv->iso_frame_known) {
+		elapsed = (uint64_t)(now.tv_sec - hpriv->iso_frame_time.tv_sec) * 1000000000ULL +
+			(uint64_t)now.tv_nsec - (uint64_t)hpriv->iso_frame_time.tv_nsec;
+		*frame_number = hpriv->iso_frame + (int)(elapsed / frame_ns);
+		r = 0;
+	}
+	usbi_mutex_unlock(&hpriv->iso_lock);
+
+	return r;
+}
+
 static int submit_iso_transfer(struct usbi_transfer *itransfer)
 {
 	struct libusb_transfer *transfer =
@@ -2137,7 +2881,7 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 	struct usbfs_urb **urbs;
 	int num_packets = transfer->num_iso_packets;
 	int num_packets_remaining;
-	int i, j;
+	int i, j, r;
 	int num_urbs;
 	unsigned int packet_len;
 	unsigned int total_len = 0;
@@ -2167,6 +2911,11 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 	if (transfer->length < (int)total_len)
 		return LIBUSB_ERROR_INVALID_PARAM;
 
+	r = iso_get_interval(transfer->dev_handle, transfer->endpoint);
+	if (r < 0)
+		return r;
+	tpriv->iso_interval = r;
+
 	/* usbfs limits the number of iso packets per URB */
 	num_urbs = (num_packets + (MAX_ISO_PACKETS_PER_URB - 1)) / MAX_ISO_PACKETS_PER_URB;
 
@@ -2209,8 +2958,12 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 
 		urb->usercontext = itransfer;
 		urb->type = USBFS_URB_TYPE_ISO;
-		/* FIXME: interface for non-ASAP data? */
-		urb->flags = USBFS_URB_ISO_ASAP;
+		/* only the first URB goes in a requested frame, the others are
+		 * queued right after it */
+		if (i == 0 && itransfer->iso_start_frame != LIBUSB_ISO_START_ASAP)
+			urb->start_frame = itransfer->iso_start_frame;
+		else
+			urb->flags = USBFS_URB_ISO_ASAP;
 		urb->endpoint = transfer->endpoint;
 		urb->number_of_packets = num_packets_in_urb;
 		urb->buffer = urb_buffer;
@@ -2221,7 +2974,9 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 
 	/* submit URBs */
 	for (i = 0; i < num_urbs; i++) {
-		int r = ioctl(dpriv->fd, IOCTL_USBFS_SUBMITURB, urbs[i]);
+		r = usbfs_ioctl(dpriv->fd, IOCTL_USBFS_SUBMITURB, urbs[i]);
+		usbi_trace(TRANSFER_CTX(transfer), LIBUSB_TRACE_SUBMIT_URB, transfer,
+			transfer->endpoint, i, r < 0 ? -errno : 0, urbs[i]->buffer_length);
 		if (r < 0) {
 			if (errno == ENODEV) {
 				r = LIBUSB_ERROR_NO_DEVICE;
@@ -2229,6 +2984,11 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 				usbi_warn(TRANSFER_CTX(transfer),
 					"submiturb failed, transfer too large");
 				r = LIBUSB_ERROR_INVALID_PARAM;
+			} else if (errno == EXDEV || errno == EFBIG) {
+				usbi_warn(TRANSFER_CTX(transfer),
+					"submiturb failed, start frame %d out of range",
+					itransfer->iso_start_frame);
+				r = LIBUSB_ERROR_INVALID_PARAM;
 			} else if (errno == EMSGSIZE) {
 				usbi_warn(TRANSFER_CTX(transfer),
 					"submiturb failed, iso packet length too large");
@@ -2302,7 +3062,9 @@ static int submit_control_transfer(struct usbi_transfer *itransfer)
 	urb->buffer = transfer->buffer;
 	urb->buffer_length = transfer->length;
 
-	r = ioctl(dpriv->fd, IOCTL_USBFS_SUBMITURB, urb);
+	r = usbfs_ioctl(dpriv->fd, IOCTL_USBFS_SUBMITURB, urb);
+	usbi_trace(TRANSFER_CTX(transfer), LIBUSB_TRACE_SUBMIT_URB, transfer,
+		transfer->endpoint, 0, r < 0 ? -errno : 0, urb->buffer_length);
 	if (r < 0) {
 		free(urb);
 		tpriv->urbs = NULL;
@@ -2320,22 +3082,43 @@ static int op_submit_transfer(struct usbi_transfer *itransfer)
 {
 	struct libusb_transfer *transfer =
 		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct linux_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+	struct linux_shard *shard =
+		_device_handle_priv(transfer->dev_handle)->shard;
+	int r;
+
+	/* the thread of a shard times out the transfers it reaps, so that they
+	 * never involve the context's own event loop */
+	tpriv->timeout_shard = NULL;
+	if (shard && timerisset(&itransfer->timeout)) {
+		tpriv->timeout_shard = shard;
+		itransfer->timeout_flags |= USBI_TRANSFER_OS_HANDLES_TIMEOUT;
+	}
 
 	switch (transfer->type) {
 	case LIBUSB_TRANSFER_TYPE_CONTROL:
-		return submit_control_transfer(itransfer);
+		r = submit_control_transfer(itransfer);
+		break;
 	case LIBUSB_TRANSFER_TYPE_BULK:
 	case LIBUSB_TRANSFER_TYPE_BULK_STREAM:
-		return submit_bulk_transfer(itransfer);
+		r = submit_bulk_transfer(itransfer);
+		break;
 	case LIBUSB_TRANSFER_TYPE_INTERRUPT:
-		return submit_bulk_transfer(itransfer);
+		r = submit_bulk_transfer(itransfer);
+		break;
 	case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
-		return submit_iso_transfer(itransfer);
+		r = submit_iso_transfer(itransfer);
+		break;
 	default:
 		usbi_err(TRANSFER_CTX(transfer),
 			"unknown endpoint type %d", transfer->type);
-		return LIBUSB_ERROR_INVALID_PARAM;
+		r = LIBUSB_ERROR_INVALID_PARAM;
 	}
+
+	if (r == 0 && tpriv->timeout_shard)
+		shard_add_timeout(shard, &itransfer->timeout);
+
+	return r;
 }
 
 static int op_cancel_transfer(struct usbi_transfer *itransfer)
@@ -2348,7 +3131,18 @@ static int op_cancel_transfer(struct usbi_transfer *itransfer)
 	if (!tpriv->urbs)
 		return LIBUSB_ERROR_NOT_FOUND;
 
-	r = discard_urbs(itransfer, 0, tpriv->num_urbs);
+	if ((transfer->type == LIBUSB_TRANSFER_TYPE_BULK ||
+	     transfer->type == LIBUSB_TRANSFER_TYPE_BULK_STREAM) &&
+	    tpriv->num_submitted < tpriv->submit_end) {
+		/* a transfer with URBs still to submit has not completed, even
+		 * if the last one submitted has */
+		stop_bulk_submission(tpriv);
+		r = discard_urbs(itransfer, 0, tpriv->num_submitted);
+		if (r == LIBUSB_ERROR_NOT_FOUND)
+			r = 0;
+	} else {
+		r = discard_urbs(itransfer, 0, tpriv->num_urbs);
+	}
 	if (r != 0)
 		return r;
 
@@ -2393,12 +3187,57 @@ static void op_clear_transfer_priv(struct usbi_transfer *itransfer)
 	}
 }
 
+/* report the outcome of a transfer once all of its URBs have been retired.
+ * transfers reaped by a shard are reported by its thread once it has stopped
+ * reaping, and those reaped by a reaper thread are handed over to the event
+ * handling thread so that user callbacks keep running there */
+static int report_transfer(struct usbi_transfer *itransfer, int cancelled,
+	enum libusb_transfer_status status)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct linux_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+
+	struct linux_device_handle_priv *hpriv =
+		_device_handle_priv(transfer->dev_handle);
+
+	if (hpriv->shard || hpriv->reaper) {
+		tpriv->deferred_cancel = cancelled;
+		tpriv->deferred_status = status;
+	}
+
+	if (hpriv->shard) {
+		/* called with the shard's lock held */
+		usbi_retire_transfer(itransfer);
+		list_add_tail(&itransfer->completed_list, &hpriv->shard->completed);
+		return 0;
+	}
+
+	if (hpriv->reaper) {
+		usbi_signal_transfer_completion(itransfer);
+		return 0;
+	}
+
+	return cancelled ? usbi_handle_transfer_cancellation(itransfer) :
+		usbi_handle_transfer_completion(itransfer, status);
+}
+
+static int op_handle_transfer_completion(struct usbi_transfer *itransfer)
+{
+	struct linux_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+
+	return tpriv->deferred_cancel ?
+		usbi_handle_transfer_cancellation(itransfer) :
+		usbi_handle_transfer_completion(itransfer, tpriv->deferred_status);
+}
+
 static int handle_bulk_completion(struct usbi_transfer *itransfer,
 	struct usbfs_urb *urb)
 {
 	struct linux_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
 	struct libusb_transfer *transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
 	int urb_idx = urb - tpriv->urbs;
+	int r;
 
 	usbi_mutex_lock(&itransfer->lock);
 	usbi_dbg("handling completion status %d of bulk urb %d/%d", urb->status,
@@ -2424,12 +3263,14 @@ static int handle_bulk_completion(struct usbi_transfer *itransfer,
 		 * When this happens, our objectives are not to lose any "surplus" data,
 		 * and also to stick it at the end of the previously-received data
 		 * (closing any holes), so that libusb reports the total amount of
-		 * transferred data and presents it in a contiguous chunk.
+		 * transferred data and presents it in a contiguous chunk. Scatter-gather
+		 * transfers instead leave the data where it is and report it in the
+		 * actual length of its segment.
 		 */
 		if (urb->actual_length > 0) {
 			unsigned char *target = transfer->buffer + itransfer->transferred;
 			usbi_dbg("received %d bytes of surplus data", urb->actual_length);
-			if (urb->buffer != target) {
+			if (!usbi_transfer_has_iov(itransfer) && urb->buffer != target) {
 				usbi_dbg("moving surplus data from offset %d to offset %d",
 					(unsigned char *) urb->buffer - transfer->buffer,
 					target - transfer->buffer);
@@ -2502,31 +3343,49 @@ static int handle_bulk_completion(struct usbi_transfer *itransfer,
 			urb->actual_length, urb->buffer_length);
 		if (tpriv->reap_action == NORMAL)
 			tpriv->reap_action = COMPLETED_EARLY;
+	} else if (tpriv->num_submitted < tpriv->submit_end) {
+		/* keep the window of URBs in flight full */
+		r = submit_bulk_urb(itransfer, tpriv->num_submitted);
+		if (r == 0) {
+			tpriv->num_submitted++;
+			goto out_unlock;
+		}
+		usbi_dbg("submitting urb %d failed errno=%d", tpriv->num_submitted + 1, -r);
+		tpriv->reap_action = -EREMOTEIO == r ? COMPLETED_EARLY : SUBMIT_FAILED;
+	} else if (tpriv->num_retired == tpriv->num_urbs) {
+		usbi_dbg("no more URBs --> complete!");
+		goto completed;
 	} else
 		goto out_unlock;
 
 cancel_remaining:
-	if (ERROR == tpriv->reap_action && LIBUSB_TRANSFER_COMPLETED == tpriv->reap_status)
+	if ((ERROR == tpriv->reap_action || SUBMIT_FAILED == tpriv->reap_action) &&
+	    LIBUSB_TRANSFER_COMPLETED == tpriv->reap_status)
 		tpriv->reap_status = LIBUSB_TRANSFER_ERROR;
 
+	stop_bulk_submission(tpriv);
 	if (tpriv->num_retired == tpriv->num_urbs) /* nothing to cancel */
 		goto completed;
 
 	/* cancel remaining urbs and wait for their completion before
 	 * reporting results */
-	discard_urbs(itransfer, urb_idx + 1, tpriv->num_urbs);
+	discard_urbs(itransfer, urb_idx + 1, tpriv->num_submitted);
 
 out_unlock:
 	usbi_mutex_unlock(&itransfer->lock);
 	return 0;
 
 completed:
+	if (usbi_transfer_has_iov(itransfer))
+		update_iov_lengths(itransfer, tpriv->urbs, tpriv->num_urbs);
+	if (tpriv->tuning_index >= 0 && tpriv->reap_action == NORMAL &&
+	    tpriv->reap_status == LIBUSB_TRANSFER_COMPLETED)
+		bulk_tuning_record(itransfer);
 	free(tpriv->urbs);
 	tpriv->urbs = NULL;
 	usbi_mutex_unlock(&itransfer->lock);
-	return CANCELLED == tpriv->reap_action ?
-		usbi_handle_transfer_cancellation(itransfer) :
-		usbi_handle_transfer_completion(itransfer, tpriv->reap_status);
+	return report_transfer(itransfer, CANCELLED == tpriv->reap_action,
+		tpriv->reap_status);
 }
 
 static int handle_iso_completion(struct usbi_transfer *itransfer,
@@ -2537,6 +3396,8 @@ static int handle_iso_completion(struct usbi_transfer *itransfer,
 	struct linux_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
 	int num_urbs = tpriv->num_urbs;
 	int urb_idx = 0;
+	int *frames;
+	int last_frame = -1;
 	int i;
 	enum libusb_transfer_status status = LIBUSB_TRANSFER_COMPLETED;
 
@@ -2558,10 +3419,17 @@ static int handle_iso_completion(struct usbi_transfer *itransfer,
 
 	/* copy isochronous results back in */
 
+	/* only the packets of an URB that was not unlinked, and that were
+	 * transferred, are known to have been scheduled in their frame */
+	frames = itransfer->iso_frames + tpriv->iso_packet_offset;
 	for (i = 0; i < urb->number_of_packets; i++) {
 		struct usbfs_iso_packet_desc *urb_desc = &urb->iso_frame_desc[i];
 		struct libusb_iso_packet_descriptor *lib_desc =
 			&transfer->iso_packet_desc[tpriv->iso_packet_offset++];
+		if (urb->status == 0 && urb_desc->status == 0) {
+			last_frame = urb->start_frame + i * tpriv->iso_interval;
+			frames[i] = last_frame;
+		}
 		lib_desc->status = LIBUSB_TRANSFER_COMPLETED;
 		switch (urb_desc->status) {
 		case 0:
@@ -2599,6 +3467,9 @@ static int handle_iso_completion(struct usbi_transfer *itransfer,
 		}
 		lib_desc->actual_length = urb_desc->actual_length;
 	}
+	if (last_frame >= 0)
+		iso_record_frame(transfer->dev_handle,
+			last_frame + tpriv->iso_interval);
 
 	tpriv->num_retired++;
 
@@ -2610,10 +3481,10 @@ static int handle_iso_completion(struct usbi_transfer *itransfer,
 			free_iso_urbs(tpriv);
 			if (tpriv->reap_action == CANCELLED) {
 				usbi_mutex_unlock(&itransfer->lock);
-				return usbi_handle_transfer_cancellation(itransfer);
+				return report_transfer(itransfer, 1, 0);
 			} else {
 				usbi_mutex_unlock(&itransfer->lock);
-				return usbi_handle_transfer_completion(itransfer,
+				return report_transfer(itransfer, 0,
 					LIBUSB_TRANSFER_ERROR);
 			}
 		}
@@ -2642,7 +3513,7 @@ static int handle_iso_completion(struct usbi_transfer *itransfer,
 		usbi_dbg("last URB in transfer --> complete!");
 		free_iso_urbs(tpriv);
 		usbi_mutex_unlock(&itransfer->lock);
-		return usbi_handle_transfer_completion(itransfer, status);
+		return report_transfer(itransfer, 0, status);
 	}
 
 out:
@@ -2668,7 +3539,7 @@ static int handle_control_completion(struct usbi_transfer *itransfer,
 		free(tpriv->urbs);
 		tpriv->urbs = NULL;
 		usbi_mutex_unlock(&itransfer->lock);
-		return usbi_handle_transfer_cancellation(itransfer);
+		return report_transfer(itransfer, 1, 0);
 	}
 
 	switch (urb->status) {
@@ -2709,7 +3580,48 @@ static int handle_control_completion(struct usbi_transfer *itransfer,
 	free(tpriv->urbs);
 	tpriv->urbs = NULL;
 	usbi_mutex_unlock(&itransfer->lock);
-	return usbi_handle_transfer_completion(itransfer, status);
+	return report_transfer(itransfer, 0, status);
+}
+
+static int handle_reaped_urb(struct libusb_device_handle *handle,
+	struct usbfs_urb *urb)
+{
+	struct usbi_transfer *itransfer = urb->usercontext;
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+
+	usbi_dbg("urb type=%d status=%d transferred=%d", urb->type, urb->status,
+		urb->actual_length);
+
+	if (HANDLE_CTX(handle)->trace_size) {
+		struct linux_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+		int i = 0;
+
+		if (transfer->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+			while (i < tpriv->num_urbs && tpriv->iso_urbs[i] != urb)
+				i++;
+		} else {
+			i = (int)(urb - tpriv->urbs);
+		}
+		usbi_trace_record(HANDLE_CTX(handle), LIBUSB_TRACE_REAP_URB,
+			transfer, transfer->endpoint, i, urb->status,
+			(unsigned int)urb->actual_length);
+	}
+
+	switch (transfer->type) {
+	case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
+		return handle_iso_completion(itransfer, urb);
+	case LIBUSB_TRANSFER_TYPE_BULK:
+	case LIBUSB_TRANSFER_TYPE_BULK_STREAM:
+	case LIBUSB_TRANSFER_TYPE_INTERRUPT:
+		return handle_bulk_completion(itransfer, urb);
+	case LIBUSB_TRANSFER_TYPE_CONTROL:
+		return handle_control_completion(itransfer, urb);
+	default:
+		usbi_err(HANDLE_CTX(handle), "unrecognised endpoint type %x",
+			transfer->type);
+		return LIBUSB_ERROR_OTHER;
+	}
 }
 
 static int reap_for_handle(struct libusb_device_handle *handle)
@@ -2717,10 +3629,8 @@ static int reap_for_handle(struct libusb_device_handle *handle)
 	struct linux_device_handle_priv *hpriv = _device_handle_priv(handle);
 	int r;
 	struct usbfs_urb *urb = NULL;
-	struct usbi_transfer *itransfer;
-	struct libusb_transfer *transfer;
 
-	r = ioctl(hpriv->fd, IOCTL_USBFS_REAPURBNDELAY, &urb);
+	r = usbfs_ioctl(hpriv->fd, IOCTL_USBFS_REAPURBNDELAY, &urb);
 	if (r == -1 && errno == EAGAIN)
 		return 1;
 	if (r < 0) {
@@ -2732,34 +3642,617 @@ static int reap_for_handle(struct libusb_device_handle *handle)
 		return LIBUSB_ERROR_IO;
 	}
 
-	itransfer = urb->usercontext;
-	transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	return handle_reaped_urb(handle, urb);
+}
 
-	usbi_dbg("urb type=%d status=%d transferred=%d", urb->type, urb->status,
-		urb->actual_length);
+/* complete any transfers the (now stopped) reaper thread of handle had
+ * handed over to the event handler but which have not been reported yet */
+static void flush_deferred_completions(struct libusb_device_handle *handle)
+{
+	struct libusb_context *ctx = HANDLE_CTX(handle);
+	struct usbi_transfer *itransfer, *tmp;
+	struct list_head deferred;
 
-	switch (transfer->type) {
-	case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
-		return handle_iso_completion(itransfer, urb);
-	case LIBUSB_TRANSFER_TYPE_BULK:
-	case LIBUSB_TRANSFER_TYPE_BULK_STREAM:
-	case LIBUSB_TRANSFER_TYPE_INTERRUPT:
-		return handle_bulk_completion(itransfer, urb);
-	case LIBUSB_TRANSFER_TYPE_CONTROL:
-		return handle_control_completion(itransfer, urb);
+	list_init(&deferred);
+
+	usbi_mutex_lock(&ctx->event_data_lock);
+	list_for_each_entry_safe(itransfer, tmp, &ctx->completed_transfers, completed_list, struct usbi_transfer) {
+		if (USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer)->dev_handle != handle)
+			continue;
+		list_del(&itransfer->completed_list);
+		list_add_tail(&itransfer->completed_list, &deferred);
+	}
+	usbi_mutex_unlock(&ctx->event_data_lock);
+
+	while (!list_empty(&deferred)) {
+		itransfer = list_first_entry(&deferred, struct usbi_transfer, completed_list);
+		list_del(&itransfer->completed_list);
+		op_handle_transfer_completion(itransfer);
+	}
+}
+
+static int shard_owns_transfer(struct usbi_transfer *itransfer, void *arg)
+{
+	struct linux_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+
+	return tpriv->timeout_shard == arg;
+}
+
+/* time out the expired transfers of a shard and return how long it may poll
+ * until the next one expires, -1 if there is none */
+static int shard_handle_timeouts(struct linux_shard *shard)
+{
+	struct timespec now_ts;
+	struct timeval now, next;
+
+	/* submissions wake the thread while next_timeout is cleared, so none
+	 * is missed while we look */
+	usbi_mutex_lock(&shard->timeout_lock);
+	timerclear(&shard->next_timeout);
+	usbi_mutex_unlock(&shard->timeout_lock);
+
+	if (!usbi_handle_os_timeouts(shard->ctx, shard_owns_transfer, shard, &next))
+		return -1;
+
+	usbi_mutex_lock(&shard->timeout_lock);
+	shard->next_timeout = next;
+	usbi_mutex_unlock(&shard->timeout_lock);
+
+	if (usbi_backend.clock_gettime(USBI_CLOCK_MONOTONIC, &now_ts) < 0)
+		return 0;
+	TIMESPEC_TO_TIMEVAL(&now, &now_ts);
+	if (!timercmp(&now, &next, <))
+		return 0;
+
+	timersub(&next, &now, &next);
+	return (int)(next.tv_sec * 1000 + (next.tv_usec + 999) / 1000);
+}
+
+/* wake the thread of a shard if a transfer just submitted to it times out
+ * before the timeout it polls for */
+static void shard_add_timeout(struct linux_shard *shard,
+	const struct timeval *timeout)
+{
+	int wake = 0;
+
+	usbi_mutex_lock(&shard->timeout_lock);
+	if (!timerisset(&shard->next_timeout) ||
+	    timercmp(timeout, &shard->next_timeout, <)) {
+		shard->next_timeout = *timeout;
+		wake = 1;
+	}
+	usbi_mutex_unlock(&shard->timeout_lock);
+
+	if (wake)
+		signal_shard(shard);
+}
+
+static void *shard_thread_main(void *arg)
+{
+	struct linux_shard *shard = arg;
+	struct linux_device_handle_priv *hpriv;
+	struct usbi_transfer *itransfer;
+	struct list_head completed;
+	struct pollfd *fds = NULL, *new_fds;
+	unsigned int nfds, fds_size = 0, i;
+	char dummy;
+	int r, found, timeout;
+
+	usbi_dbg("shard thread entering");
+
+	for (;;) {
+		/* (re)build the poll set from the handles currently assigned */
+		usbi_mutex_lock(&shard->lock);
+		if (shard->stop) {
+			usbi_mutex_unlock(&shard->lock);
+			break;
+		}
+
+		nfds = 1;
+		list_for_each_entry(hpriv, &shard->handles, shard_list, struct linux_device_handle_priv)
+			nfds++;
+		if (nfds > fds_size) {
+			new_fds = realloc(fds, nfds * sizeof(*fds));
+			if (!new_fds) {
+				usbi_mutex_unlock(&shard->lock);
+				usbi_err(shard->ctx, "shard failed to allocate poll fds");
+				break;
+			}
+			fds = new_fds;
+			fds_size = nfds;
+		}
+
+		fds[0].fd = shard->control_pipe[0];
+		fds[0].events = POLLIN;
+		nfds = 1;
+		list_for_each_entry(hpriv, &shard->handles, shard_list, struct linux_device_handle_priv) {
+			/* disconnected devices are left to the context's event loop */
+			if (hpriv->shard_error)
+				continue;
+			fds[nfds].fd = hpriv->fd;
+			fds[nfds].events = POLLOUT;
+			nfds++;
+		}
+		usbi_mutex_unlock(&shard->lock);
+
+		timeout = shard_handle_timeouts(shard);
+		r = poll(fds, nfds, timeout);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			usbi_err(shard->ctx, "shard poll failed errno=%d", errno);
+			break;
+		}
+
+		if (fds[0].revents & POLLIN) {
+			/* handles were added or removed, or we are asked to stop */
+			if (read(shard->control_pipe[0], &dummy, sizeof(dummy)) <= 0)
+				usbi_warn(shard->ctx, "shard control pipe read failed");
+			continue;
+		}
+
+		usbi_mutex_lock(&shard->lock);
+		for (i = 1; i < nfds; i++) {
+			if (!fds[i].revents)
+				continue;
+
+			/* the handle may have been removed while we were polling */
+			found = 0;
+			list_for_each_entry(hpriv, &shard->handles, shard_list, struct linux_device_handle_priv) {
+				if (hpriv->fd == fds[i].fd) {
+					found = 1;
+					break;
+				}
+			}
+			if (!found)
+				continue;
+
+			if (fds[i].revents & POLLERR) {
+				hpriv->shard_error = 1;
+				continue;
+			}
+
+			while (reap_for_handle(hpriv->handle) == 0)
+				;
+		}
+
+		list_init(&completed);
+		list_cut(&completed, &shard->completed);
+		usbi_mutex_unlock(&shard->lock);
+
+		/* the transfers have been retired, so the callbacks may close
+		 * their handles or remove them from the shard */
+		if (list_empty(&completed))
+			continue;
+		while (!list_empty(&completed)) {
+			itransfer = list_first_entry(&completed, struct usbi_transfer, completed_list);
+			list_del(&itransfer->completed_list);
+			op_handle_transfer_completion(itransfer);
+		}
+		usbi_notify_callbacks_delivered(shard->ctx);
+	}
+
+	free(fds);
+	usbi_dbg("shard thread exiting");
+
+	return NULL;
+}
+
+static int signal_shard(struct linux_shard *shard)
+{
+	char dummy = 1;
+	ssize_t r;
+
+	do {
+		r = write(shard->control_pipe[1], &dummy, sizeof(dummy));
+	} while (r < 0 && errno == EINTR);
+
+	if (r != sizeof(dummy)) {
+		usbi_warn(shard->ctx, "shard control pipe signal failed");
+		return LIBUSB_ERROR_OTHER;
+	}
+
+	return LIBUSB_SUCCESS;
+}
+
+static int start_shard_thread(struct libusb_context *ctx,
+	struct linux_shard *shard)
+{
+	int r;
+
+	shard->ctx = ctx;
+	list_init(&shard->handles);
+	list_init(&shard->completed);
+	timerclear(&shard->next_timeout);
+
+	if (usbi_pipe(shard->control_pipe)) {
+		usbi_err(ctx, "failed to create shard control pipe");
+		shard->control_pipe[0] = shard->control_pipe[1] = -1;
+		return LIBUSB_ERROR_OTHER;
+	}
+
+	usbi_mutex_init(&shard->lock);
+	usbi_mutex_init(&shard->timeout_lock);
+	r = pthread_create(&shard->thread, NULL, shard_thread_main, shard);
+	if (r) {
+		usbi_err(ctx, "failed to create shard thread (%d)", r);
+		close(shard->control_pipe[0]);
+		close(shard->control_pipe[1]);
+		shard->control_pipe[0] = shard->control_pipe[1] = -1;
+		usbi_mutex_destroy(&shard->timeout_lock);
+		usbi_mutex_destroy(&shard->lock);
+		return LIBUSB_ERROR_OTHER;
+	}
+
+	return LIBUSB_SUCCESS;
+}
+
+static void stop_shard_thread(struct linux_shard *shard)
+{
+	usbi_mutex_lock(&shard->lock);
+	shard->stop = 1;
+	usbi_mutex_unlock(&shard->lock);
+
+	/* the thread sleeps in poll() on the control pipe and the usbfs fds, so
+	 * waking it involves no device I/O. without the wakeup a join could
+	 * block forever */
+	if (signal_shard(shard) == 0) {
+		pthread_join(shard->thread, NULL);
+	} else {
+		usbi_err(shard->ctx, "failed to wake shard thread, detaching it");
+		pthread_detach(shard->thread);
+	}
+
+	close(shard->control_pipe[0]);
+	close(shard->control_pipe[1]);
+	shard->control_pipe[0] = shard->control_pipe[1] = -1;
+	usbi_mutex_destroy(&shard->timeout_lock);
+	usbi_mutex_destroy(&shard->lock);
+}
+
+/* pick an event loop shard for a newly opened handle according to the
+ * context's policy. returns the shard thread the handle was added to, or
+ * NULL if it stays on the context's own event loop */
+static struct linux_shard *assign_shard(struct libusb_device_handle *handle)
+{
+	struct linux_device_handle_priv *hpriv = _device_handle_priv(handle);
+	struct linux_context_priv *cpriv = _context_priv(HANDLE_CTX(handle));
+	struct linux_shard *shard;
+	int i, index = 0;
+
+	usbi_mutex_lock(&cpriv->shard_lock);
+	if (cpriv->num_shards <= 1) {
+		usbi_mutex_unlock(&cpriv->shard_lock);
+		return NULL;
+	}
+
+	switch (cpriv->shard_policy) {
+	case LIBUSB_SHARD_POLICY_LEAST_LOADED:
+		for (i = 1; i < cpriv->num_shards; i++)
+			if (cpriv->shards[i].load < cpriv->shards[index].load)
+				index = i;
+		break;
+	case LIBUSB_SHARD_POLICY_EXPLICIT:
+		index = cpriv->shard_next;
+		break;
 	default:
-		usbi_err(HANDLE_CTX(handle), "unrecognised endpoint type %x",
-			transfer->type);
+		index = cpriv->shard_next;
+		cpriv->shard_next = (cpriv->shard_next + 1) % cpriv->num_shards;
+		break;
+	}
+
+	shard = &cpriv->shards[index];
+	shard->load++;
+	hpriv->shard_index = index;
+	usbi_mutex_unlock(&cpriv->shard_lock);
+
+	usbi_dbg("assigned fd %d to event loop shard %d", hpriv->fd, index);
+	if (index == 0)
+		return NULL;
+
+	hpriv->handle = handle;
+	hpriv->shard_error = 0;
+	usbi_mutex_lock(&shard->lock);
+	list_add_tail(&hpriv->shard_list, &shard->handles);
+	hpriv->shard = shard;
+	usbi_mutex_unlock(&shard->lock);
+	signal_shard(shard);
+
+	return shard;
+}
+
+/* take a handle off its shard. once this returns the shard thread no longer
+ * reaps the handle, but still reports the transfers it has already reaped */
+static void shard_remove_handle(struct libusb_device_handle *handle)
+{
+	struct linux_device_handle_priv *hpriv = _device_handle_priv(handle);
+	struct linux_context_priv *cpriv = _context_priv(HANDLE_CTX(handle));
+	struct linux_shard *shard = hpriv->shard;
+
+	if (hpriv->shard_index < 0)
+		return;
+
+	if (shard) {
+		usbi_mutex_lock(&shard->lock);
+		list_del(&hpriv->shard_list);
+		hpriv->shard = NULL;
+		usbi_mutex_unlock(&shard->lock);
+		signal_shard(shard);
+	}
+
+	usbi_mutex_lock(&cpriv->shard_lock);
+	cpriv->shards[hpriv->shard_index].load--;
+	usbi_mutex_unlock(&cpriv->shard_lock);
+	hpriv->shard_index = -1;
+}
+
+static void *reaper_thread_main(void *arg)
+{
+	struct linux_reaper *reaper = arg;
+	struct libusb_device_handle *handle = reaper->handle;
+	struct linux_device_handle_priv *hpriv = _device_handle_priv(handle);
+	struct usbfs_urb *urb;
+	sigset_t set;
+	int r, stop;
+
+	usbi_dbg("reaper thread entering");
+
+	/* the thread inherits the signal mask of whoever opened the handle */
+	sigemptyset(&set);
+	sigaddset(&set, REAPER_WAKEUP_SIGNAL);
+	pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+
+	for (;;) {
+		usbi_mutex_lock(&reaper->lock);
+		stop = reaper->stop;
+		usbi_mutex_unlock(&reaper->lock);
+		if (stop)
+			break;
+
+		/* a wakeup sent before the ioctl blocks is lost, so the closing
+		 * thread keeps sending them until we are gone */
+		r = usbfs_ioctl(hpriv->fd, IOCTL_USBFS_REAPURB, &urb);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			/* disconnects are left to the context's event loop, which
+			 * reaps whatever completes after we are gone */
+			if (errno != ENODEV)
+				usbi_err(HANDLE_CTX(handle), "reap failed errno=%d", errno);
+			break;
+		}
+
+		handle_reaped_urb(handle, urb);
+	}
+
+	usbi_dbg("reaper thread exiting");
+	usbi_mutex_lock(&reaper->lock);
+	reaper->exited = 1;
+	usbi_cond_broadcast(&reaper->cond);
+	usbi_mutex_unlock(&reaper->lock);
+
+	return NULL;
+}
+
+static void reaper_wakeup_handler(int signum)
+{
+	UNUSED(signum);
+}
+
+/* REAPER_WAKEUP_SIGNAL is ignored by default, and an ignored signal does not
+ * interrupt REAPURB. give it a handler that does nothing, unless the
+ * application has installed one of its own, which works just as well */
+static int install_reaper_wakeup(void)
+{
+	static usbi_mutex_static_t lock = USBI_MUTEX_INITIALIZER;
+	static int installed;
+	struct sigaction sa, old;
+	int r = LIBUSB_SUCCESS;
+
+	usbi_mutex_static_lock(&lock);
+	if (installed)
+		goto out;
+
+	if (sigaction(REAPER_WAKEUP_SIGNAL, NULL, &old)) {
+		r = LIBUSB_ERROR_OTHER;
+		goto out;
+	}
+	if (!(old.sa_flags & SA_SIGINFO) &&
+	    (old.sa_handler == SIG_DFL || old.sa_handler == SIG_IGN)) {
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = reaper_wakeup_handler;
+		sa.sa_flags = SA_RESTART;
+		sigemptyset(&sa.sa_mask);
+		if (sigaction(REAPER_WAKEUP_SIGNAL, &sa, NULL)) {
+			r = LIBUSB_ERROR_OTHER;
+			goto out;
+		}
+	}
+	installed = 1;
+
+out:
+	usbi_mutex_static_unlock(&lock);
+	return r;
+}
+
+/* give a handle a thread of its own, see linux_reaper */
+static int start_reaper_thread(struct libusb_device_handle *handle)
+{
+	struct linux_device_handle_priv *hpriv = _device_handle_priv(handle);
+	struct linux_reaper *reaper;
+	int r;
+
+	r = install_reaper_wakeup();
+	if (r < 0) {
+		usbi_err(HANDLE_CTX(handle), "failed to install reaper wakeup handler");
+		return r;
+	}
+
+	reaper = calloc(1, sizeof(*reaper));
+	if (!reaper)
+		return LIBUSB_ERROR_NO_MEM;
+
+	reaper->handle = handle;
+	usbi_mutex_init(&reaper->lock);
+	usbi_cond_init(&reaper->cond);
+
+	/* set before the thread runs, so that what it reaps is deferred to the
+	 * event handler */
+	hpriv->reaper = reaper;
+	r = pthread_create(&reaper->thread, NULL, reaper_thread_main, reaper);
+	if (r) {
+		usbi_err(HANDLE_CTX(handle), "failed to create reaper thread (%d)", r);
+		hpriv->reaper = NULL;
+		usbi_cond_destroy(&reaper->cond);
+		usbi_mutex_destroy(&reaper->lock);
+		free(reaper);
 		return LIBUSB_ERROR_OTHER;
 	}
+
+	return LIBUSB_SUCCESS;
+}
+
+static void stop_reaper_thread(struct libusb_device_handle *handle)
+{
+	struct linux_device_handle_priv *hpriv = _device_handle_priv(handle);
+	struct linux_reaper *reaper = hpriv->reaper;
+	struct timeval tv = { 0, 10000 };
+	int attempts = 0;
+
+	/* the signal may land just before the thread blocks, keep sending it
+	 * until the thread has seen stop */
+	usbi_mutex_lock(&reaper->lock);
+	reaper->stop = 1;
+	while (!reaper->exited) {
+		pthread_kill(reaper->thread, REAPER_WAKEUP_SIGNAL);
+		if (linux_loopback_fd(hpriv->fd))
+			linux_loopback_interrupt(hpriv->fd);
+		usbi_cond_timedwait(&reaper->cond, &reaper->lock, &tv);
+		if (++attempts == 100)
+			usbi_warn(HANDLE_CTX(handle),
+				"reaper thread does not wake up, is its signal ignored?");
+	}
+	usbi_mutex_unlock(&reaper->lock);
+	pthread_join(reaper->thread, NULL);
+
+	hpriv->reaper = NULL;
+	usbi_cond_destroy(&reaper->cond);
+	usbi_mutex_destroy(&reaper->lock);
+	free(reaper);
+}
+
+static void stop_shards(struct libusb_context *ctx)
+{
+	struct linux_context_priv *cpriv = _context_priv(ctx);
+	int i;
+
+	for (i = 1; i < cpriv->num_shards; i++) {
+		struct linux_shard *shard = &cpriv->shards[i];
+
+		if (shard->control_pipe[0] == -1)
+			continue;
+
+		stop_shard_thread(shard);
+	}
+
+	free(cpriv->shards);
+	cpriv->shards = NULL;
+	cpriv->num_shards = 0;
+}
+
+static int start_shards(struct libusb_context *ctx, int num_shards)
+{
+	struct linux_context_priv *cpriv = _context_priv(ctx);
+	int i, r = LIBUSB_SUCCESS;
+
+	if (num_shards < 1 || num_shards > USBI_MAX_EVENT_SHARDS)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	usbi_mutex_lock(&cpriv->shard_lock);
+	if (cpriv->shards) {
+		r = LIBUSB_ERROR_BUSY;
+		goto out;
+	}
+
+	cpriv->shards = calloc(num_shards, sizeof(*cpriv->shards));
+	if (!cpriv->shards) {
+		r = LIBUSB_ERROR_NO_MEM;
+		goto out;
+	}
+	cpriv->num_shards = num_shards;
+
+	for (i = 0; i < num_shards; i++) {
+		cpriv->shards[i].ctx = ctx;
+		cpriv->shards[i].control_pipe[0] = cpriv->shards[i].control_pipe[1] = -1;
+		list_init(&cpriv->shards[i].handles);
+	}
+
+	for (i = 1; i < num_shards; i++) {
+		r = start_shard_thread(ctx, &cpriv->shards[i]);
+		if (r != LIBUSB_SUCCESS)
+			break;
+	}
+
+	if (r != LIBUSB_SUCCESS)
+		stop_shards(ctx);
+	else
+		usbi_dbg("running %d event loop shards", num_shards);
+
+out:
+	usbi_mutex_unlock(&cpriv->shard_lock);
+	return r;
+}
+
+static int set_shard_policy(struct libusb_context *ctx, int policy)
+{
+	struct linux_context_priv *cpriv = _context_priv(ctx);
+
+	switch (policy) {
+	case LIBUSB_SHARD_POLICY_ROUND_ROBIN:
+	case LIBUSB_SHARD_POLICY_LEAST_LOADED:
+	case LIBUSB_SHARD_POLICY_EXPLICIT:
+		break;
+	default:
+		return LIBUSB_ERROR_INVALID_PARAM;
+	}
+
+	usbi_mutex_lock(&cpriv->shard_lock);
+	cpriv->shard_policy = policy;
+	cpriv->shard_next = 0;
+	usbi_mutex_unlock(&cpriv->shard_lock);
+
+	return LIBUSB_SUCCESS;
+}
+
+static int set_next_shard(struct libusb_context *ctx, int index)
+{
+	struct linux_context_priv *cpriv = _context_priv(ctx);
+	int r = LIBUSB_SUCCESS;
+
+	usbi_mutex_lock(&cpriv->shard_lock);
+	if (cpriv->shard_policy != LIBUSB_SHARD_POLICY_EXPLICIT)
+		r = LIBUSB_ERROR_NOT_SUPPORTED;
+	else if (index < 0 || index >= (cpriv->num_shards ? cpriv->num_shards : 1))
+		r = LIBUSB_ERROR_INVALID_PARAM;
+	else
+		cpriv->shard_next = index;
+	usbi_mutex_unlock(&cpriv->shard_lock);
+
+	return r;
 }
 
 static int op_handle_events(struct libusb_context *ctx,
 	struct pollfd *fds, POLL_NFDS_TYPE nfds, int num_ready)
 {
-	int r;
+	int r, hotplug_fd;
 	unsigned int i = 0;
 
+	/* the hotplug monitor fd, if ctx services it. only op_exit() of ctx
+	 * itself takes it away again */
+	usbi_mutex_static_lock(&linux_hotplug_startstop_lock);
+	hotplug_fd = ctx == hotplug_event_ctx ? hotplug_event_fd : -1;
+	usbi_mutex_static_unlock(&linux_hotplug_startstop_lock);
+
 	usbi_mutex_lock(&ctx->open_devs_lock);
 	for (i = 0; i < nfds && num_ready > 0; i++) {
 		struct pollfd *pollfd = &fds[i];
@@ -2770,6 +4263,13 @@ static int op_handle_events(struct libusb_context *ctx,
 			continue;
 
 		num_ready--;
+
+		if (pollfd->fd == hotplug_fd) {
+			if (pollfd->revents & POLLIN)
+				op_hotplug_poll();
+			continue;
+		}
+
 		list_for_each_entry(handle, &ctx->open_devs, list, struct libusb_device_handle) {
 			hpriv = _device_handle_priv(handle);
 			if (hpriv->fd == pollfd->fd)
@@ -2789,6 +4289,16 @@ static int op_handle_events(struct libusb_context *ctx,
 			usbi_remove_pollfd(HANDLE_CTX(handle), hpriv->fd);
 			hpriv->fd_removed = 1;
 
+			/* report what the handle's reaper thread reaped before
+			 * cancelling everything else. transfers its shard reaped
+			 * are no longer in flight and are left to the shard */
+			if (hpriv->reaper) {
+				stop_reaper_thread(handle);
+				flush_deferred_completions(handle);
+			} else if (hpriv->shard) {
+				shard_remove_handle(handle);
+			}
+
 			/* device will still be marked as attached if hotplug monitor thread
 			 * hasn't processed remove event yet */
 			usbi_mutex_static_lock(&linux_hotplug_lock);
@@ -2822,6 +4332,95 @@ out:
 	return r;
 }
 
+static int op_wait_events(struct libusb_context *ctx, struct pollfd *fds,
+	POLL_NFDS_TYPE nfds, int modified, int timeout)
+{
+#ifdef HAVE_LINUX_IO_URING_H
+	struct linux_uring *uring =
+		__atomic_load_n(&_context_priv(ctx)->uring, __ATOMIC_ACQUIRE);
+
+	if (uring)
+		return linux_uring_wait(uring, fds, nfds, modified, timeout);
+#else
+	UNUSED(ctx);
+	UNUSED(modified);
+#endif
+	return usbi_poll(fds, nfds, timeout);
+}
+
+static int op_busy_poll(struct libusb_context *ctx)
+{
+	struct libusb_device_handle *handle;
+	int reaped = 0;
+
+	usbi_mutex_lock(&ctx->open_devs_lock);
+	list_for_each_entry(handle, &ctx->open_devs, list, struct libusb_device_handle) {
+		struct linux_device_handle_priv *hpriv = _device_handle_priv(handle);
+
+		if (hpriv->fd_removed || hpriv->shard || hpriv->reaper)
+			continue;
+
+		/* errors (including disconnection) are left for op_handle_events()
+		 * to deal with once poll() reports them */
+		while (reap_for_handle(handle) == 0)
+			reaped++;
+	}
+	usbi_mutex_unlock(&ctx->open_devs_lock);
+
+	return reaped;
+}
+
+int linux_add_loopback_device(struct libusb_context *ctx,
+	const struct libusb_loopback_device *config,
+	const struct linux_loopback_ops *ops, void *ops_data,
+	struct libusb_device **dev)
+{
+	uint8_t devaddr;
+	int r;
+
+	r = linux_loopback_add_device(ctx, config, ops, ops_data, &devaddr);
+	if (r < 0)
+		return r;
+
+	usbi_mutex_static_lock(&linux_hotplug_lock);
+	r = linux_enumerate_device(ctx, LINUX_LOOPBACK_BUS, devaddr, NULL);
+	usbi_mutex_static_unlock(&linux_hotplug_lock);
+	if (r < 0) {
+		linux_loopback_remove_device(ctx, devaddr);
+		return r;
+	}
+
+	if (dev)
+		*dev = usbi_get_device_by_session_id(ctx,
+			LINUX_LOOPBACK_BUS << 8 | devaddr);
+
+	return LIBUSB_SUCCESS;
+}
+
+static int op_add_loopback_device(struct libusb_context *ctx,
+	const struct libusb_loopback_device *config, struct libusb_device **dev)
+{
+	return linux_add_loopback_device(ctx, config, NULL, NULL, dev);
+}
+
+static int op_remove_loopback_device(struct libusb_device *dev)
+{
+	int r;
+
+	if (dev->bus_number != LINUX_LOOPBACK_BUS)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	r = linux_loopback_remove_device(DEVICE_CTX(dev), dev->device_address);
+	if (r < 0)
+		return r;
+
+	usbi_mutex_static_lock(&linux_hotplug_lock);
+	usbi_disconnect_device(dev);
+	usbi_mutex_static_unlock(&linux_hotplug_lock);
+
+	return LIBUSB_SUCCESS;
+}
+
 static int op_clock_gettime(int clk_id, struct timespec *tp)
 {
 	switch (clk_id) {
@@ -2844,9 +4443,10 @@ static clockid_t op_get_timerfd_clockid(void)
 
 const struct usbi_os_backend usbi_backend = {
 	.name = "Linux usbfs",
-	.caps = USBI_CAP_HAS_HID_ACCESS|USBI_CAP_SUPPORTS_DETACH_KERNEL_DRIVER,
+	.caps = USBI_CAP_HAS_HID_ACCESS|USBI_CAP_SUPPORTS_DETACH_KERNEL_DRIVER|USBI_CAP_BULK_IOV,
 	.init = op_init,
 	.exit = op_exit,
+	.set_option = op_set_option,
 	.get_device_list = NULL,
 	.hotplug_poll = op_hotplug_poll,
 	.get_device_descriptor = op_get_device_descriptor,
@@ -2883,6 +4483,15 @@ const struct usbi_os_backend usbi_backend = {
 	.clear_transfer_priv = op_clear_transfer_priv,
 
 	.handle_events = op_handle_events,
+	.handle_transfer_completion = op_handle_transfer_completion,
+	.busy_poll = op_busy_poll,
+	.wait_events = op_wait_events,
+	.add_loopback_device = op_add_loopback_device,
+	.remove_loopback_device = op_remove_loopback_device,
+	.load_replay = linux_replay_load,
+	.get_bulk_urb_params = op_get_bulk_urb_params,
+	.get_frame_number = op_get_frame_number,
+	.scan_devices = linux_scan_devices,
 
 	.clock_gettime = op_clock_gettime,
 
@@ -2890,6 +4499,7 @@ const struct usbi_os_backend usbi_backend = {
 	.get_timerfd_clockid = op_get_timerfd_clockid,
 #endif
 
+	.context_priv_size = sizeof(struct linux_context_priv),
 	.device_priv_size = sizeof(struct linux_device_priv),
 	.device_handle_priv_size = sizeof(struct linux_device_handle_priv),
 	.transfer_priv_size = sizeof(struct linux_transfer_priv),
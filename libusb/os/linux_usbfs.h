@@ -174,14 +174,80 @@ extern usbi_mutex_static_t linux_hotplug_lock;
 #if defined(HAVE_LIBUDEV)
 int linux_udev_start_event_monitor(void);
 int linux_udev_stop_event_monitor(void);
+int linux_udev_start_event_thread(void);
+void linux_udev_stop_event_thread(void);
+int linux_udev_get_monitor_fd(void);
 int linux_udev_scan_devices(struct libusb_context *ctx);
 void linux_udev_hotplug_poll(void);
 #else
 int linux_netlink_start_event_monitor(void);
 int linux_netlink_stop_event_monitor(void);
+int linux_netlink_start_event_thread(void);
+void linux_netlink_stop_event_thread(void);
+int linux_netlink_get_monitor_fd(void);
 void linux_netlink_hotplug_poll(void);
 #endif
 
+#ifdef HAVE_LINUX_IO_URING_H
+struct linux_uring;
+int linux_uring_create(struct libusb_context *ctx, struct linux_uring **ring);
+void linux_uring_destroy(struct linux_uring *ring);
+int linux_uring_wait(struct linux_uring *ring, struct pollfd *fds,
+	POLL_NFDS_TYPE nfds, int modified, int timeout);
+#endif
+
+/* loopback devices live on a bus number the kernel never assigns */
+#define LINUX_LOOPBACK_BUS	255
+
+/* Hooks that take over the URBs of a loopback device from the emulator.
+ * Both are called with the emulator lock held. */
+struct linux_loopback_ops {
+	/* A URB is being submitted. Returns the nanoseconds until it completes,
+	 * or a negative value to keep it pending until it is discarded; *cookie
+	 * is handed to complete(). */
+	int64_t (*submit)(void *data, struct usbfs_urb *urb, uint64_t now,
+		void **cookie);
+
+	/* A URB has come due: fill in its status and lengths, and the data of
+	 * IN transfers. Returning -ENOSYS for a control URB leaves the request
+	 * to the emulator. */
+	int (*complete)(void *data, struct usbfs_urb *urb, void *cookie);
+};
+
+/* the fds handed out for loopback devices are flagged in linux_loopback_fds
+ * (or counted in linux_loopback_high_fds from LINUX_LOOPBACK_FD_MAP on), so
+ * that the usbfs calls of real devices tell them apart without a lock */
+#define LINUX_LOOPBACK_FD_MAP	4096
+extern unsigned char linux_loopback_fds[LINUX_LOOPBACK_FD_MAP];
+extern int linux_loopback_high_fds;
+
+static inline int linux_loopback_fd(int fd)
+{
+	if (fd >= 0 && fd < LINUX_LOOPBACK_FD_MAP)
+		return __atomic_load_n(&linux_loopback_fds[fd], __ATOMIC_ACQUIRE);
+	return __atomic_load_n(&linux_loopback_high_fds, __ATOMIC_ACQUIRE) != 0;
+}
+
+int linux_loopback_add_device(struct libusb_context *ctx,
+	const struct libusb_loopback_device *config,
+	const struct linux_loopback_ops *ops, void *ops_data, uint8_t *devaddr);
+int linux_loopback_remove_device(struct libusb_context *ctx, uint8_t devaddr);
+void linux_loopback_exit(struct libusb_context *ctx);
+int linux_loopback_get_descriptors(struct libusb_device *dev,
+	unsigned char **descriptors);
+int linux_loopback_open(struct libusb_device *dev);
+int linux_loopback_close(int fd);
+int linux_loopback_ioctl(int fd, unsigned long request, void *arg, int *result);
+void linux_loopback_interrupt(int fd);
+
+int linux_add_loopback_device(struct libusb_context *ctx,
+	const struct libusb_loopback_device *config,
+	const struct linux_loopback_ops *ops, void *ops_data,
+	struct libusb_device **dev);
+int linux_replay_load(struct libusb_context *ctx, const char *path,
+	unsigned int rate, struct discovered_devs **devs);
+void linux_replay_exit(struct libusb_context *ctx);
+
 void linux_hotplug_enumerate(uint8_t busnum, uint8_t devaddr, const char *sys_name);
 void linux_device_disconnected(uint8_t busnum, uint8_t devaddr);
 
@@ -130,6 +130,14 @@ const struct usbi_os_backend usbi_backend = {
 
 	NULL,				/* handle_events() */
 	netbsd_handle_transfer_completion,
+	NULL,				/* busy_poll() */
+	NULL,				/* wait_events() */
+	NULL,				/* add_loopback_device() */
+	NULL,				/* remove_loopback_device() */
+	NULL,				/* load_replay() */
+	NULL,				/* get_bulk_urb_params() */
+	NULL,				/* get_frame_number() */
+	NULL,				/* scan_devices() */
 
 	netbsd_clock_gettime,
 	0,				/* context_priv_size */
@@ -133,6 +133,14 @@ const struct usbi_os_backend usbi_backend = {
 
 	NULL,				/* handle_events() */
 	obsd_handle_transfer_completion,
+	NULL,				/* busy_poll() */
+	NULL,				/* wait_events() */
+	NULL,				/* add_loopback_device() */
+	NULL,				/* remove_loopback_device() */
+	NULL,				/* load_replay() */
+	NULL,				/* get_bulk_urb_params() */
+	NULL,				/* get_frame_number() */
+	NULL,				/* scan_devices() */
 
 	obsd_clock_gettime,
 	0,				/* context_priv_size */
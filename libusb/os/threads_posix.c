@@ -21,6 +21,7 @@
 
 #include <config.h>
 
+#include <string.h>
 #include <time.h>
 #if defined(__linux__) || defined(__OpenBSD__)
 # if defined(__OpenBSD__)
@@ -37,8 +38,179 @@
 #include "threads_posix.h"
 #include "libusbi.h"
 
+#ifdef USBI_LOCK_PROFILING
+/* Lock profiling.
+ *
+ * Every mutex belongs to the lock class it was initialised for, see
+ * usbi_mutex_init(). The statistics of a class are updated with atomic
+ * operations, since different mutexes of the same class (e.g. the locks of
+ * two transfers) are held concurrently. An acquisition is contended when
+ * trylock fails; only those pay for a second clock read to measure the
+ * wait. A failed usbi_mutex_trylock() counts as contended too (e.g. a thread
+ * finding another one handling events). Hold time runs from acquisition to
+ * unlock, and a condition wait counts as an unlock followed by an
+ * uncontended acquisition. */
+#define USBI_MAX_LOCK_CLASSES	64
+
+static struct usbi_lock_stats lock_classes[USBI_MAX_LOCK_CLASSES];
+static int num_lock_classes;
+static pthread_mutex_t lock_classes_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t lock_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void lock_stats_add(uint64_t *total, uint64_t *max, uint64_t value)
+{
+	uint64_t old = __atomic_load_n(max, __ATOMIC_RELAXED);
+
+	__atomic_fetch_add(total, value, __ATOMIC_RELAXED);
+	while (value > old && !__atomic_compare_exchange_n(max, &old, value,
+			1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+static void lock_acquired(usbi_mutex_t *mutex, uint64_t start)
+{
+	struct usbi_lock_stats *stats = mutex->stats;
+	uint64_t now = lock_clock();
+
+	mutex->acquired = now;
+	__atomic_fetch_add(&stats->acquisitions, 1, __ATOMIC_RELAXED);
+	if (start) {
+		__atomic_fetch_add(&stats->contended, 1, __ATOMIC_RELAXED);
+		lock_stats_add(&stats->wait_ns, &stats->max_wait_ns, now - start);
+	}
+}
+
+static void lock_released(usbi_mutex_t *mutex)
+{
+	struct usbi_lock_stats *stats = mutex->stats;
+
+	lock_stats_add(&stats->hold_ns, &stats->max_hold_ns,
+		lock_clock() - mutex->acquired);
+}
+
+int usbi_mutex_init_named(usbi_mutex_t *mutex, const char *name)
+{
+	int i;
+
+	if (*name == '&')
+		name++;
+
+	pthread_mutex_lock(&lock_classes_lock);
+	for (i = 0; i < num_lock_classes; i++) {
+		if (!strcmp(lock_classes[i].name, name))
+			break;
+	}
+	if (i == num_lock_classes && i < USBI_MAX_LOCK_CLASSES)
+		lock_classes[num_lock_classes++].name = name;
+	mutex->stats = i < num_lock_classes ? &lock_classes[i] : NULL;
+	pthread_mutex_unlock(&lock_classes_lock);
+
+	mutex->acquired = 0;
+	return pthread_mutex_init(&mutex->mutex, NULL);
+}
+
+void usbi_mutex_lock(usbi_mutex_t *mutex)
+{
+	uint64_t start;
+
+	if (!mutex->stats) {
+		(void)pthread_mutex_lock(&mutex->mutex);
+		return;
+	}
+
+	if (pthread_mutex_trylock(&mutex->mutex) == 0) {
+		lock_acquired(mutex, 0);
+		return;
+	}
+
+	start = lock_clock();
+	(void)pthread_mutex_lock(&mutex->mutex);
+	lock_acquired(mutex, start);
+}
+
+void usbi_mutex_unlock(usbi_mutex_t *mutex)
+{
+	if (mutex->stats)
+		lock_released(mutex);
+	(void)pthread_mutex_unlock(&mutex->mutex);
+}
+
+int usbi_mutex_trylock(usbi_mutex_t *mutex)
+{
+	int r = pthread_mutex_trylock(&mutex->mutex);
+
+	if (!mutex->stats)
+		return r;
+
+	if (r == 0)
+		lock_acquired(mutex, 0);
+	else
+		__atomic_fetch_add(&mutex->stats->contended, 1, __ATOMIC_RELAXED);
+	return r;
+}
+
+int usbi_cond_wait(usbi_cond_t *cond, usbi_mutex_t *mutex)
+{
+	int r;
+
+	if (mutex->stats)
+		lock_released(mutex);
+	r = pthread_cond_wait(cond, &mutex->mutex);
+	if (mutex->stats)
+		mutex->acquired = lock_clock();
+	return r;
+}
+
+int usbi_get_lock_stats(struct libusb_lock_stats *stats, int count)
+{
+	int i, n;
+
+	pthread_mutex_lock(&lock_classes_lock);
+	n = num_lock_classes;
+	for (i = 0; i < n && i < count; i++) {
+		struct usbi_lock_stats *cls = &lock_classes[i];
+
+		stats[i].name = cls->name;
+		stats[i].acquisitions = __atomic_load_n(&cls->acquisitions, __ATOMIC_RELAXED);
+		stats[i].contended = __atomic_load_n(&cls->contended, __ATOMIC_RELAXED);
+		stats[i].wait_ns = __atomic_load_n(&cls->wait_ns, __ATOMIC_RELAXED);
+		stats[i].max_wait_ns = __atomic_load_n(&cls->max_wait_ns, __ATOMIC_RELAXED);
+		stats[i].hold_ns = __atomic_load_n(&cls->hold_ns, __ATOMIC_RELAXED);
+		stats[i].max_hold_ns = __atomic_load_n(&cls->max_hold_ns, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&lock_classes_lock);
+
+	return n;
+}
+
+void usbi_reset_lock_stats(void)
+{
+	int i;
+
+	pthread_mutex_lock(&lock_classes_lock);
+	for (i = 0; i < num_lock_classes; i++) {
+		struct usbi_lock_stats *cls = &lock_classes[i];
+
+		__atomic_store_n(&cls->acquisitions, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&cls->contended, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&cls->wait_ns, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&cls->max_wait_ns, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&cls->hold_ns, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&cls->max_hold_ns, 0, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&lock_classes_lock);
+}
+#endif /* USBI_LOCK_PROFILING */
+
 int usbi_cond_timedwait(pthread_cond_t *cond,
-	pthread_mutex_t *mutex, const struct timeval *tv)
+	usbi_mutex_t *mutex, const struct timeval *tv)
 {
 	struct timespec timeout;
 	int r;
@@ -54,7 +226,16 @@ int usbi_cond_timedwait(pthread_cond_t *cond,
 		timeout.tv_sec++;
 	}
 
+#ifdef USBI_LOCK_PROFILING
+	if (mutex->stats)
+		lock_released(mutex);
+	r = pthread_cond_timedwait(cond, &mutex->mutex, &timeout);
+	if (mutex->stats)
+		mutex->acquired = lock_clock();
+	return r;
+#else
 	return pthread_cond_timedwait(cond, mutex, &timeout);
+#endif
 }
 
 int usbi_get_tid(void)
@@ -37,6 +37,38 @@ static inline void usbi_mutex_static_unlock(usbi_mutex_static_t *mutex)
 	(void)pthread_mutex_unlock(mutex);
 }
 
+#ifdef USBI_LOCK_PROFILING
+#include <stdint.h>
+
+/* Contention statistics, shared by all the mutexes of a lock class */
+struct usbi_lock_stats {
+	const char *name;
+	uint64_t acquisitions;
+	uint64_t contended;
+	uint64_t wait_ns;
+	uint64_t max_wait_ns;
+	uint64_t hold_ns;
+	uint64_t max_hold_ns;
+};
+
+typedef struct {
+	pthread_mutex_t mutex;
+	struct usbi_lock_stats *stats;
+	uint64_t acquired;
+} usbi_mutex_t;
+
+/* Mutexes are grouped in lock classes named after the expression passed at
+ * initialisation, e.g. "ctx->events_lock" or "itransfer->lock". */
+#define usbi_mutex_init(mutex)	usbi_mutex_init_named((mutex), #mutex)
+int usbi_mutex_init_named(usbi_mutex_t *mutex, const char *name);
+void usbi_mutex_lock(usbi_mutex_t *mutex);
+void usbi_mutex_unlock(usbi_mutex_t *mutex);
+int usbi_mutex_trylock(usbi_mutex_t *mutex);
+static inline void usbi_mutex_destroy(usbi_mutex_t *mutex)
+{
+	(void)pthread_mutex_destroy(&mutex->mutex);
+}
+#else
 typedef pthread_mutex_t usbi_mutex_t;
 static inline int usbi_mutex_init(usbi_mutex_t *mutex)
 {
@@ -58,16 +90,21 @@ static inline void usbi_mutex_destroy(usbi_mutex_t *mutex)
 {
 	(void)pthread_mutex_destroy(mutex);
 }
+#endif
 
 typedef pthread_cond_t usbi_cond_t;
 static inline void usbi_cond_init(pthread_cond_t *cond)
 {
 	(void)pthread_cond_init(cond, NULL);
 }
+#ifdef USBI_LOCK_PROFILING
+int usbi_cond_wait(usbi_cond_t *cond, usbi_mutex_t *mutex);
+#else
 static inline int usbi_cond_wait(usbi_cond_t *cond, usbi_mutex_t *mutex)
 {
 	return pthread_cond_wait(cond, mutex);
 }
+#endif
 int usbi_cond_timedwait(usbi_cond_t *cond,
 	usbi_mutex_t *mutex, const struct timeval *tv);
 static inline void usbi_cond_broadcast(usbi_cond_t *cond)
@@ -84,6 +121,11 @@ static inline void usbi_tls_key_create(usbi_tls_key_t *key)
 {
 	(void)pthread_key_create(key, NULL);
 }
+static inline void usbi_tls_key_create_dtor(usbi_tls_key_t *key,
+	void (*destructor)(void *))
+{
+	(void)pthread_key_create(key, destructor);
+}
 static inline void *usbi_tls_key_get(usbi_tls_key_t key)
 {
 	return pthread_getspecific(key);
@@ -90,6 +90,13 @@ static inline void usbi_tls_key_create(usbi_tls_key_t *key)
 {
 	*key = TlsAlloc();
 }
+/* TLS slots have no destructors on Windows */
+static inline void usbi_tls_key_create_dtor(usbi_tls_key_t *key,
+	void (*destructor)(void *))
+{
+	(void)destructor;
+	*key = TlsAlloc();
+}
 static inline void *usbi_tls_key_get(usbi_tls_key_t key)
 {
 	return TlsGetValue(key);
@@ -879,6 +879,14 @@ const struct usbi_os_backend usbi_backend = {
 
 	wince_handle_events,
 	NULL,				/* handle_transfer_completion() */
+	NULL,				/* busy_poll() */
+	NULL,				/* wait_events() */
+	NULL,				/* add_loopback_device() */
+	NULL,				/* remove_loopback_device() */
+	NULL,				/* load_replay() */
+	NULL,				/* get_bulk_urb_params() */
+	NULL,				/* get_frame_number() */
+	NULL,				/* scan_devices() */
 
 	wince_clock_gettime,
 	0,
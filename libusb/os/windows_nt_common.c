@@ -1001,6 +1001,14 @@ const struct usbi_os_backend usbi_backend = {
 	windows_clear_transfer_priv,
 	windows_handle_events,
 	NULL,	/* handle_transfer_completion */
+	NULL,	/* busy_poll */
+	NULL,	/* wait_events */
+	NULL,	/* add_loopback_device */
+	NULL,	/* remove_loopback_device */
+	NULL,	/* load_replay */
+	NULL,	/* get_bulk_urb_params */
+	NULL,	/* get_frame_number */
+	NULL,	/* scan_devices */
 	windows_clock_gettime,
 	sizeof(struct windows_context_priv),
 	sizeof(union windows_device_priv),
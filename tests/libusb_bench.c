@@ -0,0 +1,888 @@
+/*
+ * libusb throughput and latency benchmarks
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Runs a fixed set of benchmarks and prints one JSON object per benchmark
+ * on stdout, with the operation rate and the 50th, 99th and 99.9th
+ * percentile latencies of a single operation in microseconds:
+ *
+ *   {"bench":"sync_bulk","target":"loopback","threads":1,"ops":10000,
+ *    "seconds":0.052,"ops_per_sec":192307.7,"p50_us":4.8,"p99_us":9.1,
+ *    "p999_us":21.4}
+ *
+ * The I/O benchmarks run against the device given with -d VID:PID, using
+ * the first bulk and isochronous endpoints of its active configuration, or
+ * else against an emulated loopback device, whose endpoints complete
+ * transfers without delay unless -l adds a latency. Every benchmark runs a
+ * warm-up round of a tenth of its iterations before it is measured.
+ * Benchmarks that the target cannot run are reported with "skipped".
+ *
+ * An operation is a single call or transfer, except in control_batch, where
+ * it is a batch of BATCH_LENGTH GET_STATUS requests sent BATCH_DEPTH at a
+ * time; compare it with BATCH_LENGTH sync_control operations. In
+ * small_writes and coalesced_writes it is WRITE_COUNT bulk OUT writes of
+ * WRITE_LENGTH bytes, submitted directly or through a write coalescer.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libusb.h"
+
+#define MAX_THREADS	64
+#define BULK_LENGTH	512
+#define ISO_PACKETS	8
+#define STORM_DEVICES	64
+#define BATCH_LENGTH	64
+#define BATCH_DEPTH	8
+#define WRITE_COUNT	64
+#define WRITE_LENGTH	16
+
+struct samples {
+	uint64_t *ns;
+	int count;
+	int size;
+};
+
+struct target {
+	const char *name;
+	libusb_device_handle *handle;
+	int loopback;
+	unsigned char bulk_in;
+	unsigned char bulk_out;
+	unsigned char iso_in;
+	int iso_packet_size;
+};
+
+static libusb_context *ctx;
+static struct target target;
+static int iterations = 10000;
+static int threads = 4;
+static unsigned int latency_us;
+static const char *only;
+
+/* a high-speed device with one interface holding a bulk IN, a bulk OUT
+ * and an isochronous IN endpoint */
+static const unsigned char loopback_descriptors[] = {
+	0x12, LIBUSB_DT_DEVICE, 0x00, 0x02, 0xff, 0x00, 0x00, 0x40,
+	0x6b, 0x1d, 0xbe, 0xbe, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01,
+
+	0x09, LIBUSB_DT_CONFIG, 0x27, 0x00, 0x01, 0x01, 0x00, 0x80, 0x32,
+	0x09, LIBUSB_DT_INTERFACE, 0x00, 0x00, 0x03, 0xff, 0x00, 0x00, 0x00,
+	0x07, LIBUSB_DT_ENDPOINT, 0x81, LIBUSB_TRANSFER_TYPE_BULK, 0x00, 0x02, 0x00,
+	0x07, LIBUSB_DT_ENDPOINT, 0x02, LIBUSB_TRANSFER_TYPE_BULK, 0x00, 0x02, 0x00,
+	0x07, LIBUSB_DT_ENDPOINT, 0x83, LIBUSB_TRANSFER_TYPE_ISOCHRONOUS, 0x00, 0x04, 0x01,
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static int samples_init(struct samples *s, int size)
+{
+	s->ns = malloc(size * sizeof(*s->ns));
+	s->count = 0;
+	s->size = size;
+	return s->ns ? 0 : -1;
+}
+
+static void samples_add(struct samples *s, uint64_t ns)
+{
+	if (s->count < s->size)
+		s->ns[s->count++] = ns;
+}
+
+static int compare_ns(const void *a, const void *b)
+{
+	uint64_t na = *(const uint64_t *)a, nb = *(const uint64_t *)b;
+
+	return na < nb ? -1 : na > nb;
+}
+
+static double percentile_us(const struct samples *s, double p)
+{
+	int i = (int)(p * s->count);
+
+	if (!s->count)
+		return 0.0;
+	if (i >= s->count)
+		i = s->count - 1;
+	return s->ns[i] / 1e3;
+}
+
+static void report(const char *bench, int nthreads, struct samples *s,
+	uint64_t elapsed_ns)
+{
+	double seconds = elapsed_ns / 1e9;
+
+	qsort(s->ns, s->count, sizeof(*s->ns), compare_ns);
+	printf("{\"bench\":\"%s\",\"target\":\"%s\",\"threads\":%d,\"ops\":%d,"
+		"\"seconds\":%.6f,\"ops_per_sec\":%.1f,\"p50_us\":%.3f,"
+		"\"p99_us\":%.3f,\"p999_us\":%.3f}\n", bench, target.name,
+		nthreads, s->count, seconds, seconds > 0 ? s->count / seconds : 0.0,
+		percentile_us(s, 0.50), percentile_us(s, 0.99),
+		percentile_us(s, 0.999));
+	fflush(stdout);
+}
+
+static void skip(const char *bench, const char *reason)
+{
+	printf("{\"bench\":\"%s\",\"target\":\"%s\",\"skipped\":\"%s\"}\n",
+		bench, target.name, reason);
+	fflush(stdout);
+}
+
+/* time n operations after a warm-up of n / 10; op returns non-zero to
+ * abort the run */
+static int run(const char *bench, int (*op)(void *), void *arg, int n)
+{
+	struct samples s;
+	uint64_t start, t;
+	int i, r = 0;
+
+	if (samples_init(&s, n) < 0)
+		return -1;
+
+	for (i = 0; i < n / 10 && !r; i++)
+		r = op(arg);
+
+	start = now_ns();
+	for (i = 0; i < n && !r; i++) {
+		t = now_ns();
+		r = op(arg);
+		samples_add(&s, now_ns() - t);
+	}
+
+	if (r)
+		skip(bench, libusb_error_name(r));
+	else
+		report(bench, 1, &s, now_ns() - start);
+	free(s.ns);
+	return r;
+}
+
+static int op_alloc_free(void *arg)
+{
+	struct libusb_transfer *transfer = libusb_alloc_transfer(0);
+
+	(void)arg;
+
+	if (!transfer)
+		return LIBUSB_ERROR_NO_MEM;
+	libusb_free_transfer(transfer);
+	return 0;
+}
+
+static int op_device_list(void *arg)
+{
+	libusb_device **list;
+	ssize_t n = libusb_get_device_list(ctx, &list);
+
+	(void)arg;
+
+	if (n < 0)
+		return (int)n;
+	libusb_free_device_list(list, 1);
+	return 0;
+}
+
+static int op_descriptor_parse(void *arg)
+{
+	struct libusb_config_descriptor *config;
+	int r = libusb_get_active_config_descriptor(libusb_get_device(target.handle),
+		&config);
+
+	(void)arg;
+
+	if (r < 0)
+		return r;
+	libusb_free_config_descriptor(config);
+	return 0;
+}
+
+static int op_sync_control(void *arg)
+{
+	unsigned char status[2];
+	int r = libusb_control_transfer(target.handle, LIBUSB_ENDPOINT_IN,
+		LIBUSB_REQUEST_GET_STATUS, 0, 0, status, sizeof(status), 1000);
+
+	(void)arg;
+
+	return r < 0 ? r : 0;
+}
+
+static int op_sync_bulk(void *arg)
+{
+	unsigned char buf[BULK_LENGTH];
+	int transferred;
+
+	(void)arg;
+
+	return libusb_bulk_transfer(target.handle, target.bulk_in, buf,
+		sizeof(buf), &transferred, 1000);
+}
+
+static void LIBUSB_CALL roundtrip_cb(struct libusb_transfer *transfer)
+{
+	*(int *)transfer->user_data = 1;
+}
+
+static int op_roundtrip(void *arg)
+{
+	struct libusb_transfer *transfer = arg;
+	int completed = 0;
+	int r;
+
+	transfer->user_data = &completed;
+	r = libusb_submit_transfer(transfer);
+	if (r < 0)
+		return r;
+	while (!completed) {
+		r = libusb_handle_events_completed(ctx, &completed);
+		if (r < 0)
+			return r;
+	}
+	return transfer->status == LIBUSB_TRANSFER_COMPLETED ? 0 : LIBUSB_ERROR_IO;
+}
+
+static void bench_roundtrip(void)
+{
+	struct libusb_transfer *transfer;
+	unsigned char *buf;
+
+	transfer = libusb_alloc_transfer(0);
+	buf = malloc(BULK_LENGTH);
+	if (!transfer || !buf) {
+		skip("submit_roundtrip", "no memory");
+	} else {
+		libusb_fill_bulk_transfer(transfer, target.handle, target.bulk_in,
+			buf, BULK_LENGTH, roundtrip_cb, NULL, 1000);
+		run("submit_roundtrip", op_roundtrip, transfer, iterations);
+	}
+	libusb_free_transfer(transfer);
+	free(buf);
+}
+
+static void LIBUSB_CALL batch_cb(struct libusb_control_batch *batch)
+{
+	*(int *)batch->user_data = 1;
+}
+
+static int op_control_batch(void *arg)
+{
+	struct libusb_control_batch *batch = arg;
+	int completed = 0;
+	int r;
+
+	batch->user_data = &completed;
+	r = libusb_submit_control_batch(batch);
+	if (r < 0)
+		return r;
+	while (!completed) {
+		r = libusb_handle_events_completed(ctx, &completed);
+		if (r < 0)
+			return r;
+	}
+	return batch->status == LIBUSB_TRANSFER_COMPLETED ? 0 : LIBUSB_ERROR_IO;
+}
+
+static void bench_control_batch(void)
+{
+	static unsigned char status[BATCH_LENGTH][2];
+	struct libusb_control_batch *batch;
+	int i;
+
+	batch = libusb_alloc_control_batch(BATCH_LENGTH);
+	if (!batch) {
+		skip("control_batch", "no memory");
+		return;
+	}
+
+	batch->dev_handle = target.handle;
+	batch->depth = BATCH_DEPTH;
+	batch->timeout = 1000;
+	batch->callback = batch_cb;
+	for (i = 0; i < BATCH_LENGTH; i++) {
+		batch->entries[i].bmRequestType = LIBUSB_ENDPOINT_IN;
+		batch->entries[i].bRequest = LIBUSB_REQUEST_GET_STATUS;
+		batch->entries[i].wLength = sizeof(status[i]);
+		batch->entries[i].data = status[i];
+	}
+	run("control_batch", op_control_batch, batch, iterations / BATCH_LENGTH + 10);
+	libusb_free_control_batch(batch);
+}
+
+struct writes {
+	struct libusb_transfer *transfers[WRITE_COUNT];
+	unsigned char buf[WRITE_COUNT * WRITE_LENGTH];
+	struct libusb_bulk_coalescer *coalescer;
+	int completed;
+	int failed;
+};
+
+static void LIBUSB_CALL write_cb(struct libusb_transfer *transfer)
+{
+	struct writes *w = transfer->user_data;
+
+	w->completed++;
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED)
+		w->failed = 1;
+}
+
+static int op_writes(void *arg)
+{
+	struct writes *w = arg;
+	int i, r = 0, r2;
+
+	w->completed = 0;
+	w->failed = 0;
+	for (i = 0; i < WRITE_COUNT; i++) {
+		if (w->coalescer)
+			r = libusb_submit_coalesced_transfer(w->coalescer, w->transfers[i]);
+		else
+			r = libusb_submit_transfer(w->transfers[i]);
+		if (r < 0)
+			break;
+	}
+	while (w->completed < i) {
+		r2 = libusb_handle_events(ctx);
+		if (r2 < 0)
+			return r2;
+	}
+	if (r < 0)
+		return r;
+	return w->failed ? LIBUSB_ERROR_IO : 0;
+}
+
+static void bench_writes(int coalesce)
+{
+	const char *bench = coalesce ? "coalesced_writes" : "small_writes";
+	struct writes *w;
+	int i;
+
+	w = calloc(1, sizeof(*w));
+	if (!w) {
+		skip(bench, "no memory");
+		return;
+	}
+
+	for (i = 0; i < WRITE_COUNT; i++) {
+		w->transfers[i] = libusb_alloc_transfer(0);
+		if (!w->transfers[i]) {
+			skip(bench, "no memory");
+			goto out;
+		}
+		libusb_fill_bulk_transfer(w->transfers[i], target.handle,
+			target.bulk_out, w->buf + i * WRITE_LENGTH, WRITE_LENGTH,
+			write_cb, w, 1000);
+	}
+
+	if (coalesce) {
+		w->coalescer = libusb_alloc_bulk_coalescer(target.handle,
+			target.bulk_out, WRITE_COUNT * WRITE_LENGTH, 0);
+		if (!w->coalescer) {
+			skip(bench, "no coalescer");
+			goto out;
+		}
+	}
+
+	run(bench, op_writes, w, iterations / WRITE_COUNT + 10);
+	libusb_free_bulk_coalescer(w->coalescer);
+
+out:
+	for (i = 0; i < WRITE_COUNT; i++)
+		libusb_free_transfer(w->transfers[i]);
+	free(w);
+}
+
+/* every thread runs sync bulk transfers, so that they contend for event
+ * handling */
+struct contention_worker {
+	pthread_t thread;
+	struct samples samples;
+	int error;
+};
+
+static void *contention_main(void *arg)
+{
+	struct contention_worker *w = arg;
+	uint64_t t;
+	int i, r = 0;
+
+	for (i = 0; i < iterations && !r; i++) {
+		t = now_ns();
+		r = op_sync_bulk(NULL);
+		samples_add(&w->samples, now_ns() - t);
+	}
+	w->error = r;
+	return NULL;
+}
+
+static void bench_contention(void)
+{
+	static struct contention_worker workers[MAX_THREADS];
+	struct samples all;
+	uint64_t start, elapsed;
+	int i, started = 0, error = 0;
+
+	if (samples_init(&all, iterations * threads) < 0) {
+		skip("sync_contention", "no memory");
+		return;
+	}
+
+	start = now_ns();
+	for (i = 0; i < threads; i++) {
+		if (samples_init(&workers[i].samples, iterations) < 0)
+			break;
+		if (pthread_create(&workers[i].thread, NULL, contention_main, &workers[i])) {
+			free(workers[i].samples.ns);
+			break;
+		}
+		started++;
+	}
+	for (i = 0; i < started; i++) {
+		pthread_join(workers[i].thread, NULL);
+		if (workers[i].error)
+			error = workers[i].error;
+		memcpy(all.ns + all.count, workers[i].samples.ns,
+			workers[i].samples.count * sizeof(*all.ns));
+		all.count += workers[i].samples.count;
+		free(workers[i].samples.ns);
+	}
+	elapsed = now_ns() - start;
+
+	if (started < threads)
+		skip("sync_contention", "failed to start threads");
+	else if (error)
+		skip("sync_contention", libusb_error_name(error));
+	else
+		report("sync_contention", threads, &all, elapsed);
+	free(all.ns);
+}
+
+/* each completion is timed from the resubmission of the transfer */
+struct iso_state {
+	struct samples samples;
+	uint64_t submitted;
+	int remaining;
+	int error;
+};
+
+static void LIBUSB_CALL iso_cb(struct libusb_transfer *transfer)
+{
+	struct iso_state *st = transfer->user_data;
+	uint64_t t = now_ns();
+	int r;
+
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+		st->error = LIBUSB_ERROR_IO;
+		st->remaining = 0;
+		return;
+	}
+
+	samples_add(&st->samples, t - st->submitted);
+	if (!--st->remaining)
+		return;
+
+	st->submitted = now_ns();
+	r = libusb_submit_transfer(transfer);
+	if (r < 0) {
+		st->error = r;
+		st->remaining = 0;
+	}
+}
+
+static void bench_iso(void)
+{
+	struct libusb_transfer *transfer;
+	struct iso_state st;
+	unsigned char *buf;
+	uint64_t start;
+	int r, done = 0;
+
+	/* iso transfers are bound by the frame rate, run fewer of them */
+	if (samples_init(&st.samples, iterations / 10 + 1) < 0) {
+		skip("iso_resubmit", "no memory");
+		return;
+	}
+	st.remaining = st.samples.size;
+	st.error = 0;
+
+	transfer = libusb_alloc_transfer(ISO_PACKETS);
+	buf = malloc(ISO_PACKETS * target.iso_packet_size);
+	if (!transfer || !buf) {
+		skip("iso_resubmit", "no memory");
+		goto out;
+	}
+	libusb_fill_iso_transfer(transfer, target.handle, target.iso_in, buf,
+		ISO_PACKETS * target.iso_packet_size, ISO_PACKETS, iso_cb, &st, 1000);
+	libusb_set_iso_packet_lengths(transfer, target.iso_packet_size);
+
+	start = now_ns();
+	st.submitted = start;
+	r = libusb_submit_transfer(transfer);
+	if (r < 0) {
+		skip("iso_resubmit", libusb_error_name(r));
+		goto out;
+	}
+	while (st.remaining) {
+		r = libusb_handle_events_completed(ctx, &done);
+		if (r < 0) {
+			/* cannot leave with the transfer in flight */
+			libusb_cancel_transfer(transfer);
+			st.error = r;
+		}
+	}
+
+	if (st.error)
+		skip("iso_resubmit", libusb_error_name(st.error));
+	else
+		report("iso_resubmit", 1, &st.samples, now_ns() - start);
+
+out:
+	libusb_free_transfer(transfer);
+	free(buf);
+	free(st.samples.ns);
+}
+
+/* hotplug events are timed from the addition or removal of the device to
+ * the callback */
+struct storm_state {
+	struct samples samples;
+	uint64_t changed[256];
+	int pending;
+};
+
+static int LIBUSB_CALL storm_cb(libusb_context *cb_ctx, libusb_device *dev,
+	libusb_hotplug_event event, void *user_data)
+{
+	struct storm_state *st = user_data;
+	uint8_t addr = libusb_get_device_address(dev);
+
+	(void)cb_ctx;
+	(void)event;
+
+	if (libusb_get_bus_number(dev) != libusb_get_bus_number(
+	    libusb_get_device(target.handle)) || !st->changed[addr])
+		return 0;
+
+	samples_add(&st->samples, now_ns() - st->changed[addr]);
+	st->changed[addr] = 0;
+	st->pending--;
+	return 0;
+}
+
+static int storm_wait(struct storm_state *st)
+{
+	struct timeval tv = { 1, 0 };
+	int r;
+
+	while (st->pending) {
+		r = libusb_handle_events_timeout(ctx, &tv);
+		if (r < 0)
+			return r;
+	}
+	return 0;
+}
+
+static void bench_hotplug(void)
+{
+	libusb_hotplug_callback_handle cb_handle;
+	libusb_device *devs[STORM_DEVICES];
+	struct libusb_loopback_device config;
+	struct storm_state st;
+	uint64_t start;
+	int rounds = iterations / (2 * STORM_DEVICES) + 1;
+	int i, j, r = 0;
+
+	memset(&config, 0, sizeof(config));
+	config.descriptors = loopback_descriptors;
+	config.descriptors_length = sizeof(loopback_descriptors);
+	config.speed = LIBUSB_SPEED_HIGH;
+
+	memset(&st, 0, sizeof(st));
+	if (samples_init(&st.samples, rounds * 2 * STORM_DEVICES) < 0) {
+		skip("hotplug_storm", "no memory");
+		return;
+	}
+
+	r = libusb_hotplug_register_callback(ctx,
+		LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+		0, LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+		LIBUSB_HOTPLUG_MATCH_ANY, storm_cb, &st, &cb_handle);
+	if (r < 0) {
+		skip("hotplug_storm", libusb_error_name(r));
+		free(st.samples.ns);
+		return;
+	}
+
+	/* plug in a batch of devices, then unplug them all again */
+	start = now_ns();
+	for (i = 0; i < rounds && !r; i++) {
+		for (j = 0; j < STORM_DEVICES; j++) {
+			r = libusb_loopback_add_device(ctx, &config, &devs[j]);
+			if (r < 0)
+				break;
+			st.changed[libusb_get_device_address(devs[j])] = now_ns();
+			st.pending++;
+		}
+		if (!r)
+			r = storm_wait(&st);
+		while (j--) {
+			st.changed[libusb_get_device_address(devs[j])] = now_ns();
+			st.pending++;
+			libusb_loopback_remove_device(devs[j]);
+			libusb_unref_device(devs[j]);
+		}
+		if (!r)
+			r = storm_wait(&st);
+	}
+
+	if (r < 0)
+		skip("hotplug_storm", libusb_error_name(r));
+	else
+		report("hotplug_storm", 1, &st.samples, now_ns() - start);
+
+	libusb_hotplug_deregister_callback(ctx, cb_handle);
+	free(st.samples.ns);
+}
+
+static int open_loopback(void)
+{
+	struct libusb_loopback_endpoint endpoints[3];
+	struct libusb_loopback_device config;
+	libusb_device *dev;
+	int i, r;
+
+	memset(endpoints, 0, sizeof(endpoints));
+	endpoints[0].endpoint = 0x81;
+	endpoints[1].endpoint = 0x02;
+	endpoints[2].endpoint = 0x83;
+	for (i = 0; i < 3; i++)
+		endpoints[i].latency_us = latency_us;
+
+	memset(&config, 0, sizeof(config));
+	config.descriptors = loopback_descriptors;
+	config.descriptors_length = sizeof(loopback_descriptors);
+	config.speed = LIBUSB_SPEED_HIGH;
+	config.endpoints = endpoints;
+	config.num_endpoints = 3;
+
+	r = libusb_loopback_add_device(ctx, &config, &dev);
+	if (r < 0)
+		return r;
+
+	r = libusb_open(dev, &target.handle);
+	libusb_unref_device(dev);
+	if (r < 0)
+		return r;
+
+	target.name = "loopback";
+	target.loopback = 1;
+	target.bulk_in = 0x81;
+	target.bulk_out = 0x02;
+	target.iso_in = 0x83;
+	target.iso_packet_size = 1024;
+	return 0;
+}
+
+/* pick the first bulk IN, bulk OUT and isochronous IN endpoints of the
+ * active configuration */
+static void find_endpoints(void)
+{
+	libusb_device *dev = libusb_get_device(target.handle);
+	struct libusb_config_descriptor *config;
+	const struct libusb_interface_descriptor *alt;
+	const struct libusb_endpoint_descriptor *ep;
+	int i, j;
+
+	if (libusb_get_active_config_descriptor(dev, &config) < 0)
+		return;
+
+	for (i = 0; i < config->bNumInterfaces; i++) {
+		if (!config->interface[i].num_altsetting)
+			continue;
+		alt = &config->interface[i].altsetting[0];
+		for (j = 0; j < alt->bNumEndpoints; j++) {
+			ep = &alt->endpoint[j];
+			switch (ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) {
+			case LIBUSB_TRANSFER_TYPE_BULK:
+				if ((ep->bEndpointAddress & LIBUSB_ENDPOINT_IN) && !target.bulk_in)
+					target.bulk_in = ep->bEndpointAddress;
+				else if (!(ep->bEndpointAddress & LIBUSB_ENDPOINT_IN) && !target.bulk_out)
+					target.bulk_out = ep->bEndpointAddress;
+				break;
+			case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
+				if ((ep->bEndpointAddress & LIBUSB_ENDPOINT_IN) && !target.iso_in)
+					target.iso_in = ep->bEndpointAddress;
+				break;
+			}
+		}
+	}
+	libusb_free_config_descriptor(config);
+
+	if (target.iso_in)
+		target.iso_packet_size = libusb_get_max_iso_packet_size(dev, target.iso_in);
+	if (target.iso_packet_size <= 0)
+		target.iso_in = 0;
+}
+
+static int selected(const char *bench)
+{
+	return !only || strstr(only, bench);
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "usage: %s [-d VID:PID] [-n ITERATIONS] [-t THREADS] [-l LATENCY_US] [-b BENCH,...]\n"
+		"benchmarks: alloc_free device_list descriptor_parse sync_control control_batch\n"
+		"            sync_bulk submit_roundtrip sync_contention small_writes coalesced_writes\n"
+		"            iso_resubmit hotplug_storm\n",
+		argv0);
+}
+
+int main(int argc, char *argv[])
+{
+	const struct libusb_version *version = libusb_get_version();
+	unsigned int vid = 0, pid = 0;
+	int opt, r;
+
+	while ((opt = getopt(argc, argv, "d:n:t:l:b:")) != -1) {
+		switch (opt) {
+		case 'd':
+			if (sscanf(optarg, "%x:%x", &vid, &pid) != 2) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'n':
+			iterations = atoi(optarg);
+			break;
+		case 't':
+			threads = atoi(optarg);
+			break;
+		case 'l':
+			latency_us = (unsigned int)atoi(optarg);
+			break;
+		case 'b':
+			only = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (iterations < 10 || threads < 1 || threads > MAX_THREADS) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	r = libusb_init(&ctx);
+	if (r < 0) {
+		fprintf(stderr, "libusb_init failed: %s\n", libusb_error_name(r));
+		return 1;
+	}
+
+	if (vid || pid) {
+		target.handle = libusb_open_device_with_vid_pid(ctx, (uint16_t)vid, (uint16_t)pid);
+		if (!target.handle) {
+			fprintf(stderr, "device %04x:%04x not found\n", vid, pid);
+			libusb_exit(ctx);
+			return 1;
+		}
+		target.name = "device";
+		find_endpoints();
+	} else {
+		r = open_loopback();
+		if (r < 0) {
+			fprintf(stderr, "no loopback device (%s), only running benchmarks without I/O\n",
+				libusb_error_name(r));
+			target.name = "none";
+		}
+	}
+
+	if (target.handle && (target.bulk_in || target.iso_in)) {
+		r = libusb_claim_interface(target.handle, 0);
+		if (r < 0)
+			fprintf(stderr, "failed to claim interface 0: %s\n", libusb_error_name(r));
+	}
+
+	printf("{\"libusb\":\"%u.%u.%u.%u\",\"target\":\"%s\",\"iterations\":%d}\n",
+		version->major, version->minor, version->micro, version->nano,
+		target.name, iterations);
+
+	if (selected("alloc_free"))
+		run("alloc_free", op_alloc_free, NULL, iterations);
+	if (selected("device_list"))
+		run("device_list", op_device_list, NULL, iterations / 10);
+
+	if (target.handle) {
+		if (selected("descriptor_parse"))
+			run("descriptor_parse", op_descriptor_parse, NULL, iterations);
+		if (selected("sync_control"))
+			run("sync_control", op_sync_control, NULL, iterations);
+		if (selected("control_batch"))
+			bench_control_batch();
+	}
+
+	if (target.bulk_in) {
+		if (selected("sync_bulk"))
+			run("sync_bulk", op_sync_bulk, NULL, iterations);
+		if (selected("submit_roundtrip"))
+			bench_roundtrip();
+		if (selected("sync_contention"))
+			bench_contention();
+	} else if (selected("sync_bulk")) {
+		skip("sync_bulk", "no bulk IN endpoint");
+	}
+
+	if (target.bulk_out) {
+		if (selected("small_writes"))
+			bench_writes(0);
+		if (selected("coalesced_writes"))
+			bench_writes(1);
+	} else if (selected("small_writes")) {
+		skip("small_writes", "no bulk OUT endpoint");
+	}
+
+	if (target.iso_in && selected("iso_resubmit"))
+		bench_iso();
+	else if (selected("iso_resubmit"))
+		skip("iso_resubmit", "no isochronous IN endpoint");
+
+	if (target.loopback && selected("hotplug_storm"))
+		bench_hotplug();
+	else if (selected("hotplug_storm"))
+		skip("hotplug_storm", "needs the loopback device");
+
+	if (target.handle) {
+		libusb_release_interface(target.handle, 0);
+		libusb_close(target.handle);
+	}
+	libusb_exit(ctx);
+	return 0;
+}
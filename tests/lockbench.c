@@ -0,0 +1,268 @@
+/*
+ * libusb lock contention benchmark
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Runs several threads that all submit transfers and handle events on the
+ * same context, then prints the contention statistics of libusb's internal
+ * locks. libusb must be configured with --enable-lock-profiling.
+ *
+ * Given a device (-d VID:PID), each thread keeps a number of GET_STATUS
+ * control transfers in flight and resubmits them as they complete. Without
+ * one, the threads allocate transfers, enumerate devices and poll for
+ * events in a loop, which exercises the same locks without any I/O.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "libusb.h"
+
+#define MAX_THREADS	64
+#define MAX_DEPTH	64
+#define MAX_LOCKS	64
+
+/* callbacks run on whichever thread happens to handle events, so the
+ * counters of a worker are protected by its lock */
+struct worker {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	unsigned long ops;
+	int in_flight;
+	struct libusb_transfer *transfers[MAX_DEPTH];
+};
+
+static libusb_context *ctx;
+static libusb_device_handle *handle;
+static volatile int stop;
+static int depth = 8;
+
+static void LIBUSB_CALL transfer_cb(struct libusb_transfer *transfer)
+{
+	struct worker *w = transfer->user_data;
+	int done = stop || transfer->status != LIBUSB_TRANSFER_COMPLETED ||
+		libusb_submit_transfer(transfer) < 0;
+
+	pthread_mutex_lock(&w->lock);
+	w->ops++;
+	if (done)
+		w->in_flight--;
+	pthread_mutex_unlock(&w->lock);
+}
+
+static int worker_in_flight(struct worker *w)
+{
+	int in_flight;
+
+	pthread_mutex_lock(&w->lock);
+	in_flight = w->in_flight;
+	pthread_mutex_unlock(&w->lock);
+	return in_flight;
+}
+
+static void *device_worker(void *arg)
+{
+	struct worker *w = arg;
+	struct timeval tv = { 0, 100000 };
+	unsigned char *buf;
+	int i;
+
+	for (i = 0; i < depth; i++) {
+		w->transfers[i] = libusb_alloc_transfer(0);
+		buf = malloc(LIBUSB_CONTROL_SETUP_SIZE + 2);
+		if (!w->transfers[i] || !buf) {
+			free(buf);
+			break;
+		}
+		libusb_fill_control_setup(buf, LIBUSB_ENDPOINT_IN,
+			LIBUSB_REQUEST_GET_STATUS, 0, 0, 2);
+		libusb_fill_control_transfer(w->transfers[i], handle, buf,
+			transfer_cb, w, 1000);
+		w->transfers[i]->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+		pthread_mutex_lock(&w->lock);
+		if (libusb_submit_transfer(w->transfers[i]) == 0)
+			w->in_flight++;
+		pthread_mutex_unlock(&w->lock);
+	}
+
+	while (worker_in_flight(w) > 0)
+		libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+
+	for (i = 0; i < depth; i++) {
+		if (w->transfers[i])
+			libusb_free_transfer(w->transfers[i]);
+	}
+	return NULL;
+}
+
+static void *idle_worker(void *arg)
+{
+	struct worker *w = arg;
+	struct timeval tv = { 0, 0 };
+	struct libusb_transfer *transfer;
+	libusb_device **list;
+	ssize_t n;
+
+	while (!stop) {
+		transfer = libusb_alloc_transfer(0);
+		n = libusb_get_device_list(ctx, &list);
+		if (n >= 0)
+			libusb_free_device_list(list, 1);
+		libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+		libusb_free_transfer(transfer);
+		w->ops++;
+	}
+	return NULL;
+}
+
+static int compare_wait(const void *a, const void *b)
+{
+	const struct libusb_lock_stats *sa = a, *sb = b;
+
+	if (sa->wait_ns != sb->wait_ns)
+		return sa->wait_ns < sb->wait_ns ? 1 : -1;
+	return strcmp(sa->name, sb->name);
+}
+
+static void print_lock_stats(double seconds)
+{
+	struct libusb_lock_stats stats[MAX_LOCKS];
+	int i, n;
+
+	n = libusb_get_lock_stats(stats, MAX_LOCKS);
+	if (n < 0) {
+		printf("lock statistics not available, configure libusb with --enable-lock-profiling\n");
+		return;
+	}
+	if (n > MAX_LOCKS)
+		n = MAX_LOCKS;
+
+	qsort(stats, n, sizeof(stats[0]), compare_wait);
+
+	printf("%-32s %12s %10s %7s %12s %10s %12s %10s\n", "lock",
+		"acquired", "contended", "%", "wait ms", "max us",
+		"hold ms", "max us");
+	for (i = 0; i < n; i++) {
+		if (!stats[i].acquisitions)
+			continue;
+		printf("%-32s %12llu %10llu %6.2f%% %12.3f %10.1f %12.3f %10.1f\n",
+			stats[i].name,
+			(unsigned long long)stats[i].acquisitions,
+			(unsigned long long)stats[i].contended,
+			100.0 * stats[i].contended / stats[i].acquisitions,
+			stats[i].wait_ns / 1e6, stats[i].max_wait_ns / 1e3,
+			stats[i].hold_ns / 1e6, stats[i].max_hold_ns / 1e3);
+	}
+	printf("(over %.1f s; wait and hold times are summed over all threads)\n",
+		seconds);
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "usage: %s [-t THREADS] [-s SECONDS] [-q DEPTH] [-d VID:PID]\n",
+		argv0);
+}
+
+int main(int argc, char *argv[])
+{
+	static struct worker workers[MAX_THREADS];
+	unsigned int vid = 0, pid = 0;
+	int threads = 4, seconds = 5;
+	unsigned long ops = 0;
+	int i, opt, r;
+
+	while ((opt = getopt(argc, argv, "t:s:q:d:")) != -1) {
+		switch (opt) {
+		case 't':
+			threads = atoi(optarg);
+			break;
+		case 's':
+			seconds = atoi(optarg);
+			break;
+		case 'q':
+			depth = atoi(optarg);
+			break;
+		case 'd':
+			if (sscanf(optarg, "%x:%x", &vid, &pid) != 2) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (threads < 1 || threads > MAX_THREADS || seconds < 1 ||
+	    depth < 1 || depth > MAX_DEPTH) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	r = libusb_init(&ctx);
+	if (r < 0) {
+		fprintf(stderr, "libusb_init failed: %s\n", libusb_error_name(r));
+		return 1;
+	}
+
+	if (vid || pid) {
+		handle = libusb_open_device_with_vid_pid(ctx, (uint16_t)vid, (uint16_t)pid);
+		if (!handle) {
+			fprintf(stderr, "device %04x:%04x not found\n", vid, pid);
+			libusb_exit(ctx);
+			return 1;
+		}
+	}
+
+	/* leave out the locking done by libusb_init() and libusb_open() */
+	libusb_reset_lock_stats();
+
+	for (i = 0; i < threads; i++) {
+		pthread_mutex_init(&workers[i].lock, NULL);
+		r = pthread_create(&workers[i].thread, NULL,
+			handle ? device_worker : idle_worker, &workers[i]);
+		if (r) {
+			fprintf(stderr, "failed to start thread %d\n", i);
+			stop = 1;
+			threads = i;
+			break;
+		}
+	}
+
+	if (!stop)
+		sleep((unsigned int)seconds);
+	stop = 1;
+
+	for (i = 0; i < threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		ops += workers[i].ops;
+	}
+
+	printf("%d threads, %s: %lu operations, %.0f/s\n\n", threads,
+		handle ? "control transfers" : "no device", ops,
+		(double)ops / seconds);
+	print_lock_stats(seconds);
+
+	if (handle)
+		libusb_close(handle);
+	libusb_exit(ctx);
+	return 0;
+}
@@ -0,0 +1,1178 @@
+/*
+ * libusb tests run against emulated loopback devices
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "libusb.h"
+#include "libusb_testlib.h"
+
+/* A vendor specific device with one bulk IN and one bulk OUT endpoint */
+static const unsigned char bulk_descriptors[] = {
+	18, LIBUSB_DT_DEVICE, 0x00, 0x02, 0xff, 0, 0, 64,
+	0x6b, 0x1d, 0x04, 0x01, 0x00, 0x01, 0, 0, 0, 1,
+	9, LIBUSB_DT_CONFIG, 32, 0, 1, 1, 0, 0x80, 50,
+	9, LIBUSB_DT_INTERFACE, 0, 0, 2, 0xff, 0, 0, 0,
+	7, LIBUSB_DT_ENDPOINT, 0x81, LIBUSB_TRANSFER_TYPE_BULK, 0x00, 0x02, 0,
+	7, LIBUSB_DT_ENDPOINT, 0x02, LIBUSB_TRANSFER_TYPE_BULK, 0x00, 0x02, 0,
+};
+
+/* A vendor specific device with an isochronous IN endpoint of 512 byte
+ * packets every other microframe, or every eighth in alternate setting 1 */
+static const unsigned char iso_descriptors[] = {
+	18, LIBUSB_DT_DEVICE, 0x00, 0x02, 0xff, 0, 0, 64,
+	0x6b, 0x1d, 0x04, 0x01, 0x00, 0x01, 0, 0, 0, 1,
+	9, LIBUSB_DT_CONFIG, 41, 0, 1, 1, 0, 0x80, 50,
+	9, LIBUSB_DT_INTERFACE, 0, 0, 1, 0xff, 0, 0, 0,
+	7, LIBUSB_DT_ENDPOINT, 0x81, LIBUSB_TRANSFER_TYPE_ISOCHRONOUS, 0x00, 0x02, 2,
+	9, LIBUSB_DT_INTERFACE, 0, 1, 1, 0xff, 0, 0, 0,
+	7, LIBUSB_DT_ENDPOINT, 0x81, LIBUSB_TRANSFER_TYPE_ISOCHRONOUS, 0x00, 0x02, 4,
+};
+
+/* A full speed device whose interface has alternate settings with an
+ * isochronous IN endpoint of 0, 256, 512 and 1023 byte packets every
+ * frame */
+static const unsigned char periodic_descriptors[] = {
+	18, LIBUSB_DT_DEVICE, 0x00, 0x02, 0xff, 0, 0, 64,
+	0x6b, 0x1d, 0x04, 0x01, 0x00, 0x01, 0, 0, 0, 1,
+	9, LIBUSB_DT_CONFIG, 9 + 4 * 16, 0, 1, 1, 0, 0x80, 50,
+	9, LIBUSB_DT_INTERFACE, 0, 0, 1, 0xff, 0, 0, 0,
+	7, LIBUSB_DT_ENDPOINT, 0x81, LIBUSB_TRANSFER_TYPE_ISOCHRONOUS, 0x00, 0x00, 1,
+	9, LIBUSB_DT_INTERFACE, 0, 1, 1, 0xff, 0, 0, 0,
+	7, LIBUSB_DT_ENDPOINT, 0x81, LIBUSB_TRANSFER_TYPE_ISOCHRONOUS, 0x00, 0x01, 1,
+	9, LIBUSB_DT_INTERFACE, 0, 2, 1, 0xff, 0, 0, 0,
+	7, LIBUSB_DT_ENDPOINT, 0x81, LIBUSB_TRANSFER_TYPE_ISOCHRONOUS, 0x00, 0x02, 1,
+	9, LIBUSB_DT_INTERFACE, 0, 3, 1, 0xff, 0, 0, 0,
+	7, LIBUSB_DT_ENDPOINT, 0x81, LIBUSB_TRANSFER_TYPE_ISOCHRONOUS, 0xff, 0x03, 1,
+};
+
+#define BULK_IN		0x81
+#define BULK_OUT	0x02
+#define ISO_IN		0x81
+
+/* vendor request reading or writing the registers of a loopback device,
+ * at the offset given by wValue */
+#define REQUEST_REGISTERS	0x01
+
+/* Data moved by the endpoints of a loopback device. IN endpoints return a
+ * running byte count, cut short to the scripted length of each of the first
+ * num_lengths URBs; OUT endpoints append what they are given to data. An
+ * endpoint with stall set halts on the next URB, one with unplug set
+ * removes that device. */
+struct endpoint_data {
+	int lengths[8];
+	int num_lengths;
+	int calls;
+	int stall;
+	libusb_device *unplug;
+	unsigned char data[2048];
+	int data_length;
+};
+
+struct loopback {
+	libusb_context *ctx;
+	libusb_device *dev;
+	libusb_device_handle *handle;
+	struct endpoint_data in;
+	struct endpoint_data out;
+	unsigned char registers[256];
+};
+
+static int LIBUSB_CALL endpoint_cb(unsigned char endpoint, unsigned char *data,
+	int length, void *user_data)
+{
+	struct endpoint_data *ep = user_data;
+	int i;
+
+	if (ep->stall) {
+		ep->stall = 0;
+		return LIBUSB_ERROR_PIPE;
+	}
+	if (ep->unplug) {
+		libusb_loopback_remove_device(ep->unplug);
+		ep->unplug = NULL;
+	}
+
+	if (endpoint & LIBUSB_ENDPOINT_IN) {
+		if (ep->calls < ep->num_lengths && ep->lengths[ep->calls] < length)
+			length = ep->lengths[ep->calls];
+		for (i = 0; i < length; i++)
+			data[i] = (unsigned char)ep->data_length++;
+	} else {
+		if (length > (int)sizeof(ep->data) - ep->data_length)
+			return LIBUSB_ERROR_OVERFLOW;
+		memcpy(ep->data + ep->data_length, data, length);
+		ep->data_length += length;
+	}
+	ep->calls++;
+	return length;
+}
+
+static int LIBUSB_CALL control_cb(const struct libusb_control_setup *setup,
+	unsigned char *data, void *user_data)
+{
+	struct loopback *lb = user_data;
+	int offset = libusb_le16_to_cpu(setup->wValue);
+	int length = libusb_le16_to_cpu(setup->wLength);
+
+	if (setup->bRequest != REQUEST_REGISTERS ||
+			offset + length > (int)sizeof(lb->registers))
+		return LIBUSB_ERROR_PIPE;
+
+	if (setup->bmRequestType & LIBUSB_ENDPOINT_IN)
+		memcpy(data, lb->registers + offset, length);
+	else
+		memcpy(lb->registers + offset, data, length);
+	return length;
+}
+
+/* Attach a loopback device with the given descriptors and open it. Its
+ * endpoint 0x81 moves the data of lb->in, 0x02 that of lb->out, and its
+ * vendor requests the registers. Skips the test where loopback devices are
+ * not supported. */
+static libusb_testlib_result open_loopback_device(libusb_testlib_ctx *tctx,
+	struct loopback *lb, const unsigned char *descriptors, int length,
+	enum libusb_speed speed)
+{
+	struct libusb_loopback_endpoint endpoints[2];
+	struct libusb_loopback_device config;
+	int r;
+
+	memset(lb, 0, sizeof(*lb));
+	memset(endpoints, 0, sizeof(endpoints));
+	endpoints[0].endpoint = BULK_IN;
+	endpoints[0].data_cb = endpoint_cb;
+	endpoints[0].user_data = &lb->in;
+	endpoints[1].endpoint = BULK_OUT;
+	endpoints[1].data_cb = endpoint_cb;
+	endpoints[1].user_data = &lb->out;
+
+	memset(&config, 0, sizeof(config));
+	config.descriptors = descriptors;
+	config.descriptors_length = length;
+	config.speed = speed;
+	config.endpoints = endpoints;
+	config.num_endpoints = 2;
+	config.control_cb = control_cb;
+	config.user_data = lb;
+
+	r = libusb_init(&lb->ctx);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf(tctx, "Failed to init libusb: %d", r);
+		return TEST_STATUS_FAILURE;
+	}
+	r = libusb_loopback_add_device(lb->ctx, &config, &lb->dev);
+	if (r == LIBUSB_ERROR_NOT_SUPPORTED) {
+		libusb_exit(lb->ctx);
+		return TEST_STATUS_SKIP;
+	} else if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf(tctx, "Failed to add loopback device: %d", r);
+		libusb_exit(lb->ctx);
+		return TEST_STATUS_FAILURE;
+	}
+	r = libusb_open(lb->dev, &lb->handle);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf(tctx, "Failed to open loopback device: %d", r);
+		libusb_unref_device(lb->dev);
+		libusb_exit(lb->ctx);
+		return TEST_STATUS_FAILURE;
+	}
+	return TEST_STATUS_SUCCESS;
+}
+
+/* Attach and open a high speed loopback device with bulk endpoints */
+static libusb_testlib_result open_loopback(libusb_testlib_ctx *tctx,
+	struct loopback *lb)
+{
+	return open_loopback_device(tctx, lb, bulk_descriptors,
+		sizeof(bulk_descriptors), LIBUSB_SPEED_HIGH);
+}
+
+static void close_loopback(struct loopback *lb)
+{
+	libusb_close(lb->handle);
+	libusb_unref_device(lb->dev);
+	libusb_exit(lb->ctx);
+}
+
+static void LIBUSB_CALL transfer_done_cb(struct libusb_transfer *transfer)
+{
+	*(int *)transfer->user_data = 1;
+}
+
+/* Submit a transfer and handle events until it has completed */
+static int run_transfer(libusb_context *ctx, struct libusb_transfer *transfer)
+{
+	int completed = 0;
+	int r;
+
+	transfer->callback = transfer_done_cb;
+	transfer->user_data = &completed;
+	r = libusb_submit_transfer(transfer);
+	if (r != LIBUSB_SUCCESS)
+		return r;
+	while (!completed) {
+		r = libusb_handle_events_completed(ctx, &completed);
+		if (r != LIBUSB_SUCCESS)
+			return r;
+	}
+	return LIBUSB_SUCCESS;
+}
+
+/* Handle events until count reaches target */
+static int wait_for_count(libusb_context *ctx, int *count, int target)
+{
+	struct timeval tv = { 0, 100000 };
+	int r;
+
+	while (*count < target) {
+		r = libusb_handle_events_timeout(ctx, &tv);
+		if (r != LIBUSB_SUCCESS)
+			return r;
+	}
+	return LIBUSB_SUCCESS;
+}
+
+/** Tests synchronous bulk transfers in both directions, an endpoint halt
+ * and its clearing, and the unplugging of a loopback device from its own
+ * data callback. */
+static libusb_testlib_result test_loopback_bulk(libusb_testlib_ctx *tctx)
+{
+	struct loopback lb;
+	unsigned char buffer[64];
+	libusb_testlib_result result;
+	int r, i, transferred;
+
+	result = open_loopback(tctx, &lb);
+	if (result != TEST_STATUS_SUCCESS)
+		return result;
+
+	r = libusb_bulk_transfer(lb.handle, BULK_IN, buffer, sizeof(buffer),
+		&transferred, 1000);
+	if (r != LIBUSB_SUCCESS || transferred != (int)sizeof(buffer)) {
+		libusb_testlib_logf(tctx, "IN transfer %d, length %d", r,
+			transferred);
+		result = TEST_STATUS_FAILURE;
+		goto out;
+	}
+	for (i = 0; i < (int)sizeof(buffer); i++) {
+		if (buffer[i] != i) {
+			libusb_testlib_logf(tctx, "Wrong data at offset %d", i);
+			result = TEST_STATUS_FAILURE;
+			goto out;
+		}
+	}
+
+	r = libusb_bulk_transfer(lb.handle, BULK_OUT, buffer, 16,
+		&transferred, 1000);
+	if (r != LIBUSB_SUCCESS || transferred != 16 ||
+			lb.out.data_length != 16 ||
+			memcmp(lb.out.data, buffer, 16) != 0) {
+		libusb_testlib_logf(tctx, "OUT transfer %d, length %d", r,
+			transferred);
+		result = TEST_STATUS_FAILURE;
+		goto out;
+	}
+
+	/* a halted endpoint stalls until the halt is cleared */
+	lb.in.stall = 1;
+	r = libusb_bulk_transfer(lb.handle, BULK_IN, buffer, sizeof(buffer),
+		&transferred, 1000);
+	if (r != LIBUSB_ERROR_PIPE) {
+		libusb_testlib_logf(tctx, "Stalled transfer returned %d", r);
+		result = TEST_STATUS_FAILURE;
+		goto out;
+	}
+	r = libusb_clear_halt(lb.handle, BULK_IN);
+	if (r == LIBUSB_SUCCESS)
+		r = libusb_bulk_transfer(lb.handle, BULK_IN, buffer,
+			sizeof(buffer), &transferred, 1000);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf(tctx, "Transfer after clearing halt %d", r);
+		result = TEST_STATUS_FAILURE;
+		goto out;
+	}
+
+	lb.in.unplug = lb.dev;
+	libusb_bulk_transfer(lb.handle, BULK_IN, buffer, sizeof(buffer),
+		&transferred, 1000);
+	r = libusb_bulk_transfer(lb.handle, BULK_IN, buffer, sizeof(buffer),
+		&transferred, 1000);
+	if (lb.in.unplug || r != LIBUSB_ERROR_NO_DEVICE) {
+		libusb_testlib_logf(tctx, "Transfer after unplug returned %d", r);
+		result = TEST_STATUS_FAILURE;
+	}
+
+out:
+	close_loopback(&lb);
+	return result;
+}
+
+/** Tests that a short read in a middle segment of a scatter-gather IN
+ * transfer ends it there, with the later segments left empty. */
+static libusb_testlib_result test_iov_short_read(libusb_testlib_ctx *tctx)
+{
+	static const int expected[4] = { 16, 0, 5, 0 };
+	struct loopback lb;
+	struct libusb_transfer *transfer;
+	struct libusb_iovec iov[4];
+	unsigned char a[16], c[16], d[16];
+	libusb_testlib_result result;
+	int r, i;
+
+	result = open_loopback(tctx, &lb);
+	if (result != TEST_STATUS_SUCCESS)
+		return result;
+
+	memset(a, 0xee, sizeof(a));
+	memset(c, 0xee, sizeof(c));
+	memset(d, 0xee, sizeof(d));
+	iov[0].buffer = a;
+	iov[0].length = sizeof(a);
+	iov[1].buffer = c;
+	iov[1].length = 0;
+	iov[2].buffer = c;
+	iov[2].length = sizeof(c);
+	iov[3].buffer = d;
+	iov[3].length = sizeof(d);
+	lb.in.lengths[0] = 16;
+	lb.in.lengths[1] = 5;
+	lb.in.lengths[2] = 16;
+	lb.in.num_lengths = 3;
+
+	transfer = libusb_alloc_transfer(0);
+	libusb_fill_bulk_transfer_iov(transfer, lb.handle, BULK_IN, iov, 4,
+		NULL, NULL, 1000);
+	r = run_transfer(lb.ctx, transfer);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf(tctx, "Transfer failed: %d", r);
+		result = TEST_STATUS_FAILURE;
+		goto out;
+	}
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED ||
+			transfer->actual_length != 21) {
+		libusb_testlib_logf(tctx, "Transfer status %d, length %d",
+			transfer->status, transfer->actual_length);
+		result = TEST_STATUS_FAILURE;
+	}
+	for (i = 0; i < 4; i++) {
+		if (iov[i].actual_length != expected[i]) {
+			libusb_testlib_logf(tctx, "Segment %d length %d, expected %d",
+				i, iov[i].actual_length, expected[i]);
+			result = TEST_STATUS_FAILURE;
+		}
+	}
+	for (i = 0; i < 16; i++) {
+		if (a[i] != i || c[i] != (i < 5 ? 16 + i : 0xee) || d[i] != 0xee) {
+			libusb_testlib_logf(tctx, "Wrong data at offset %d", i);
+			result = TEST_STATUS_FAILURE;
+			break;
+		}
+	}
+
+out:
+	libusb_free_transfer(transfer);
+	close_loopback(&lb);
+	return result;
+}
+
+/** Tests that full scatter-gather transfers fill, and gather from, every
+ * segment in order, skipping empty ones. */
+static libusb_testlib_result test_iov_full(libusb_testlib_ctx *tctx)
+{
+	static const int lengths[4] = { 10, 0, 20, 6 };
+	struct loopback lb;
+	struct libusb_transfer *transfer;
+	struct libusb_iovec iov[4];
+	unsigned char buffer[36];
+	libusb_testlib_result result;
+	int r, i, offset;
+
+	result = open_loopback(tctx, &lb);
+	if (result != TEST_STATUS_SUCCESS)
+		return result;
+
+	transfer = libusb_alloc_transfer(0);
+	for (i = 0; i < (int)sizeof(buffer); i++)
+		buffer[i] = (unsigned char)(100 + i);
+
+	/* OUT: the device sees the segments back to back */
+	for (i = 0, offset = 0; i < 4; offset += lengths[i], i++) {
+		iov[i].buffer = buffer + offset;
+		iov[i].length = lengths[i];
+	}
+	libusb_fill_bulk_transfer_iov(transfer, lb.handle, BULK_OUT, iov, 4,
+		NULL, NULL, 1000);
+	r = run_transfer(lb.ctx, transfer);
+	if (r != LIBUSB_SUCCESS || transfer->status != LIBUSB_TRANSFER_COMPLETED ||
+			transfer->actual_length != 36 || lb.out.data_length != 36 ||
+			memcmp(lb.out.data, buffer, 36) != 0) {
+		libusb_testlib_logf(tctx, "OUT transfer %d, status %d, length %d",
+			r, transfer->status, transfer->actual_length);
+		result = TEST_STATUS_FAILURE;
+		goto out;
+	}
+
+	/* IN: each segment is filled in turn */
+	memset(buffer, 0, sizeof(buffer));
+	libusb_fill_bulk_transfer_iov(transfer, lb.handle, BULK_IN, iov, 4,
+		NULL, NULL, 1000);
+	r = run_transfer(lb.ctx, transfer);
+	if (r != LIBUSB_SUCCESS || transfer->status != LIBUSB_TRANSFER_COMPLETED ||
+			transfer->actual_length != 36) {
+		libusb_testlib_logf(tctx, "IN transfer %d, status %d, length %d",
+			r, transfer->status, transfer->actual_length);
+		result = TEST_STATUS_FAILURE;
+		goto out;
+	}
+	for (i = 0; i < 4; i++) {
+		if (iov[i].actual_length != lengths[i]) {
+			libusb_testlib_logf(tctx, "Segment %d length %d, expected %d",
+				i, iov[i].actual_length, lengths[i]);
+			result = TEST_STATUS_FAILURE;
+		}
+	}
+	for (i = 0; i < (int)sizeof(buffer); i++) {
+		if (buffer[i] != i) {
+			libusb_testlib_logf(tctx, "Wrong data at offset %d", i);
+			result = TEST_STATUS_FAILURE;
+			break;
+		}
+	}
+
+	/* segments that do not add up to the transfer length are refused */
+	transfer->length--;
+	r = libusb_submit_transfer(transfer);
+	if (r != LIBUSB_ERROR_INVALID_PARAM) {
+		libusb_testlib_logf(tctx, "Mismatched length submitted: %d", r);
+		result = TEST_STATUS_FAILURE;
+	}
+
+out:
+	libusb_free_transfer(transfer);
+	close_loopback(&lb);
+	return result;
+}
+
+#define CAPTURE_FILE	"loopback-capture.pcapng"
+
+/** Tests that the transfers captured with LIBUSB_OPTION_CAPTURE_FD are
+ * replayed, with their data, by the device loaded from the capture. */
+static libusb_testlib_result test_capture_replay(libusb_testlib_ctx *tctx)
+{
+	struct loopback lb;
+	struct libusb_capture_stats stats;
+	libusb_context *ctx = NULL;
+	libusb_device **list = NULL;
+	libusb_device_handle *handle = NULL;
+	unsigned char buffer[64];
+	libusb_testlib_result result;
+	FILE *file;
+	ssize_t count;
+	int r, i, transferred;
+
+	result = open_loopback(tctx, &lb);
+	if (result != TEST_STATUS_SUCCESS)
+		return result;
+
+	file = fopen(CAPTURE_FILE, "w+b");
+	if (!file) {
+		libusb_testlib_logf(tctx, "Failed to create " CAPTURE_FILE);
+		close_loopback(&lb);
+		return TEST_STATUS_ERROR;
+	}
+	r = libusb_set_option(lb.ctx, LIBUSB_OPTION_CAPTURE_FD, fileno(file));
+	if (r == LIBUSB_ERROR_NOT_SUPPORTED) {
+		result = TEST_STATUS_SKIP;
+		goto out_close;
+	} else if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf(tctx, "Failed to start capture: %d", r);
+		result = TEST_STATUS_FAILURE;
+		goto out_close;
+	}
+
+	r = libusb_bulk_transfer(lb.handle, BULK_IN, buffer, sizeof(buffer),
+		&transferred, 1000);
+	if (r == LIBUSB_SUCCESS)
+		r = libusb_bulk_transfer(lb.handle, BULK_OUT, buffer, 16,
+			&transferred, 1000);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf(tctx, "Captured transfer failed: %d", r);
+		libusb_set_option(lb.ctx, LIBUSB_OPTION_CAPTURE_FD, -1);
+		result = TEST_STATUS_FAILURE;
+		goto out_close;
+	}
+
+	/* the counters are only there while the capture runs */
+	r = libusb_get_capture_stats(lb.ctx, &stats);
+	libusb_set_option(lb.ctx, LIBUSB_OPTION_CAPTURE_FD, -1);
+	if (r != LIBUSB_SUCCESS || stats.dropped) {
+		libusb_testlib_logf(tctx, "Capture stats %d: %d packets dropped",
+			r, (int)stats.dropped);
+		result = TEST_STATUS_FAILURE;
+		goto out_close;
+	}
+	close_loopback(&lb);
+	fclose(file);
+	file = NULL;
+
+	r = libusb_init(&ctx);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf(tctx, "Failed to init libusb: %d", r);
+		result = TEST_STATUS_FAILURE;
+		goto out_remove;
+	}
+	count = libusb_replay_load(ctx, CAPTURE_FILE, 0, &list);
+	if (count != 1) {
+		libusb_testlib_logf(tctx, "Replay loaded %d devices", (int)count);
+		result = TEST_STATUS_FAILURE;
+		goto out_exit;
+	}
+	r = libusb_open(list[0], &handle);
+	if (r == LIBUSB_SUCCESS) {
+		memset(buffer, 0, sizeof(buffer));
+		r = libusb_bulk_transfer(handle, BULK_IN, buffer, sizeof(buffer),
+			&transferred, 1000);
+	}
+	if (r != LIBUSB_SUCCESS || transferred != (int)sizeof(buffer)) {
+		libusb_testlib_logf(tctx, "Replayed transfer %d, length %d", r,
+			transferred);
+		result = TEST_STATUS_FAILURE;
+		goto out_exit;
+	}
+	for (i = 0; i < (int)sizeof(buffer); i++) {
+		if (buffer[i] != i) {
+			libusb_testlib_logf(tctx, "Wrong data at offset %d", i);
+			result = TEST_STATUS_FAILURE;
+			break;
+		}
+	}
+
+out_exit:
+	if (handle)
+		libusb_close(handle);
+	if (list)
+		libusb_free_device_list(list, 1);
+	libusb_exit(ctx);
+out_remove:
+	remove(CAPTURE_FILE);
+	return result;
+
+out_close:
+	close_loopback(&lb);
+	fclose(file);
+	remove(CAPTURE_FILE);
+	return result;
+}
+
+static void LIBUSB_CALL batch_done_cb(struct libusb_control_batch *batch)
+{
+	*(int *)batch->user_data = 1;
+}
+
+/* Submit a control batch and handle events until it has completed */
+static int run_batch(libusb_context *ctx, struct libusb_control_batch *batch)
+{
+	int completed = 0;
+	int r;
+
+	batch->callback = batch_done_cb;
+	batch->user_data = &completed;
+	r = libusb_submit_control_batch(batch);
+	if (r != LIBUSB_SUCCESS)
+		return r;
+	while (!completed) {
+		r = libusb_handle_events_completed(ctx, &completed);
+		if (r != LIBUSB_SUCCESS)
+			return r;
+	}
+	return LIBUSB_SUCCESS;
+}
+
+/** Tests that a control batch sends its requests in order, several at a
+ * time, and that it stops at a failed request when asked to. */
+static libusb_testlib_result test_control_batch(libusb_testlib_ctx *tctx)
+{
+	struct loopback lb;
+	struct libusb_control_batch *batch;
+	struct libusb_control_batch_entry *entry;
+	unsigned char out[16][4], in[16][4];
+	libusb_testlib_result result;
+	int r, i;
+
+	result = open_loopback(tctx, &lb);
+	if (result != TEST_STATUS_SUCCESS)
+		return result;
+
+	batch = libusb_alloc_control_batch(32);
+	if (!batch) {
+		close_loopback(&lb);
+		return TEST_STATUS_ERROR;
+	}
+
+	/* write 16 registers, then read them back */
+	batch->dev_handle = lb.handle;
+	batch->depth = 4;
+	batch->timeout = 1000;
+	for (i = 0; i < 32; i++) {
+		entry = &batch->entries[i];
+		entry->bmRequestType = LIBUSB_REQUEST_TYPE_VENDOR |
+			LIBUSB_RECIPIENT_DEVICE |
+			(i < 16 ? LIBUSB_ENDPOINT_OUT : LIBUSB_ENDPOINT_IN);
+		entry->bRequest = REQUEST_REGISTERS;
+		entry->wValue = (uint16_t)((i % 16) * 4);
+		entry->wLength = 4;
+		entry->data = i < 16 ? out[i] : in[i - 16];
+		if (i < 16)
+			memset(out[i], 0x10 + i, 4);
+	}
+	memset(in, 0, sizeof(in));
+	r = run_batch(lb.ctx, batch);
+	if (r != LIBUSB_SUCCESS || batch->status != LIBUSB_TRANSFER_COMPLETED ||
+			batch->num_completed != 32 || memcmp(in, out, sizeof(in))) {
+		libusb_testlib_logf(tctx, "Batch %d, status %d, %d completed", r,
+			batch->status, batch->num_completed);
+		result = TEST_STATUS_FAILURE;
+		goto out;
+	}
+
+	/* an unknown request stalls, and the ones after it are not sent */
+	batch->flags = LIBUSB_CONTROL_BATCH_STOP_ON_ERROR;
+	batch->depth = 1;
+	batch->num_entries = 6;
+	batch->entries[2].bRequest = REQUEST_REGISTERS + 1;
+	r = run_batch(lb.ctx, batch);
+	if (r != LIBUSB_SUCCESS || batch->status != LIBUSB_TRANSFER_STALL ||
+			batch->num_completed != 2) {
+		libusb_testlib_logf(tctx, "Batch %d, status %d, %d completed", r,
+			batch->status, batch->num_completed);
+		result = TEST_STATUS_FAILURE;
+		goto out;
+	}
+	for (i = 3; i < 6; i++) {
+		if (batch->entries[i].status != LIBUSB_TRANSFER_CANCELLED) {
+			libusb_testlib_logf(tctx, "Request %d after the stall: %d",
+				i, batch->entries[i].status);
+			result = TEST_STATUS_FAILURE;
+		}
+	}
+
+out:
+	libusb_free_control_batch(batch);
+	close_loopback(&lb);
+	return result;
+}
+
+#define WRITE_COUNT	64
+#define WRITE_LENGTH	16
+
+/* Writes queued on a coalescer, whose callbacks must come in order */
+struct write_queue {
+	struct libusb_transfer *transfers[WRITE_COUNT];
+	int completed;
+	int out_of_order;
+	int failed;
+	int in_submit;
+	int in_submit_callbacks;
+};
+
+static void LIBUSB_CALL write_done_cb(struct libusb_transfer *transfer)
+{
+	struct write_queue *queue = transfer->user_data;
+
+	if (queue->transfers[queue->completed] != transfer)
+		queue->out_of_order++;
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED)
+		queue->failed++;
+	if (queue->in_submit)
+		queue->in_submit_callbacks++;
+	queue->completed++;
+}
+
+static int queue_write(struct libusb_bulk_coalescer *coalescer,
+	struct write_queue *queue, libusb_device_handle *handle, int index,
+	unsigned char *data, unsigned char flags)
+{
+	struct libusb_transfer *transfer = queue->transfers[index];
+	int r;
+
+	libusb_fill_bulk_transfer(transfer, handle, BULK_OUT, data,
+		WRITE_LENGTH, write_done_cb, queue, 1000);
+	transfer->flags = flags;
+	queue->in_submit = 1;
+	r = libusb_submit_coalesced_transfer(coalescer, transfer);
+	queue->in_submit = 0;
+	return r;
+}
+
+/** Tests that a write coalescer sends small writes in fewer transfers, in
+ * order, and that writes failing with a transfer it could not submit have
+ * their callbacks invoked by the event handler. */
+static libusb_testlib_result test_coalescer(libusb_testlib_ctx *tctx)
+{
+	struct loopback lb;
+	struct libusb_bulk_coalescer *coalescer = NULL;
+	struct write_queue queue;
+	unsigned char data[WRITE_COUNT * WRITE_LENGTH];
+	libusb_testlib_result result;
+	int r, i;
+
+	result = open_loopback(tctx, &lb);
+	if (result != TEST_STATUS_SUCCESS)
+		return result;
+
+	memset(&queue, 0, sizeof(queue));
+	for (i = 0; i < WRITE_COUNT; i++)
+		queue.transfers[i] = libusb_alloc_transfer(0);
+	for (i = 0; i < (int)sizeof(data); i++)
+		data[i] = (unsigned char)(i * 7);
+
+	coalescer = libusb_alloc_bulk_coalescer(lb.handle, BULK_OUT, 512, 0);
+	if (!coalescer) {
+		libusb_testlib_logf(tctx, "Failed to allocate coalescer");
+		result = TEST_STATUS_FAILURE;
+		goto out;
+	}
+	for (i = 0; i < WRITE_COUNT; i++) {
+		r = queue_write(coalescer, &queue, lb.handle, i,
+			data + i * WRITE_LENGTH, 0);
+		if (r != LIBUSB_SUCCESS) {
+			libusb_testlib_logf(tctx, "Write %d failed: %d", i, r);
+			result = TEST_STATUS_FAILURE;
+			goto out;
+		}
+	}
+	r = wait_for_count(lb.ctx, &queue.completed, WRITE_COUNT);
+	if (r != LIBUSB_SUCCESS || queue.out_of_order || queue.failed ||
+			lb.out.data_length != (int)sizeof(data) ||
+			memcmp(lb.out.data, data, sizeof(data)) != 0) {
+		libusb_testlib_logf(tctx, "Writes %d: %d out of order, %d failed",
+			r, queue.out_of_order, queue.failed);
+		result = TEST_STATUS_FAILURE;
+		goto out;
+	}
+	if (lb.out.calls >= WRITE_COUNT) {
+		libusb_testlib_logf(tctx, "%d writes took %d transfers",
+			WRITE_COUNT, lb.out.calls);
+		result = TEST_STATUS_FAILURE;
+		goto out;
+	}
+	libusb_free_bulk_coalescer(coalescer);
+
+	/* writes held back by the delay fail with the flush after unplug */
+	memset(&queue.completed, 0, sizeof(queue) -
+		sizeof(queue.transfers));
+	coalescer = libusb_alloc_bulk_coalescer(lb.handle, BULK_OUT, 512,
+		1000000);
+	for (i = 0; i < 3; i++)
+		queue_write(coalescer, &queue, lb.handle, i, data, 0);
+	libusb_loopback_remove_device(lb.dev);
+	r = queue_write(coalescer, &queue, lb.handle, 3, data,
+		LIBUSB_TRANSFER_ADD_ZERO_PACKET);
+	if (r == LIBUSB_SUCCESS || queue.in_submit_callbacks) {
+		libusb_testlib_logf(tctx, "Write after unplug %d, %d callbacks",
+			r, queue.in_submit_callbacks);
+		result = TEST_STATUS_FAILURE;
+		goto out;
+	}
+	r = wait_for_count(lb.ctx, &queue.completed, 3);
+	if (r != LIBUSB_SUCCESS || queue.failed != 3 || queue.out_of_order) {
+		libusb_testlib_logf(tctx, "Failed writes %d: %d failed, %d out of order",
+			r, queue.failed, queue.out_of_order);
+		result = TEST_STATUS_FAILURE;
+	}
+
+out:
+	libusb_free_bulk_coalescer(coalescer);
+	for (i = 0; i < WRITE_COUNT; i++)
+		libusb_free_transfer(queue.transfers[i]);
+	close_loopback(&lb);
+	return result;
+#undef WRITE_COUNT
+#undef WRITE_LENGTH
+}
+
+#define REQUEST_COUNT	8
+
+/* Requests of a stream scheduler, of one IN and one OUT transfer each */
+struct stream_requests {
+	struct libusb_transfer *transfers[REQUEST_COUNT][2];
+	unsigned char buffers[REQUEST_COUNT][2][64];
+	int completed;
+	int failed;
+};
+
+static void LIBUSB_CALL stream_done_cb(struct libusb_transfer *transfer)
+{
+	struct stream_requests *requests = transfer->user_data;
+
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED)
+		requests->failed++;
+	requests->completed++;
+}
+
+/** Tests that a stream scheduler sends the transfers of each request on
+ * one of its streams, and that a request it cannot submit is handed back
+ * unchanged or fails through the event handler. */
+static libusb_testlib_result test_stream_scheduler(libusb_testlib_ctx *tctx)
+{
+	unsigned char endpoints[2] = { BULK_IN, BULK_OUT };
+	struct loopback lb;
+	struct libusb_stream_scheduler *scheduler;
+	struct stream_requests requests;
+	struct libusb_iovec iov;
+	struct libusb_transfer **request;
+	libusb_testlib_result result;
+	uint32_t stream_id;
+	int r, i, j;
+
+	result = open_loopback_device(tctx, &lb, bulk_descriptors,
+		sizeof(bulk_descriptors), LIBUSB_SPEED_SUPER);
+	if (result != TEST_STATUS_SUCCESS)
+		return result;
+
+	scheduler = libusb_alloc_stream_scheduler(lb.handle, endpoints, 2, 4, 1,
+		2, LIBUSB_STREAM_SCHEDULER_ROUND_ROBIN);
+	if (!scheduler) {
+		libusb_testlib_logf(tctx, "Failed to allocate scheduler");
+		close_loopback(&lb);
+		return TEST_STATUS_FAILURE;
+	}
+
+	memset(&requests, 0, sizeof(requests));
+	for (i = 0; i < REQUEST_COUNT; i++) {
+		for (j = 0; j < 2; j++) {
+			requests.transfers[i][j] = libusb_alloc_transfer(0);
+			libusb_fill_bulk_transfer(requests.transfers[i][j],
+				lb.handle, endpoints[j], requests.buffers[i][j], 64,
+				stream_done_cb, &requests, 1000);
+		}
+	}
+
+	/* twice as many requests as streams, half of them waiting */
+	for (i = 0; i < REQUEST_COUNT; i++) {
+		r = libusb_submit_stream_request(scheduler, requests.transfers[i],
+			2, i % 2);
+		if (r != LIBUSB_SUCCESS) {
+			libusb_testlib_logf(tctx, "Request %d failed: %d", i, r);
+			result = TEST_STATUS_FAILURE;
+			goto out;
+		}
+	}
+	r = wait_for_count(lb.ctx, &requests.completed, REQUEST_COUNT * 2);
+	if (r != LIBUSB_SUCCESS || requests.failed) {
+		libusb_testlib_logf(tctx, "Requests %d, %d failed", r,
+			requests.failed);
+		result = TEST_STATUS_FAILURE;
+		goto out;
+	}
+	for (i = 0; i < REQUEST_COUNT; i++) {
+		stream_id = libusb_transfer_get_stream_id(requests.transfers[i][0]);
+		if (stream_id < 1 || stream_id > 4 || stream_id !=
+				libusb_transfer_get_stream_id(requests.transfers[i][1])) {
+			libusb_testlib_logf(tctx, "Request %d on streams %u and %u", i,
+				stream_id,
+				libusb_transfer_get_stream_id(requests.transfers[i][1]));
+			result = TEST_STATUS_FAILURE;
+			goto out;
+		}
+	}
+
+	/* segments that do not add up to the length fail the submission */
+	iov.buffer = requests.buffers[0][0];
+	iov.length = 32;
+
+	/* a request whose first transfer fails is handed back as it was */
+	request = requests.transfers[0];
+	request[0]->type = LIBUSB_TRANSFER_TYPE_BULK;
+	libusb_transfer_set_stream_id(request[0], 0);
+	request[0]->buffer = NULL;
+	libusb_transfer_set_iov(request[0], &iov, 1);
+	r = libusb_submit_stream_request(scheduler, request, 2, 0);
+	if (r != LIBUSB_ERROR_INVALID_PARAM ||
+			request[0]->type != LIBUSB_TRANSFER_TYPE_BULK ||
+			libusb_transfer_get_stream_id(request[0]) != 0 ||
+			request[0]->callback != stream_done_cb) {
+		libusb_testlib_logf(tctx, "Failed request %d, type %d, stream %u",
+			r, request[0]->type,
+			libusb_transfer_get_stream_id(request[0]));
+		result = TEST_STATUS_FAILURE;
+		goto out;
+	}
+	request[0]->buffer = requests.buffers[0][0];
+
+	/* one whose second transfer fails has the callbacks run later */
+	request = requests.transfers[1];
+	request[1]->buffer = NULL;
+	libusb_transfer_set_iov(request[1], &iov, 1);
+	requests.completed = 0;
+	requests.failed = 0;
+	r = libusb_submit_stream_request(scheduler, request, 2, 0);
+	if (r != LIBUSB_SUCCESS || requests.completed) {
+		libusb_testlib_logf(tctx, "Partly failed request %d, %d callbacks",
+			r, requests.completed);
+		result = TEST_STATUS_FAILURE;
+		goto out;
+	}
+	r = wait_for_count(lb.ctx, &requests.completed, 2);
+	if (r != LIBUSB_SUCCESS || !requests.failed) {
+		libusb_testlib_logf(tctx, "Partly failed request %d, %d failed",
+			r, requests.failed);
+		result = TEST_STATUS_FAILURE;
+	}
+
+out:
+	libusb_free_stream_scheduler(scheduler);
+	for (i = 0; i < REQUEST_COUNT; i++) {
+		for (j = 0; j < 2; j++)
+			libusb_free_transfer(requests.transfers[i][j]);
+	}
+	close_loopback(&lb);
+	return result;
+#undef REQUEST_COUNT
+}
+
+/** Tests that isochronous transfers report the frame of each packet, and
+ * start in the frame they are given. */
+static libusb_testlib_result test_iso_start_frame(libusb_testlib_ctx *tctx)
+{
+	struct loopback lb;
+	struct libusb_transfer *transfer;
+	unsigned char buffer[8 * 512];
+	libusb_testlib_result result;
+	int r, i, frame, start;
+
+	result = open_loopback_device(tctx, &lb, iso_descriptors,
+		sizeof(iso_descriptors), LIBUSB_SPEED_HIGH);
+	if (result != TEST_STATUS_SUCCESS)
+		return result;
+
+	transfer = libusb_alloc_transfer(8);
+	libusb_fill_iso_transfer(transfer, lb.handle, ISO_IN, buffer,
+		sizeof(buffer), 8, NULL, NULL, 1000);
+	libusb_set_iso_packet_lengths(transfer, 512);
+
+	r = libusb_get_frame_number(lb.handle, &frame);
+	if (r != LIBUSB_ERROR_NOT_FOUND ||
+			libusb_get_iso_packet_frame(transfer, 0) != -1) {
+		libusb_testlib_logf(tctx, "Frame known before any transfer: %d", r);
+		result = TEST_STATUS_FAILURE;
+		goto out;
+	}
+
+	/* packets follow each other at the service interval */
+	r = run_transfer(lb.ctx, transfer);
+	if (r != LIBUSB_SUCCESS || transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+		libusb_testlib_logf(tctx, "Transfer %d, status %d", r,
+			transfer->status);
+		result = TEST_STATUS_FAILURE;
+		goto out;
+	}
+	start = libusb_get_iso_packet_frame(transfer, 0);
+	for (i = 0; i < 8; i++) {
+		if (libusb_get_iso_packet_frame(transfer, i) != start + i * 2) {
+			libusb_testlib_logf(tctx, "Packet %d in frame %d, first %d", i,
+				libusb_get_iso_packet_frame(transfer, i), start);
+			result = TEST_STATUS_FAILURE;
+			goto out;
+		}
+	}
+
+	/* the microframe counter of loopback devices wraps at 16384. start
+	 * 50ms ahead, so that being descheduled does not make the frame late */
+	r = libusb_get_frame_number(lb.handle, &frame);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf(tctx, "No frame number: %d", r);
+		result = TEST_STATUS_FAILURE;
+		goto out;
+	}
+	start = (frame + 400) % 16384;
+	libusb_transfer_set_iso_start_frame(transfer, start);
+	r = run_transfer(lb.ctx, transfer);
+	if (r != LIBUSB_SUCCESS || transfer->status != LIBUSB_TRANSFER_COMPLETED ||
+			libusb_get_iso_packet_frame(transfer, 0) != start) {
+		libusb_testlib_logf(tctx, "Transfer %d for frame %d started in %d",
+			r, start, libusb_get_iso_packet_frame(transfer, 0));
+		result = TEST_STATUS_FAILURE;
+		goto out;
+	}
+
+	/* a frame that has already begun is refused */
+	libusb_get_frame_number(lb.handle, &frame);
+	libusb_transfer_set_iso_start_frame(transfer, (frame + 16384 - 8) % 16384);
+	r = libusb_submit_transfer(transfer);
+	if (r != LIBUSB_ERROR_INVALID_PARAM) {
+		libusb_testlib_logf(tctx, "Transfer for a past frame: %d", r);
+		result = TEST_STATUS_FAILURE;
+		goto out;
+	}
+
+	/* the service interval follows the alternate setting */
+	r = libusb_claim_interface(lb.handle, 0);
+	if (r == LIBUSB_SUCCESS)
+		r = libusb_set_interface_alt_setting(lb.handle, 0, 1);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf(tctx, "Failed to set alternate setting: %d", r);
+		result = TEST_STATUS_FAILURE;
+		goto out;
+	}
+	libusb_transfer_set_iso_start_frame(transfer, LIBUSB_ISO_START_ASAP);
+	r = run_transfer(lb.ctx, transfer);
+	start = libusb_get_iso_packet_frame(transfer, 0);
+	if (r != LIBUSB_SUCCESS || transfer->status != LIBUSB_TRANSFER_COMPLETED ||
+			libusb_get_iso_packet_frame(transfer, 7) != start + 7 * 8) {
+		libusb_testlib_logf(tctx, "Transfer %d in alternate setting 1: "
+			"packet 7 in frame %d, first %d", r,
+			libusb_get_iso_packet_frame(transfer, 7), start);
+		result = TEST_STATUS_FAILURE;
+	}
+
+out:
+	libusb_free_transfer(transfer);
+	close_loopback(&lb);
+	return result;
+}
+
+/** Tests that the alternate setting picked to fit the periodic bandwidth
+ * of the bus reserves it, until the device is reset. */
+static libusb_testlib_result test_bandwidth(libusb_testlib_ctx *tctx)
+{
+	struct loopback lb;
+	struct libusb_periodic_bandwidth bandwidth;
+	libusb_testlib_result result;
+	int r, altsetting;
+
+	result = open_loopback_device(tctx, &lb, periodic_descriptors,
+		sizeof(periodic_descriptors), LIBUSB_SPEED_FULL);
+	if (result != TEST_STATUS_SUCCESS)
+		return result;
+
+	r = libusb_get_periodic_bandwidth(lb.handle, &bandwidth);
+	if (r != LIBUSB_SUCCESS || bandwidth.bus_used != 0 ||
+			!bandwidth.bus_budget) {
+		libusb_testlib_logf(tctx, "Idle bandwidth %d: %u of %u", r,
+			bandwidth.bus_used, bandwidth.bus_budget);
+		result = TEST_STATUS_FAILURE;
+		goto out;
+	}
+
+	r = libusb_claim_interface(lb.handle, 0);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf(tctx, "Failed to claim interface: %d", r);
+		result = TEST_STATUS_FAILURE;
+		goto out;
+	}
+	altsetting = libusb_get_fitting_altsetting(lb.handle, 0);
+	if (altsetting != 3) {
+		libusb_testlib_logf(tctx, "Fitting alternate setting %d", altsetting);
+		result = TEST_STATUS_FAILURE;
+		goto out_release;
+	}
+	r = libusb_set_interface_alt_setting(lb.handle, 0, altsetting);
+	if (r == LIBUSB_SUCCESS)
+		r = libusb_get_periodic_bandwidth(lb.handle, &bandwidth);
+	if (r != LIBUSB_SUCCESS || !bandwidth.bus_used ||
+			bandwidth.bus_used > bandwidth.bus_budget) {
+		libusb_testlib_logf(tctx, "Reserved bandwidth %d: %u of %u", r,
+			bandwidth.bus_used, bandwidth.bus_budget);
+		result = TEST_STATUS_FAILURE;
+		goto out_release;
+	}
+
+	/* the reset puts the interface back in alternate setting 0 */
+	r = libusb_reset_device(lb.handle);
+	if (r == LIBUSB_SUCCESS)
+		r = libusb_get_periodic_bandwidth(lb.handle, &bandwidth);
+	if (r != LIBUSB_SUCCESS || bandwidth.bus_used != 0) {
+		libusb_testlib_logf(tctx, "Bandwidth after reset %d: %u", r,
+			bandwidth.bus_used);
+		result = TEST_STATUS_FAILURE;
+	}
+
+out_release:
+	libusb_release_interface(lb.handle, 0);
+out:
+	close_loopback(&lb);
+	return result;
+}
+
+/** Tests that a context scanning lazily still lists its devices, including
+ * loopback devices added before the scan. */
+static libusb_testlib_result test_lazy_scan(libusb_testlib_ctx *tctx)
+{
+	struct loopback lb;
+	libusb_device **list;
+	libusb_testlib_result result;
+	ssize_t count;
+	int r, i;
+
+	r = libusb_set_option(NULL, LIBUSB_OPTION_DEVICE_SCAN,
+		LIBUSB_DEVICE_SCAN_LAZY);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf(tctx, "Failed to set lazy scan: %d", r);
+		return TEST_STATUS_FAILURE;
+	}
+	result = open_loopback(tctx, &lb);
+	libusb_set_option(NULL, LIBUSB_OPTION_DEVICE_SCAN,
+		LIBUSB_DEVICE_SCAN_EAGER);
+	if (result != TEST_STATUS_SUCCESS)
+		return result;
+
+	count = libusb_get_device_list(lb.ctx, &list);
+	if (count < 1) {
+		libusb_testlib_logf(tctx, "Lazy scan listed %d devices", (int)count);
+		close_loopback(&lb);
+		return TEST_STATUS_FAILURE;
+	}
+	for (i = 0; i < count && list[i] != lb.dev; i++)
+		;
+	if (i == count) {
+		libusb_testlib_logf(tctx, "Loopback device missing from the list");
+		result = TEST_STATUS_FAILURE;
+	}
+	libusb_free_device_list(list, 1);
+
+	r = libusb_wait_device_scan(lb.ctx);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf(tctx, "Waiting for the scan: %d", r);
+		result = TEST_STATUS_FAILURE;
+	}
+
+	close_loopback(&lb);
+	return result;
+}
+
+/* Fill in the list of tests. */
+static const libusb_testlib_test tests[] = {
+	{"loopback_bulk", &test_loopback_bulk},
+	{"iov_short_read", &test_iov_short_read},
+	{"iov_full", &test_iov_full},
+	{"capture_replay", &test_capture_replay},
+	{"control_batch", &test_control_batch},
+	{"coalescer", &test_coalescer},
+	{"stream_scheduler", &test_stream_scheduler},
+	{"iso_start_frame", &test_iso_start_frame},
+	{"bandwidth", &test_bandwidth},
+	{"lazy_scan", &test_lazy_scan},
+	LIBUSB_NULL_TEST
+};
+
+int main (int argc, char ** argv)
+{
+	return libusb_testlib_run_tests(argc, argv, tests);
+}